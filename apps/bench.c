@@ -0,0 +1,1414 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+// our libraries
+#include "logging.h"
+#include "network.h"
+#include "datagram.h"
+#include "metrics.h"
+
+
+
+int LOG_LEVEL = INFO_LEVEL; // must do this before any log_*() call
+
+
+#define SERVER_IP           "127.0.0.1"     /* the benchmark only ever talks to loopback   */
+#define SERVER_PORT         29000
+#define BUFLEN              2048
+#define MAX_THREADS         64
+#define MAX_EVENTS          256
+#define PICK_ATTEMPTS       16              /* random picks before giving up on a user     */
+#define LISTEN_PORT_BASE    49152           /* advertised, nothing listens there           */
+#define TIMEOUT_SCAN_NS     10000000ULL     /* how often in-flight transactions are checked */
+#define NAME_LEN            32              /* "bench<pid>_<user>"                         */
+#define CHAT_QUEUE_LEN      (64 * 1024)     /* chat output queued, as much as the client's */
+
+
+/* a transaction is one connection carrying one of these */
+enum bench_op {
+	BENCH_REGISTER,     /* REGISTER                                     */
+	BENCH_LISTEN,       /* REGISTER + LISTEN                            */
+	BENCH_CONNECT,      /* REGISTER + CONNECT to a listening user       */
+	BENCH_UNREGISTER,   /* UNREGISTER                                   */
+	BENCH_OPS
+};
+
+enum bench_error {
+	BENCH_ERR_CONNECT,  /* the server could not be reached              */
+	BENCH_ERR_SOCKET,   /* failed reads and writes, early close         */
+	BENCH_ERR_PROTOCOL, /* answers that make no sense                   */
+	BENCH_ERR_TIMEOUT,  /* no answer in time                            */
+	BENCH_ERRORS
+};
+
+/* what the server is believed to know about a user */
+enum user_state {
+	USER_UNREGISTERED,
+	USER_REGISTERED,
+	USER_LISTENING,
+	USER_CONNECTED
+};
+
+const char *op_names[BENCH_OPS] = {"register", "listen", "connect", "unregister"};
+const char *error_names[BENCH_ERRORS] = {"connect", "socket", "protocol", "timeout"};
+const int status_codes[] = {STATUS_OK, STATUS_BAD_REQUEST, STATUS_NOT_FOUND, STATUS_CONFLICT};
+#define STATUS_KINDS    (int) (sizeof(status_codes) / sizeof(status_codes[0]))
+
+typedef struct BenchUser {
+	_Atomic uint8_t state;      /* read by every thread looking for CONNECT peers */
+	bool busy;                  /* in a transaction, only touched by the owner    */
+} BenchUser;
+
+/* one simulated client connection */
+typedef struct BenchSlot {
+	int fd;                     /* -1 while the slot is free                      */
+	FramedStream stream;
+	int op;
+	int user;
+	bool connected;
+	bool hello_pending;         /* binary: the HELLO answer comes first           */
+	int expected;               /* status answers still to come                   */
+	uint64_t start_ns;          /* intended start, latency is measured from here  */
+	uint64_t deadline_ns;
+} BenchSlot;
+
+/*
+ * Every thread drives its own slots from its own epoll set and owns the users whose index is
+ * congruent to its id; only the user states are shared, for picking CONNECT peers.
+ */
+typedef struct BenchThread {
+	int id;
+	pthread_t thread;
+	int epoll_fd;
+	BenchSlot *slots;
+	int slots_count;
+	int in_flight;
+	uint64_t rng;
+	uint64_t interval_ns;       /* open loop: time between arrivals, 0 closed loop */
+	uint64_t next_arrival_ns;
+	uint64_t backlog;           /* open loop: arrivals waiting for a free slot     */
+	uint64_t last_scan_ns;
+	uint64_t transactions;
+	uint64_t requests;
+	uint64_t ops[BENCH_OPS];
+	uint64_t ops_ok[BENCH_OPS];
+	uint64_t statuses[STATUS_KINDS];
+	uint64_t errors[BENCH_ERRORS];
+	LatencyHistogram *latency;  /* BENCH_OPS histograms, successful transactions only */
+} BenchThread;
+
+
+/* configuration */
+int server_port = SERVER_PORT;
+int users_count = 1000;
+int concurrency = 64;
+int threads_count = 1;
+double rate = 0;                /* transactions per second, 0 runs closed loop    */
+double duration = 10;           /* seconds                                        */
+uint64_t transactions_limit = 0;
+int weights[BENCH_OPS] = {10, 30, 40, 20};
+int use_binary = 1;
+int timeout_ms = 5000;
+const char *json_path = NULL;
+bool chat_mode = false;         /* peer chat instead of server transactions       */
+bool chat_udp = false;
+int message_size = 64;          /* chat mode, NUL included                        */
+uint32_t messages_count = 100000;
+uint64_t chat_interval_ns = 0;  /* chat mode open loop: time between messages     */
+
+/* state */
+struct sockaddr_in server_addr;
+BenchUser *users = NULL;
+BenchThread threads[MAX_THREADS];
+atomic_bool stopping = false;
+atomic_uint_fast64_t launched = 0;
+uint64_t end_ns;
+pid_t run_id;
+
+
+void sigint_handler(int s) {
+	(void) s;
+	atomic_store(&stopping, true);
+}
+
+void usage(void) {
+	const char *message = "\tc_chat_bench [-p port] [-n users] [-c connections] [-t threads] [-r rate] [-d seconds] [-N transactions]\n"
+	                      "\t             [-x register=W,listen=W,connect=W,unregister=W] [-A] [-T ms] [-j file]\n"
+	                      "\tc_chat_bench -C tcp|udp [-s bytes] [-N messages] [-r rate] [-T ms] [-j file]\n"
+	                      "\tc_chat_bench -h\n";
+	const char *options = "\t-p port\t\tServer's port on 127.0.0.1\n"
+	                      "\t-n users\tSimulated users (default 1000)\n"
+	                      "\t-c N\t\tConnections in flight at most (default 64)\n"
+	                      "\t-t N\t\tThreads driving the connections (default 1)\n"
+	                      "\t-r rate\t\tOpen loop: start this many transactions per second, latency counts from the intended start.\n"
+	                      "\t       \t\tWithout it the benchmark runs closed loop, every connection starts the next one when done\n"
+	                      "\t-d seconds\tRun time (default 10)\n"
+	                      "\t-N count\tStop after this many transactions\n"
+	                      "\t-x mix\t\tRelative weights of the transactions (default register=10,listen=30,connect=40,unregister=20)\n"
+	                      "\t-A     \t\tUse the ASCII protocol instead of the binary one\n"
+	                      "\t-T ms  \t\tGive up on a transaction after this long (default 5000), on a chat after this long without progress\n"
+	                      "\t-C tcp|udp\tNo server: time a peer chat between two threads over loopback, like the client holds it, and count\n"
+	                      "\t       \t\tits system calls. -N is the messages to send (default 100000), -r messages per second\n"
+	                      "\t-s bytes\tChat mode message size, NUL included (default 64)\n"
+	                      "\t-j file\t\tAlso write the results as JSON to file, '-' for stdout\n"
+	                      "\t-h     \t\tThis help message\n";
+	log_usage(message, options);
+	exit(EXIT_SUCCESS);
+}
+
+uint64_t next_random(BenchThread *thread) {
+	// xorshift64*
+	thread->rng ^= thread->rng >> 12;
+	thread->rng ^= thread->rng << 25;
+	thread->rng ^= thread->rng >> 27;
+	return thread->rng * 2685821657736338717ULL;
+}
+
+void user_name(int user, char *name, size_t size) {
+	snprintf(name, size, "bench%d_%d", (int) run_id, user);
+}
+
+int parse_mix(const char *mix) {
+	char *copy = strdup(mix);
+	char *saveptr = NULL;
+	char *token;
+	char *value;
+	int op;
+	int total = 0;
+
+	memset(weights, 0, sizeof(weights));
+	for (token = strtok_r(copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+		if ((value = strchr(token, '=')) == NULL) {
+			free(copy);
+			return -1;
+		}
+		*value++ = '\0';
+		for (op = 0; op < BENCH_OPS && strcmp(token, op_names[op]) != 0; op++) {}
+		if (op == BENCH_OPS || (weights[op] = (int) strtol(value, NULL, 10)) < 0) {
+			free(copy);
+			return -1;
+		}
+		total += weights[op];
+	}
+	free(copy);
+	return total > 0 ? 0 : -1;
+}
+
+/* a random idle user of this thread in one of the states in mask, -1 if none turned up */
+int pick_user(BenchThread *thread, unsigned mask) {
+	int owned = (users_count - thread->id + threads_count - 1) / threads_count;
+	int attempt;
+	int user;
+
+	if (owned <= 0) {
+		return -1;
+	}
+	for (attempt = 0; attempt < PICK_ATTEMPTS; attempt++) {
+		user = thread->id + (int) (next_random(thread) % (uint64_t) owned) * threads_count;
+		if (!users[user].busy && (mask & (1u << atomic_load_explicit(&users[user].state, memory_order_relaxed)))) {
+			return user;
+		}
+	}
+	return -1;
+}
+
+/* any listening user, whichever thread owns it */
+int pick_peer(BenchThread *thread) {
+	int attempt;
+	int user;
+
+	for (attempt = 0; attempt < PICK_ATTEMPTS; attempt++) {
+		user = (int) (next_random(thread) % (uint64_t) users_count);
+		if (atomic_load_explicit(&users[user].state, memory_order_relaxed) == USER_LISTENING) {
+			return user;
+		}
+	}
+	return -1;
+}
+
+int pick_op(BenchThread *thread) {
+	int total = 0;
+	int op;
+	int r;
+
+	for (op = 0; op < BENCH_OPS; op++) {
+		total += weights[op];
+	}
+	r = (int) (next_random(thread) % (uint64_t) total);
+	for (op = 0; r >= weights[op]; op++) {
+		r -= weights[op];
+	}
+	return op;
+}
+
+/* queue the requests of the transaction, returns how many answers to expect or -1 */
+int queue_transaction(BenchSlot *slot, int peer) {
+	char buffer[BUFLEN];
+	char name[NAME_LEN];
+	char peer_name[NAME_LEN];
+	size_t len = 0;
+	int requests = 0;
+	uint16_t port = (uint16_t) (LISTEN_PORT_BASE + slot->user % (65536 - LISTEN_PORT_BASE));
+	uint32_t ip_addr = htonl(INADDR_LOOPBACK);
+	char ip[INET_ADDRSTRLEN];
+
+	user_name(slot->user, name, sizeof(name));
+	inet_ntop(AF_INET, &ip_addr, ip, sizeof(ip));
+
+	if (use_binary) {
+		len += frame_encode_hello(buffer, PROTOCOL_VERSION, 0);
+		if (slot->op == BENCH_UNREGISTER) {
+			len += frame_encode(buffer + len, OP_UNREGISTER, 0, name, (uint16_t) strlen(name));
+			requests = 1;
+		} else {
+			len += frame_encode(buffer + len, OP_REGISTER, 0, name, (uint16_t) strlen(name));
+			requests = 1;
+			if (slot->op == BENCH_LISTEN) {
+				len += frame_encode_listen(buffer + len, ip_addr, port);
+				requests++;
+			} else if (slot->op == BENCH_CONNECT) {
+				user_name(peer, peer_name, sizeof(peer_name));
+				len += frame_encode(buffer + len, OP_CONNECT, 0, peer_name, (uint16_t) strlen(peer_name));
+				requests++;
+			}
+		}
+	} else {
+		if (slot->op == BENCH_UNREGISTER) {
+			len += (size_t) sprintf(buffer, "%c%s", UNREGISTER_BYTE, name) + 1;
+			requests = 1;
+		} else {
+			len += (size_t) sprintf(buffer, "%c%s", REGISTER_BYTE, name) + 1;
+			requests = 1;
+			if (slot->op == BENCH_LISTEN) {
+				len += (size_t) sprintf(buffer + len, "%c %s %d", LISTEN_BYTE, ip, port) + 1;
+				requests++;
+			} else if (slot->op == BENCH_CONNECT) {
+				user_name(peer, peer_name, sizeof(peer_name));
+				len += (size_t) sprintf(buffer + len, "%c %s", CONNECT_BYTE, peer_name) + 1;
+				requests++;
+			}
+		}
+	}
+
+	if (framed_write(&slot->stream, buffer, len) == -1) {
+		return -1;
+	}
+	return requests;
+}
+
+/* what the server knows about the user after the transaction ended with status, 0 for errors */
+void update_user(BenchSlot *slot, int status) {
+	_Atomic uint8_t *state = &users[slot->user].state;
+
+	if (status == STATUS_OK) {
+		switch (slot->op) {
+			case BENCH_REGISTER:
+				atomic_store(state, USER_REGISTERED);
+				break;
+			case BENCH_LISTEN:
+				atomic_store(state, USER_LISTENING);
+				break;
+			case BENCH_CONNECT:
+				atomic_store(state, USER_CONNECTED);
+				break;
+			default:
+				atomic_store(state, USER_UNREGISTERED);
+				break;
+		}
+	} else if (status == STATUS_NOT_FOUND) {
+		// UNREGISTER of an unknown user, or CONNECT to a vanished peer which drops our registration
+		atomic_store(state, USER_UNREGISTERED);
+	} else if (slot->op != BENCH_UNREGISTER) {
+		// a conflict, or a failure that may have left the registration behind: unregister it later
+		atomic_store(state, USER_REGISTERED);
+	}
+}
+
+/* end the transaction of the slot, with the final status or 0 and an error */
+void transaction_finish(BenchThread *thread, BenchSlot *slot, int status, int error) {
+	int i;
+
+	close(slot->fd);
+	slot->fd = -1;
+	thread->in_flight--;
+	thread->transactions++;
+	thread->ops[slot->op]++;
+
+	if (status == 0) {
+		thread->errors[error]++;
+	}
+	for (i = 0; i < STATUS_KINDS; i++) {
+		if (status_codes[i] == status) {
+			thread->statuses[i]++;
+		}
+	}
+	if (status == STATUS_OK) {
+		thread->ops_ok[slot->op]++;
+		histogram_record(&thread->latency[slot->op], metrics_now_ns() - slot->start_ns);
+	}
+
+	update_user(slot, status);
+	users[slot->user].busy = false;
+}
+
+/* open a connection and send the requests of a new transaction, returns -1 if no work was found */
+int transaction_start(BenchThread *thread, BenchSlot *slot, uint64_t start_ns) {
+	struct epoll_event ev;
+	int op = pick_op(thread);
+	int user;
+	int peer = -1;
+	int fd;
+
+	// fall back to whatever the current user states allow
+	user = op == BENCH_UNREGISTER ? pick_user(thread, ~(1u << USER_UNREGISTERED)) : pick_user(thread, 1u << USER_UNREGISTERED);
+	if (user != -1 && op == BENCH_CONNECT && (peer = pick_peer(thread)) == -1) {
+		op = BENCH_LISTEN;
+	}
+	if (user == -1) {
+		op = op == BENCH_UNREGISTER ? BENCH_LISTEN : BENCH_UNREGISTER;
+		user = op == BENCH_UNREGISTER ? pick_user(thread, ~(1u << USER_UNREGISTERED)) : pick_user(thread, 1u << USER_UNREGISTERED);
+		if (user == -1) {
+			return -1;
+		}
+	}
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_IP)) == -1) {
+		log_with_errno("[bench] socket call failed");
+		return -1;
+	}
+	slot->fd = fd;
+	slot->op = op;
+	slot->user = user;
+	slot->connected = false;
+	slot->hello_pending = use_binary;
+	slot->start_ns = start_ns;
+	slot->deadline_ns = metrics_now_ns() + (uint64_t) timeout_ms * 1000000ULL;
+	framed_stream_reset(&slot->stream, fd, use_binary ? FRAMING_BINARY : FRAMING_ASCII);
+	users[user].busy = true;
+	thread->in_flight++;
+	atomic_fetch_add(&launched, 1);
+
+	if ((slot->expected = queue_transaction(slot, peer)) == -1) {
+		transaction_finish(thread, slot, 0, BENCH_ERR_PROTOCOL);
+		return 0;
+	}
+	thread->requests += (uint64_t) slot->expected;
+
+	if (connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1 && errno != EINPROGRESS) {
+		transaction_finish(thread, slot, 0, BENCH_ERR_CONNECT);
+		return 0;
+	}
+	ev.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = slot;
+	if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		transaction_finish(thread, slot, 0, BENCH_ERR_SOCKET);
+	}
+	return 0;
+}
+
+void slot_on_writable(BenchThread *thread, BenchSlot *slot) {
+	struct epoll_event ev;
+	socklen_t len = sizeof(int);
+	int error = 0;
+	ssize_t pending;
+
+	if (!slot->connected) {
+		if (getsockopt(slot->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+			transaction_finish(thread, slot, 0, BENCH_ERR_CONNECT);
+			return;
+		}
+		slot->connected = true;
+	}
+	if ((pending = framed_flush(&slot->stream)) == -1) {
+		transaction_finish(thread, slot, 0, BENCH_ERR_SOCKET);
+		return;
+	}
+	if (pending == 0) {
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = slot;
+		epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, slot->fd, &ev);
+	}
+}
+
+void slot_on_readable(BenchThread *thread, BenchSlot *slot) {
+	FramedMessage message;
+	uint32_t ip_addr;
+	uint16_t port;
+	uint16_t code;
+	ssize_t n;
+	int status;
+	int ret;
+
+	if ((n = framed_read(&slot->stream)) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			transaction_finish(thread, slot, 0, errno == ECONNREFUSED ? BENCH_ERR_CONNECT : BENCH_ERR_SOCKET);
+		}
+		return;
+	}
+
+	while ((ret = framed_next(&slot->stream, &message)) == 1) {
+		if (use_binary) {
+			if (slot->hello_pending) {
+				if (message.frame.opcode != OP_HELLO) {
+					transaction_finish(thread, slot, 0, BENCH_ERR_PROTOCOL);
+					return;
+				}
+				slot->hello_pending = false;
+				continue;
+			}
+			if (frame_decode_status(&message.frame, &code, &ip_addr, &port) == -1) {
+				transaction_finish(thread, slot, 0, BENCH_ERR_PROTOCOL);
+				return;
+			}
+			status = code;
+		} else {
+			status = extract_status_code((char *) message.data);
+		}
+
+		// the server closes the connection after any refusal
+		if (status != STATUS_OK || --slot->expected == 0) {
+			transaction_finish(thread, slot, status, 0);
+			return;
+		}
+	}
+	if (ret == -1) {
+		transaction_finish(thread, slot, 0, BENCH_ERR_PROTOCOL);
+	} else if (n == 0) {
+		transaction_finish(thread, slot, 0, BENCH_ERR_SOCKET);
+	}
+}
+
+bool may_launch(void) {
+	if (atomic_load_explicit(&stopping, memory_order_relaxed)) {
+		return false;
+	}
+	if (transactions_limit > 0 && atomic_load_explicit(&launched, memory_order_relaxed) >= transactions_limit) {
+		return false;
+	}
+	return metrics_now_ns() < end_ns;
+}
+
+/* start transactions on free slots, as many as the arrival model allows */
+void launch_transactions(BenchThread *thread, uint64_t now) {
+	uint64_t start;
+	int i;
+
+	if (thread->interval_ns > 0) {
+		while (thread->next_arrival_ns <= now) {
+			thread->backlog++;
+			thread->next_arrival_ns += thread->interval_ns;
+		}
+	}
+
+	for (i = 0; i < thread->slots_count && may_launch(); i++) {
+		if (thread->slots[i].fd != -1) {
+			continue;
+		}
+		if (thread->interval_ns > 0) {
+			if (thread->backlog == 0) {
+				break;
+			}
+			// arrivals are evenly spaced, so the oldest waiting one is backlog intervals back
+			start = thread->next_arrival_ns - thread->backlog * thread->interval_ns;
+			if (transaction_start(thread, &thread->slots[i], start) == -1) {
+				break;
+			}
+			thread->backlog--;
+		} else if (transaction_start(thread, &thread->slots[i], now) == -1) {
+			break;
+		}
+	}
+}
+
+void expire_transactions(BenchThread *thread, uint64_t now) {
+	int i;
+
+	thread->last_scan_ns = now;
+	for (i = 0; i < thread->slots_count; i++) {
+		if (thread->slots[i].fd != -1 && thread->slots[i].deadline_ns <= now) {
+			transaction_finish(thread, &thread->slots[i], 0, BENCH_ERR_TIMEOUT);
+		}
+	}
+}
+
+void *thread_loop(void *arg) {
+	BenchThread *thread = arg;
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t now;
+	int timeout;
+	int i;
+	int n;
+
+	while (1) {
+		now = metrics_now_ns();
+		if (now - thread->last_scan_ns >= TIMEOUT_SCAN_NS) {
+			expire_transactions(thread, now);
+		}
+		launch_transactions(thread, now);
+		if (thread->in_flight == 0 && !may_launch()) {
+			break;
+		}
+
+		timeout = 10;
+		if (thread->interval_ns > 0 && thread->next_arrival_ns > now && thread->next_arrival_ns - now < 10000000ULL) {
+			timeout = (int) ((thread->next_arrival_ns - now) / 1000000ULL);
+		}
+		if ((n = epoll_wait(thread->epoll_fd, events, MAX_EVENTS, timeout)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_with_errno("[bench] epoll_wait failed");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			BenchSlot *slot = events[i].data.ptr;
+			if (slot->fd != -1 && (events[i].events & (EPOLLOUT | EPOLLERR))) {
+				slot_on_writable(thread, slot);
+			}
+			if (slot->fd != -1 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+				slot_on_readable(thread, slot);
+			}
+		}
+	}
+	return NULL;
+}
+
+int thread_init(BenchThread *thread, int id) {
+	int i;
+
+	memset(thread, 0, sizeof(BenchThread));
+	thread->id = id;
+	thread->rng = 0x9E3779B97F4A7C15ULL ^ ((uint64_t) (id + 1) * 0xBF58476D1CE4E5B9ULL) ^ (uint64_t) run_id;
+	thread->slots_count = concurrency / threads_count + (id < concurrency % threads_count);
+	if (rate > 0) {
+		thread->interval_ns = (uint64_t) (1e9 * threads_count / rate);
+		thread->next_arrival_ns = metrics_now_ns();
+	}
+	if ((thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		log_with_errno("[bench] epoll_create1 failed");
+		return -1;
+	}
+	thread->latency = calloc(BENCH_OPS, sizeof(LatencyHistogram));
+	thread->slots = calloc((size_t) thread->slots_count, sizeof(BenchSlot));
+	if (thread->latency == NULL || thread->slots == NULL) {
+		log_error("[bench] out of memory");
+		return -1;
+	}
+	for (i = 0; i < thread->slots_count; i++) {
+		thread->slots[i].fd = -1;
+		if (framed_stream_init(&thread->slots[i].stream, -1, FRAMING_BINARY, BUFLEN, BUFLEN) == -1) {
+			log_error("[bench] out of memory");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void thread_destroy(BenchThread *thread) {
+	int i;
+
+	for (i = 0; thread->slots != NULL && i < thread->slots_count; i++) {
+		framed_stream_free(&thread->slots[i].stream);
+	}
+	free(thread->slots);
+	free(thread->latency);
+	if (thread->epoll_fd > 0) {
+		close(thread->epoll_fd);
+	}
+}
+
+/* unregister what the run left behind, one blocking connection per user */
+int unregister_leftovers(void) {
+	FramedStream stream;
+	FramedMessage message;
+	char buffer[BUFLEN];
+	char name[NAME_LEN];
+	size_t len;
+	int fd;
+	int user;
+	int left = 0;
+
+	for (user = 0; user < users_count; user++) {
+		if (atomic_load(&users[user].state) == USER_UNREGISTERED) {
+			continue;
+		}
+		left++;
+		if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_IP)) == -1) {
+			continue;
+		}
+		if (connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1 ||
+		    framed_stream_init(&stream, fd, use_binary ? FRAMING_BINARY : FRAMING_ASCII, BUFLEN, BUFLEN) == -1) {
+			close(fd);
+			continue;
+		}
+		user_name(user, name, sizeof(name));
+		if (use_binary) {
+			len = frame_encode_hello(buffer, PROTOCOL_VERSION, 0);
+			len += frame_encode(buffer + len, OP_UNREGISTER, 0, name, (uint16_t) strlen(name));
+		} else {
+			len = (size_t) sprintf(buffer, "%c%s", UNREGISTER_BYTE, name) + 1;
+		}
+		if (framed_send(&stream, buffer, len) == 0) {
+			// the server closes once it answered
+			while (framed_recv(&stream, &message) == 1) {}
+		}
+		close(fd);
+		framed_stream_free(&stream);
+	}
+	return left;
+}
+
+void print_latency_row(FILE *out, const char *name, const LatencySummary *summary) {
+	fprintf(out, "  %-12s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f\n", name, summary->count,
+	        summary->p50 / 1e3, summary->p99 / 1e3, summary->p999 / 1e3, summary->max / 1e3);
+}
+
+void write_latency_json(FILE *out, const LatencySummary *summary) {
+	fprintf(out, "{\"count\": %" PRIu64 ", \"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f}",
+	        summary->count, summary->count ? summary->sum / 1e3 / (double) summary->count : 0.0,
+	        summary->p50 / 1e3, summary->p99 / 1e3, summary->p999 / 1e3, summary->max / 1e3);
+}
+
+/* sum up the threads and print the results, as text and as JSON when asked to */
+int report(double elapsed) {
+	const LatencyHistogram *histograms[MAX_THREADS];
+	const LatencyHistogram *all_histograms[MAX_THREADS * BENCH_OPS];
+	LatencySummary op_latency[BENCH_OPS];
+	LatencySummary all_latency;
+	uint64_t transactions = 0;
+	uint64_t requests = 0;
+	uint64_t ops[BENCH_OPS] = {0};
+	uint64_t ops_ok[BENCH_OPS] = {0};
+	uint64_t statuses[STATUS_KINDS] = {0};
+	uint64_t errors[BENCH_ERRORS] = {0};
+	uint64_t error_total = 0;
+	FILE *out;
+	int t;
+	int i;
+
+	for (t = 0; t < threads_count; t++) {
+		transactions += threads[t].transactions;
+		requests += threads[t].requests;
+		for (i = 0; i < BENCH_OPS; i++) {
+			ops[i] += threads[t].ops[i];
+			ops_ok[i] += threads[t].ops_ok[i];
+		}
+		for (i = 0; i < STATUS_KINDS; i++) {
+			statuses[i] += threads[t].statuses[i];
+		}
+		for (i = 0; i < BENCH_ERRORS; i++) {
+			errors[i] += threads[t].errors[i];
+		}
+	}
+	for (i = 0; i < BENCH_ERRORS; i++) {
+		error_total += errors[i];
+	}
+	for (i = 0; i < BENCH_OPS; i++) {
+		for (t = 0; t < threads_count; t++) {
+			histograms[t] = &threads[t].latency[i];
+			all_histograms[i * threads_count + t] = &threads[t].latency[i];
+		}
+		histogram_summarize(histograms, threads_count, &op_latency[i]);
+	}
+	histogram_summarize(all_histograms, threads_count * BENCH_OPS, &all_latency);
+
+	printf("c_chat_bench: %s protocol, %d users, %d connections on %d threads, ", use_binary ? "binary" : "ASCII", users_count, concurrency, threads_count);
+	if (rate > 0) {
+		printf("open loop at %.0f/s\n", rate);
+	} else {
+		printf("closed loop\n");
+	}
+	printf("duration       %.2f s\n", elapsed);
+	printf("transactions   %" PRIu64 " (%.1f/s)\n", transactions, transactions / elapsed);
+	printf("requests       %" PRIu64 " (%.1f/s)\n", requests, requests / elapsed);
+	printf("status        ");
+	for (i = 0; i < STATUS_KINDS; i++) {
+		printf(" %d: %" PRIu64, status_codes[i], statuses[i]);
+	}
+	printf("\nerrors         %" PRIu64 " (", error_total);
+	for (i = 0; i < BENCH_ERRORS; i++) {
+		printf("%s%s: %" PRIu64, i ? ", " : "", error_names[i], errors[i]);
+	}
+	printf(")\nlatency of successful transactions in us\n");
+	printf("  %-12s %10s %10s %10s %10s %10s\n", "", "count", "p50", "p99", "p999", "max");
+	for (i = 0; i < BENCH_OPS; i++) {
+		print_latency_row(stdout, op_names[i], &op_latency[i]);
+	}
+	print_latency_row(stdout, "all", &all_latency);
+	fflush(stdout);
+
+	if (json_path == NULL) {
+		return 0;
+	}
+	if (strcmp(json_path, "-") == 0) {
+		out = stdout;
+	} else if ((out = fopen(json_path, "w")) == NULL) {
+		log_with_errno("[bench] could not open '%s'", json_path);
+		return -1;
+	}
+	fprintf(out, "{\n  \"protocol\": \"%s\",\n  \"users\": %d,\n  \"connections\": %d,\n  \"threads\": %d,\n  \"rate\": %.1f,\n",
+	        use_binary ? "binary" : "ascii", users_count, concurrency, threads_count, rate);
+	fprintf(out, "  \"duration_s\": %.3f,\n  \"transactions\": %" PRIu64 ",\n  \"requests\": %" PRIu64 ",\n", elapsed, transactions, requests);
+	fprintf(out, "  \"throughput_tps\": %.1f,\n  \"requests_per_s\": %.1f,\n", transactions / elapsed, requests / elapsed);
+	fprintf(out, "  \"status\": {");
+	for (i = 0; i < STATUS_KINDS; i++) {
+		fprintf(out, "%s\"%d\": %" PRIu64, i ? ", " : "", status_codes[i], statuses[i]);
+	}
+	fprintf(out, "},\n  \"errors\": {\"total\": %" PRIu64, error_total);
+	for (i = 0; i < BENCH_ERRORS; i++) {
+		fprintf(out, ", \"%s\": %" PRIu64, error_names[i], errors[i]);
+	}
+	fprintf(out, "},\n  \"ops\": {\n");
+	for (i = 0; i < BENCH_OPS; i++) {
+		fprintf(out, "    \"%s\": {\"count\": %" PRIu64 ", \"ok\": %" PRIu64 ", \"latency\": ", op_names[i], ops[i], ops_ok[i]);
+		write_latency_json(out, &op_latency[i]);
+		fprintf(out, "},\n");
+	}
+	fprintf(out, "    \"all\": {\"count\": %" PRIu64 ", \"ok\": %" PRIu64 ", \"latency\": ", transactions, all_latency.count);
+	write_latency_json(out, &all_latency);
+	fprintf(out, "}\n  }\n}\n");
+	if (out == stdout) {
+		fflush(stdout);
+	} else if (fclose(out) != 0) {
+		log_with_errno("[bench] writing '%s' failed", json_path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Chat mode: a sender and a receiver thread hold a peer chat over loopback the way the client does,
+ * over TCP or over UDP (datagram.h), without a server. Messages carry the time they were queued,
+ * the receiver records how long each took and acknowledges them as the client would. Every system
+ * call either end makes on the chat is counted, poll included.
+ */
+typedef struct ChatEnd {
+	const char *name;
+	pthread_t thread;
+	FramedStream stream;        /* TCP                                            */
+	DatagramSocket udp;         /* UDP, fd is -1 on TCP                           */
+	DatagramPeer peer;
+	uint32_t messages;          /* sent or received                               */
+	uint32_t acked;             /* sender: acknowledged by the receiver           */
+	uint32_t acked_received;    /* receiver: last one it acknowledged             */
+	uint64_t progress_ns;       /* last message or acknowledgement, sent or taken */
+	uint64_t syscalls;          /* on the chat's socket, poll included            */
+	bool failed;
+	LatencyHistogram latency;   /* receiver: queued to received                   */
+} ChatEnd;
+
+ChatEnd chat_sender = {.name = "sender"};
+ChatEnd chat_receiver = {.name = "receiver"};
+
+/* a message of message_size bytes, NUL included, that starts with the time it was queued */
+void chat_message(char *text, uint64_t now) {
+	int len = snprintf(text, (size_t) message_size, "%" PRIu64 " ", now);
+
+	memset(text + len, 'x', (size_t) (message_size - 1 - len));
+	text[message_size - 1] = '\0';
+}
+
+void chat_take(ChatEnd *end, const char *text) {
+	uint64_t now = metrics_now_ns();
+
+	histogram_record(&end->latency, now - strtoull(text, NULL, 10));
+	end->messages++;
+	end->progress_ns = now;
+}
+
+/* the first of due_ns (0 when nothing is due) and the stall timeout */
+uint64_t chat_deadline(const ChatEnd *end, uint64_t due_ns) {
+	uint64_t stall_ns = end->progress_ns + (uint64_t) timeout_ms * 1000000ULL;
+
+	return due_ns != 0 && due_ns < stall_ns ? due_ns : stall_ns;
+}
+
+/* wait for the chat's socket until deadline_ns. Returns -1 when the run is over for this end */
+int chat_poll(ChatEnd *end, struct pollfd *pfd, uint64_t deadline_ns) {
+	struct timespec timeout;
+	uint64_t now = metrics_now_ns();
+	uint64_t wait_ns = deadline_ns > now ? deadline_ns - now : 0;
+
+	if (atomic_load(&stopping)) {
+		return -1;
+	}
+	if (now - end->progress_ns > (uint64_t) timeout_ms * 1000000ULL) {
+		log_error("[bench] chat %s: nothing from the other end for %d ms", end->name, timeout_ms);
+		return -1;
+	}
+	timeout.tv_sec = (time_t) (wait_ns / 1000000000ULL);
+	timeout.tv_nsec = (long) (wait_ns % 1000000000ULL);
+	end->syscalls++;
+	if (ppoll(pfd, 1, &timeout, NULL) == -1 && errno != EINTR) {
+		log_with_errno("[bench] chat %s: poll failed", end->name);
+		return -1;
+	}
+	return 0;
+}
+
+/* write the queued output, one sendmsg per system call. Returns -1 on error */
+int chat_tcp_flush(ChatEnd *end) {
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	while ((msg.msg_iovlen = (size_t) framed_output(&end->stream, iov)) > 0) {
+		end->syscalls++;
+		if ((n = sendmsg(end->stream.fd, &msg, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		framed_sent(&end->stream, (size_t) n);
+	}
+	return 0;
+}
+
+/* one read off the connection. Returns -1 when it failed or the other end closed it */
+int chat_tcp_read(ChatEnd *end) {
+	ssize_t n;
+
+	end->syscalls++;
+	if ((n = framed_read(&end->stream)) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	return n > 0 ? 0 : -1;
+}
+
+void *chat_tcp_send(void *arg) {
+	ChatEnd *end = arg;
+	struct pollfd pfd = {.fd = end->stream.fd};
+	FramedMessage message;
+	char text[DGRAM_MAX_PAYLOAD];
+	uint64_t next_ns = metrics_now_ns();
+	uint64_t due_ns;
+	uint64_t now;
+	int ret;
+
+	end->progress_ns = next_ns;
+	while (end->acked < messages_count) {
+		now = metrics_now_ns();
+		while (end->messages < messages_count && end->messages - end->acked < CHAT_WINDOW && (chat_interval_ns == 0 || next_ns <= now)) {
+			chat_message(text, now);
+			if (framed_write(&end->stream, text, (size_t) message_size) == -1) {
+				break;
+			}
+			end->messages++;
+			end->progress_ns = now;
+			next_ns += chat_interval_ns;
+		}
+		if (chat_tcp_flush(end) == -1) {
+			goto fail;
+		}
+		due_ns = chat_interval_ns > 0 && end->messages < messages_count && end->messages - end->acked < CHAT_WINDOW ? next_ns : 0;
+		// the ring took less than the window allows and the socket all of it, there is more to write
+		if (framed_pending_output(&end->stream) == 0 && chat_interval_ns == 0 && end->messages < messages_count &&
+		    end->messages - end->acked < CHAT_WINDOW) {
+			continue;
+		}
+		pfd.events = POLLIN | (framed_pending_output(&end->stream) > 0 ? POLLOUT : 0);
+		pfd.revents = 0;
+		if (chat_poll(end, &pfd, chat_deadline(end, due_ns)) == -1) {
+			goto fail;
+		}
+		if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+			continue;
+		}
+		if (chat_tcp_read(end) == -1) {
+			goto fail;
+		}
+		while ((ret = framed_next(&end->stream, &message)) == 1) {
+			if (message.data[0] != CHAT_ACK_BYTE) {
+				goto fail;
+			}
+			end->acked = (uint32_t) strtoul(message.data + 1, NULL, 10);
+			end->progress_ns = metrics_now_ns();
+		}
+		if (ret == -1) {
+			goto fail;
+		}
+	}
+	return NULL;
+
+fail:
+	log_error("[bench] chat sender failed after %" PRIu32 " messages", end->messages);
+	end->failed = true;
+	atomic_store(&stopping, true);
+	return NULL;
+}
+
+void *chat_tcp_receive(void *arg) {
+	ChatEnd *end = arg;
+	struct pollfd pfd = {.fd = end->stream.fd};
+	FramedMessage message;
+	char ack[16];
+	size_t len;
+	int ret;
+
+	end->progress_ns = metrics_now_ns();
+	while (end->messages < messages_count || framed_pending_output(&end->stream) > 0) {
+		pfd.events = (end->messages < messages_count ? POLLIN : 0) | (framed_pending_output(&end->stream) > 0 ? POLLOUT : 0);
+		pfd.revents = 0;
+		if (chat_poll(end, &pfd, chat_deadline(end, 0)) == -1) {
+			goto fail;
+		}
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (chat_tcp_read(end) == -1) {
+				goto fail;
+			}
+			while ((ret = framed_next(&end->stream, &message)) == 1) {
+				chat_take(end, message.data);
+			}
+			if (ret == -1) {
+				goto fail;
+			}
+			// every half window like the client, and the last ones so the sender can finish
+			if (end->messages - end->acked_received >= CHAT_WINDOW / 2 || (end->messages == messages_count && end->acked_received != end->messages)) {
+				len = (size_t) sprintf(ack, "%c%" PRIu32, CHAT_ACK_BYTE, end->messages) + 1;
+				framed_write(&end->stream, ack, len);
+				end->acked_received = end->messages;
+			}
+		}
+		if (chat_tcp_flush(end) == -1) {
+			goto fail;
+		}
+	}
+	return NULL;
+
+fail:
+	log_error("[bench] chat receiver failed after %" PRIu32 " messages", end->messages);
+	end->failed = true;
+	atomic_store(&stopping, true);
+	return NULL;
+}
+
+void chat_on_datagram(void *ctx, DatagramPeer *peer, const char *data, size_t len) {
+	(void) peer;
+	(void) len;
+	chat_take(ctx, data);
+}
+
+/* send what is due. Returns -1 on error or when the other end stopped acknowledging */
+int chat_udp_flush(ChatEnd *end) {
+	if (datagram_flush(&end->udp, metrics_now_ns()) == -1) {
+		log_with_errno("[bench] chat %s: sending failed", end->name);
+		return -1;
+	}
+	if (end->peer.lost) {
+		log_error("[bench] chat %s: the other end stopped acknowledging", end->name);
+		return -1;
+	}
+	return 0;
+}
+
+/* wait until due_ns or an acknowledgement or retransmission is due, and receive */
+int chat_udp_wait(ChatEnd *end, uint64_t due_ns) {
+	struct pollfd pfd = {.fd = end->udp.fd};
+	uint64_t now = metrics_now_ns();
+	int timeout;
+
+	if ((timeout = datagram_timeout_ms(&end->udp, now)) != -1 && (due_ns == 0 || now + (uint64_t) timeout * 1000000ULL < due_ns)) {
+		due_ns = now + (uint64_t) timeout * 1000000ULL;
+	}
+	pfd.events = POLLIN | (datagram_pending_output(&end->udp) ? POLLOUT : 0);
+	if (chat_poll(end, &pfd, chat_deadline(end, due_ns)) == -1) {
+		return -1;
+	}
+	if ((pfd.revents & (POLLIN | POLLERR)) && datagram_receive(&end->udp, metrics_now_ns(), chat_on_datagram, end) == -1) {
+		log_with_errno("[bench] chat %s: receiving failed", end->name);
+		return -1;
+	}
+	return 0;
+}
+
+void *chat_udp_send(void *arg) {
+	ChatEnd *end = arg;
+	char text[DGRAM_MAX_PAYLOAD];
+	uint64_t next_ns = metrics_now_ns();
+	uint64_t due_ns;
+	uint64_t now;
+	uint32_t acked;
+
+	end->progress_ns = next_ns;
+	while (end->messages < messages_count || datagram_peer_unacked(&end->peer) > 0) {
+		now = metrics_now_ns();
+		while (end->messages < messages_count && datagram_peer_room(&end->peer) && (chat_interval_ns == 0 || next_ns <= now)) {
+			chat_message(text, now);
+			datagram_queue(&end->peer, text, (size_t) message_size);
+			end->messages++;
+			end->progress_ns = now;
+			next_ns += chat_interval_ns;
+		}
+		due_ns = chat_interval_ns > 0 && end->messages < messages_count && datagram_peer_room(&end->peer) ? next_ns : 0;
+		acked = end->peer.acked;
+		if (chat_udp_flush(end) == -1 || chat_udp_wait(end, due_ns) == -1) {
+			end->failed = true;
+			break;
+		}
+		if (end->peer.acked != acked) {
+			end->progress_ns = metrics_now_ns();
+		}
+	}
+	end->acked = end->peer.acked;
+	end->syscalls += end->udp.syscalls;
+	if (end->failed) {
+		log_error("[bench] chat sender failed after %" PRIu32 " messages", end->messages);
+		atomic_store(&stopping, true);
+	}
+	return NULL;
+}
+
+void *chat_udp_receive(void *arg) {
+	ChatEnd *end = arg;
+
+	end->progress_ns = metrics_now_ns();
+	// the last acknowledgement has to leave too, the sender waits for it
+	while (end->messages < messages_count || end->peer.acked_received != end->peer.received || datagram_pending_output(&end->udp)) {
+		if (chat_udp_wait(end, 0) == -1 || chat_udp_flush(end) == -1) {
+			end->failed = true;
+			break;
+		}
+	}
+	end->acked_received = end->peer.acked_received;
+	end->syscalls += end->udp.syscalls;
+	if (end->failed) {
+		log_error("[bench] chat receiver failed after %" PRIu32 " messages", end->messages);
+		atomic_store(&stopping, true);
+	}
+	return NULL;
+}
+
+/* a connected pair of non-blocking TCP sockets on loopback. Returns -1 on error */
+int chat_tcp_open(void) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int on = 1;
+	int listen_fd;
+	int fd = -1;
+	int accepted = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+	if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		return -1;
+	}
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listen_fd, 1) == -1 ||
+	    getsockname(listen_fd, (struct sockaddr *) &addr, &len) == -1 ||
+	    (fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+	    connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    (accepted = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1 ||
+	    fcntl(fd, F_SETFL, O_NONBLOCK) == -1 || setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1 ||
+	    setsockopt(accepted, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+		goto fail;
+	}
+	close(listen_fd);
+	if (framed_stream_init(&chat_sender.stream, fd, FRAMING_ASCII, BUFLEN, CHAT_QUEUE_LEN) == -1 ||
+	    framed_stream_init(&chat_receiver.stream, accepted, FRAMING_ASCII, BUFLEN, CHAT_QUEUE_LEN) == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+
+fail:
+	close(listen_fd);
+	if (fd != -1) {
+		close(fd);
+	}
+	if (accepted != -1) {
+		close(accepted);
+	}
+	return -1;
+}
+
+/* a UDP socket on loopback for each end, each with the other as its peer. Returns -1 on error */
+int chat_udp_open(void) {
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+	if (datagram_socket_open(&chat_sender.udp, &addr) == -1) {
+		return -1;
+	}
+	if (datagram_socket_open(&chat_receiver.udp, &addr) == -1) {
+		return -1;
+	}
+	addr.sin_port = htons(chat_receiver.udp.port);
+	if (datagram_peer_init(&chat_sender.udp, &chat_sender.peer, &addr, &chat_sender) == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	addr.sin_port = htons(chat_sender.udp.port);
+	if (datagram_peer_init(&chat_receiver.udp, &chat_receiver.peer, &addr, &chat_receiver) == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+void chat_close(ChatEnd *end) {
+	if (end->udp.fd != -1) {
+		datagram_peer_free(&end->udp, &end->peer);
+		datagram_socket_close(&end->udp);
+	}
+	if (end->stream.fd != -1) {
+		close(end->stream.fd);
+	}
+	framed_stream_free(&end->stream);
+}
+
+/* open the chat and run both ends to the last acknowledgement. Returns the seconds it took, -1 on error */
+double chat_run(void) {
+	uint64_t start_ns;
+
+	chat_sender.udp.fd = -1;
+	chat_receiver.udp.fd = -1;
+	chat_sender.stream.fd = -1;
+	chat_receiver.stream.fd = -1;
+	if ((chat_udp ? chat_udp_open() : chat_tcp_open()) == -1) {
+		log_with_errno("[bench] could not open the chat");
+		return -1;
+	}
+
+	log_info("[bench] chatting %" PRIu32 " messages of %d bytes over %s%s", messages_count, message_size, chat_udp ? "UDP" : "TCP",
+	         chat_udp ? (chat_sender.udp.gso ? " with GSO" : " without GSO") : "");
+	start_ns = metrics_now_ns();
+	if (pthread_create(&chat_receiver.thread, NULL, chat_udp ? chat_udp_receive : chat_tcp_receive, &chat_receiver) != 0) {
+		log_error("[bench] could not start the receiver");
+		return -1;
+	}
+	if (chat_udp) {
+		chat_udp_send(&chat_sender);
+	} else {
+		chat_tcp_send(&chat_sender);
+	}
+	pthread_join(chat_receiver.thread, NULL);
+	return (double) (metrics_now_ns() - start_ns) / 1e9;
+}
+
+/* print the chat's results, as text and as JSON when asked to */
+int chat_report(double elapsed) {
+	const LatencyHistogram *histograms[1] = {&chat_receiver.latency};
+	LatencySummary latency;
+	uint32_t messages = chat_receiver.messages;
+	FILE *out;
+
+	histogram_summarize(histograms, 1, &latency);
+	printf("c_chat_bench: peer chat over %s, %d byte messages, ", chat_udp ? "UDP" : "TCP", message_size);
+	if (chat_interval_ns > 0) {
+		printf("open loop at %.0f/s\n", rate);
+	} else {
+		printf("closed loop\n");
+	}
+	printf("duration       %.3f s\n", elapsed);
+	printf("messages       %" PRIu32 " (%.1f/s)\n", messages, messages / elapsed);
+	printf("syscalls       sender %" PRIu64 ", receiver %" PRIu64 " (%.3f per message)\n", chat_sender.syscalls, chat_receiver.syscalls,
+	       messages ? (double) (chat_sender.syscalls + chat_receiver.syscalls) / messages : 0.0);
+	if (chat_udp) {
+		printf("datagrams      out %" PRIu64 ", in %" PRIu64 ", retransmitted %" PRIu64 " (GSO %s, GRO %s)\n",
+		       chat_sender.udp.datagrams_out + chat_receiver.udp.datagrams_out, chat_sender.udp.datagrams_in + chat_receiver.udp.datagrams_in,
+		       chat_sender.udp.retransmits, chat_sender.udp.gso ? "on" : "off", chat_receiver.udp.gro ? "on" : "off");
+	}
+	printf("latency of messages in us\n");
+	printf("  %-12s %10s %10s %10s %10s %10s\n", "", "count", "p50", "p99", "p999", "max");
+	print_latency_row(stdout, "all", &latency);
+	fflush(stdout);
+
+	if (json_path == NULL) {
+		return 0;
+	}
+	if (strcmp(json_path, "-") == 0) {
+		out = stdout;
+	} else if ((out = fopen(json_path, "w")) == NULL) {
+		log_with_errno("[bench] could not open '%s'", json_path);
+		return -1;
+	}
+	fprintf(out, "{\n  \"mode\": \"chat\",\n  \"transport\": \"%s\",\n  \"message_size\": %d,\n  \"rate\": %.1f,\n",
+	        chat_udp ? "udp" : "tcp", message_size, chat_interval_ns > 0 ? rate : 0.0);
+	fprintf(out, "  \"duration_s\": %.3f,\n  \"messages\": %" PRIu32 ",\n  \"messages_per_s\": %.1f,\n", elapsed, messages, messages / elapsed);
+	fprintf(out, "  \"syscalls\": {\"sender\": %" PRIu64 ", \"receiver\": %" PRIu64 ", \"per_message\": %.3f},\n", chat_sender.syscalls,
+	        chat_receiver.syscalls, messages ? (double) (chat_sender.syscalls + chat_receiver.syscalls) / messages : 0.0);
+	if (chat_udp) {
+		fprintf(out, "  \"datagrams\": {\"out\": %" PRIu64 ", \"in\": %" PRIu64 ", \"retransmitted\": %" PRIu64 ", \"gso\": %s, \"gro\": %s},\n",
+		        chat_sender.udp.datagrams_out + chat_receiver.udp.datagrams_out, chat_sender.udp.datagrams_in + chat_receiver.udp.datagrams_in,
+		        chat_sender.udp.retransmits, chat_sender.udp.gso ? "true" : "false", chat_receiver.udp.gro ? "true" : "false");
+	}
+	fprintf(out, "  \"latency\": ");
+	write_latency_json(out, &latency);
+	fprintf(out, "\n}\n");
+	if (out == stdout) {
+		fflush(stdout);
+	} else if (fclose(out) != 0) {
+		log_with_errno("[bench] writing '%s' failed", json_path);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t start_ns;
+	double elapsed;
+	int opt;
+	int left;
+	int ret;
+	int i;
+
+	while ((opt = getopt(argc, argv, "p:n:c:t:r:d:N:x:AT:j:C:s:h")) != -1) {
+		switch (opt) {
+			case 'p':
+				server_port = (int) strtol(optarg, NULL, 10);
+				break;
+			case 'n':
+				users_count = (int) strtol(optarg, NULL, 10);
+				break;
+			case 'c':
+				concurrency = (int) strtol(optarg, NULL, 10);
+				break;
+			case 't':
+				threads_count = (int) strtol(optarg, NULL, 10);
+				break;
+			case 'r':
+				rate = strtod(optarg, NULL);
+				break;
+			case 'd':
+				duration = strtod(optarg, NULL);
+				break;
+			case 'N':
+				transactions_limit = strtoull(optarg, NULL, 10);
+				break;
+			case 'x':
+				if (parse_mix(optarg) == -1) {
+					log_error("[bench] invalid mix '%s'", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'A':
+				use_binary = 0;
+				break;
+			case 'T':
+				timeout_ms = (int) strtol(optarg, NULL, 10);
+				break;
+			case 'j':
+				json_path = optarg;
+				break;
+			case 'C':
+				chat_mode = true;
+				if (strcmp(optarg, "udp") == 0) {
+					chat_udp = true;
+				} else if (strcmp(optarg, "tcp") != 0) {
+					log_error("[bench] chats run over 'tcp' or 'udp'");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 's':
+				message_size = (int) strtol(optarg, NULL, 10);
+				break;
+			case 'h':
+				usage();
+				break;
+			default:
+				usage();
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, sigint_handler);
+
+	if (chat_mode) {
+		if (transactions_limit > 0) {
+			messages_count = (uint32_t) transactions_limit;
+		}
+		// the time stamp and the NUL have to fit, a datagram takes DGRAM_MAX_PAYLOAD at most
+		if (message_size < 24 || message_size > DGRAM_MAX_PAYLOAD || messages_count == 0 || timeout_ms <= 0) {
+			log_error("[bench] chat messages are 24 - %d bytes, at least one of them and a positive timeout", DGRAM_MAX_PAYLOAD);
+			exit(EXIT_FAILURE);
+		}
+		if (rate > 0) {
+			chat_interval_ns = (uint64_t) (1e9 / rate);
+		}
+		if ((elapsed = chat_run()) < 0) {
+			exit(EXIT_FAILURE);
+		}
+		ret = chat_report(elapsed);
+		chat_close(&chat_sender);
+		chat_close(&chat_receiver);
+		return ret == -1 || chat_sender.failed || chat_receiver.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (threads_count < 1 || threads_count > MAX_THREADS) {
+		log_error("[bench] threads must be in range 1 - %d", MAX_THREADS);
+		exit(EXIT_FAILURE);
+	}
+	if (concurrency < threads_count || users_count < concurrency || duration <= 0 || timeout_ms <= 0) {
+		log_error("[bench] need at least one connection per thread, one user per connection and a positive duration and timeout");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&server_addr, 0, sizeof(struct sockaddr_in));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(server_port);
+	inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+
+	run_id = getpid();
+
+	if ((users = calloc((size_t) users_count, sizeof(BenchUser))) == NULL) {
+		log_error("[bench] out of memory");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < threads_count; i++) {
+		if (thread_init(&threads[i], i) == -1) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	log_info("[bench] running against '%s:%d' for %.1f s", SERVER_IP, server_port, duration);
+	start_ns = metrics_now_ns();
+	end_ns = start_ns + (uint64_t) (duration * 1e9);
+	for (i = 1; i < threads_count; i++) {
+		if (pthread_create(&threads[i].thread, NULL, thread_loop, &threads[i]) != 0) {
+			log_error("[bench] could not start thread %d", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	thread_loop(&threads[0]);
+	for (i = 1; i < threads_count; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+	elapsed = (double) (metrics_now_ns() - start_ns) / 1e9;
+
+	if ((left = unregister_leftovers()) > 0) {
+		log_info("[bench] unregistered %d users left behind by the run", left);
+	}
+	ret = report(elapsed);
+
+	for (i = 0; i < threads_count; i++) {
+		thread_destroy(&threads[i]);
+	}
+	free(users);
+	return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
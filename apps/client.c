@@ -2,6 +2,7 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <stdio.h>
@@ -10,14 +11,18 @@
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <inttypes.h>
 
 #include <signal.h>
 #include <getopt.h>
 #include <time.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include "logging.h"
 #include "network.h"
+#include "metrics.h"
+#include "datagram.h"
 
 
 
@@ -26,8 +31,72 @@ int LOG_LEVEL = INFO_LEVEL; // must do this before any log_*() call
 #define SERVER_IP       "127.0.0.1"
 #define SERVER_PORT     29000
 #define BUFLEN          2048
+#define CHAT_QUEUE_LEN  (64 * 1024)     /* chat output queued while the peer is slower, power of two */
+#define CHAT_UDP_PIECES ((BUFLEN + DGRAM_MAX_PAYLOAD - 1) / DGRAM_MAX_PAYLOAD)  /* datagrams of the longest message */
+#define CHAT_PEERS      16              /* concurrent chats of a listener unless told otherwise     */
+#define CHAT_PEERS_MAX  4096
+#define RELAY_RETRIES   10              /* asks for a relay while the peer parks again after a chat */
+#define RELAY_RETRY_MS  100
+
+/* a request to the server, independent of the protocol it is sent in */
+typedef struct ClientRequest {
+	char operation;             /* one of the *_BYTE values                  */
+	const char *username;       /* REGISTER/UNREGISTER/CONNECT               */
+	const char *room;           /* JOIN                                      */
+	uint32_t ip_addr;           /* LISTEN address, network byte order        */
+	uint16_t port;              /* LISTEN port                               */
+} ClientRequest;
+
+/* one chat connection, the peer's username is the first message it sends */
+typedef struct ChatPeer {
+	FramedStream stream;        /* stream.fd is -1 while the slot is free        */
+	char *username;             /* NULL until the peer introduced itself         */
+	bool closing;               /* nothing more to send, shut down once drained  */
+	bool shut;                  /* our side of the connection is shut down       */
+	bool closed;                /* the peer closed its side                      */
+	bool parked;                /* parked with the server, waiting for a caller  */
+	uint32_t sent;              /* number of the last message queued             */
+	uint32_t acked;             /* last message the peer acknowledged            */
+	uint32_t received;          /* number of the last message taken from the peer */
+	uint32_t acked_received;    /* last message we acknowledged                  */
+	DatagramPeer *udp;          /* the chat runs over UDP, NULL on TCP           */
+	bool udp_offered;           /* UDP offered, nothing is sent until the answer */
+	char *udp_text;             /* pieces of a long UDP message so far, BUFLEN   */
+	size_t udp_text_len;
+} ChatPeer;
+
+/*
+ * The chats of the client, served by one poll() loop: the peer of CONNECT mode, or every peer
+ * that connected to a listener.
+ */
+typedef struct Chat {
+	ChatPeer *peers;
+	int capacity;               /* peer slots, the connection limit              */
+	int count;                  /* slots in use                                  */
+	int listen_fd;              /* -1 unless listening                           */
+	bool input;                 /* stdin is still open                           */
+	bool closing;               /* 'q' was typed, finish every chat              */
+	struct sockaddr_in *relay_server;   /* parks connections there, NULL if not  */
+	int parked;                 /* peers parked with relay_server                */
+	const char *username;
+	char line[BUFLEN];          /* typed line being assembled                    */
+	size_t line_len;
+	size_t *t_txb;
+	size_t *t_rxb;
+	DatagramSocket *udp;        /* chats may run over UDP, NULL when they may not */
+	struct pollfd *fds;         /* listening socket, stdin, UDP, peers and session */
+	ChatPeer **fd_peers;        /* peer behind fds[3 + i]                        */
+} Chat;
 
 volatile sig_atomic_t sigint_received = 0;
+int use_binary = 1;     /* offer the binary protocol, cleared when the server only speaks ASCII */
+int use_session = 1;    /* keep one control connection open, cleared when the server declines   */
+FramedStream *session = NULL;   /* open session with the server, NULL when there is none */
+time_t session_ping_at;         /* monotonic second the next OP_PING is due              */
+struct sockaddr_in *lease_server = NULL;    /* server holding our lease, NULL while there is none */
+const ClientRequest *lease_requests = NULL; /* REGISTER + operation, sent again when it ran out    */
+ClientRequest lease_heartbeat;
+time_t lease_renew_at;          /* monotonic second the next heartbeat is due            */
 
 void sigint_handler(int s) {
 	log_info("[client] SIGINT handler called");
@@ -35,7 +104,7 @@ void sigint_handler(int s) {
 }
 
 enum mode {
-	LISTEN, CONNECT, UNKNOWN
+	LISTEN, CONNECT, STATS, ROOM, UNKNOWN
 };
 typedef enum mode mode;
 
@@ -55,19 +124,1197 @@ enum mode map_str_to_mode(const char *name) {
 		return CONNECT;
 	}
 
+	if (strcmp(name_to_lower, "stats") == 0) {
+		return STATS;
+	}
+
+	if (strcmp(name_to_lower, "room") == 0) {
+		return ROOM;
+	}
+
 	return UNKNOWN;
 }
 
-const char *map_mode_to_str(enum mode mode) {
-	switch (mode) {
-		case LISTEN:
-			return "listen";
-		case CONNECT:
-			return "connect";
-		default:
-			return "unknown";
+const char *map_mode_to_str(enum mode mode) {
+	switch (mode) {
+		case LISTEN:
+			return "listen";
+		case CONNECT:
+			return "connect";
+		case STATS:
+			return "stats";
+		case ROOM:
+			return "room";
+		default:
+			return "unknown";
+	}
+
+}
+
+int connect_to_server(struct sockaddr_in *server_addr) {
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP)) == -1) {
+		log_with_errno("[client] socket call failed");
+		return -1;
+	}
+	if ((connect(fd, (struct sockaddr *) server_addr, sizeof(*server_addr))) == -1) {
+		log_with_errno("[client] socket connect failed");
+		close(fd);
+		return -1;
+	}
+	log_info("[client] connected to server at '%s:%d'", inet_ntoa(server_addr->sin_addr), ntohs(server_addr->sin_port));
+	return fd;
+}
+
+/* connect to the server and wrap the socket in a stream framed for the current protocol */
+int open_server_stream(FramedStream *stream, struct sockaddr_in *server_addr) {
+	int fd;
+
+	if ((fd = connect_to_server(server_addr)) == -1) {
+		return -1;
+	}
+	if (framed_stream_init(stream, fd, use_binary ? FRAMING_BINARY : FRAMING_ASCII, BUFLEN, BUFLEN) == -1) {
+		log_error("[client] out of memory");
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+void close_stream(FramedStream *stream) {
+	close(stream->fd);
+	framed_stream_free(stream);
+}
+
+/*
+ * Queue REGISTER/UNREGISTER/HEARTBEAT/PARK/RELAY/CONNECT (username), LISTEN (ip_addr, port) or JOIN
+ * (room, binary protocol only) in the negotiated protocol. Nothing is written until the stream is
+ * flushed.
+ */
+int queue_request(FramedStream *stream, const ClientRequest *request, size_t *t_txb) {
+	char plaintext[BUFLEN];
+	char ip[INET_ADDRSTRLEN];
+	char operation = request->operation;
+	const char *username = request->username;
+	uint32_t ip_addr = request->ip_addr;
+	uint16_t port = request->port;
+	size_t len;
+	size_t txb;
+	uint8_t opcode;
+
+	if (use_binary) {
+		if (operation == LISTEN_BYTE) {
+			len = frame_encode_listen(plaintext, ip_addr, port);
+		} else if (operation == STATS_BYTE) {
+			len = frame_encode(plaintext, OP_STATS, 0, NULL, 0);
+		} else if (operation == JOIN_BYTE) {
+			len = frame_encode(plaintext, OP_JOIN, 0, request->room, (uint16_t) strlen(request->room));
+		} else {
+			opcode = operation == REGISTER_BYTE ? OP_REGISTER : operation == UNREGISTER_BYTE ? OP_UNREGISTER :
+			         operation == HEARTBEAT_BYTE ? OP_HEARTBEAT : operation == PARK_BYTE ? OP_PARK :
+			         operation == RELAY_BYTE ? OP_RELAY : OP_CONNECT;
+			len = frame_encode(plaintext, opcode, 0, username, (uint16_t) strlen(username));
+		}
+		log_debug("[client] sending '%c' request to server", operation);
+	} else {
+		memset(&plaintext, 0, sizeof(plaintext));
+		if (operation == LISTEN_BYTE) {
+			inet_ntop(AF_INET, &ip_addr, ip, sizeof(ip));
+			sprintf(plaintext, "%c %s %d", operation, ip, port);
+		} else if (operation == CONNECT_BYTE) {
+			sprintf(plaintext, "%c %s", operation, username);
+		} else if (operation == STATS_BYTE) {
+			sprintf(plaintext, "%c", operation);
+		} else {
+			sprintf(plaintext, "%c%s", operation, username);
+		}
+		log_debug("[client] sending message to server '%s'", plaintext);
+		len = strlen(plaintext) + 1;
+	}
+
+	if (framed_write(stream, plaintext, len) == -1) {
+		return -1;
+	}
+	txb = len;
+	transmitted_bytes_increase_and_report(&txb, t_txb, "client", 1);
+	return 0;
+}
+
+/* write several requests with a single syscall, the server answers them in order */
+int send_requests(FramedStream *stream, const ClientRequest *requests, int count, size_t *t_txb) {
+	ssize_t pending;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (queue_request(stream, &requests[i], t_txb) == -1) {
+			return -1;
+		}
+	}
+	while ((pending = framed_flush(stream)) > 0) {}
+	return pending == -1 ? -1 : 0;
+}
+
+/*
+ * Offer the binary protocol with OP_HELLO, pipelining the given requests behind it. A server that
+ * only speaks ASCII drops the connection on the unknown first byte, in which case we reconnect
+ * and send the requests again in ASCII. Returns -1 on error, the stream is closed then.
+ */
+int negotiate_protocol(FramedStream *stream, struct sockaddr_in *server_addr, const ClientRequest *requests, int count, size_t *t_txb) {
+	char buffer[FRAME_HEADER_LEN + 1];
+	FramedMessage message;
+
+	if (use_binary) {
+		log_debug("[client] offering binary protocol version %d", PROTOCOL_VERSION);
+		framed_write(stream, buffer, frame_encode_hello(buffer, PROTOCOL_VERSION, use_session ? HELLO_FLAG_SESSION : 0));
+		if (send_requests(stream, requests, count, t_txb) == -1) {
+			log_with_errno("[client] socket sending HELLO to server failed");
+			close_stream(stream);
+			return -1;
+		}
+		if (framed_recv(stream, &message) == 1 && message.frame.opcode == OP_HELLO && message.frame.length >= 1) {
+			log_debug("[client] server accepted binary protocol version %u", message.frame.payload[0]);
+			use_session = (message.frame.flags & HELLO_FLAG_SESSION) != 0;
+			return 0;
+		}
+
+		log_info("[client] server does not speak the binary protocol, falling back to ASCII");
+		close_stream(stream);
+		use_binary = 0;
+		use_session = 0;
+		if (open_server_stream(stream, server_addr) == -1) {
+			return -1;
+		}
+	}
+
+	if (send_requests(stream, requests, count, t_txb) == -1) {
+		log_with_errno("[client] socket sending initial message to server failed");
+		close_stream(stream);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Receive the server's answer. ip_addr and port are filled in when the answer carries an address.
+ * Returns 0 when the server closed the connection, -1 on error and 1 otherwise.
+ */
+int recv_response(FramedStream *stream, int *status, uint32_t *ip_addr, uint16_t *port, size_t *t_rxb) {
+	char plaintext[BUFLEN];
+	FramedMessage message;
+	uint16_t code;
+	size_t rxb;
+	int ret;
+	char *token;
+	char *saveptr = NULL;
+
+	do {
+		if ((ret = framed_recv(stream, &message)) <= 0) {
+			return ret;
+		}
+		// keepalive answers and room messages may still be in flight on a session
+	} while (use_binary && (message.frame.opcode == OP_PONG || message.frame.opcode == OP_PUBLISH));
+
+	if (use_binary) {
+		if (frame_decode_status(&message.frame, &code, ip_addr, port) == -1) {
+			log_error("[client] unexpected frame (opcode 0x%02x) from server", message.frame.opcode);
+			return -1;
+		}
+		*status = code;
+		log_debug("[client] response from server: %d", *status);
+	} else {
+		memcpy(plaintext, message.data, message.len);
+		log_debug("[client] response from server '%s'", plaintext);
+		*status = extract_status_code(plaintext);
+
+		// "200OK <ip> <port>"
+		if ((token = strtok_r(plaintext, " ", &saveptr)) != NULL && (token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+			inet_pton(AF_INET, token, ip_addr);
+			if ((token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+				*port = (uint16_t) strtol(token, NULL, 10);
+			}
+		}
+	}
+
+	rxb = message.len;
+	received_bytes_increase_and_report(&rxb, t_rxb, "client", 1);
+	return 1;
+}
+
+time_t monotonic_seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+void session_open(FramedStream *stream) {
+	session = stream;
+	session_ping_at = monotonic_seconds() + SESSION_KEEPALIVE_SECS;
+	log_debug("[client] keeping the session with the server open");
+}
+
+/* take the messages buffered on the session: keepalive answers, and room messages to print */
+void session_drain(void) {
+	FramedMessage message;
+	RoomPost post;
+	uint16_t status;
+	uint32_t ip_addr;
+	uint16_t port;
+
+	while (framed_next(session, &message) == 1) {
+		if (message.frame.opcode == OP_PONG) {
+			log_debug("[client] keepalive answered by the server");
+		} else if (frame_decode_publish(&message.frame, &post) == 0) {
+			printf("[%.*s] %.*s\n", post.username_len, post.username, post.text_len, post.text);
+			fflush(stdout);
+		} else if (frame_decode_status(&message.frame, &status, &ip_addr, &port) == 0) {
+			log_error("[client] %u: the server refused a message to the room", status);
+		} else {
+			log_error("[client] unexpected frame (opcode 0x%02x) on the session", message.frame.opcode);
+		}
+	}
+}
+
+/* consume what the server sent on the session, closes the session when the server went away */
+void session_on_readable(void) {
+	if (framed_read(session) <= 0) {
+		log_error("[client] lost the session with the server");
+		close_stream(session);
+		session = NULL;
+		return;
+	}
+	session_drain();
+}
+
+/*
+ * Without a session the registration is a lease, renewed with a heartbeat every
+ * HEARTBEAT_INTERVAL_SECS. requests register the user again should the server have dropped it
+ * meanwhile, NULL to give the registration up then.
+ */
+void lease_open(struct sockaddr_in *server_addr, const char *username, const ClientRequest *requests) {
+	lease_server = server_addr;
+	lease_requests = requests;
+	memset(&lease_heartbeat, 0, sizeof(lease_heartbeat));
+	lease_heartbeat.operation = HEARTBEAT_BYTE;
+	lease_heartbeat.username = username;
+	lease_renew_at = monotonic_seconds() + HEARTBEAT_INTERVAL_SECS;
+}
+
+/* send a heartbeat on a connection of its own, registering again if the lease had run out */
+void lease_renew(void) {
+	FramedStream server;
+	int status_code = -1;
+	uint32_t ip_addr = 0;
+	uint16_t port = 0;
+	size_t t_txb = 0;
+	size_t t_rxb = 0;
+	int i;
+
+	if (open_server_stream(&server, lease_server) == -1 || negotiate_protocol(&server, lease_server, &lease_heartbeat, 1, &t_txb) == -1) {
+		log_error("[client] could not reach the server to renew the registration");
+		return;
+	}
+	if (recv_response(&server, &status_code, &ip_addr, &port, &t_rxb) != 1) {
+		log_error("[client] connection terminated before the heartbeat was answered");
+	} else if (status_code == 200) {
+		log_debug("[client] registration of '%s' renewed", lease_heartbeat.username);
+	} else if (status_code == 404 && lease_requests != NULL) {
+		log_info("[client] the server dropped '%s', registering again", lease_heartbeat.username);
+		close_stream(&server);
+		if (open_server_stream(&server, lease_server) == -1 || negotiate_protocol(&server, lease_server, lease_requests, 2, &t_txb) == -1) {
+			return;
+		}
+		for (i = 0; i < 2 && status_code != -1; i++) {
+			if (recv_response(&server, &status_code, &ip_addr, &port, &t_rxb) != 1 || status_code != 200) {
+				status_code = -1;
+			}
+		}
+		if (status_code == -1) {
+			log_error("[client] could not register '%s' again", lease_heartbeat.username);
+		}
+	} else {
+		log_error("[client] %d: the server no longer knows '%s'", status_code, lease_heartbeat.username);
+		lease_server = NULL;
+	}
+	close_stream(&server);
+}
+
+/* the earlier of two poll() timeouts, -1 being for ever */
+static inline int min_timeout(int a, int b) {
+	return a == -1 || (b != -1 && b < a) ? b : a;
+}
+
+/*
+ * poll() fds until one of them has events, or timeout_ms passed (-1 waits for ever). While a
+ * session is open its connection is served as well, through one more entry fds must have room
+ * for, and an OP_PING goes out every SESSION_KEEPALIVE_SECS; a lease is renewed in time instead.
+ * Negative descriptors are skipped like poll() does. Returns -1 on error, EINTR when a signal
+ * arrived.
+ */
+int session_poll(struct pollfd *fds, int count, int timeout_ms) {
+	char ping[FRAME_HEADER_LEN];
+	uint64_t deadline_ns = timeout_ms >= 0 ? metrics_now_ns() + (uint64_t) timeout_ms * 1000000ULL : 0;
+	uint64_t now_ns;
+	int nfds;
+	int timeout;
+	int ready;
+	time_t now;
+
+	while (1) {
+		nfds = count;
+		timeout = -1;
+		if (timeout_ms >= 0) {
+			now_ns = metrics_now_ns();
+			timeout = deadline_ns > now_ns ? (int) ((deadline_ns - now_ns + 999999) / 1000000) : 0;
+		}
+		if (lease_server != NULL) {
+			now = monotonic_seconds();
+			if (now >= lease_renew_at) {
+				lease_renew();
+				lease_renew_at = now + HEARTBEAT_INTERVAL_SECS;
+			}
+			timeout = min_timeout(timeout, (int) (lease_renew_at - now) * 1000);
+		}
+		if (session != NULL) {
+			now = monotonic_seconds();
+			if (now >= session_ping_at) {
+				if (framed_send(session, ping, frame_encode(ping, OP_PING, 0, NULL, 0)) == -1) {
+					log_with_errno("[client] sending keepalive to the server failed");
+				}
+				session_ping_at = now + SESSION_KEEPALIVE_SECS;
+			}
+			fds[nfds].fd = session->fd;
+			fds[nfds].events = POLLIN;
+			nfds++;
+			timeout = min_timeout(timeout, (int) (session_ping_at - now) * 1000);
+		}
+
+		if ((ready = poll(fds, (nfds_t) nfds, timeout)) == -1) {
+			return -1;
+		}
+		if (nfds > count && fds[count].revents != 0) {
+			session_on_readable();
+			ready--;
+		}
+		if (ready > 0 || (timeout_ms >= 0 && metrics_now_ns() >= deadline_ns)) {
+			return 0;
+		}
+	}
+}
+
+int chat_init(Chat *chat, int capacity, int listen_fd, const char *username, size_t *t_txb, size_t *t_rxb) {
+	int i;
+
+	memset(chat, 0, sizeof(Chat));
+	chat->peers = calloc((size_t) capacity, sizeof(ChatPeer));
+	// the listening socket, stdin, the UDP socket, every peer and the session
+	chat->fds = calloc((size_t) capacity + 4, sizeof(struct pollfd));
+	chat->fd_peers = calloc((size_t) capacity, sizeof(ChatPeer *));
+	if (chat->peers == NULL || chat->fds == NULL || chat->fd_peers == NULL) {
+		free(chat->peers);
+		free(chat->fds);
+		free(chat->fd_peers);
+		return -1;
+	}
+	for (i = 0; i < capacity; i++) {
+		chat->peers[i].stream.fd = -1;
+	}
+	chat->capacity = capacity;
+	chat->listen_fd = listen_fd;
+	chat->input = true;
+	chat->username = username;
+	chat->t_txb = t_txb;
+	chat->t_rxb = t_rxb;
+	return 0;
+}
+
+/* take the connected socket fd into a free slot, username is NULL until the peer sends it */
+ChatPeer *chat_peer_open(Chat *chat, int fd, const char *username) {
+	ChatPeer *peer = NULL;
+	int on = 1;
+	int i;
+
+	for (i = 0; i < chat->capacity && peer == NULL; i++) {
+		if (chat->peers[i].stream.fd == -1) {
+			peer = &chat->peers[i];
+		}
+	}
+	if (peer == NULL || framed_stream_init(&peer->stream, fd, FRAMING_ASCII, BUFLEN, CHAT_QUEUE_LEN) == -1) {
+		return NULL;
+	}
+	// output leaves in whole batches already, Nagle would only hold messages back for the peer's delayed ACK
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	peer->username = username != NULL ? strdup(username) : NULL;
+	peer->closing = chat->closing;
+	peer->shut = false;
+	peer->closed = false;
+	peer->parked = false;
+	peer->sent = 0;
+	peer->acked = 0;
+	peer->received = 0;
+	peer->acked_received = 0;
+	peer->udp = NULL;
+	peer->udp_offered = false;
+	peer->udp_text = NULL;
+	peer->udp_text_len = 0;
+	chat->count++;
+	return peer;
+}
+
+void chat_peer_close(Chat *chat, ChatPeer *peer) {
+	if (peer->parked) {
+		chat->parked--;
+	}
+	if (peer->udp != NULL) {
+		datagram_peer_free(chat->udp, peer->udp);
+		free(peer->udp);
+		peer->udp = NULL;
+	}
+	free(peer->udp_text);
+	peer->udp_text = NULL;
+	close_stream(&peer->stream);
+	peer->stream.fd = -1;
+	free(peer->username);
+	peer->username = NULL;
+	chat->count--;
+}
+
+void chat_free(Chat *chat) {
+	int i;
+
+	for (i = 0; i < chat->capacity; i++) {
+		if (chat->peers[i].stream.fd != -1) {
+			chat_peer_close(chat, &chat->peers[i]);
+		}
+	}
+	if (chat->udp != NULL) {
+		datagram_socket_close(chat->udp);
+	}
+	free(chat->peers);
+	free(chat->fds);
+	free(chat->fd_peers);
+}
+
+/* let chats run over UDP, on a socket bound to addr. Returns -1 when it cannot be opened */
+int chat_open_udp(Chat *chat, DatagramSocket *sock, const struct sockaddr_in *addr) {
+	if (datagram_socket_open(sock, addr) == -1) {
+		log_with_errno("[client] could not open a UDP socket, chatting over TCP");
+		return -1;
+	}
+	log_debug("[client] chats may run over UDP on port %u (GSO %s, GRO %s)", sock->port, sock->gso ? "on" : "off", sock->gro ? "on" : "off");
+	chat->udp = sock;
+	return 0;
+}
+
+/* the send ring of the peer can take another message of any size */
+static inline bool chat_peer_ring_room(const ChatPeer *peer) {
+	return peer->stream.tx.capacity - framed_pending_output(&peer->stream) >= BUFLEN;
+}
+
+/* the peer can be sent another message: its ring has room and the window is not full */
+static inline bool chat_peer_room(const ChatPeer *peer) {
+	if (peer->udp_offered) {
+		return false;
+	}
+	// a message takes up to CHAT_UDP_PIECES datagrams of the window
+	if (peer->udp != NULL) {
+		return datagram_peer_room(peer->udp) && datagram_peer_unacked(peer->udp) <= DGRAM_WINDOW - CHAT_UDP_PIECES;
+	}
+	return chat_peer_ring_room(peer) && peer->sent - peer->acked < CHAT_WINDOW;
+}
+
+/* messages sent that the peer did not acknowledge yet, only UDP waits for them before closing */
+static inline uint32_t chat_peer_unacked(const ChatPeer *peer) {
+	return peer->udp != NULL && !peer->udp->lost ? datagram_peer_unacked(peer->udp) : 0;
+}
+
+/*
+ * Queue text, NUL terminator included, for the peer. Only called while it has room. Over UDP a
+ * message longer than a datagram goes in pieces, only the last one ends with the NUL.
+ */
+void chat_peer_queue(Chat *chat, ChatPeer *peer, const char *text, size_t len) {
+	size_t txb = len;
+	size_t offset;
+	size_t piece;
+
+	log_debug("[client] sending message '%s' to user %s", text, peer->username);
+	if (peer->udp != NULL) {
+		for (offset = 0; offset < len; offset += piece) {
+			piece = len - offset < DGRAM_MAX_PAYLOAD ? len - offset : DGRAM_MAX_PAYLOAD;
+			datagram_queue(peer->udp, text + offset, piece);
+		}
+	} else {
+		framed_write(&peer->stream, text, len);
+		peer->sent++;
+	}
+	transmitted_bytes_increase_and_report(&txb, chat->t_txb, "client", 1);
+}
+
+/* CHAT_UDP_BYTE and port for the peer, behind what was queued on its connection so far */
+void chat_peer_queue_udp(Chat *chat, ChatPeer *peer, uint16_t port) {
+	char offer[16];
+	size_t txb;
+
+	txb = (size_t) sprintf(offer, "%c%u", CHAT_UDP_BYTE, port) + 1;
+	framed_write(&peer->stream, offer, txb);
+	transmitted_bytes_increase_and_report(&txb, chat->t_txb, "client", 1);
+}
+
+/*
+ * Offer the peer, reached directly, to chat over UDP. Its datagrams are taken from the address
+ * of the connection already, they may overtake the answer. Stays on TCP when that fails.
+ */
+void chat_peer_offer_udp(Chat *chat, ChatPeer *peer) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if (getpeername(peer->stream.fd, (struct sockaddr *) &addr, &addr_len) == -1 || (peer->udp = malloc(sizeof(DatagramPeer))) == NULL) {
+		return;
+	}
+	if (datagram_peer_init(chat->udp, peer->udp, &addr, peer) == -1) {
+		free(peer->udp);
+		peer->udp = NULL;
+		return;
+	}
+	log_debug("[client] offering '%s' to chat over UDP from port %u", peer->username, chat->udp->port);
+	chat_peer_queue_udp(chat, peer, chat->udp->port);
+	peer->udp_offered = true;
+}
+
+/*
+ * CHAT_UDP_BYTE from the peer: the answer to our offer, or its offer, which is taken when chats
+ * may run over UDP here. Returns -1 when the peer has to be dropped.
+ */
+int chat_peer_on_udp(Chat *chat, ChatPeer *peer, const char *message) {
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	char *end;
+	unsigned long port = strtoul(message + 1, &end, 10);
+
+	if (end == message + 1 || *end != '\0' || port > 65535) {
+		log_error("[client] bad UDP offer '%s' from user '%s'", message + 1, peer->username);
+		return -1;
+	}
+	if (peer->udp_offered) {
+		peer->udp_offered = false;
+		if (port == 0) {
+			log_info("[client] user '%s' chats over TCP", peer->username);
+			datagram_peer_free(chat->udp, peer->udp);
+			free(peer->udp);
+			peer->udp = NULL;
+			return 0;
+		}
+		peer->udp->addr.sin_port = htons((uint16_t) port);
+		log_info("[client] chatting with user '%s' over UDP", peer->username);
+		return 0;
+	}
+	if (peer->udp != NULL || port == 0) {
+		log_error("[client] unexpected UDP offer from user '%s'", peer->username);
+		return -1;
+	}
+
+	// chats through the server never offer, the address of the connection is the caller's
+	if (chat->udp == NULL || getpeername(peer->stream.fd, (struct sockaddr *) &addr, &addr_len) == -1 ||
+	    (peer->udp = malloc(sizeof(DatagramPeer))) == NULL) {
+		chat_peer_queue_udp(chat, peer, 0);
+		return 0;
+	}
+	addr.sin_port = htons((uint16_t) port);
+	if (datagram_peer_init(chat->udp, peer->udp, &addr, peer) == -1) {
+		free(peer->udp);
+		peer->udp = NULL;
+		chat_peer_queue_udp(chat, peer, 0);
+		return 0;
+	}
+	chat_peer_queue_udp(chat, peer, chat->udp->port);
+	log_info("[client] chatting with user '%s' over UDP", peer->username);
+	return 0;
+}
+
+/* a message, or a piece of one, that came over UDP in order. The last piece ends with the NUL */
+void chat_on_datagram(void *ctx, DatagramPeer *udp, const char *data, size_t len) {
+	Chat *chat = ctx;
+	ChatPeer *peer = udp->owner;
+	size_t rxb = len;
+
+	if (len == 0) {
+		log_error("[client] malformed message from user '%s'", peer->username);
+		return;
+	}
+	received_bytes_increase_and_report(&rxb, chat->t_rxb, "client", 1);
+	if (peer->udp_text_len == 0 && data[len - 1] == '\0') {
+		printf("[%s] %s\n", peer->username, data);
+		return;
+	}
+	if (peer->udp_text == NULL && (peer->udp_text = malloc(BUFLEN)) == NULL) {
+		log_error("[client] out of memory, message from user '%s' dropped", peer->username);
+		return;
+	}
+	// too long: what is left of it goes too, up to the piece that ends it
+	if (peer->udp_text_len + len > BUFLEN) {
+		if (data[len - 1] == '\0') {
+			log_error("[client] message from user '%s' exceeds %d bytes, dropped", peer->username, BUFLEN);
+			peer->udp_text_len = 0;
+		} else {
+			peer->udp_text_len = BUFLEN;
+		}
+		return;
+	}
+	memcpy(peer->udp_text + peer->udp_text_len, data, len);
+	peer->udp_text_len += len;
+	if (data[len - 1] == '\0') {
+		printf("[%s] %s\n", peer->username, peer->udp_text);
+		peer->udp_text_len = 0;
+	}
+}
+
+/* acknowledge what was taken from the peer once half a window of it is unacknowledged */
+void chat_peer_ack(Chat *chat, ChatPeer *peer) {
+	char ack[16];
+	size_t txb;
+
+	if (peer->received - peer->acked_received < CHAT_WINDOW / 2) {
+		return;
+	}
+	txb = (size_t) sprintf(ack, "%c%" PRIu32, CHAT_ACK_BYTE, peer->received) + 1;
+	framed_write(&peer->stream, ack, txb);
+	peer->acked_received = peer->received;
+	transmitted_bytes_increase_and_report(&txb, chat->t_txb, "client", 1);
+}
+
+/* take a cumulative acknowledgement. Returns -1 when it covers messages never sent */
+int chat_peer_on_ack(ChatPeer *peer, const char *ack) {
+	char *end;
+	uint32_t number = (uint32_t) strtoul(ack + 1, &end, 10);
+
+	if (end == ack + 1 || *end != '\0' || number - peer->acked > peer->sent - peer->acked) {
+		log_error("[client] bad acknowledgement '%s' from user '%s'", ack + 1, peer->username);
+		return -1;
+	}
+	peer->acked = number;
+	return 0;
+}
+
+/* "@user text" goes to that user, anything else to every peer of the chat */
+void chat_route_line(Chat *chat, char *line) {
+	ChatPeer *peer;
+	char *text = line;
+	const char *to = NULL;
+	int sent = 0;
+	int i;
+
+	// a leading CHAT_ACK_BYTE or CHAT_UDP_BYTE would pass for one of those
+	if (line[0] == CHAT_ACK_BYTE || line[0] == CHAT_UDP_BYTE) {
+		text = ++line;
+	}
+	if (line[0] == '@') {
+		to = line + 1;
+		text = line + 1 + strcspn(line + 1, " ");
+		if (*text != '\0') {
+			*text++ = '\0';
+		}
+	}
+	for (i = 0; i < chat->capacity; i++) {
+		peer = &chat->peers[i];
+		if (peer->stream.fd == -1 || peer->username == NULL || peer->closing || (to != NULL && strcmp(to, peer->username) != 0)) {
+			continue;
+		}
+		chat_peer_queue(chat, peer, text, strlen(text) + 1);
+		sent++;
+	}
+	if (sent == 0) {
+		log_error("[client] %s%s to send the message to", to != NULL ? "no chat with " : "nobody", to != NULL ? to : "");
+	}
+}
+
+/* every peer can be sent another message */
+bool chat_room(const Chat *chat) {
+	int i;
+
+	for (i = 0; i < chat->capacity; i++) {
+		if (chat->peers[i].stream.fd != -1 && !chat_peer_room(&chat->peers[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Route the complete lines typed so far, a full buffer goes out even without a newline; what is
+ * left moves to the front of the line buffer, as do the lines a full window holds back. 'q'
+ * closes every chat.
+ */
+void chat_on_input(Chat *chat, bool eof) {
+	char *line = chat->line;
+	char *newline;
+	size_t end;
+
+	if (eof && chat->line_len > 0) {
+		// what is left of the last line goes out on its own
+		line[chat->line_len++] = '\n';
+	}
+	while (!chat->closing && ((newline = memchr(line, '\n', chat->line_len)) != NULL || chat->line_len == BUFLEN - 1) && chat_room(chat)) {
+		end = newline != NULL ? (size_t) (newline - line) : chat->line_len;
+		line[end] = '\0';
+		// strip the carriage return of a terminal in raw mode
+		if (end > 0 && line[end - 1] == '\r') {
+			line[end - 1] = '\0';
+		}
+		if ((line[0] == 'q' || line[0] == 'Q') && line[1] == '\0') {
+			log_info("[client] terminating the chat");
+			chat->closing = true;
+		} else {
+			chat_route_line(chat, line);
+		}
+
+		end += newline != NULL;
+		memmove(line, line + end, chat->line_len - end);
+		chat->line_len -= end;
+	}
+}
+
+/*
+ * The server's answer to a parked connection: 200 when a caller was relayed to it, which makes it
+ * a chat like any other. Anything else gives relaying up. Returns -1 when the peer has to be
+ * dropped.
+ */
+int chat_peer_unpark(Chat *chat, ChatPeer *peer, const FramedMessage *message) {
+	char plaintext[BUFLEN];
+	uint32_t ip_addr;
+	uint16_t port;
+	uint16_t status = 0;
+
+	if (peer->stream.framing == FRAMING_BINARY) {
+		frame_decode_status(&message->frame, &status, &ip_addr, &port);
+	} else {
+		memcpy(plaintext, message->data, message->len);
+		status = (uint16_t) extract_status_code(plaintext);
+	}
+	peer->parked = false;
+	chat->parked--;
+	if (status != 200) {
+		log_error("[client] %d: the server does not relay chats to '%s'", status, chat->username);
+		chat->relay_server = NULL;
+		return -1;
+	}
+	log_info("[client] a user connected for chat through the server");
+	peer->stream.framing = FRAMING_ASCII;
+	return 0;
+}
+
+/* take in what the peer sent. Returns -1 when the peer has to be dropped */
+int chat_peer_on_readable(Chat *chat, ChatPeer *peer) {
+	FramedMessage message;
+	size_t rxb;
+	ssize_t n;
+	int ret;
+
+	if ((n = framed_read(&peer->stream)) == 0) {
+		log_info("[client] connection with '%s' terminated", peer->username != NULL ? peer->username : "unknown user");
+		peer->closed = true;
+	} else if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		log_with_errno("[client] socket error receiving message from user '%s'", peer->username);
+		return -1;
+	}
+	while ((ret = framed_next(&peer->stream, &message)) == 1) {
+		rxb = message.len;
+		received_bytes_increase_and_report(&rxb, chat->t_rxb, "client", 1);
+		if (peer->parked) {
+			if (chat_peer_unpark(chat, peer, &message) == -1) {
+				return -1;
+			}
+			continue;
+		}
+		if (message.data[0] == CHAT_ACK_BYTE) {
+			if (chat_peer_on_ack(peer, message.data) == -1) {
+				return -1;
+			}
+			continue;
+		}
+		if (message.data[0] == CHAT_UDP_BYTE) {
+			if (peer->username == NULL || chat_peer_on_udp(chat, peer, message.data) == -1) {
+				return -1;
+			}
+			continue;
+		}
+		peer->received++;
+		// before chat the peer sends its username to make it more beautiful
+		if (peer->username == NULL) {
+			peer->username = strdup(message.data);
+			log_info("[client] user '%s' joined the chat", peer->username);
+			continue;
+		}
+		printf("[%s] %s\n", peer->username, message.data);
+	}
+	fflush(stdout);
+	chat_peer_ack(chat, peer);
+	if (ret == -1) {
+		log_error("[client] message from user '%s' exceeds %d bytes", peer->username, BUFLEN);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Make a connection to the server a peer, with what it buffered so far; parked ones keep talking
+ * to the server until it answered. Returns NULL with the stream closed on failure.
+ */
+ChatPeer *chat_peer_adopt(Chat *chat, FramedStream *stream, const char *username, bool parked) {
+	char buffered[BUFLEN];
+	size_t len;
+	ChatPeer *peer;
+
+	if ((peer = chat_peer_open(chat, stream->fd, username)) == NULL) {
+		log_error("[client] out of memory");
+		close_stream(stream);
+		return NULL;
+	}
+	fcntl(peer->stream.fd, F_SETFL, O_NONBLOCK);
+	peer->parked = parked;
+	peer->stream.framing = parked ? stream->framing : FRAMING_ASCII;
+	chat->parked += parked;
+
+	len = framed_take(stream, buffered, sizeof(buffered));
+	framed_stream_free(stream);
+	if (len > 0) {
+		// poll() will not report what has been read already
+		framed_feed(&peer->stream, buffered, len);
+		if (chat_peer_on_readable(chat, peer) == -1) {
+			chat_peer_close(chat, peer);
+			return NULL;
+		}
+	}
+	return peer;
+}
+
+/*
+ * Keep RELAY_PARKED connections parked with the server while there are free slots, for callers
+ * that cannot connect to us. Relaying is given up when the server cannot be reached.
+ */
+void chat_park(Chat *chat) {
+	FramedStream stream;
+	ClientRequest park;
+
+	memset(&park, 0, sizeof(park));
+	park.operation = PARK_BYTE;
+	park.username = chat->username;
+	while (chat->relay_server != NULL && chat->parked < RELAY_PARKED && chat->count < chat->capacity) {
+		if (open_server_stream(&stream, chat->relay_server) == -1 || negotiate_protocol(&stream, chat->relay_server, &park, 1, chat->t_txb) == -1) {
+			log_error("[client] could not park a connection with the server, no longer relaying");
+			chat->relay_server = NULL;
+			return;
+		}
+		if (chat_peer_adopt(chat, &stream, NULL, true) == NULL) {
+			return;
+		}
+		log_debug("[client] parked a connection with the server");
+	}
+}
+
+/*
+ * Chat with username through the server, on a connection it joins with one the user parked. A
+ * 404 is retried for a while, the user may be busy parking the next one. Returns NULL when the
+ * server cannot relay.
+ */
+ChatPeer *chat_relay(Chat *chat, struct sockaddr_in *server_addr, const char *username) {
+	struct timespec pause = {0, RELAY_RETRY_MS * 1000000L};
+	FramedStream stream;
+	ClientRequest relay;
+	int status_code = 404;
+	uint32_t ip_addr = 0;
+	uint16_t port = 0;
+	int tries;
+
+	memset(&relay, 0, sizeof(relay));
+	relay.operation = RELAY_BYTE;
+	relay.username = username;
+	for (tries = 0; status_code == 404 && tries < RELAY_RETRIES; tries++) {
+		if (tries > 0) {
+			nanosleep(&pause, NULL);
+		}
+		if (open_server_stream(&stream, server_addr) == -1 || negotiate_protocol(&stream, server_addr, &relay, 1, chat->t_txb) == -1) {
+			return NULL;
+		}
+		if (recv_response(&stream, &status_code, &ip_addr, &port, chat->t_rxb) != 1) {
+			status_code = -1;
+		}
+		if (status_code != 200) {
+			close_stream(&stream);
+		}
+	}
+	if (status_code != 200) {
+		log_error("[client] %d: the server cannot relay the chat with '%s'", status_code, username);
+		return NULL;
+	}
+	log_info("[client] chatting with user '%s' through the server", username);
+	return chat_peer_adopt(chat, &stream, username, false);
+}
+
+/* accept the waiting peers while there are free slots */
+void chat_accept(Chat *chat) {
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+	int fd;
+
+	while (chat->count < chat->capacity) {
+		addr_len = sizeof(addr);
+		if ((fd = accept4(chat->listen_fd, (struct sockaddr *) &addr, &addr_len, SOCK_NONBLOCK)) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+				log_with_errno("[client] socket accept failed");
+			}
+			return;
+		}
+		if (chat_peer_open(chat, fd, NULL) == NULL) {
+			log_error("[client] out of memory");
+			close(fd);
+			return;
+		}
+		log_info("[client] a user connected for chat from '%s:%d'", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	}
+}
+
+/*
+ * The chat event loop: stdin, every peer and the listening socket in one poll(). Lines typed go
+ * out as they are typed, messages are printed as they arrive, and neither waits for the other.
+ * Every peer has a send ring and a window of its own; stdin is only read while all of them can
+ * take another line, and a peer's messages only while its ring can take the acknowledgements, so
+ * a slow peer holds up nobody but itself. The listening socket is left alone while every slot is taken, the kernel
+ * keeps further peers in the backlog.
+ * With a relay server, connections parked there wait for callers next to the listening socket.
+ * Chats over UDP share one socket; their connections only carry the end of the chat.
+ * 'q' (or the end of input without a listening socket) half-closes every chat once its ring
+ * drained and its messages were acknowledged, the peers' last messages are still taken until they
+ * close too. Returns 0 once no chat is left to wait for or on SIGINT, -1 on error.
+ */
+int chat_run(Chat *chat) {
+	ChatPeer *peer;
+	bool room;
+	ssize_t pending;
+	ssize_t n;
+	int nfds;
+	int i;
+
+	while (!sigint_received) {
+		if (!chat->closing) {
+			chat_park(chat);
+		}
+		// lines a full window held back go out first
+		if (chat->line_len > 0) {
+			chat_on_input(chat, false);
+		}
+		if (!chat->input && chat->line_len == 0) {
+			// without a listening socket there is nothing left to do but finish the chat
+			chat->closing |= chat->listen_fd == -1;
+		}
+		room = true;
+		nfds = 3;
+		for (i = 0; i < chat->capacity; i++) {
+			peer = &chat->peers[i];
+			if (peer->stream.fd == -1) {
+				continue;
+			}
+			if (peer->parked && chat->closing) {
+				// nobody is coming through it anymore
+				chat_peer_close(chat, peer);
+				continue;
+			}
+			if (peer->udp != NULL && peer->udp->lost) {
+				log_error("[client] user '%s' stopped acknowledging messages, closing the chat", peer->username);
+				chat_peer_close(chat, peer);
+				continue;
+			}
+			if ((pending = framed_flush(&peer->stream)) == -1) {
+				log_with_errno("[client] socket error sending message to user '%s'", peer->username);
+				chat_peer_close(chat, peer);
+				continue;
+			}
+			peer->closing |= chat->closing;
+			if (pending == 0 && chat_peer_unacked(peer) == 0 && peer->closed) {
+				chat_peer_close(chat, peer);
+				continue;
+			}
+			if (pending == 0 && chat_peer_unacked(peer) == 0 && peer->closing && !peer->shut) {
+				shutdown(peer->stream.fd, SHUT_WR);
+				peer->shut = true;
+			}
+			room &= chat_peer_room(peer);
+			chat->fds[nfds].fd = peer->stream.fd;
+			chat->fds[nfds].events = (!peer->closed && chat_peer_ring_room(peer) ? POLLIN : 0) | (pending > 0 ? POLLOUT : 0);
+			chat->fd_peers[nfds - 3] = peer;
+			nfds++;
+		}
+		if (chat->count == 0 && (chat->closing || chat->listen_fd == -1)) {
+			return 0;
+		}
+		if (chat->udp != NULL && datagram_flush(chat->udp, metrics_now_ns()) == -1) {
+			log_with_errno("[client] socket error sending messages over UDP");
+		}
+
+		chat->fds[0].fd = chat->listen_fd != -1 && !chat->closing && chat->count < chat->capacity ? chat->listen_fd : -1;
+		chat->fds[0].events = POLLIN;
+		chat->fds[1].fd = chat->input && !chat->closing && room && chat->line_len < BUFLEN - 1 ? STDIN_FILENO : -1;
+		chat->fds[1].events = POLLIN;
+		chat->fds[2].fd = chat->udp != NULL ? chat->udp->fd : -1;
+		chat->fds[2].events = POLLIN | (chat->udp != NULL && datagram_pending_output(chat->udp) ? POLLOUT : 0);
+		if (session_poll(chat->fds, nfds, chat->udp != NULL ? datagram_timeout_ms(chat->udp, metrics_now_ns()) : -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_with_errno("[client] poll failed");
+			return -1;
+		}
+
+		if ((chat->fds[2].revents & POLLIN) && datagram_receive(chat->udp, metrics_now_ns(), chat_on_datagram, chat) == -1) {
+			log_with_errno("[client] socket error receiving messages over UDP");
+		}
+		fflush(stdout);
+		for (i = 3; i < nfds; i++) {
+			peer = chat->fd_peers[i - 3];
+			if (!peer->closed && (chat->fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && chat_peer_on_readable(chat, peer) == -1) {
+				chat_peer_close(chat, peer);
+			}
+		}
+		if (chat->fds[1].revents != 0) {
+			if ((n = read(STDIN_FILENO, chat->line + chat->line_len, BUFLEN - 1 - chat->line_len)) > 0) {
+				chat->line_len += (size_t) n;
+				chat_on_input(chat, false);
+			} else if (n == 0 || errno != EINTR) {
+				chat_on_input(chat, true);
+				chat->input = false;
+			}
+		}
+		if (chat->fds[0].revents != 0) {
+			chat_accept(chat);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Room mode: every line typed is published to the room, what the other members publish arrives on
+ * the session and is printed as it comes. Returns once 'q' was typed, the input ended, the session
+ * was lost or on SIGINT.
+ */
+void room_run(const char *room, const char *username, size_t *t_txb) {
+	char frame[FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD];
+	char line[BUFLEN];
+	size_t line_len = 0;
+	struct pollfd fds[2];                   /* stdin and the session */
+	char *newline;
+	size_t end;
+	size_t len;
+	size_t txb;
+	ssize_t n;
+
+	// messages may have arrived behind the answer to JOIN
+	session_drain();
+	while (!sigint_received && session != NULL) {
+		fds[0].fd = STDIN_FILENO;
+		fds[0].events = POLLIN;
+		if (session_poll(fds, 1, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_with_errno("[client] poll failed");
+			return;
+		}
+		if (session == NULL || fds[0].revents == 0) {
+			continue;
+		}
+		if ((n = read(STDIN_FILENO, line + line_len, sizeof(line) - 1 - line_len)) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		line_len += (size_t) n;
+		while ((newline = memchr(line, '\n', line_len)) != NULL || line_len == sizeof(line) - 1) {
+			end = newline != NULL ? (size_t) (newline - line) : line_len;
+			line[end] = '\0';
+			if ((line[0] == 'q' || line[0] == 'Q') && line[1] == '\0') {
+				log_info("[client] leaving the room");
+				return;
+			}
+			if ((len = frame_encode_publish(frame, room, "", line, strlen(line))) == 0) {
+				log_error("[client] message does not fit a frame, not sent");
+			} else if (framed_send(session, frame, len) == -1) {
+				log_with_errno("[client] socket error publishing to room '%s'", room);
+				return;
+			} else {
+				log_debug("[client] '%s' published '%s' to room '%s'", username, line, room);
+				txb = len;
+				transmitted_bytes_increase_and_report(&txb, t_txb, "client", 1);
+			}
+			end += newline != NULL;
+			memmove(line, line + end, line_len - end);
+			line_len -= end;
+		}
+	}
+}
+
+/* wait for the answer to an UNREGISTER already sent, then close the stream */
+void finish_unregister(FramedStream *stream, size_t *t_rxb) {
+	int status_code = -1;
+	uint32_t ip_addr = 0;
+	uint16_t port = 0;
+	int err;
+
+	if ((err = recv_response(stream, &status_code, &ip_addr, &port, t_rxb)) == -1) {
+		log_with_errno("[client] socket error receiving unregister message response from server");
+	} else if (err == 0) {
+		log_error("[client] connection terminated unexpectedly");
+	} else {
+		log_debug("[client] server responded with status code: %d", status_code);
+	}
+	close_stream(stream);
+}
+
+/* ask the server for a snapshot of its metrics and print them one per line */
+int print_server_stats(struct sockaddr_in *server_addr) {
+	FramedStream server;
+	FramedMessage message;
+	ClientRequest request;
+	uint64_t values[METRIC_COUNT];
+	char text[BUFLEN];
+	size_t t_txb = 0;
+	size_t count;
+	char *pairs;
+	char *p;
+	int ret = -1;
+
+	memset(&request, 0, sizeof(request));
+	request.operation = STATS_BYTE;
+	use_session = 0;
+	if (open_server_stream(&server, server_addr) == -1 || negotiate_protocol(&server, server_addr, &request, 1, &t_txb) == -1) {
+		return -1;
 	}
 
+	if (framed_recv(&server, &message) != 1) {
+		log_error("[client] connection terminated before receiving the metrics");
+	} else if (use_binary) {
+		if ((count = frame_decode_stats(&message.frame, values, METRIC_COUNT)) == 0) {
+			log_error("[client] unexpected frame (opcode 0x%02x) from server", message.frame.opcode);
+		} else {
+			metrics_format_text(values, count, '\n', text, sizeof(text));
+			printf("%s\n", text);
+			ret = 0;
+		}
+	} else {
+		// "200OK key=value key=value ..."
+		memcpy(text, message.data, message.len);
+		if (extract_status_code(text) != 200 || (pairs = strchr(text, ' ')) == NULL) {
+			log_error("[client] server refused the metrics request: '%s'", text);
+		} else {
+			for (p = ++pairs; (p = strchr(p, ' ')) != NULL; p++) {
+				*p = '\n';
+			}
+			printf("%s\n", pairs);
+			ret = 0;
+		}
+	}
+	fflush(stdout);
+	close_stream(&server);
+	return ret;
 }
 
 void usage(void) {
@@ -76,9 +1323,16 @@ void usage(void) {
 	const char *options =
 			"\t-i  IP           \t\tClient's IP address (IPv4 xxx.xxx.xxx.xxx OR IPv6 2001:0db8:85a3:0000:0000:8a2e:0370:7334) [will be used only in 'listen' mode]\n"
 			"\t-p  port         \t\tClient's port [will be used only in 'listen' mode]\n"
-			"\t-m  mode         \t\tMode in which the client will be run available modes: [listen, connect]\n"
+			"\t-m  mode         \t\tMode in which the client will be run available modes: [listen, connect, stats, room]\n"
 			"\t-u  username     \t\tUsername that will be registered to the server [your username] \n"
 			"\t-c  client name  \t\tClient's username [will be used only in 'connect' mode]\n"
+			"\t-g  room         \t\tRoom to join and chat in [will be used only in 'room' mode, binary protocol only]\n"
+			"\t-A               \t\tTalk to the server in the ASCII protocol instead of the binary one\n"
+			"\t-S               \t\tDo not keep a session connection open, reconnect for every request\n"
+			"\t-n  peers        \t\tChat with up to peers users at once [will be used only in 'listen' mode, default 16]\n"
+			"\t-r               \t\tChat through the server: park connections there for callers, or call through them\n"
+			"\t                 \t\tinstead of connecting directly (which falls back to it anyway)\n"
+			"\t-U               \t\tChat over UDP with peers that agree to, on chats not going through the server\n"
 			"\t-h               \t\tThis help message\n";
 	log_usage(message, options);
 	exit(EXIT_SUCCESS);
@@ -87,23 +1341,21 @@ void usage(void) {
 int main(int argc, char *argv[]) {
 	/* socket variables */
 	int client_fd = -1;                             /* listen file descriptor   */
-	int connection_fd = -1;                         /* conn file descriptor     */
+	FramedStream server;                            /* connection to the server */
+	Chat chat;                                      /* connections to the peers */
+	DatagramSocket udp_socket;                      /* chats over UDP with -U   */
+	struct sockaddr_in udp_addr;                    /* where it is bound        */
+	ChatPeer *peer;                                 /* peer of CONNECT mode     */
+	ClientRequest requests[2];                      /* REGISTER + operation     */
+	ClientRequest unregister;                       /* UNREGISTER on the way out */
 	int server_port = SERVER_PORT;                  /* server port		        */
 	const char *server_ip = SERVER_IP;              /* server IP		        */
 	int optval = 1;                                 /* socket options	        */
 	struct sockaddr_in server_addr;                 /* server socket address    */
-	int server_addr_len = -1;                       /* server address length    */
 	struct sockaddr_in client_addr;                 /* client socket address    */
 	int client_addr_len = -1;                       /* client address length    */
-	size_t rxb = 0;                                 /* received bytes	        */
 	size_t t_rxb = 0;                               /* total received bytes     */
-	size_t txb = 0;                                 /* transmitted bytes	    */
 	size_t t_txb = 0;                               /* total transmitted bytes  */
-	char plaintext[BUFLEN];                         /* plaintext buffer	        */
-	int plaintext_len = 0;                          /* plaintext size	        */
-	char init_byte;
-	struct sockaddr_in chat_addr;
-	socklen_t chat_addr_len;
 
 
 
@@ -111,7 +1363,6 @@ int main(int argc, char *argv[]) {
 	char *ip_address_buffer = NULL;         /* address str representation */
 	unsigned char buffer[INET_ADDRSTRLEN];
 	char *tmp;                              /* temp pointer for conventions */
-	int i;                                  /* temp int counter             */
 	int err;                                /* errors		                */
 
 
@@ -125,20 +1376,31 @@ int main(int argc, char *argv[]) {
 	/* getopt_long stores the option index here. */
 	int opt_index = 0;
 	int help_flag = 0;
-	mode mode;
+	mode mode = UNKNOWN;
 	char *username = NULL;
 	char *client_username = NULL;
+	char *room = NULL;
 	char *listening_ip = NULL;
 	int listening_port = -1;
+	int max_peers = CHAT_PEERS;
+	int relay = 0;
+	int use_udp = 0;
+	bool direct = false;
 	struct option longopts[] = {{"mode",            required_argument, NULL, 'm'},
 	                            {"username",        required_argument, NULL, 'u'},
 	                            {"ip",              required_argument, NULL, 'i'},
 	                            {"port",            required_argument, NULL, 'p'},
 	                            {"client-username", required_argument, NULL, 'c'},
+	                            {"ascii",           no_argument,       NULL, 'A'},
+	                            {"no-session",      no_argument,       NULL, 'S'},
+	                            {"max-peers",       required_argument, NULL, 'n'},
+	                            {"relay",           no_argument,       NULL, 'r'},
+	                            {"udp",             no_argument,       NULL, 'U'},
+	                            {"room",            required_argument, NULL, 'g'},
 	                            {"help",            no_argument, &help_flag, 1},
 	                            {0}};
 	while (1) {
-		opt = getopt_long(argc, argv, "muipc:h::", longopts, &opt_index);
+		opt = getopt_long(argc, argv, "m:u:i:p:c:n:g:ASrUh", longopts, &opt_index);
 		if (opt == -1) {
 			/* a return value of -1 indicates that there are no more options */
 			break;
@@ -179,6 +1441,32 @@ int main(int argc, char *argv[]) {
 					exit(EXIT_FAILURE);
 				}
 				break;
+			case 'n':
+				max_peers = (int) strtol(optarg, &tmp, 10);
+				if (*tmp != '\0' || max_peers < 1 || max_peers > CHAT_PEERS_MAX) {
+					log_info("[client] Peers given '%s' is not in range 1 - %d", optarg, CHAT_PEERS_MAX);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'A':
+				use_binary = 0;
+				break;
+			case 'S':
+				use_session = 0;
+				break;
+			case 'r':
+				relay = 1;
+				break;
+			case 'U':
+				use_udp = 1;
+				break;
+			case 'g':
+				room = strdup(optarg);
+				if (strlen(room) == 0 || strlen(room) > ROOM_NAME_MAX_LEN) {
+					log_info("[client] Room given '%s' must be 1 - %d characters", optarg, ROOM_NAME_MAX_LEN);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'c':
 				client_username = strdup(optarg);
 				if (strlen(client_username) > 256) {
@@ -199,73 +1487,34 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	/* socket init */
-	if ((client_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP)) == -1) {
-		log_with_errno("[client] socket call failed");
-		exit(EXIT_FAILURE);
+	if (help_flag) {
+		usage();
+	}
+	memset(requests, 0, sizeof(requests));
+
+	if (username == NULL && mode != STATS) {
+		log_error("[client] no username provided");
+		usage();
 	}
+	memset(&unregister, 0, sizeof(unregister));
+	unregister.operation = UNREGISTER_BYTE;
+	unregister.username = username;
 
+	/* socket init */
 	memset(&server_addr, 0, sizeof(struct sockaddr_in));
 	server_addr.sin_port = htons(server_port);
 	server_addr.sin_family = AF_INET;
 	inet_aton(server_ip, &server_addr.sin_addr);
-	server_addr_len = sizeof(server_addr);
-
-	if ((connect(client_fd, (struct sockaddr *) &server_addr, server_addr_len)) == -1) {
-		log_with_errno("[client] socket connect failed");
-		close(client_fd);
-		exit(EXIT_FAILURE);
-	}
-	log_info("[client] connected to server at '%s%d'", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
-
-	/* STAGE1: Show the initial text */
-	init_byte = REGISTER_BYTE;
-	memset(&plaintext, 0, sizeof(plaintext));
-	plaintext_len = sprintf(plaintext, "%c%s", init_byte, username);
-	log_debug("[client] sending initial message to server '%s'", plaintext);
-	if ((txb = (size_t) send(client_fd, plaintext, strlen(plaintext) + 1, 0)) == -1) {
-		log_with_errno("[client] socket sending initial message to server failed");
-		close(client_fd);
-		exit(EXIT_FAILURE);
-	}
-	transmitted_bytes_increase_and_report(&txb, &t_txb, "client", 1);
-
-	memset(&plaintext, 0, sizeof(plaintext));
-	if ((rxb = (size_t) recv(client_fd, plaintext, sizeof(plaintext), 0)) == -1) {
-		log_with_errno("[client] socket error receiving initial message response from server");
-		close(client_fd);
-		exit(EXIT_FAILURE);
-	}
-	if (rxb == 0) {
-		log_error("[client] connection terminated before receiving init message response from server");
-		close(client_fd);
-		exit(EXIT_FAILURE);
-	}
-	received_bytes_increase_and_report(&rxb, &t_rxb, "client", 1);
 
-	log_debug("[client] initial message response from server '%s'", plaintext);
-
-	int status_code = extract_status_code(plaintext);
-	if (status_code != 200) {
-		log_debug("[client] an error has occurred with status code: %d", status_code);
-		if (status_code == 409) {
-			log_error("[client] 409 Conflict: user '%s' already registered with the server", username);
-		} else {
-			log_error("[client] %d: unknown error code", status_code);
-		}
-		log_error("[client] closing connection");
-		close(client_fd);
-		exit(EXIT_FAILURE);
+	if (mode == STATS) {
+		exit(print_server_stats(&server_addr) == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
 	}
 
-	log_debug("[client] server responded with status code: %d", status_code);
-	log_info("[client] User '%s' successfully registered to the server", username);
-
-	// STAGE2: Send operation message to the server
+	// the operation is worked out first, it is pipelined behind REGISTER in the same write
+	requests[0].operation = REGISTER_BYTE;
+	requests[0].username = username;
 	switch (mode) {
 		case LISTEN:
-			//region LISTEN
-			init_byte = LISTEN_BYTE;
 			memset(&client_addr, 0, sizeof(struct sockaddr_in));
 			if (listening_ip == NULL) {
 				log_info("[client] No listening IP specified. Resolving back to '127.0.0.1'");
@@ -284,38 +1533,7 @@ int main(int argc, char *argv[]) {
 
 			log_debug("[client] listening mode at '%s:%d'", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
-			memset(&plaintext, 0, sizeof(plaintext));
-			sprintf((char *) &plaintext, "%c %s %d", init_byte, inet_ntoa(client_addr.sin_addr), listening_port);
-			log_debug("[client] sending operation message to server: %s", plaintext);
-			if ((txb = send(client_fd, &plaintext, strlen(plaintext) + 1, 0)) == -1) {
-				log_with_errno("[client] Socket sending operation message to server failed");
-				close(client_fd);
-				exit(EXIT_FAILURE);
-			}
-			transmitted_bytes_increase_and_report(&txb, &t_txb, "client", 1);
-
-			memset(&plaintext, 0, sizeof(plaintext));
-			if ((rxb = (size_t) recv(client_fd, &plaintext, sizeof(plaintext), 0)) == -1) {
-				close(client_fd);
-				log_with_errno("[client] Socket error receiving operation message response");
-				exit(EXIT_FAILURE);
-			}
-			if (rxb == 0) {
-				log_error("[client] connection terminated before receiving operation message response from server");
-				close(client_fd);
-				exit(EXIT_FAILURE);
-			}
-			received_bytes_increase_and_report(&rxb, &t_rxb, "client", 1);
-
-			log_debug("[client] operation message response from server: '%s'", plaintext);
-
-			status_code = extract_status_code(plaintext);
-			log_debug("[client] server responded with status code: %d", status_code);
-
-			//close the connection with server
-			close(client_fd);
-
-			// and now we wait for connections (like a second server)
+			// we wait for connections (like a second server), bound before the address is published
 			if ((client_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP)) == -1) {
 				log_with_errno("[client] socket call failed");
 				exit(EXIT_FAILURE);
@@ -339,141 +1557,181 @@ int main(int argc, char *argv[]) {
 			}
 
 			//listen for connections on socket
-			if (listen(client_fd, 5)) {
+			if (listen(client_fd, SOMAXCONN)) {
 				log_with_errno("[client] socket listen failed");
 				close(client_fd);
 				exit(EXIT_FAILURE);
 			}
 
-			log_info("[client] Awaiting for client connections on '%s:%d'", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-
-			signal(SIGINT, sigint_handler);
-
-			while (!sigint_received) {
-				memset(&chat_addr, 0, sizeof(struct sockaddr_in));
-
-				if ((connection_fd = accept4(client_fd, (struct sockaddr *) &chat_addr, &chat_addr_len, 0)) == -1) {
-					//make socket non-blocking to handle SIGINT only for accept()
-					if (errno == EAGAIN | errno == EWOULDBLOCK) { continue; }
-					log_with_errno("[client] socket accept failed");
-					close(client_fd);
-					exit(EXIT_FAILURE);
-				}
-
-				// disable nonblock flag so, it won't crash the program later
-				fcntl(client_fd, F_SETFL, ~O_NONBLOCK);
-
+			requests[1].operation = LISTEN_BYTE;
+			requests[1].ip_addr = client_addr.sin_addr.s_addr;
+			requests[1].port = (uint16_t) listening_port;
+			break;
+		case CONNECT:
+			if (client_username == NULL) {
+				log_error("[client] no client username provided. No one to chat with.");
+				exit(EXIT_FAILURE);
+			}
 
-				log_info("[client] a user connected for chat from '%s:%d'", inet_ntoa(chat_addr.sin_addr), ntohs(chat_addr.sin_port));
+			log_debug("[client] connection mode with user '%s'", client_username);
 
-				// before chat receive the username to make it more beautiful
-				memset(plaintext, 0, sizeof(plaintext));
-				if ((rxb = (size_t) recv(connection_fd, plaintext, sizeof(plaintext), 0)) == -1) {
-					log_with_errno("[client] socket error receiving message");
-					close(connection_fd);
-					break;
-				}
-				if (rxb == 0) {
-					log_info("[client] connection terminated");
-					close(connection_fd);
-					break;
-				}
-				received_bytes_increase_and_report(&rxb, &t_rxb, "client", 1);
+			requests[1].operation = CONNECT_BYTE;
+			requests[1].username = client_username;
+			break;
+		case ROOM:
+			if (room == NULL) {
+				log_error("[client] no room provided. Nowhere to chat.");
+				exit(EXIT_FAILURE);
+			}
+			if (!use_binary) {
+				log_error("[client] rooms need the binary protocol");
+				exit(EXIT_FAILURE);
+			}
 
-				client_username = (char *) malloc(rxb + 1 * sizeof(char));
-				strcpy(client_username, plaintext);
-				log_debug("[client] username: '%s'", client_username);
+			log_debug("[client] room mode in room '%s'", room);
 
-				while (1) {
+			// the connection carries the room, it stays open either way
+			use_session = 1;
+			requests[1].operation = JOIN_BYTE;
+			requests[1].room = room;
+			break;
+		default:
+			log_info("[client] wrong operation %s", map_mode_to_str(mode));
+			exit(EXIT_FAILURE);
+	}
 
-					memset(plaintext, 0, sizeof(plaintext));
-					if ((rxb = (size_t) recv(connection_fd, plaintext, sizeof(plaintext), 0)) == -1) {
-						log_with_errno("[client] socket error receiving message");
-						close(connection_fd);
-						close(client_fd);
-						exit(EXIT_FAILURE);
-					}
-					if (rxb == 0) {
-						log_info("[client] connection terminated");
-						close(connection_fd);
-						break;
-					}
-					received_bytes_increase_and_report(&rxb, &t_rxb, "client", 1);
+	if (open_server_stream(&server, &server_addr) == -1) {
+		exit(EXIT_FAILURE);
+	}
+	if (negotiate_protocol(&server, &server_addr, requests, 2, &t_txb) == -1) {
+		exit(EXIT_FAILURE);
+	}
 
-					printf("[%s] %s\n", client_username, plaintext);
-					fflush(stdout);
+	/* STAGE1: answer to the initial message */
+	int status_code = -1;
+	uint32_t peer_ip = 0;
+	uint16_t peer_port = 0;
+	if ((err = recv_response(&server, &status_code, &peer_ip, &peer_port, &t_rxb)) == -1) {
+		log_with_errno("[client] socket error receiving initial message response from server");
+		close_stream(&server);
+		exit(EXIT_FAILURE);
+	}
+	if (err == 0) {
+		log_error("[client] connection terminated before receiving init message response from server");
+		close_stream(&server);
+		exit(EXIT_FAILURE);
+	}
 
-					// send message back as is
-					log_debug("[client] sending message back to the user: '%s'", plaintext);
-					if ((txb = send(connection_fd, plaintext, strlen(plaintext) + 1, 0)) == -1) {
-						log_with_errno("[client] socket error sending message back to the user '%s'", client_username);
-						close(connection_fd);
-						exit(EXIT_FAILURE);
-					}
-					transmitted_bytes_increase_and_report(&txb, &t_txb, "client", 1);
+	if (status_code != 200) {
+		log_debug("[client] an error has occurred with status code: %d", status_code);
+		if (status_code == 409) {
+			log_error("[client] 409 Conflict: user '%s' already registered with the server", username);
+		} else {
+			log_error("[client] %d: unknown error code", status_code);
+		}
+		log_error("[client] closing connection");
+		close_stream(&server);
+		exit(EXIT_FAILURE);
+	}
 
-					printf("[%s] %s\n", username, plaintext);
-					fflush(stdout);
+	log_debug("[client] server responded with status code: %d", status_code);
+	log_info("[client] User '%s' successfully registered to the server", username);
 
-				}
+	// STAGE2: answer to the operation message
+	switch (mode) {
+		case LISTEN:
+			//region LISTEN
+			if ((err = recv_response(&server, &status_code, &peer_ip, &peer_port, &t_rxb)) == -1) {
+				close_stream(&server);
+				log_with_errno("[client] Socket error receiving operation message response");
+				exit(EXIT_FAILURE);
+			}
+			if (err == 0) {
+				log_error("[client] connection terminated before receiving operation message response from server");
+				close_stream(&server);
+				exit(EXIT_FAILURE);
+			}
 
-				free(client_username);
+			log_debug("[client] server responded with status code: %d", status_code);
+			if (status_code != 200) {
+				log_error("[client] %d: server refused the listening address", status_code);
+				close_stream(&server);
+				close(client_fd);
+				exit(EXIT_FAILURE);
+			}
 
+			// keep the session for keepalives and UNREGISTER, otherwise close the connection with server
+			if (use_session) {
+				session_open(&server);
+			} else {
+				close_stream(&server);
+				lease_open(&server_addr, username, requests);
 			}
 
-			// reconnect to the server and tell him that you are not listening anymore for connections
+			log_info("[client] Awaiting for client connections on '%s:%d'", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
-			break;
-			//endregion
-		case CONNECT:
-			//region CONNECT
-			init_byte = CONNECT_BYTE;
+			signal(SIGINT, sigint_handler);
 
-			if (client_username == NULL) {
-				log_error("[client] no client username provided. No one to chat with.");
-				log_error("[client] closing connection");
+			// lines typed go to the peers, what they send is acknowledged
+			if (chat_init(&chat, max_peers, client_fd, username, &t_txb, &t_rxb) == -1) {
+				log_error("[client] out of memory");
 				close(client_fd);
 				exit(EXIT_FAILURE);
 			}
+			if (relay) {
+				chat.relay_server = &server_addr;
+			}
+			// on the address the peers connect to, over UDP
+			if (use_udp) {
+				chat_open_udp(&chat, &udp_socket, &client_addr);
+			}
+			if (chat_run(&chat) == -1) {
+				log_error("[client] chat failed");
+			}
+			chat_free(&chat);
 
-			log_debug("[client] connection mode with user '%s'", client_username);
+			close(client_fd);
 
-			// send operation message to server
-			memset(&plaintext, 0, sizeof(plaintext));
-			sprintf((char *) &plaintext, "%c %s", init_byte, client_username);
-			log_debug("[client] sending operation message to server: %s", plaintext);
-			if ((txb = send(client_fd, &plaintext, strlen(plaintext) + 1, 0)) == -1) {
-				log_with_errno("[client] socket sending operation message to server failed");
-				close(client_fd);
-				exit(EXIT_FAILURE);
+			// tell the server that you are not listening anymore for connections
+			if (session != NULL) {
+				log_info("[client] unregistering '%s' from the server", username);
+				if (send_requests(session, &unregister, 1, &t_txb) == -1) {
+					log_with_errno("[client] socket sending UNREGISTER message to server failed");
+				}
+				finish_unregister(session, &t_rxb);
+				session = NULL;
+			} else if (lease_server != NULL) {
+				log_info("[client] unregistering '%s' from the server", username);
+				lease_server = NULL;
+				if (open_server_stream(&server, &server_addr) == 0 && negotiate_protocol(&server, &server_addr, &unregister, 1, &t_txb) == 0) {
+					finish_unregister(&server, &t_rxb);
+				}
 			}
-			transmitted_bytes_increase_and_report(&txb, &t_txb, "client", 1);
 
-			// receive reply from server
-			memset(&plaintext, 0, sizeof(plaintext));
-			if ((rxb = (size_t) recv(client_fd, plaintext, sizeof(plaintext), 0)) == -1) {
+			break;
+			//endregion
+		case CONNECT:
+			//region CONNECT
+			// receive reply from server, it carries the address the user listens on
+			if ((err = recv_response(&server, &status_code, &peer_ip, &peer_port, &t_rxb)) == -1) {
 				log_with_errno("[client] socket error receiving operation message response from server");
-				close(client_fd);
+				close_stream(&server);
 				exit(EXIT_FAILURE);
 			}
-			if (rxb == 0) {
+			if (err == 0) {
 				log_error("[client] connection terminated before receiving operation message response from server");
-				close(client_fd);
+				close_stream(&server);
 				exit(EXIT_FAILURE);
 			}
-			received_bytes_increase_and_report(&rxb, &t_rxb, "client", 1);
 
-			log_debug("[client] operation message response from server: '%s'", plaintext);
-
-			status_code = extract_status_code(plaintext);
 			if (status_code != 200) {
-				if (status_code == 409) {
+				if (status_code == 404) {
 					log_error("[client] 404 Not Found: user '%s' does not exist in the server", client_username);
 				} else {
 					log_error("[client] %d: unknown error code", status_code);
 				}
 				log_error("[client] closing connection");
-				close(client_fd);
+				close_stream(&server);
 				exit(EXIT_FAILURE);
 			}
 
@@ -495,22 +1753,11 @@ int main(int argc, char *argv[]) {
 //
 //			log_debug("[client] second operation message response from server: '%s'", plaintext);
 
-			//tokenize the reply and populate client_addr
+			// populate client_addr from the reply
 			memset(&client_addr, 0, sizeof(struct sockaddr_in));
 			client_addr.sin_family = AF_INET;
-			i = 0;
-			char *token = strtok(&plaintext[6], " ");
-			int tmp_port;
-			while (token) {
-				if (i == 0) {
-					inet_aton(token, &client_addr.sin_addr);
-				} else if (i == 1) {
-					tmp_port = (int) strtol(token, NULL, 10);
-					client_addr.sin_port = htons(tmp_port);
-				}
-				token = strtok(NULL, " ");
-				i++;
-			}
+			client_addr.sin_addr.s_addr = peer_ip;
+			client_addr.sin_port = htons(peer_port);
 			client_addr_len = sizeof(client_addr);
 
 
@@ -520,122 +1767,128 @@ int main(int argc, char *argv[]) {
 					inet_ntoa(client_addr.sin_addr),
 					ntohs(client_addr.sin_port));
 
-			// close connection with the server
-			close(client_fd);
-
-			// connect to the user for chat
-			if ((client_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP)) == -1) {
-				log_with_errno("[client] socket call failed");
-				exit(EXIT_FAILURE);
-			}
-
-			if ((connect(client_fd, (struct sockaddr *) &client_addr, client_addr_len)) == -1) {
-				log_with_errno("[client] socket connect failed");
-				close(client_fd);
-				exit(EXIT_FAILURE);
+			// keep the session for keepalives and UNREGISTER, otherwise close the connection with server
+			if (use_session) {
+				session_open(&server);
+			} else {
+				close_stream(&server);
+				lease_open(&server_addr, username, NULL);
 			}
-			log_info("[client] connected with user '%s' for chat at '%s:%d'", client_username, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
-			memset(plaintext, 0, sizeof(plaintext));
-			sprintf(plaintext, "%s", username);
-			log_debug("[client] sending username '%s' to '%s' for recognition", username, client_username);
-			if ((txb = (size_t) send(client_fd, plaintext, strlen(plaintext) + 1, 0)) == -1) {
-				close(client_fd);
-				log_with_errno("[client] socket error sending username to '%s'", client_username);
+			if (chat_init(&chat, 1, -1, username, &t_txb, &t_rxb) == -1) {
+				log_error("[client] out of memory");
 				exit(EXIT_FAILURE);
 			}
-			transmitted_bytes_increase_and_report(&txb, &t_txb, "client", 1);
-
-			while (1) {
-				printf("[%s] ", username);
-				fflush(stdout);
-				memset(plaintext, 0, sizeof(plaintext));
-				fgets(plaintext, sizeof(plaintext), stdin);
-
-				// strip newline from message
-				plaintext[strcspn(plaintext, "\r\n")] = 0;
 
-				if (plaintext[1] == '\0' && (plaintext[0] == 'q' || plaintext[0] == 'Q')) {
-					log_info("[client] terminating chat connection with %s", client_username);
-					close(client_fd);
-					break;
-				}
-
-				log_debug("[client] sending message '%s' to user %s", plaintext, client_username);
-				if ((txb = (size_t) send(client_fd, plaintext, strlen(plaintext) + 1, 0)) == -1) {
-					log_with_errno("[client] socket error sending message to user '%s'", client_username);
-					close(client_fd);
+			// connect to the user for chat, through the server when that is not possible
+			peer = NULL;
+			if (!relay) {
+				if ((client_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP)) == -1) {
+					log_with_errno("[client] socket call failed");
 					exit(EXIT_FAILURE);
 				}
-				transmitted_bytes_increase_and_report(&txb, &t_txb, "client", 1);
-
-				memset(plaintext, 0, sizeof(plaintext));
-				if ((rxb = (size_t) recv(client_fd, plaintext, sizeof(plaintext), 0)) == -1) {
-					log_with_errno("[client] socket error receiving message from user '%s'", client_username);
+				if ((connect(client_fd, (struct sockaddr *) &client_addr, client_addr_len)) == -1) {
+					log_with_errno("[client] socket connect failed, asking the server to relay");
 					close(client_fd);
-					exit(EXIT_FAILURE);
+				} else {
+					log_info("[client] connected with user '%s' for chat at '%s:%d'", client_username, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+
+					// from here on typing and receiving do not wait for each other
+					fcntl(client_fd, F_SETFL, O_NONBLOCK);
+					if ((peer = chat_peer_open(&chat, client_fd, client_username)) == NULL) {
+						log_error("[client] out of memory");
+						close(client_fd);
+						exit(EXIT_FAILURE);
+					}
+					direct = true;
 				}
-				if (rxb == 0) {
-					log_error("[client] connection terminated unexpectedly");
-					close(client_fd);
-					exit(EXIT_FAILURE);
+			}
+			if (peer == NULL && (peer = chat_relay(&chat, &server_addr, client_username)) == NULL) {
+				exit(EXIT_FAILURE);
+			}
+			log_debug("[client] sending username '%s' to '%s' for recognition", username, client_username);
+			chat_peer_queue(&chat, peer, username, strlen(username) + 1);
+			// the server relays nothing but the connection, UDP only reaches a peer directly
+			if (use_udp && direct) {
+				memset(&udp_addr, 0, sizeof(udp_addr));
+				udp_addr.sin_family = AF_INET;
+				udp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+				if (chat_open_udp(&chat, &udp_socket, &udp_addr) == 0) {
+					chat_peer_offer_udp(&chat, peer);
 				}
-				received_bytes_increase_and_report(&rxb, &t_rxb, "client", 1);
-
-				printf("[%s] %s\n", client_username, plaintext);
-				fflush(stdout);
 			}
-
-			// unregister from the server
-			if ((client_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP)) == -1) {
-				log_with_errno("[client] socket call failed");
+			err = chat_run(&chat);
+			chat_free(&chat);
+			if (err == -1) {
 				exit(EXIT_FAILURE);
 			}
 
-			memset(&server_addr, 0, sizeof(struct sockaddr_in));
-			server_addr.sin_port = htons(server_port);
-			server_addr.sin_family = AF_INET;
-			inet_aton(server_ip, &server_addr.sin_addr);
-			server_addr_len = sizeof(server_addr);
-
-			if ((connect(client_fd, (struct sockaddr *) &server_addr, server_addr_len)) == -1) {
-				log_with_errno("[client] socket connect failed");
-				close(client_fd);
+			// unregister from the server, over the session when there is one
+			if (session != NULL) {
+				if (send_requests(session, &unregister, 1, &t_txb) == -1) {
+					log_with_errno("[client] socket sending UNREGISTER message to server failed");
+				}
+				finish_unregister(session, &t_rxb);
+				session = NULL;
+				break;
+			}
+			if (use_session) {
+				// the server dropped the session and the registration along with it
+				break;
+			}
+			if (open_server_stream(&server, &server_addr) == -1) {
 				exit(EXIT_FAILURE);
 			}
-			log_info("[client] connected to server at '%s:%d'", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
-
-			init_byte = UNREGISTER_BYTE;
-			memset(&plaintext, 0, sizeof(plaintext));
-			plaintext_len = sprintf(plaintext, "%c%s", init_byte, username);
-			log_debug("[client] sending UNREGISTER message to server '%s'", plaintext);
-			if ((txb = (size_t) send(client_fd, plaintext, strlen(plaintext) + 1, 0)) == -1) {
-				log_with_errno("[client] socket sending UNREGISTER message to server failed");
-				close(client_fd);
+			if (negotiate_protocol(&server, &server_addr, &unregister, 1, &t_txb) == -1) {
 				exit(EXIT_FAILURE);
 			}
-			transmitted_bytes_increase_and_report(&txb, &t_txb, "client", 1);
+			finish_unregister(&server, &t_rxb);
 
-			memset(plaintext, 0, sizeof(plaintext));
-			if ((rxb = (size_t) recv(client_fd, plaintext, sizeof(plaintext), 0)) == -1) {
-				log_with_errno("[client] socket error receiving unregister message response from server");
-				close(client_fd);
+			break;
+			//endregion
+		case ROOM:
+			//region ROOM
+			if (!use_binary) {
+				// the server fell back to ASCII and took REGISTER, take the registration back
+				log_error("[client] server does not speak the binary protocol, rooms need it");
+				if (send_requests(&server, &unregister, 1, &t_txb) == 0) {
+					finish_unregister(&server, &t_rxb);
+				}
 				exit(EXIT_FAILURE);
 			}
-			if (rxb == 0) {
-				log_error("[client] connection terminated unexpectedly");
-				close(client_fd);
-				break;
+			if ((err = recv_response(&server, &status_code, &peer_ip, &peer_port, &t_rxb)) <= 0) {
+				log_error("[client] connection terminated before receiving join message response from server");
+				close_stream(&server);
+				exit(EXIT_FAILURE);
+			}
+			if (status_code != 200) {
+				if (status_code == 409) {
+					log_error("[client] 409 Conflict: already in room '%s'", room);
+				} else {
+					log_error("[client] %d: server refused to join room '%s'", status_code, room);
+				}
+				close_stream(&server);
+				exit(EXIT_FAILURE);
 			}
-			received_bytes_increase_and_report(&rxb, &t_rxb, "client", 1);
 
-			close(client_fd);
+			log_info("[client] joined room '%s', type 'q' to leave", room);
+			session_open(&server);
+			signal(SIGINT, sigint_handler);
+			room_run(room, username, &t_txb);
 
+			// leaving the connection leaves the room, UNREGISTER does both
+			if (session != NULL) {
+				log_info("[client] unregistering '%s' from the server", username);
+				if (send_requests(session, &unregister, 1, &t_txb) == -1) {
+					log_with_errno("[client] socket sending UNREGISTER message to server failed");
+				}
+				finish_unregister(session, &t_rxb);
+				session = NULL;
+			}
 			break;
 			//endregion
 		default:
-			log_info("[client] wrong operation %d", map_mode_to_str(mode));
-			close(client_fd);
+			close_stream(&server);
 			break;
 	}
 
@@ -8,398 +8,3419 @@
 #include <errno.h>
 
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <inttypes.h>
+#include <limits.h>
 
 // our libraries
 #include "logging.h"
 #include "network.h"
 #include "structures.h"
+#include "metrics.h"
+#include "shared_registry.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "timer_wheel.h"
+#include "uring.h"
 
 
 
 int LOG_LEVEL = DEBUG_LEVEL; // must do this before any log_*() call
 
-RegisteredUser *users_list_head = NULL;
+SharedRegistry *registry = NULL;   /* sharded, CONNECT reads peers without a lock */
+RegistrySnapshot *snapshot = NULL;  /* users of the last checkpoint not restored yet, under any shard lock */
+WriteAheadLog *wal = NULL;          /* registry mutations since the last checkpoint, NULL when disabled */
+uint64_t recovered_sequence = 0;    /* last log record replayed at startup                              */
+pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;    /* one checkpoint or compaction at a time */
 
 
 #define SERVER_IP       "127.0.0.1"
 #define SERVER_PORT     29000
 #define BUFLEN          2048
-
-
-volatile sig_atomic_t sigint_received = 0;
+#define MAX_EVENTS      256
+#define MAX_WORKERS     256
+#define SNAPSHOT_RESTORE_BATCH  4096    /* users restored per hold of the shard locks */
+#define WAL_COMPACT_BYTES       (64 << 20)  /* log size that triggers a snapshot in the background */
+#define CONNECTION_IDLE_SECS    30      /* handshakes silent this long are closed, sessions excepted */
+#define RELAY_CHUNK             (64 * 1024) /* bytes asked of one splice(), a pipe's default size */
+#define RELAY_ROUNDS            16      /* splices per direction and event, then the others get a turn */
+#define RELAY_PARK_MAX          8       /* connections a user may have parked at once */
+#define RELAY_PARK_BUCKETS      1024    /* power of two */
+#define ROOM_BUCKETS            256     /* power of two, each with a lock of its own */
+#define ROOM_JOINED_MAX         16      /* rooms one connection may be a member of */
+#define ROOM_OUTBOX_LEN         256     /* room messages queued for a member before it counts as too slow, power of two */
+#define ROOM_IOV_MAX            64      /* room messages gathered into one write */
+#define URING_ENTRIES           4096    /* submission queue of an io_uring worker, twice as many completions */
+#define URING_BUFFERS           1024    /* receive buffers of BUFLEN bytes per io_uring worker, power of two */
+#define URING_BUFFER_GROUP      0
+/* only the worker's thread uses its ring, completions are run when it waits (6.1) */
+#define URING_SETUP             (IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED)
+
+/* TCP keepalive on session connections, so vanished clients get unregistered */
+#define SESSION_TCP_KEEPIDLE    (2 * SESSION_KEEPALIVE_SECS)
+#define SESSION_TCP_KEEPINTVL   10
+#define SESSION_TCP_KEEPCNT     3
+
+
+/* per-connection handshake stages */
+enum connection_state {
+	STAGE_REGISTER,     /* waiting for the REGISTER/UNREGISTER message  */
+	STAGE_OPERATION,    /* waiting for the LISTEN/CONNECT message       */
+	STAGE_SESSION,      /* session kept open for PING/UNREGISTER        */
+	STAGE_RELAY,        /* joined with a peer's connection, see Relay   */
+	STAGE_ROOM,         /* member of rooms, see Room                    */
+	STAGE_CLOSING       /* flushing the last response, then close       */
+};
+
+/* event loop of the workers */
+enum io_backend {
+	IO_BACKEND_EPOLL,   /* readiness: accept4, read and write once epoll says so      */
+	IO_BACKEND_URING    /* completions: accept, receive, send and close on io_uring   */
+};
+
+/* what an io_uring completion is for, kept in the low bits of its user_data */
+enum uring_request {
+	URING_ACCEPT,
+	URING_WAKE,
+	URING_SIGNAL,
+	URING_RECV,         /* the rest carry the Connection in the other bits */
+	URING_SEND,
+	URING_CLOSE,
+	URING_CANCEL,
+	URING_REQUEST_MASK = 7
+};
+
+struct Worker;
+struct Relay;
+struct Outbox;
+struct ParkedConnection;
+
+typedef struct Connection {
+	struct Worker *worker;
+	int fd;
+	enum connection_state state;
+	bool negotiated;            /* binary clients must say OP_HELLO first        */
+	bool watched;               /* registered with the worker's epoll set        */
+	bool want_write;            /* EPOLLOUT armed for leftover output            */
+	bool session;               /* negotiated HELLO_FLAG_SESSION                 */
+	RegisteredUser *user;       /* registration owned by the session, or NULL    */
+	uint32_t user_generation;   /* user->generation when it was registered       */
+	uint64_t accepted_ns;       /* monotonic time of accept, for the latencies   */
+	bool received;              /* first bytes arrived                           */
+	uint64_t wal_sequence;      /* log record the queued answers depend on       */
+	bool held;                  /* answers wait for the log to reach the disk    */
+	struct Connection *held_prev;
+	struct Connection *held_next;
+	Timer idle;                 /* closes the connection once it sits idle        */
+	uint64_t active_at;         /* server second of the last bytes received       */
+	struct Relay *relay;        /* relay the connection is an end of, or NULL     */
+	struct Outbox *outbox;      /* rooms and their messages, NULL until a JOIN    */
+	struct ParkedConnection *parking;   /* PARK waiting for the output to drain, or NULL */
+	int inflight;               /* io_uring requests not completed yet            */
+	bool receiving;             /* an io_uring receive is in flight               */
+	bool sending;               /* an io_uring send is in flight, from tx.head    */
+	bool closed;                /* io_uring: closed, freed once nothing is in flight */
+	struct msghdr msg;          /* of the send in flight                          */
+	struct iovec iov[2];
+	struct sockaddr_in addr;
+	char username[USERNAME_MAX_LEN + 1];
+	FramedStream stream;        /* wire format is decided by the first byte sent */
+} Connection;
+
+/* a client message, independent of the protocol it arrived in */
+typedef struct Request {
+	char operation;                         /* one of the *_BYTE values                 */
+	char username[USERNAME_MAX_LEN + 1];    /* user to (un)register or to connect with  */
+	char room[ROOM_NAME_MAX_LEN + 1];       /* JOIN, LEAVE and PUBLISH                  */
+	const char *text;                       /* PUBLISH, points into the frame           */
+	size_t text_len;
+	uint32_t ip_addr;                       /* LISTEN address, network byte order       */
+	int port;                               /* LISTEN port                              */
+} Request;
+
+/*
+ * Every worker owns an SO_REUSEPORT listening socket and an event loop; the kernel spreads new
+ * connections across the listening sockets, so a connection never leaves the worker that
+ * accepted it. Only the user registry is shared.
+ */
+typedef struct Worker {
+	int id;
+	int cpu;                    /* core the worker is pinned to, -1 if not pinned  */
+	pthread_t thread;
+	int epoll_fd;
+	int listen_fd;
+	int signal_fd;              /* only worker 0 receives SIGINT, -1 for the rest   */
+	int wake_fd;                /* eventfd to ask the worker to stop or to release  */
+	int parked_fd;              /* epoll set for hangups of what it parked, or -1   */
+	Connection *held;           /* connections waiting for the write-ahead log      */
+	TimerWheel timers;          /* in server seconds: leases and idle connections   */
+	Timer sweep;                /* worker 0 only, see lease_sweep()                  */
+	int sweep_shard;
+	Connection **connections;   /* connections indexed by their file descriptor     */
+	size_t connections_capacity;
+	WorkerMetrics *metrics;     /* this worker's slot of worker_metrics             */
+	pthread_mutex_t outbox_lock;    /* the outboxes of the worker's connections     */
+	Connection *outbox_ready;   /* connections with new room messages, under outbox_lock */
+	bool deliver;               /* outbox_ready filled by the worker itself          */
+	Uring ring;                 /* IO_BACKEND_URING only, ring.fd is -1 otherwise   */
+	UringBuffers buffers;       /* the ring's receive buffers                       */
+} Worker;
+
+/*
+ * Lease of a registration made without a session. It lives in the wheel of the worker that
+ * registered the user; heartbeats, which may arrive on any worker, only move the deadline in the
+ * record and the timer catches up with it when it fires.
+ */
+typedef struct Lease {
+	Timer timer;
+	Worker *worker;
+	RegisteredUser *user;
+	uint32_t generation;        /* user->generation when leased, the record may be reused */
+	uint64_t hash;              /* picks the user's shard without reading the name        */
+} Lease;
+
+/*
+ * Two client connections joined by the worker of the caller. What one end sends is spliced into a
+ * pipe and from the pipe into the other end, so the bytes stay in the kernel; buffered counts
+ * what waits in the pipe. A direction ends with the end's EOF, passed on as a shutdown of the
+ * other end once the pipe drained.
+ */
+typedef struct Relay {
+	Connection *ends[2];        /* the caller, then the listener that parked       */
+	int pipes[2][2];            /* pipes[k] carries what ends[k] sent               */
+	size_t buffered[2];
+	bool eof[2];                /* ends[k] will send nothing more                   */
+	bool shut[2];               /* the EOF of ends[k] was passed on                 */
+	uint32_t events[2];         /* epoll interest of ends[k]                        */
+} Relay;
+
+/* a listener's connection waiting for a caller, owned by no worker meanwhile */
+typedef struct ParkedConnection {
+	int fd;
+	int framing;                /* the protocol it spoke, for the answer            */
+	struct sockaddr_in addr;
+	Worker *worker;             /* whose parked set watches it for the hangup      */
+	struct ParkedConnection *next;
+	char username[USERNAME_MAX_LEN + 1];
+} ParkedConnection;
+
+/*
+ * A chat room. The members are connections of any worker; a message is encoded once into a
+ * RoomMessage and a reference to it queued in the outbox of every member, whose worker writes it
+ * out. Members and the bucket chain are under the lock of the room's bucket.
+ */
+typedef struct Room {
+	Connection **members;
+	int count;
+	int capacity;
+	struct Room *next;
+	char name[ROOM_NAME_MAX_LEN + 1];
+} Room;
+
+typedef struct RoomBucket {
+	pthread_mutex_t lock;
+	Room *rooms;
+} RoomBucket;
+
+/* an OP_PUBLISH frame as members receive it, freed once the last member wrote it */
+typedef struct RoomMessage {
+	atomic_uint refs;
+	size_t len;
+	char data[];
+} RoomMessage;
+
+/*
+ * What a room member has to send besides its own answers. Any worker may queue into it, under the
+ * outbox_lock of the member's worker; only the member's worker takes messages out. A member that
+ * lets ROOM_OUTBOX_LEN messages pile up is closed instead of being queued to without bounds.
+ */
+typedef struct Outbox {
+	RoomMessage *queue[ROOM_OUTBOX_LEN];
+	unsigned head;              /* under outbox_lock, moved by the owner only       */
+	unsigned tail;              /* under outbox_lock                                 */
+	size_t offset;              /* bytes of queue[head] written already              */
+	size_t gathered_tx;         /* bytes of the stream's output in the last gather   */
+	bool ready;                 /* on the worker's outbox_ready list                 */
+	bool overflow;              /* a message found the queue full                    */
+	Connection *next_ready;
+	int rooms_count;
+	Room *rooms[ROOM_JOINED_MAX];
+	struct iovec iov[2 + ROOM_IOV_MAX];     /* of the io_uring send in flight        */
+} Outbox;
+
+Worker workers[MAX_WORKERS];
+WorkerMetrics worker_metrics[MAX_WORKERS];  /* kept apart from Worker so a snapshot reads one array */
+int workers_count = 1;
+atomic_bool stopping = false;
+const char *metrics_path = NULL;            /* SIGUSR1 dump goes here, stdout when NULL */
+const char *snapshot_path = NULL;           /* registry checkpoint, NULL when disabled  */
+int wal_policy = -1;                        /* one of wal_sync_policy, -1 without a log */
+pthread_mutex_t compaction_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compaction_wake = PTHREAD_COND_INITIALIZER;
+bool compaction_asked = false;              /* under compaction_lock                    */
+int lease_secs = REGISTRATION_LEASE_SECS;   /* 0 when registrations never expire        */
+bool relay_enabled = false;                 /* PARK and RELAY are taken                 */
+int io_backend = IO_BACKEND_EPOLL;          /* decided before the workers start         */
+ParkedConnection *parked[RELAY_PARK_BUCKETS];   /* by username hash, oldest first       */
+pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t parked_count = 0;                    /* under parked_lock                        */
+RoomBucket room_buckets[ROOM_BUCKETS];      /* by room name hash, locks set up in main() */
+
+
+const char *status_reason(int code) {
+	switch (code) {
+		case STATUS_OK:
+			return "OK";
+		case STATUS_BAD_REQUEST:
+			return "BADREQUEST";
+		case STATUS_NOT_FOUND:
+			return "NOTFOUND";
+		case STATUS_CONFLICT:
+			return "CONFLICT";
+		default:
+			return "ERROR";
+	}
+}
 
 void prepare_status_code(char *buffer, int code, const char *message) {
 	memset(buffer, 0, BUFLEN);
 	sprintf(buffer, "%d%s", code, message);
 }
 
-void sigint_handler(int s) {
-	log_info("[server] SIGINT handler called");
-	sigint_received = 1;
-}
-
 void usage(void) {
-	const char *message = "\tserver [-p port]\n"
+	const char *message = "\tserver [-p port] [-a] [-t workers] [-l drop|block] [-m file] [-s file [-w always|interval|never]] [-e secs] [-r] [-b epoll|io_uring]\n"
 	                      "\tserver -h\n";
 	const char *options = "\t-p port\t\tServer's port\n"
 	                      "\t-a     \t\tListen to ANY address not just localhost\n"
+	                      "\t-t N   \t\tRun N workers, each pinned to a core with its own listening socket\n"
+	                      "\t-l policy\tWhat to do with log lines when the log buffer is full: drop (default) or block\n"
+	                      "\t-m file\t\tWrite the metrics dump requested with SIGUSR1 to file instead of stdout\n"
+	                      "\t-s file\t\tRestore the registry from file and checkpoint it there on SIGUSR2 and exit\n"
+	                      "\t-w sync\t\tLog registry changes next to the snapshot, synced always, every interval or never\n"
+	                      "\t-e secs\t\tDrop registrations without a session after secs without a heartbeat (default 90, 0 never)\n"
+	                      "\t-r     \t\tRelay chats between peers that cannot connect to each other\n"
+	                      "\t-b backend\tWait for sockets with epoll (default) or io_uring, which falls back to epoll where missing\n"
 	                      "\t-h     \t\tThis help message\n";
 	log_usage(message, options);
 	exit(EXIT_SUCCESS);
 }
 
-int main(int argc, char const *argv[]) {
-	/* socket variables */
-	int server_fd = -1;                 /* listen file descriptor   */
-	int connection_fd = -1;             /* conn file descriptor     */
-	int server_port = SERVER_PORT;      /* server port		        */
-	const char *server_ip = SERVER_IP;  /* server IP		        */
-	in_addr_t server_in_addr = INADDR_LOOPBACK;
-	int optval = 1;                     /* socket options	        */
-	struct sockaddr_in server_addr;     /* server socket address    */
-	int server_addr_len;                /* server address length    */
-	struct sockaddr_in client_addr;     /* client socket address    */
-	socklen_t client_addr_len;                /* client address length    */
-	size_t rxb = 0;                     /* received bytes	        */
-	size_t t_rxb = 0;                   /* total received bytes     */
-	size_t txb = 0;                     /* transmitted bytes	    */
-	size_t t_txb = 0;                   /* total transmitted bytes  */
-	char plaintext[BUFLEN];             /* plaintext buffer	        */
-	int plaintext_len = 0;              /* plaintext size	        */
+void connection_close(Connection *conn);
 
-	/* command line variables */
-	int opt = 0;                       /* cmd options		        */
-	int any_addr = 0;                  /* listen to any address    */
+void relay_close(Relay *relay);
 
+void drop_parked(const char *username);
 
-	/* general purpose variables */
-	char *ip_address_buffer = NULL;         /* address str representation */
-	unsigned char buffer[INET_ADDRSTRLEN];
-	char *tmp;                              /* temp pointer for conventions */
-	int i;                                  /* temp int counter             */
-	int err;                                /* errors		                */
+size_t parked_connections(void);
 
+/*
+ * Close a connection that has not sent anything for CONNECTION_IDLE_SECS. Sessions, relays and
+ * room members are left to the TCP keepalive, held connections wait for the log instead of the client.
+ */
+void connection_idle(Timer *timer, void *arg) {
+	Connection *conn = arg;
+	Worker *worker = conn->worker;
 
-	/* initialize */
+	if (conn->state == STAGE_SESSION || conn->state == STAGE_RELAY || conn->state == STAGE_ROOM) {
+		return;
+	}
+	if (conn->held || conn->active_at + CONNECTION_IDLE_SECS > worker->timers.now) {
+		timer_wheel_add(&worker->timers, timer, (conn->held ? worker->timers.now : conn->active_at) + CONNECTION_IDLE_SECS);
+		return;
+	}
+	log_info("[server] client '%s:%d' idle for %d seconds, closing connection", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port), CONNECTION_IDLE_SECS);
+	metric_inc(worker->metrics, METRIC_IDLE_CLOSED);
+	connection_close(conn);
+}
 
-	/* get cmd options */
-	while ((opt = getopt(argc, (char *const *) argv, "p::a::h::")) != -1) {
-		switch (opt) {
-			case 'p':
-				server_port = (int) strtol(optarg, &tmp, 10);
-				break;
-			case 'a':
-				any_addr = 1;
-				server_ip = "0.0.0.0";
-				server_in_addr = INADDR_ANY;
-				break;
-			case 'h':
-				usage();
-				exit(EXIT_SUCCESS);
-			default:
-				break;
+Connection *connection_open(Worker *worker, int fd, const struct sockaddr_in *addr) {
+	if ((size_t) fd >= worker->connections_capacity) {
+		size_t capacity = worker->connections_capacity ? worker->connections_capacity : 64;
+		while (capacity <= (size_t) fd) {
+			capacity *= 2;
+		}
+		Connection **tmp = realloc(worker->connections, capacity * sizeof(Connection *));
+		if (tmp == NULL) {
+			return NULL;
 		}
+		memset(tmp + worker->connections_capacity, 0, (capacity - worker->connections_capacity) * sizeof(Connection *));
+		worker->connections = tmp;
+		worker->connections_capacity = capacity;
 	}
 
-	// socket init
-	if ((server_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP)) == -1) {
-		log_with_errno("[server] socket call failed");
-		exit(EXIT_FAILURE);
+	Connection *conn = malloc(sizeof(Connection));
+	if (conn == NULL) {
+		return NULL;
 	}
+	if (framed_stream_init(&conn->stream, fd, FRAMING_DETECT, BUFLEN, BUFLEN) == -1) {
+		free(conn);
+		return NULL;
+	}
+	conn->worker = worker;
+	conn->fd = fd;
+	conn->state = STAGE_REGISTER;
+	conn->negotiated = false;
+	conn->watched = false;
+	conn->want_write = false;
+	conn->session = false;
+	conn->user = NULL;
+	conn->accepted_ns = metrics_now_ns();
+	conn->received = false;
+	conn->wal_sequence = 0;
+	conn->held = false;
+	conn->active_at = worker->timers.now;
+	conn->relay = NULL;
+	conn->outbox = NULL;
+	conn->parking = NULL;
+	conn->inflight = 0;
+	conn->receiving = false;
+	conn->sending = false;
+	conn->closed = false;
+	timer_init(&conn->idle, connection_idle, conn);
+	timer_wheel_add(&worker->timers, &conn->idle, worker->timers.now + CONNECTION_IDLE_SECS);
+	conn->addr = *addr;
+	conn->username[0] = '\0';
+	worker->connections[fd] = conn;
+	return conn;
+}
 
-	//make socket non blocking to handle SIGINT
-	fcntl(server_fd, F_SETFL, O_NONBLOCK);
-
-	memset(&server_addr, 0, sizeof(struct sockaddr_in));
-	server_addr.sin_port = htons(server_port);
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_addr.s_addr = htonl(server_in_addr);
+/*
+ * Log a registry mutation, with the user's shard locked so the log orders the changes of a user
+ * like the registry does.
+ * The answers queued on conn leave once the record is durable.
+ */
+void journal(Connection *conn, int type, const char *username, const char *peer, uint32_t ip_addr, uint16_t port) {
+	uint64_t sequence;
 
-	// set socket options like "ERROR on binding: Address already in use"
-	if ((setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (char *) &optval, sizeof(optval))) < 0) {
-		close(server_fd);
-		log_with_errno("[server] Socket setsockopt failed");
-		exit(EXIT_FAILURE);
+	if (wal == NULL) {
+		return;
+	}
+	if ((sequence = wal_append(wal, type, username, peer, ip_addr, port)) == 0) {
+		log_error("[server] out of memory, change of user '%s' not logged", username);
+		return;
 	}
+	if (conn != NULL) {
+		conn->wal_sequence = sequence;
+	}
+}
 
+/* drop the registration a session owns, unless it has been removed by someone else meanwhile */
+void session_unregister(Connection *conn) {
+	RegistryShard *shard = registry_shard(registry, conn->username);
 
+	registry_shard_lock(shard);
+	if (conn->user->generation == conn->user_generation) {
+		log_info("[server] session of '%s' closed, unregistering the user", registered_user_name(conn->user));
+		journal(NULL, WAL_UNREGISTER, registered_user_name(conn->user), NULL, 0, 0);
+		drop_parked(registered_user_name(conn->user));
+		shard_delete_user(shard, registered_user_name(conn->user));
+	}
+	registry_shard_unlock(shard);
+	conn->user = NULL;
+}
 
-	//bind the socket
-	if (bind(server_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1) {
-		close(server_fd);
-		log_with_errno("[server] Socket bind failed");
-		exit(EXIT_FAILURE);
+/* monotonic seconds, the tick of every worker's timer wheel */
+uint64_t server_seconds(void) {
+	return metrics_now_ns() / 1000000000ull;
+}
+
+/* a lease came due: drop the user, unless a heartbeat moved the deadline meanwhile */
+void lease_expire(Timer *timer, void *arg) {
+	Lease *lease = arg;
+	RegistryShard *shard = registry_shard_of(registry, lease->hash);
+	RegisteredUser *user = lease->user;
+
+	registry_shard_lock(shard);
+	if (user->generation != lease->generation || user->lease_expires == LEASE_FOREVER) {
+		// unregistered, or the name was taken over by a session, since the lease started
+		registry_shard_unlock(shard);
+		free(lease);
+		return;
 	}
+	if (user->lease_expires > lease->worker->timers.now) {
+		timer_wheel_add(&lease->worker->timers, timer, user->lease_expires);
+		registry_shard_unlock(shard);
+		return;
+	}
+	log_info("[server] lease of '%s' ran out, unregistering the user", registered_user_name(user));
+	journal(NULL, WAL_UNREGISTER, registered_user_name(user), NULL, 0, 0);
+	drop_parked(registered_user_name(user));
+	shard_delete_user(shard, registered_user_name(user));
+	registry_shard_unlock(shard);
+	metric_inc(lease->worker->metrics, METRIC_LEASES_EXPIRED);
+	free(lease);
+}
 
-	//listen for connections on socket
-	if (listen(server_fd, 5)) {
-		close(server_fd);
-		log_with_errno("[server] Socket listen failed");
-		exit(EXIT_FAILURE);
+/*
+ * Lease user for lease_secs from now, on the wheel of worker; the user's shard is locked.
+ * Returns -1 when out of memory.
+ */
+int lease_start(Worker *worker, RegisteredUser *user, uint64_t hash) {
+	Lease *lease = malloc(sizeof(Lease));
+
+	if (lease == NULL) {
+		return -1;
 	}
+	timer_init(&lease->timer, lease_expire, lease);
+	lease->worker = worker;
+	lease->user = user;
+	lease->generation = user->generation;
+	lease->hash = hash;
+	user->lease_expires = (uint32_t) (server_seconds() + (uint64_t) lease_secs);
+	timer_wheel_add(&worker->timers, &lease->timer, user->lease_expires);
+	return 0;
+}
 
-	log_info("[server] Awaiting for client connections on '%s:%d'", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
+/* users of a shard that came back from disk and were not heartbeated since */
+typedef struct UnleasedUsers {
+	RegisteredUser **users;
+	size_t count;
+	size_t capacity;
+} UnleasedUsers;
 
-	signal(SIGINT, sigint_handler);
+int collect_unleased(RegisteredUser *user, void *arg) {
+	UnleasedUsers *unleased = arg;
+	RegisteredUser **tmp;
 
-	while (!sigint_received) {
-		//SOCK_NONBLOCK --> flag for accept4()
-		memset(&client_addr, 0, sizeof(struct sockaddr_in));
-		if ((connection_fd = accept4(server_fd, (struct sockaddr *) &client_addr, &client_addr_len, 0)) == -1) {
-			//make socket non-blocking to handle SIGINT only for accept()
-			if (errno == EAGAIN | errno == EWOULDBLOCK) {continue;}
-			log_with_errno("[server] Socket accept failed");
-			continue;
+	if (user->lease_expires != LEASE_UNSET) {
+		return 0;
+	}
+	if (unleased->count == unleased->capacity) {
+		unleased->capacity = unleased->capacity ? unleased->capacity * 2 : 64;
+		if ((tmp = realloc(unleased->users, unleased->capacity * sizeof(RegisteredUser *))) == NULL) {
+			return -1;
 		}
+		unleased->users = tmp;
+	}
+	unleased->users[unleased->count++] = user;
+	return 0;
+}
 
-		// disable nonblock flag so, it won't crash the program later
-		fcntl(server_fd, F_SETFL, ~O_NONBLOCK);
+/*
+ * Users restored from the snapshot or the log have no lease, the heartbeats they got went with
+ * the previous process. A lease after the start worker 0 drops the ones nobody renewed since, a
+ * shard per tick. This is the only scan of the registry and it runs once.
+ */
+void lease_sweep(Timer *timer, void *arg) {
+	Worker *worker = arg;
+	RegistryShard *shard = &registry->shards[worker->sweep_shard];
+	UnleasedUsers unleased = {NULL, 0, 0};
+	bool restoring;
+	size_t i;
+
+	// users still waiting in the snapshot are unleased too, the restore has to finish first
+	registry_shard_lock(&registry->shards[0]);
+	restoring = snapshot != NULL;
+	registry_shard_unlock(&registry->shards[0]);
+	if (restoring) {
+		timer_wheel_add(&worker->timers, timer, worker->timers.now + 1);
+		return;
+	}
 
+	registry_shard_lock(shard);
+	if (registry_for_each(shard->registry, collect_unleased, &unleased) == -1) {
+		registry_shard_unlock(shard);
+		free(unleased.users);
+		log_error("[server] out of memory sweeping shard %d for expired users, trying again", worker->sweep_shard);
+		timer_wheel_add(&worker->timers, timer, worker->timers.now + 1);
+		return;
+	}
+	for (i = 0; i < unleased.count; i++) {
+		journal(NULL, WAL_UNREGISTER, registered_user_name(unleased.users[i]), NULL, 0, 0);
+		drop_parked(registered_user_name(unleased.users[i]));
+		shard_delete_user(shard, registered_user_name(unleased.users[i]));
+	}
+	registry_shard_unlock(shard);
+	free(unleased.users);
+	metric_add(worker->metrics, METRIC_LEASES_EXPIRED, unleased.count);
+	if (unleased.count > 0) {
+		log_info("[server] %zu restored users of shard %d were not renewed, unregistered them", unleased.count, worker->sweep_shard);
+	}
 
-		log_info("[server] client connected from '%s:%d'", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+	if (++worker->sweep_shard < REGISTRY_SHARDS) {
+		timer_wheel_add(&worker->timers, timer, worker->timers.now + 1);
+	}
+}
 
-		/* STAGE1: Receive the initial message (REGISTER USER) */
-		log_debug("[server] Waiting for client to send init message");
-		if ((rxb = (size_t) recv(connection_fd, &plaintext, sizeof(plaintext), 0)) == -1) {
-			close(connection_fd);
-			log_with_errno("[server] socket error receiving initial message");
-			continue;
-		}
-		if (rxb == 0) {
-			log_error("[server] connection terminated before receiving init message");
-			close(connection_fd);
-			continue;
-		}
-		received_bytes_increase_and_report(&rxb, &t_rxb, "server", 1);
+void session_enable_keepalive(int fd) {
+	int on = 1;
+	int idle = SESSION_TCP_KEEPIDLE;
+	int interval = SESSION_TCP_KEEPINTVL;
+	int count = SESSION_TCP_KEEPCNT;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == -1 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == -1 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == -1 ||
+	    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) == -1) {
+		log_with_errno("[server] enabling keepalive on session connection failed");
+	}
+}
 
-		log_info("[server] Initial message from client: '%s'", plaintext);
+/* keep the queued answers back until the log record they depend on is on disk */
+void connection_hold(Connection *conn) {
+	Worker *worker = conn->worker;
 
-		if (plaintext[0] != REGISTER_BYTE && plaintext[0] != UNREGISTER_BYTE) {
-			log_error("[server] wrong initial byte %c --> should be one of [%c, %c]", plaintext[0], REGISTER_BYTE, UNREGISTER_BYTE);
-			log_error("[server] closing connection");
-			close(connection_fd);
-			continue;
+	if (conn->held) {
+		return;
+	}
+	conn->held = true;
+	conn->held_prev = NULL;
+	conn->held_next = worker->held;
+	if (worker->held != NULL) {
+		worker->held->held_prev = conn;
+	}
+	worker->held = conn;
+}
+
+void connection_unhold(Connection *conn) {
+	if (!conn->held) {
+		return;
+	}
+	if (conn->held_prev != NULL) {
+		conn->held_prev->held_next = conn->held_next;
+	} else {
+		conn->worker->held = conn->held_next;
+	}
+	if (conn->held_next != NULL) {
+		conn->held_next->held_prev = conn->held_prev;
+	}
+	conn->held = false;
+}
+
+void room_message_put(RoomMessage *message) {
+	if (atomic_fetch_sub_explicit(&message->refs, 1, memory_order_acq_rel) == 1) {
+		free(message);
+	}
+}
+
+/* drop what conn still had to send to its rooms, it has left them already */
+void outbox_free(Connection *conn) {
+	Outbox *outbox = conn->outbox;
+	Worker *worker = conn->worker;
+	Connection **link;
+	unsigned i;
+
+	pthread_mutex_lock(&worker->outbox_lock);
+	if (outbox->ready) {
+		for (link = &worker->outbox_ready; *link != conn; link = &(*link)->outbox->next_ready) {}
+		*link = outbox->next_ready;
+	}
+	pthread_mutex_unlock(&worker->outbox_lock);
+	for (i = outbox->head; i != outbox->tail; i++) {
+		room_message_put(outbox->queue[i & (ROOM_OUTBOX_LEN - 1)]);
+	}
+	free(outbox);
+	conn->outbox = NULL;
+}
+
+/*
+ * Gather the output of a room member into iov: the answers in the stream, then the room messages
+ * queued. A room message written in part goes first, so frames never interleave. Returns the
+ * number of iov entries, total their bytes.
+ */
+int outbox_gather(Connection *conn, struct iovec iov[2 + ROOM_IOV_MAX], size_t *total) {
+	Outbox *outbox = conn->outbox;
+	RoomMessage *message;
+	size_t skip;
+	unsigned tail;
+	unsigned i;
+	int count = 0;
+
+	*total = 0;
+	outbox->gathered_tx = 0;
+	if (outbox->offset == 0) {
+		count = framed_output(&conn->stream, iov);
+		for (i = 0; i < (unsigned) count; i++) {
+			*total += iov[i].iov_len;
 		}
+		outbox->gathered_tx = *total;
+	}
 
-		char username[rxb];
-		memset(username, 0, rxb);
-		strncpy(username, plaintext + 1, rxb - 1);
-		log_debug("[server] username sent from client: %s", username);
+	// the slots up to tail are filled in, only the owner takes them out again
+	pthread_mutex_lock(&conn->worker->outbox_lock);
+	tail = outbox->tail;
+	pthread_mutex_unlock(&conn->worker->outbox_lock);
+	for (i = outbox->head; i != tail && count < 2 + ROOM_IOV_MAX; i++) {
+		message = outbox->queue[i & (ROOM_OUTBOX_LEN - 1)];
+		skip = i == outbox->head ? outbox->offset : 0;
+		iov[count].iov_base = message->data + skip;
+		iov[count].iov_len = message->len - skip;
+		*total += iov[count].iov_len;
+		count++;
+	}
+	return count;
+}
 
-		// check if username exists, otherwise add it to the list
-		RegisteredUser *user = search_registered_user(users_list_head, username);
+/* n bytes of the last gather were sent */
+void outbox_consume(Connection *conn, size_t n) {
+	Outbox *outbox = conn->outbox;
+	size_t tx = n < outbox->gathered_tx ? n : outbox->gathered_tx;
+	unsigned head = outbox->head;
+	RoomMessage *message;
+	size_t left;
+
+	framed_sent(&conn->stream, tx);
+	n -= tx;
+	while (n > 0) {
+		message = outbox->queue[head & (ROOM_OUTBOX_LEN - 1)];
+		left = message->len - outbox->offset;
+		if (n < left) {
+			outbox->offset += n;
+			break;
+		}
+		n -= left;
+		outbox->offset = 0;
+		room_message_put(message);
+		head++;
+	}
+	pthread_mutex_lock(&conn->worker->outbox_lock);
+	outbox->head = head;
+	pthread_mutex_unlock(&conn->worker->outbox_lock);
+}
 
-		// unregister mode
-		if (plaintext[0] == UNREGISTER_BYTE) {
-			if (user == NULL) {
-				log_info("[server] user '%s' is not registered to the server", username);
-				// send response back to client that user was not found
-				prepare_status_code((char *) &plaintext, 404, "NOTFOUND");
-			} else {
-				// send reply to client with status_code: 200 OK
-				delete_registered_user(&users_list_head, username);
-				log_debug("[server] successfully deleted user '%s' from the list", username);
-				prepare_status_code((char *) &plaintext, 200, "OK");
+/* write what a room member has to send, as many messages per writev as fit. Returns the bytes left, -1 on error */
+ssize_t outbox_write(Connection *conn) {
+	struct iovec iov[2 + ROOM_IOV_MAX];
+	size_t total;
+	ssize_t n;
+	int count;
+
+	while ((count = outbox_gather(conn, iov, &total)) > 0) {
+		if ((n = writev(conn->fd, iov, count)) == -1) {
+			if (errno == EINTR) {
+				continue;
 			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? (ssize_t) total : -1;
+		}
+		outbox_consume(conn, (size_t) n);
+		metric_add(conn->worker->metrics, METRIC_TX_BYTES, (uint64_t) n);
+		if ((size_t) n < total) {
+			return (ssize_t) (total - (size_t) n);
+		}
+	}
+	return 0;
+}
 
-			log_debug("[server] sending response to client: %s", plaintext);
-			if ((txb = send(connection_fd, plaintext, strlen(plaintext) + 1, 0)) == -1) {
-				close(connection_fd);
-				close(server_fd);
-				log_with_errno("[server] sending message to client failed.");
-				exit(EXIT_FAILURE);
-			}
-			transmitted_bytes_increase_and_report(&txb, &t_txb, "server", 1);
-			log_info("[server] closing connection");
-			close(connection_fd);
+void room_leave_all(Connection *conn);
+
+/* everything closing a connection takes but closing the descriptor and freeing conn */
+void connection_release(Connection *conn) {
+	timer_wheel_cancel(&conn->worker->timers, &conn->idle);
+	connection_unhold(conn);
+	if (conn->outbox != NULL) {
+		room_leave_all(conn);
+	}
+	if (conn->user != NULL) {
+		session_unregister(conn);
+	}
+	metric_inc(conn->worker->metrics, METRIC_CLOSED);
+	latency_record_since(conn->worker->metrics, LATENCY_LIFETIME, conn->accepted_ns);
+}
+
+void connection_free(Connection *conn) {
+	if (conn->outbox != NULL) {
+		outbox_free(conn);
+	}
+	free(conn->parking);
+	framed_stream_free(&conn->stream);
+	free(conn);
+}
+
+void uring_close(Connection *conn);
+
+int uring_flush(Connection *conn);
+
+int connection_park(Connection *conn);
+
+void connection_close(Connection *conn) {
+	if (conn->relay != NULL) {
+		// both ends go together
+		relay_close(conn->relay);
+		return;
+	}
+	if (conn->worker->ring.fd != -1) {
+		uring_close(conn);
+		return;
+	}
+	connection_release(conn);
+	// closing the descriptor also removes it from the epoll set
+	close(conn->fd);
+	conn->worker->connections[conn->fd] = NULL;
+	connection_free(conn);
+}
+
+/*
+ * Take the descriptor away from the worker without closing it, for a worker to adopt later. conn
+ * is freed; the connection counts as closed here and as accepted again where it is adopted.
+ */
+int connection_detach(Connection *conn) {
+	Worker *worker = conn->worker;
+	int fd = conn->fd;
+
+	timer_wheel_cancel(&worker->timers, &conn->idle);
+	connection_unhold(conn);
+	if (conn->watched && epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+		log_with_errno("[server] epoll_ctl failed");
+	}
+	metric_inc(worker->metrics, METRIC_CLOSED);
+	worker->connections[fd] = NULL;
+	framed_stream_free(&conn->stream);
+	free(conn);
+	return fd;
+}
+
+void close_all_connections(Worker *worker) {
+	size_t i;
+	for (i = 0; i < worker->connections_capacity; i++) {
+		if (worker->connections[i] == NULL) {
 			continue;
 		}
+		if (worker->connections[i]->closed) {
+			// released already, its io_uring requests went with the ring
+			connection_free(worker->connections[i]);
+		} else {
+			connection_close(worker->connections[i]);
+		}
+	}
+	free(worker->connections);
+	worker->connections = NULL;
+	worker->connections_capacity = 0;
+}
 
+/* (re)arm the connection in the epoll set, it is only added once it has to wait for something */
+int connection_watch(Connection *conn, uint32_t events) {
+	struct epoll_event ev;
 
-		// register mode
-		if (user != NULL) {
-			log_info("[server] user '%s' already registered", user->username);
+	ev.events = events;
+	ev.data.fd = conn->fd;
+	if (epoll_ctl(conn->worker->epoll_fd, conn->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+		return -1;
+	}
+	conn->watched = true;
+	return 0;
+}
 
-			// send response back to client that user already exists
-			prepare_status_code((char *) &plaintext, 409, "CONFLICT");
-			log_debug("[server] sending response to client: %s", plaintext);
-			if ((txb = send(connection_fd, plaintext, strlen(plaintext) + 1, 0)) == -1) {
-				close(connection_fd);
-				close(server_fd);
-				log_with_errno("[server] sending message to client failed.");
-				exit(EXIT_FAILURE);
-			}
-			transmitted_bytes_increase_and_report(&txb, &t_txb, "server", 1);
+/*
+ * Write as much of the pending response, and of the room messages of a member, as the socket
+ * accepts. Returns -1 when the connection has been closed, 0 otherwise. Leftovers are retried once
+ * epoll reports the socket writable; io_uring workers hand the whole response to the ring instead.
+ */
+int connection_flush(Connection *conn) {
+	size_t queued = framed_pending_output(&conn->stream);
+	ssize_t pending;
+	size_t txb;
+
+	if (conn->worker->ring.fd != -1) {
+		return uring_flush(conn);
+	}
+	if (conn->outbox != NULL) {
+		pending = outbox_write(conn);
+	} else if ((pending = framed_flush(&conn->stream)) != -1) {
+		txb = queued - (size_t) pending;
+		metric_add(conn->worker->metrics, METRIC_TX_BYTES, txb);
+	}
+	if (pending == -1) {
+		log_with_errno("[server] sending message to client failed.");
+		metric_inc(conn->worker->metrics, METRIC_ERR_SOCKET);
+		connection_close(conn);
+		return -1;
+	}
 
-			log_info("[server] closing connection");
-			close(connection_fd);
-			continue;
+	if (pending > 0) {
+		if (!conn->want_write) {
+			connection_watch(conn, EPOLLOUT);
+			conn->want_write = true;
 		}
+		return 0;
+	}
 
-		user = add_registered_user(&users_list_head, username);
+	if (conn->parking != NULL) {
+		return connection_park(conn);
+	}
+	if (conn->state == STAGE_CLOSING) {
+		log_info("[server] closing connection");
+		connection_close(conn);
+		return -1;
+	}
+
+	if (conn->want_write) {
+		connection_watch(conn, EPOLLIN | EPOLLRDHUP);
+		conn->want_write = false;
+	}
+	return 0;
+}
+
+/* append bytes to the pending response */
+int connection_queue(Connection *conn, const void *data, size_t len) {
+	if (framed_write(&conn->stream, data, len) == -1) {
+		log_error("[server] response buffer full, closing connection");
+		metric_inc(conn->worker->metrics, METRIC_ERR_RESOURCE);
+		connection_close(conn);
+		return -1;
+	}
+	return 0;
+}
 
-		log_debug("[server] successfully added user '%s' to the list", username);
+/*
+ * Queue a status code, and the address of a user when with_address is set. Responses are written
+ * once every message of the current read has been handled.
+ */
+int connection_respond(Connection *conn, int status, bool with_address, uint32_t ip_addr, uint16_t port) {
+	char plaintext[BUFLEN];
+	char ip[INET_ADDRSTRLEN];
+	size_t len;
+	int id;
+
+	if ((id = metric_status_id(status)) != -1) {
+		metric_inc(conn->worker->metrics, id);
+	}
 
-		// send reply to client with status_code: 200 OK
-		prepare_status_code((char *) &plaintext, 200, "OK");
+	if (conn->stream.framing == FRAMING_BINARY) {
+		len = with_address ? frame_encode_status_address(plaintext, (uint16_t) status, ip_addr, port)
+		                   : frame_encode_status(plaintext, (uint16_t) status);
+		log_debug("[server] sending response to client: %d", status);
+	} else {
+		if (with_address) {
+			inet_ntop(AF_INET, &ip_addr, ip, sizeof(ip));
+			memset(plaintext, 0, sizeof(plaintext));
+			sprintf(plaintext, "%d%s %s %d", status, status_reason(status), ip, port);
+		} else {
+			prepare_status_code(plaintext, status, status_reason(status));
+		}
 		log_debug("[server] sending response to client: %s", plaintext);
-		if ((txb = send(connection_fd, plaintext, strlen(plaintext) + 1, 0)) == -1) {
-			close(connection_fd);
-			close(server_fd);
-			log_with_errno("[server] sending message to client failed.");
-			exit(EXIT_FAILURE);
+		len = strlen(plaintext) + 1;
+	}
+
+	return connection_queue(conn, plaintext, len);
+}
+
+int connection_respond_status(Connection *conn, int status) {
+	return connection_respond(conn, status, false, 0, 0);
+}
+
+/* registered users, the ones still waiting in the snapshot included; takes the shard locks one by one */
+size_t registry_count(void) {
+	size_t users = shared_registry_count(registry);
+
+	// the snapshot is only closed with every shard locked
+	registry_shard_lock(&registry->shards[0]);
+	if (snapshot != NULL) {
+		users += atomic_load(&snapshot->remaining);
+	}
+	registry_shard_unlock(&registry->shards[0]);
+	return users;
+}
+
+/*
+ * search_registered_user() in the locked shard of username. Users of a snapshot still being
+ * restored are moved into the registry on their first lookup.
+ */
+RegisteredUser *registry_find(RegistryShard *shard, const char *username) {
+	RegisteredUser *user = search_registered_user(shard->registry, username);
+
+	if (user == NULL && snapshot != NULL) {
+		user = registry_snapshot_take(snapshot, registry, username);
+	}
+	return user;
+}
+
+/* registry_find() timed into the lookup histogram */
+RegisteredUser *registry_lookup(Worker *worker, RegistryShard *shard, const char *username) {
+	uint64_t start = metrics_now_ns();
+	RegisteredUser *user = registry_find(shard, username);
+
+	latency_record_since(worker->metrics, LATENCY_LOOKUP, start);
+	return user;
+}
+
+/*
+ * Look the peer of a CONNECT up without taking a lock, timed into the lookup histogram. Only a
+ * miss locks the peer's shard, the user may still be waiting in the snapshot.
+ */
+bool peer_lookup(Worker *worker, const char *username, RegisteredUserView *view) {
+	uint64_t start = metrics_now_ns();
+	bool found = shared_registry_read(registry, worker->id, username, view) == 1;
+	RegistryShard *shard;
+	RegisteredUser *user;
+
+	if (!found) {
+		shard = registry_shard(registry, username);
+		registry_shard_lock(shard);
+		if ((user = registry_find(shard, username)) != NULL) {
+			view->user = user;
+			view->generation = user->generation;
+			view->ip_addr = user->ip_addr;
+			view->port = user->port;
+			view->operation = user->operation;
+			found = true;
 		}
-		transmitted_bytes_increase_and_report(&txb, &t_txb, "server", 1);
+		registry_shard_unlock(shard);
+	}
+
+	latency_record_since(worker->metrics, LATENCY_LOOKUP, start);
+	return found;
+}
 
+/* STAGE1: initial message (REGISTER/UNREGISTER USER) */
+int handle_register_request(Connection *conn, const Request *req) {
+	char *username = conn->username;
+	strcpy(username, req->username);
+	log_debug("[server] username sent from client: %s", username);
 
-		// STAGE2: get operation from client
-		memset(plaintext, 0, sizeof(plaintext));
-		log_debug("[server] waiting for client to send operation message");
-		if ((rxb = (size_t) recv(connection_fd, plaintext, sizeof(plaintext), 0)) == -1) {
-			close(server_fd);
-			close(connection_fd);
-			log_with_errno("[server] socket error receiving operation message");
-			exit(EXIT_FAILURE);
+	if (username[0] == '\0') {
+		log_error("[server] username must be 1 - %d characters long", USERNAME_MAX_LEN);
+		conn->state = STAGE_CLOSING;
+		return connection_respond_status(conn, STATUS_BAD_REQUEST);
+	}
+
+	// check if username exists, otherwise add it to the list
+	uint64_t hash = hash_username(username, strlen(username));
+	RegistryShard *shard = registry_shard_of(registry, hash);
+	registry_shard_lock(shard);
+	RegisteredUser *user = registry_lookup(conn->worker, shard, username);
+
+	// unregister mode
+	if (req->operation == UNREGISTER_BYTE) {
+		int status;
+		if (user == NULL) {
+			registry_shard_unlock(shard);
+			log_info("[server] user '%s' is not registered to the server", username);
+			// send response back to client that user was not found
+			status = STATUS_NOT_FOUND;
+		} else {
+			// send reply to client with status_code: 200 OK
+			shard_delete_user(shard, username);
+			journal(conn, WAL_UNREGISTER, username, NULL, 0, 0);
+			drop_parked(username);
+			registry_shard_unlock(shard);
+			log_debug("[server] successfully deleted user '%s' from the list", username);
+			status = STATUS_OK;
+			metric_inc(conn->worker->metrics, METRIC_HANDSHAKES);
 		}
-		if (rxb == 0) {
-			log_error("[server] connection terminated before receiving operation message");
-			close(connection_fd);
-			continue;
+		conn->state = STAGE_CLOSING;
+		return connection_respond_status(conn, status);
+	}
+
+	// register mode
+	if (user != NULL) {
+		registry_shard_unlock(shard);
+		log_info("[server] user '%s' already registered", username);
+
+		// send response back to client that user already exists
+		conn->state = STAGE_CLOSING;
+		return connection_respond_status(conn, STATUS_CONFLICT);
+	}
+
+	if ((user = shard_add_user(shard, username)) == NULL) {
+		registry_shard_unlock(shard);
+		log_error("[server] out of memory, could not register user '%s'", username);
+		log_error("[server] closing connection");
+		metric_inc(conn->worker->metrics, METRIC_ERR_RESOURCE);
+		connection_close(conn);
+		return -1;
+	}
+	if (conn->session || lease_secs == 0) {
+		user->lease_expires = LEASE_FOREVER;
+	} else if (lease_start(conn->worker, user, hash) == -1) {
+		shard_delete_user(shard, username);
+		registry_shard_unlock(shard);
+		log_error("[server] out of memory, could not lease user '%s'", username);
+		log_error("[server] closing connection");
+		metric_inc(conn->worker->metrics, METRIC_ERR_RESOURCE);
+		connection_close(conn);
+		return -1;
+	}
+	journal(conn, WAL_REGISTER, username, NULL, 0, 0);
+	if (conn->session) {
+		conn->user = user;
+		conn->user_generation = user->generation;
+	}
+	registry_shard_unlock(shard);
+	log_debug("[server] successfully added user '%s' to the list", username);
+
+	// send reply to client with status_code: 200 OK
+	conn->state = STAGE_OPERATION;
+	log_debug("[server] waiting for client to send operation message");
+	return connection_respond_status(conn, STATUS_OK);
+}
+
+/*
+ * HEARTBEAT: renew the lease of a registration. The deadline in the record moves, the timer of the
+ * lease stays where it is and catches up when it fires. Restored users get their lease here.
+ */
+int handle_heartbeat_request(Connection *conn, const Request *req) {
+	uint64_t hash = hash_username(req->username, strlen(req->username));
+	RegistryShard *shard = registry_shard_of(registry, hash);
+	RegisteredUser *user;
+
+	if (conn->state != STAGE_SESSION && conn->state != STAGE_ROOM) {
+		conn->state = STAGE_CLOSING;
+	}
+
+	registry_shard_lock(shard);
+	if ((user = registry_lookup(conn->worker, shard, req->username)) == NULL) {
+		registry_shard_unlock(shard);
+		log_info("[server] heartbeat of '%s', who is not registered", req->username);
+		return connection_respond_status(conn, STATUS_NOT_FOUND);
+	}
+	if (lease_secs > 0 && user->lease_expires != LEASE_FOREVER) {
+		if (user->lease_expires != LEASE_UNSET) {
+			user->lease_expires = (uint32_t) (server_seconds() + (uint64_t) lease_secs);
+		} else if (lease_start(conn->worker, user, hash) == -1) {
+			// still registered, only without an expiry
+			log_error("[server] out of memory, could not lease user '%s'", req->username);
+			metric_inc(conn->worker->metrics, METRIC_ERR_RESOURCE);
 		}
-		received_bytes_increase_and_report(&rxb, &t_rxb, "server", 1);
+	}
+	registry_shard_unlock(shard);
+	log_debug("[server] renewed the lease of '%s'", req->username);
+	return connection_respond_status(conn, STATUS_OK);
+}
 
-		log_info("[server] operation message from client: '%s'", plaintext);
+/* STAGE2: operation message (LISTEN/CONNECT) */
+int handle_operation_request(Connection *conn, const Request *req) {
+	char listen_ip[INET_ADDRSTRLEN];
+	RegistryShard *shard = registry_shard(registry, conn->username);
+	RegisteredUserView connect_user;
+	bool connect_found = false;
 
-		char *token = NULL;
-		switch (plaintext[0]) {
-			case CONNECT_BYTE:
-				i = 0;
-				char connect_with_username[256];
-				token = strtok(&plaintext[2], " ");
-				while (token) {
-					if (i == 0) {
-						strcpy(connect_with_username, token);
-					}
-					token = strtok(NULL, " ");
-					i++;
-				}
+	// the peer is read before the own shard is locked, no two shard locks are ever held
+	if (req->operation == CONNECT_BYTE) {
+		connect_found = peer_lookup(conn->worker, req->username, &connect_user);
+	}
 
-				log_info("[server] user '%s' wants to connect (chat) with '%s'", user->username, connect_with_username);
+	registry_shard_lock(shard);
+	RegisteredUser *user = registry_lookup(conn->worker, shard, conn->username);
+	if (user == NULL) {
+		registry_shard_unlock(shard);
+		// the registration was removed by another client in the meantime
+		log_info("[server] user '%s' is not registered to the server", conn->username);
+		conn->state = STAGE_CLOSING;
+		return connection_respond_status(conn, STATUS_NOT_FOUND);
+	}
 
-				RegisteredUser *connect_user = search_registered_user(users_list_head, connect_with_username);
-				if (connect_user == NULL) {
-					log_info("[server] user '%s' does not exist", connect_with_username);
+	switch (req->operation) {
+		case CONNECT_BYTE:
+			log_info("[server] user '%s' wants to connect (chat) with '%s'", conn->username, req->username);
 
-					// delete registered user because it won't connect with anyone and thus is not a valid list entry
-					delete_registered_user(&users_list_head, user->username);
+			if (!connect_found) {
+				log_info("[server] user '%s' does not exist", req->username);
 
-					// send reply that user does not exist
-					prepare_status_code((char *) &plaintext, 404, "NOTFOUND");
-					log_debug("[server] sending response to client: %s", plaintext);
-					if ((txb = send(connection_fd, &plaintext, strlen((const char *) &plaintext) + 1, 0)) == -1) {
-						close(connection_fd);
-						close(server_fd);
-						log_with_errno("[server] sending message to client failed.");
-						exit(EXIT_FAILURE);
-					}
-					transmitted_bytes_increase_and_report(&txb, &t_txb, "server", 1);
-					close(connection_fd);
-					break;
-				}
+				// delete registered user because it won't connect with anyone and thus is not a valid list entry
+				shard_delete_user(shard, conn->username);
+				journal(conn, WAL_UNREGISTER, conn->username, NULL, 0, 0);
+				registry_shard_unlock(shard);
 
-				//update current user's information
-				user->operation = CONNECT_BYTE;
-				strcpy(user->connected_with, connect_user->username);
-
-				// send reply that user exists and then send a SECOND reply with the appropriate IP and PORT of the user
-
-				//1st
-				//prepare_status_code((char *) &plaintext, 200, "OK");
-				memset(plaintext, 0, sizeof(plaintext));
-				sprintf((char *) &plaintext, "%d%s %s %d", 200, "OK", connect_user->ip_addr, connect_user->port);
-				log_debug("[server] sending response to client: %s", plaintext);
-				if ((txb = send(connection_fd, plaintext, strlen(plaintext) + 1, 0)) == -1) {
-					close(connection_fd);
-					close(server_fd);
-					log_with_errno("[server] sending message to client failed.");
-					exit(EXIT_FAILURE);
-				}
-				transmitted_bytes_increase_and_report(&txb, &t_txb, "server", 1);
-
-				//2nd
-//				memset(plaintext, 0, sizeof(plaintext));
-//				sprintf((char *) &plaintext, "%s %d", connect_user->ip_addr, connect_user->port);
-//				log_debug("[client] sending operation message response to client: %s", plaintext);
-//				if ((txb = send(connection_fd, plaintext, strlen(plaintext) + 1, 0)) == -1) {
-//					close(connection_fd);
-//					close(server_fd);
-//					log_with_errno("[client] sending message to client failed");
-//					exit(EXIT_FAILURE);
-//				}
-//				transmitted_bytes_increase_and_report(&txb, &t_txb, "server", 1);
-
-				close(connection_fd);
+				// send reply that user does not exist
+				conn->state = STAGE_CLOSING;
+				return connection_respond_status(conn, STATUS_NOT_FOUND);
+			}
 
-				break;
-			case LISTEN_BYTE:
-				i = 0;
-
-				char listen_ip[INET_ADDRSTRLEN];
-				int listen_port;
-
-				token = strtok(&plaintext[2], " ");
-				while (token) {
-					if (i == 0) {
-						strcpy(listen_ip, token);
-					} else if (i == 1) {
-						listen_port = (int) strtol(token, NULL, 10);
-					}
-					token = strtok(NULL, " ");
-					i++;
-				}
+			//update current user's information
+			registry_write_begin(shard);
+			user->operation = CONNECT_BYTE;
+			registered_user_connect_view(user, &connect_user);
+			registry_write_end(shard);
+			journal(conn, WAL_CONNECT, conn->username, req->username, 0, 0);
+			uint32_t connect_ip = connect_user.ip_addr;
+			uint16_t connect_port = connect_user.port;
+			registry_shard_unlock(shard);
+			metric_inc(conn->worker->metrics, METRIC_HANDSHAKES);
+
+			// send reply that user exists along with the appropriate IP and PORT of the user
+			conn->state = conn->session ? STAGE_SESSION : STAGE_CLOSING;
+			return connection_respond(conn, STATUS_OK, true, connect_ip, connect_port);
+		case LISTEN_BYTE:
+			inet_ntop(AF_INET, &req->ip_addr, listen_ip, sizeof(listen_ip));
+			log_info("[server] user '%s' waits to chat at '%s:%d'", conn->username, listen_ip, req->port);
+
+			if (req->port < 1 || req->port > 65535) {
+				registry_shard_unlock(shard);
+				log_error("[server] invalid listening address '%s:%d'", listen_ip, req->port);
+				conn->state = STAGE_CLOSING;
+				return connection_respond_status(conn, STATUS_BAD_REQUEST);
+			}
+			registry_write_begin(shard);
+			user->operation = LISTEN_BYTE;
+			user->ip_addr = req->ip_addr;
+			user->port = (uint16_t) req->port;
+			registry_write_end(shard);
+			journal(conn, WAL_LISTEN, conn->username, NULL, req->ip_addr, user->port);
+			registry_shard_unlock(shard);
+			metric_inc(conn->worker->metrics, METRIC_HANDSHAKES);
+
+			// send response back to client
+			conn->state = conn->session ? STAGE_SESSION : STAGE_CLOSING;
+			return connection_respond_status(conn, STATUS_OK);
+		default:
+			registry_shard_unlock(shard);
+			return -1;
+	}
+}
 
-				log_info("[server] user '%s' waits to chat at '%s:%d'", user->username, listen_ip, listen_port);
+/*
+ * STATS: answer with a snapshot of every worker's counters. A session stays open afterwards, any
+ * other connection is closed like after a handshake.
+ */
+int handle_stats_request(Connection *conn) {
+	uint64_t values[METRIC_COUNT];
+	char reply[BUFLEN];
+	size_t len;
+
+	metrics_snapshot(worker_metrics, workers_count, values);
+	values[METRIC_PARKED] = parked_connections();
+	values[METRIC_REGISTERED_USERS] = registry_count();
+
+	if (conn->state != STAGE_SESSION && conn->state != STAGE_ROOM) {
+		conn->state = STAGE_CLOSING;
+	}
+	if (conn->stream.framing == FRAMING_BINARY) {
+		len = frame_encode_stats(reply, values, METRIC_COUNT);
+	} else {
+		len = (size_t) sprintf(reply, "%d%s ", STATUS_OK, status_reason(STATUS_OK));
+		len += metrics_format_text(values, METRIC_COUNT, ' ', reply + len, sizeof(reply) - len) + 1;
+	}
+	log_debug("[server] sending metrics snapshot to client");
+	return connection_queue(conn, reply, len);
+}
 
-				user->operation = LISTEN_BYTE;
-				strcpy(user->ip_addr, listen_ip);
-				user->port = listen_port;
+/* a parked connection is still there: nothing arrived, or bytes that wait for the caller */
+bool parked_alive(int fd) {
+	char byte;
+	ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
 
-				// send response back to client
-				prepare_status_code((char *) &plaintext, 200, "OK");
-				log_debug("[server] sending response to client: %s", plaintext);
-				if ((txb = send(connection_fd, &plaintext, strlen(plaintext) + 1, 0)) == -1) {
-					close(connection_fd);
-					close(server_fd);
-					log_with_errno("[server] sending message to client failed.");
-					exit(EXIT_FAILURE);
-				}
-				transmitted_bytes_increase_and_report(&txb, &t_txb, "server", 1);
+	return n == 1 || (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+}
 
-				close(connection_fd);
+/* unlink *link from parked and close it, parked_lock is held */
+void parked_close(ParkedConnection **link) {
+	ParkedConnection *entry = *link;
 
-				break;
-			default:
-				log_error("[server] wrong initial byte '%c' --> should be one of [%c, %c]", plaintext[0], CONNECT_BYTE, LISTEN_BYTE);
-				log_error("[server] closing connection");
-				close(connection_fd);
-				break;
+	*link = entry->next;
+	close(entry->fd);
+	free(entry);
+	parked_count--;
+}
+
+/*
+ * Detach conn from its worker and park it for a caller, dropping the connections of the same
+ * user that went away meanwhile. The worker keeps watching it for a hangup. Returns -1, leaving
+ * conn alone, when the user has RELAY_PARK_MAX parked already.
+ */
+int park_connection(Connection *conn, ParkedConnection *parking) {
+	ParkedConnection **link = &parked[hash_username(parking->username, strlen(parking->username)) & (RELAY_PARK_BUCKETS - 1)];
+	ParkedConnection *entry;
+	struct epoll_event ev;
+	int count = 0;
+
+	pthread_mutex_lock(&parked_lock);
+	while ((entry = *link) != NULL) {
+		if (strcmp(entry->username, parking->username) == 0) {
+			if (!parked_alive(entry->fd)) {
+				parked_close(link);
+				continue;
+			}
+			count++;
 		}
+		link = &entry->next;
+	}
+	if (count >= RELAY_PARK_MAX) {
+		pthread_mutex_unlock(&parked_lock);
+		return -1;
+	}
+	// detached under the lock, no caller can adopt the descriptor while conn still has it
+	parking->worker = conn->worker;
+	parking->fd = connection_detach(conn);
+	ev.events = EPOLLRDHUP;
+	ev.data.ptr = parking;
+	if (epoll_ctl(parking->worker->parked_fd, EPOLL_CTL_ADD, parking->fd, &ev) == -1) {
+		log_with_errno("[server] epoll_ctl failed, a parked connection of '%s' is not watched", parking->username);
+	}
+	parking->next = NULL;
+	*link = parking;
+	parked_count++;
+	pthread_mutex_unlock(&parked_lock);
+	return 0;
+}
+
+/* take the oldest connection parked for username that is still open, NULL when there is none */
+ParkedConnection *unpark_connection(const char *username) {
+	ParkedConnection **link = &parked[hash_username(username, strlen(username)) & (RELAY_PARK_BUCKETS - 1)];
+	ParkedConnection *entry;
 
-		//print_all_registered_users(users_list_head);
+	pthread_mutex_lock(&parked_lock);
+	while ((entry = *link) != NULL) {
+		if (strcmp(entry->username, username) != 0) {
+			link = &entry->next;
+			continue;
+		}
+		if (!parked_alive(entry->fd)) {
+			parked_close(link);
+			continue;
+		}
+		// the worker that parked it must not see its events anymore once the caller's has it
+		epoll_ctl(entry->worker->parked_fd, EPOLL_CTL_DEL, entry->fd, NULL);
+		*link = entry->next;
+		parked_count--;
+		break;
 	}
+	pthread_mutex_unlock(&parked_lock);
+	return entry;
+}
 
-	// cleanup
-	log_info("[server] cleanup..");
-	free_registered_users_list(users_list_head);
-	log_info("[server] freed registered users list");
-	close(server_fd);
+/* close the connections username has parked, it is not registered anymore; the user's shard is locked */
+void drop_parked(const char *username) {
+	ParkedConnection **link = &parked[hash_username(username, strlen(username)) & (RELAY_PARK_BUCKETS - 1)];
+	int dropped = 0;
+
+	pthread_mutex_lock(&parked_lock);
+	while (*link != NULL) {
+		if (strcmp((*link)->username, username) == 0) {
+			parked_close(link);
+			dropped++;
+		} else {
+			link = &(*link)->next;
+		}
+	}
+	pthread_mutex_unlock(&parked_lock);
+	if (dropped > 0) {
+		log_debug("[server] closed %d connections '%s' had parked", dropped, username);
+	}
+}
+
+/*
+ * Close the connections parked from worker whose listener hung up. The set is read under the
+ * lock: a connection a caller took or that was closed meanwhile has left it, so every entry
+ * reported is still parked.
+ */
+void worker_on_parked(Worker *worker) {
+	struct epoll_event events[MAX_EVENTS];
+	ParkedConnection **link;
+	ParkedConnection *entry;
+	int n;
+	int i;
+
+	pthread_mutex_lock(&parked_lock);
+	if ((n = epoll_wait(worker->parked_fd, events, MAX_EVENTS, 0)) == -1) {
+		pthread_mutex_unlock(&parked_lock);
+		log_with_errno("[server] epoll_wait on the parked connections failed");
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		entry = events[i].data.ptr;
+		link = &parked[hash_username(entry->username, strlen(entry->username)) & (RELAY_PARK_BUCKETS - 1)];
+		while (*link != entry) {
+			link = &(*link)->next;
+		}
+		log_info("[server] a connection '%s' had parked was closed by the client", entry->username);
+		parked_close(link);
+	}
+	pthread_mutex_unlock(&parked_lock);
+}
+
+/* connections parked right now, for the METRIC_PARKED gauge */
+size_t parked_connections(void) {
+	size_t count;
+
+	pthread_mutex_lock(&parked_lock);
+	count = parked_count;
+	pthread_mutex_unlock(&parked_lock);
+	return count;
+}
+
+/* close every parked connection, once the workers are gone */
+void close_parked(void) {
+	size_t i;
+
+	for (i = 0; i < RELAY_PARK_BUCKETS; i++) {
+		while (parked[i] != NULL) {
+			parked_close(&parked[i]);
+		}
+	}
+}
+
+void relay_close(Relay *relay) {
+	Worker *worker = relay->ends[0]->worker;
+	int k;
+
+	metric_inc(worker->metrics, METRIC_RELAYS_CLOSED);
+	for (k = 0; k < 2; k++) {
+		relay->ends[k]->relay = NULL;
+		connection_close(relay->ends[k]);
+		close(relay->pipes[k][0]);
+		close(relay->pipes[k][1]);
+	}
+	free(relay);
+}
+
+/*
+ * Splice what ends[from] sent through its pipe into the other end, until a socket would block or
+ * RELAY_ROUNDS splices went by. Answers queued on the other end leave first. Returns -1 when a
+ * socket failed.
+ */
+int relay_pump(Relay *relay, int from) {
+	Connection *src = relay->ends[from];
+	Connection *dst = relay->ends[!from];
+	WorkerMetrics *metrics = src->worker->metrics;
+	size_t queued = framed_pending_output(&dst->stream);
+	ssize_t n;
+	int rounds;
+
+	if (queued > 0) {
+		if ((n = framed_flush(&dst->stream)) == -1) {
+			return -1;
+		}
+		metric_add(metrics, METRIC_TX_BYTES, queued - (size_t) n);
+		if (n > 0) {
+			return 0;
+		}
+	}
+
+	for (rounds = 0; rounds < RELAY_ROUNDS; rounds++) {
+		if (relay->buffered[from] > 0) {
+			if ((n = splice(relay->pipes[from][0], NULL, dst->fd, NULL, relay->buffered[from], SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) == -1) {
+				return errno == EAGAIN || errno == EINTR ? 0 : -1;
+			}
+			relay->buffered[from] -= (size_t) n;
+			metric_add(metrics, METRIC_TX_BYTES, (uint64_t) n);
+			metric_add(metrics, METRIC_RELAY_BYTES, (uint64_t) n);
+			continue;
+		}
+		if (relay->eof[from]) {
+			if (!relay->shut[from]) {
+				shutdown(dst->fd, SHUT_WR);
+				relay->shut[from] = true;
+			}
+			return 0;
+		}
+		// the pipe is empty here, so only the socket can be short of data
+		if ((n = splice(src->fd, NULL, relay->pipes[from][1], NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) == -1) {
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		}
+		if (n == 0) {
+			relay->eof[from] = true;
+			continue;
+		}
+		relay->buffered[from] += (size_t) n;
+		metric_add(metrics, METRIC_RX_BYTES, (uint64_t) n);
+	}
+	return 0;
+}
+
+/* an end is read while its pipe is empty and written while the other end's pipe has bytes */
+int relay_watch(Relay *relay) {
+	Connection *conn;
+	uint32_t events;
+	int k;
+
+	for (k = 0; k < 2; k++) {
+		conn = relay->ends[k];
+		events = !relay->eof[k] && relay->buffered[k] == 0 ? EPOLLIN : 0;
+		if (relay->buffered[!k] > 0 || framed_pending_output(&conn->stream) > 0) {
+			events |= EPOLLOUT;
+		}
+		if (events != relay->events[k]) {
+			if (connection_watch(conn, events) == -1) {
+				return -1;
+			}
+			relay->events[k] = events;
+		}
+	}
+	return 0;
+}
+
+/* move what both ends have for each other, the relay is closed once both are done or one broke */
+void relay_on_event(Relay *relay) {
+	if (relay_pump(relay, 0) == -1 || relay_pump(relay, 1) == -1) {
+		log_with_errno("[server] relayed chat with '%s' failed", relay->ends[1]->username);
+		metric_inc(relay->ends[0]->worker->metrics, METRIC_ERR_SOCKET);
+		relay_close(relay);
+		return;
+	}
+	if (relay->shut[0] && relay->shut[1]) {
+		log_info("[server] relayed chat with '%s' finished", relay->ends[1]->username);
+		relay_close(relay);
+		return;
+	}
+	if (relay_watch(relay) == -1) {
+		log_with_errno("[server] epoll_ctl failed");
+		relay_close(relay);
+	}
+}
+
+/*
+ * Join conn with the parked connection and answer both with 200; the relay owns both from here
+ * on. What conn sent behind its request is relayed first. Everything is closed on failure.
+ */
+void relay_open(Connection *conn, ParkedConnection *parking) {
+	Worker *worker = conn->worker;
+	char leftover[BUFLEN];
+	Connection *peer = NULL;
+	Relay *relay;
+	size_t len;
+	int k;
+
+	if ((relay = calloc(1, sizeof(Relay))) != NULL) {
+		relay->pipes[0][0] = relay->pipes[0][1] = relay->pipes[1][0] = relay->pipes[1][1] = -1;
+	}
+	if (relay == NULL || pipe2(relay->pipes[0], O_NONBLOCK | O_CLOEXEC) == -1 || pipe2(relay->pipes[1], O_NONBLOCK | O_CLOEXEC) == -1 ||
+	    (peer = connection_open(worker, parking->fd, &parking->addr)) == NULL) {
+		log_with_errno("[server] could not relay a chat with '%s'", parking->username);
+		metric_inc(worker->metrics, METRIC_ERR_RESOURCE);
+		for (k = 0; relay != NULL && k < 2; k++) {
+			close(relay->pipes[k][0]);
+			close(relay->pipes[k][1]);
+		}
+		free(relay);
+		close(parking->fd);
+		free(parking);
+		connection_close(conn);
+		return;
+	}
+	metric_inc(worker->metrics, METRIC_ACCEPTED);
+	metric_inc(worker->metrics, METRIC_RELAYS_OPENED);
+	peer->stream.framing = parking->framing;
+	peer->negotiated = true;
+	strcpy(peer->username, parking->username);
+	free(parking);
+	log_info("[server] relaying a chat with '%s' for '%s:%d'", peer->username, inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+
+	relay->ends[0] = conn;
+	relay->ends[1] = peer;
+	for (k = 0; k < 2; k++) {
+		relay->ends[k]->relay = relay;
+		relay->ends[k]->state = STAGE_RELAY;
+		relay->events[k] = UINT32_MAX;     /* neither is watched the way the relay wants yet */
+		session_enable_keepalive(relay->ends[k]->fd);
+	}
+
+	if ((len = framed_take(&conn->stream, leftover, sizeof(leftover))) > 0) {
+		// the pipe is empty and far larger than the receive ring
+		if (write(relay->pipes[0][1], leftover, len) != (ssize_t) len) {
+			log_with_errno("[server] could not relay a chat with '%s'", peer->username);
+			relay_close(relay);
+			return;
+		}
+		relay->buffered[0] = len;
+	}
+	if (connection_respond_status(peer, STATUS_OK) == -1 || connection_respond_status(conn, STATUS_OK) == -1) {
+		// the relay went with the connection
+		return;
+	}
+	relay_on_event(relay);
+}
+
+/*
+ * PARK: leave the connection with the server until a caller asks for the user with RELAY. The
+ * worker lets go of it once the answers queued before are out, the worker of the caller answers it.
+ */
+int handle_park_request(Connection *conn, const Request *req) {
+	Worker *worker = conn->worker;
+	RegisteredUserView view;
+
+	conn->state = STAGE_CLOSING;
+	if (!relay_enabled) {
+		log_error("[server] relay mode is off, not parking a connection of '%s'", req->username);
+		return connection_respond_status(conn, STATUS_BAD_REQUEST);
+	}
+	if (!peer_lookup(worker, req->username, &view) || view.operation != LISTEN_BYTE) {
+		log_info("[server] user '%s' does not listen, nothing to park for", req->username);
+		return connection_respond_status(conn, STATUS_NOT_FOUND);
+	}
+
+	if ((conn->parking = malloc(sizeof(ParkedConnection))) == NULL) {
+		log_error("[server] out of memory, could not park a connection of '%s'", req->username);
+		metric_inc(worker->metrics, METRIC_ERR_RESOURCE);
+		connection_close(conn);
+		return -1;
+	}
+	conn->parking->framing = conn->stream.framing;
+	conn->parking->addr = conn->addr;
+	strcpy(conn->parking->username, req->username);
+	// a parked connection has no buffers, the answer to HELLO leaves first
+	return connection_flush(conn);
+}
+
+/* park conn, whose output drained; answered with 409 and closed when the user has enough parked */
+int connection_park(Connection *conn) {
+	ParkedConnection *parking = conn->parking;
+
+	conn->parking = NULL;
+	if (park_connection(conn, parking) == -1) {
+		log_info("[server] user '%s' has %d connections parked already", parking->username, RELAY_PARK_MAX);
+		free(parking);
+		if (connection_respond_status(conn, STATUS_CONFLICT) == -1) {
+			return -1;
+		}
+		return connection_flush(conn);
+	}
+	log_debug("[server] parked a connection of '%s' for relaying", parking->username);
+	return -1;
+}
+
+/* RELAY: join the connection with one the peer parked, this worker relays the chat from here on */
+int handle_relay_request(Connection *conn, const Request *req) {
+	ParkedConnection *parking;
+
+	conn->state = STAGE_CLOSING;
+	if (!relay_enabled) {
+		log_error("[server] relay mode is off, not relaying to '%s'", req->username);
+		return connection_respond_status(conn, STATUS_BAD_REQUEST);
+	}
+	if ((parking = unpark_connection(req->username)) == NULL) {
+		log_info("[server] user '%s' has no connection parked to relay to", req->username);
+		return connection_respond_status(conn, STATUS_NOT_FOUND);
+	}
+	relay_open(conn, parking);
+	return -1;
+}
+
+RoomBucket *room_bucket(const char *name) {
+	return &room_buckets[hash_username(name, strlen(name)) & (ROOM_BUCKETS - 1)];
+}
+
+/* the room called name, under the bucket's lock */
+Room *room_find(RoomBucket *bucket, const char *name) {
+	Room *room;
+
+	for (room = bucket->rooms; room != NULL && strcmp(room->name, name) != 0; room = room->next) {}
+	return room;
+}
+
+/* index of the room in conn's outbox, -1 if conn is not a member */
+int outbox_room(const Outbox *outbox, const char *name) {
+	int i;
+
+	for (i = 0; outbox != NULL && i < outbox->rooms_count; i++) {
+		if (strcmp(outbox->rooms[i]->name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* take conn out of the room at index of its outbox, the last member out frees the room */
+void room_remove(Connection *conn, int index) {
+	Outbox *outbox = conn->outbox;
+	Room *room = outbox->rooms[index];
+	RoomBucket *bucket = room_bucket(room->name);
+	Room **link;
+	int i;
+
+	pthread_mutex_lock(&bucket->lock);
+	for (i = 0; i < room->count && room->members[i] != conn; i++) {}
+	room->members[i] = room->members[--room->count];
+	if (room->count == 0) {
+		for (link = &bucket->rooms; *link != room; link = &(*link)->next) {}
+		*link = room->next;
+		free(room->members);
+		free(room);
+	}
+	pthread_mutex_unlock(&bucket->lock);
+	outbox->rooms[index] = outbox->rooms[--outbox->rooms_count];
+}
+
+void room_leave_all(Connection *conn) {
+	while (conn->outbox->rooms_count > 0) {
+		room_remove(conn, conn->outbox->rooms_count - 1);
+	}
+}
+
+/*
+ * Queue message for member, under the bucket lock of the room. A full outbox marks the member as
+ * too slow instead. Returns true when the member's worker has to be woken up for it.
+ */
+bool outbox_queue(Connection *member, RoomMessage *message) {
+	Worker *worker = member->worker;
+	Outbox *outbox = member->outbox;
+	bool wake = false;
+
+	pthread_mutex_lock(&worker->outbox_lock);
+	if (outbox->tail - outbox->head == ROOM_OUTBOX_LEN) {
+		outbox->overflow = true;
+	} else {
+		atomic_fetch_add_explicit(&message->refs, 1, memory_order_relaxed);
+		outbox->queue[outbox->tail & (ROOM_OUTBOX_LEN - 1)] = message;
+		outbox->tail++;
+	}
+	if (!outbox->ready) {
+		wake = worker->outbox_ready == NULL;
+		outbox->ready = true;
+		outbox->next_ready = worker->outbox_ready;
+		worker->outbox_ready = member;
+	}
+	pthread_mutex_unlock(&worker->outbox_lock);
+	return wake;
+}
+
+/*
+ * Write out what other workers, or this one, queued for the worker's room members. Members that
+ * fell ROOM_OUTBOX_LEN messages behind are closed.
+ */
+void worker_deliver(Worker *worker) {
+	Connection *conn;
+
+	while (1) {
+		pthread_mutex_lock(&worker->outbox_lock);
+		if ((conn = worker->outbox_ready) != NULL) {
+			worker->outbox_ready = conn->outbox->next_ready;
+			conn->outbox->ready = false;
+		}
+		pthread_mutex_unlock(&worker->outbox_lock);
+		if (conn == NULL) {
+			return;
+		}
+
+		if (conn->outbox->overflow) {
+			log_error("[server] member '%s' fell %d messages behind its rooms, closing connection", conn->username, ROOM_OUTBOX_LEN);
+			metric_inc(worker->metrics, METRIC_ROOM_SLOW_CLOSED);
+			connection_close(conn);
+		} else if (!conn->held && !conn->want_write) {
+			connection_flush(conn);
+		}
+	}
+}
+
+/* JOIN: make the connection a member of the room, which is opened by its first member */
+int handle_join_request(Connection *conn, const Request *req) {
+	RoomBucket *bucket = room_bucket(req->room);
+	Connection **members;
+	Room *room;
+	int capacity;
+
+	if (conn->outbox == NULL && (conn->outbox = calloc(1, sizeof(Outbox))) == NULL) {
+		log_error("[server] out of memory, could not join room '%s'", req->room);
+		metric_inc(conn->worker->metrics, METRIC_ERR_RESOURCE);
+		connection_close(conn);
+		return -1;
+	}
+	if (conn->state != STAGE_ROOM) {
+		// the connection stays open for the rooms from here on, left to the TCP keepalive like a session
+		conn->state = STAGE_ROOM;
+		if (!conn->session) {
+			session_enable_keepalive(conn->fd);
+		}
+	}
+	if (outbox_room(conn->outbox, req->room) != -1) {
+		log_info("[server] user '%s' is in room '%s' already", conn->username, req->room);
+		return connection_respond_status(conn, STATUS_CONFLICT);
+	}
+	if (conn->outbox->rooms_count == ROOM_JOINED_MAX) {
+		log_info("[server] user '%s' is in %d rooms already", conn->username, ROOM_JOINED_MAX);
+		return connection_respond_status(conn, STATUS_CONFLICT);
+	}
+
+	pthread_mutex_lock(&bucket->lock);
+	if ((room = room_find(bucket, req->room)) == NULL && (room = calloc(1, sizeof(Room))) != NULL) {
+		strcpy(room->name, req->room);
+		room->next = bucket->rooms;
+		bucket->rooms = room;
+	}
+	if (room != NULL && room->count == room->capacity) {
+		capacity = room->capacity ? room->capacity * 2 : 8;
+		if ((members = realloc(room->members, (size_t) capacity * sizeof(Connection *))) != NULL) {
+			room->members = members;
+			room->capacity = capacity;
+		}
+	}
+	if (room == NULL || room->count == room->capacity) {
+		pthread_mutex_unlock(&bucket->lock);
+		log_error("[server] out of memory, could not join room '%s'", req->room);
+		metric_inc(conn->worker->metrics, METRIC_ERR_RESOURCE);
+		connection_close(conn);
+		return -1;
+	}
+	room->members[room->count++] = conn;
+	pthread_mutex_unlock(&bucket->lock);
+	conn->outbox->rooms[conn->outbox->rooms_count++] = room;
+
+	log_info("[server] user '%s' joined room '%s'", conn->username, req->room);
+	return connection_respond_status(conn, STATUS_OK);
+}
+
+/* LEAVE: the connection stays open for other rooms */
+int handle_leave_request(Connection *conn, const Request *req) {
+	int index;
+
+	if ((index = outbox_room(conn->outbox, req->room)) == -1) {
+		log_info("[server] user '%s' is not in room '%s'", conn->username, req->room);
+		return connection_respond_status(conn, STATUS_NOT_FOUND);
+	}
+	room_remove(conn, index);
+	log_info("[server] user '%s' left room '%s'", conn->username, req->room);
+	return connection_respond_status(conn, STATUS_OK);
+}
+
+/*
+ * PUBLISH: encode the message once and queue a reference to it for every other member. Members of
+ * this worker are written to at the end of the event loop round, the other workers are woken up
+ * once for all of theirs. Either way the messages published meanwhile leave in the same write.
+ */
+int handle_publish_request(Connection *conn, const Request *req) {
+	char frame[FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD];
+	bool wake[MAX_WORKERS] = {false};
+	Worker *worker = conn->worker;
+	RoomMessage *message;
+	RoomBucket *bucket;
+	Room *room;
+	uint64_t one = 1;
+	uint64_t delivered = 0;
+	size_t len;
+	int index;
+	int i;
+
+	if ((index = outbox_room(conn->outbox, req->room)) == -1) {
+		log_info("[server] user '%s' is not in room '%s'", conn->username, req->room);
+		return connection_respond_status(conn, STATUS_NOT_FOUND);
+	}
+	if ((len = frame_encode_publish(frame, req->room, conn->username, req->text, req->text_len)) == 0) {
+		log_error("[server] message of '%s' to room '%s' does not fit a frame", conn->username, req->room);
+		return connection_respond_status(conn, STATUS_BAD_REQUEST);
+	}
+	if ((message = malloc(sizeof(RoomMessage) + len)) == NULL) {
+		log_error("[server] out of memory, dropping a message to room '%s'", req->room);
+		metric_inc(worker->metrics, METRIC_ERR_RESOURCE);
+		return 0;
+	}
+	atomic_init(&message->refs, 1);
+	message->len = len;
+	memcpy(message->data, frame, len);
+
+	room = conn->outbox->rooms[index];
+	bucket = room_bucket(room->name);
+	pthread_mutex_lock(&bucket->lock);
+	for (i = 0; i < room->count; i++) {
+		if (room->members[i] != conn) {
+			wake[room->members[i]->worker->id] |= outbox_queue(room->members[i], message);
+			delivered++;
+		}
+	}
+	pthread_mutex_unlock(&bucket->lock);
+	room_message_put(message);
+	metric_add(worker->metrics, METRIC_ROOM_DELIVERIES, delivered);
+	log_debug("[server] message of '%s' queued for %" PRIu64 " members of room '%s'", conn->username, delivered, req->room);
+
+	for (i = 0; i < workers_count; i++) {
+		if (wake[i] && i != worker->id && write(workers[i].wake_fd, &one, sizeof(one)) == -1) {
+			log_with_errno("[server] waking worker failed");
+		}
+	}
+	worker->deliver |= wake[worker->id];
+	return 0;
+}
+
+/* dump the metrics for SIGUSR1, to metrics_path when given so scrapers never see a partial file */
+void dump_metrics(void) {
+	char tmp_path[PATH_MAX];
+	uint64_t registered_users;
+	uint64_t parked_conns;
+	FILE *out = stdout;
+
+	registered_users = registry_count();
+	parked_conns = parked_connections();
+
+	if (metrics_path != NULL) {
+		snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics_path);
+		if ((out = fopen(tmp_path, "w")) == NULL) {
+			log_with_errno("[server] could not open '%s' for the metrics dump", tmp_path);
+			return;
+		}
+	}
+	if (metrics_write_prometheus(out, worker_metrics, workers_count, parked_conns, registered_users) == -1) {
+		log_error("[server] writing the metrics dump failed");
+	}
+	if (metrics_path == NULL) {
+		fflush(stdout);
+		return;
+	}
+	if (fclose(out) != 0 || rename(tmp_path, metrics_path) == -1) {
+		log_with_errno("[server] could not write the metrics dump to '%s'", metrics_path);
+		return;
+	}
+	log_info("[server] metrics written to '%s'", metrics_path);
+}
+
+/*
+ * Write the registry to snapshot_path in process, for the exit once the workers are gone; SIGUSR2
+ * goes through compact_registry(). The log continues in a new segment and the ones before are
+ * deleted.
+ */
+void checkpoint_registry(void) {
+	uint64_t start = metrics_now_ns();
+	uint64_t segment = recovered_sequence + 1;
+	size_t users;
+	int result = -1;
+
+	pthread_mutex_lock(&checkpoint_lock);
+	users = registry_count();
+	shared_registry_lock_all(registry);
+	if (wal == NULL || (segment = wal_rotate(wal)) != 0) {
+		result = registry_snapshot_write(registry, snapshot, segment - 1, snapshot_path);
+	}
+	shared_registry_unlock_all(registry);
+
+	if (result == -1) {
+		log_with_errno("[server] could not checkpoint the registry to '%s'", snapshot_path);
+	} else {
+		wal_compacted(snapshot_path, segment);
+		log_info("[server] checkpointed %zu users to '%s' in %.1f ms", users, snapshot_path, (metrics_now_ns() - start) / 1e6);
+	}
+	pthread_mutex_unlock(&checkpoint_lock);
+}
+
+/*
+ * Compaction, and checkpoints on SIGUSR2: write a new snapshot without stalling the workers. The
+ * registry is copied by fork() while every shard is locked, the child writes the snapshot from its
+ * copy and the log segments it covers are deleted once it succeeded.
+ */
+void compact_registry(void) {
+	uint64_t start = metrics_now_ns();
+	uint64_t segment = recovered_sequence + 1;
+	size_t users;
+	int status;
+	pid_t pid;
+
+	pthread_mutex_lock(&checkpoint_lock);
+	users = registry_count();
+	shared_registry_lock_all(registry);
+	if (wal != NULL && (segment = wal_rotate(wal)) == 0) {
+		shared_registry_unlock_all(registry);
+		pthread_mutex_unlock(&checkpoint_lock);
+		log_with_errno("[server] could not start a new log segment for the compaction");
+		return;
+	}
+	if ((pid = fork()) == 0) {
+		// the child has one thread and copies of the others' locks in whatever state they were in: it
+		// only runs the snapshot writer, which allocates nothing and takes no lock (the shard locks
+		// held for the fork are never taken again), and it must not log or touch stdio
+		_exit(registry_snapshot_write(registry, snapshot, segment - 1, snapshot_path) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	shared_registry_unlock_all(registry);
+
+	if (pid == -1) {
+		log_with_errno("[server] fork for the compaction failed");
+	} else if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		log_error("[server] compaction into '%s' failed, the log is kept", snapshot_path);
+	} else {
+		wal_compacted(snapshot_path, segment);
+		log_info("[server] compacted the registry into a snapshot of %zu users at '%s' in %.1f ms", users, snapshot_path,
+		         (metrics_now_ns() - start) / 1e6);
+	}
+	pthread_mutex_unlock(&checkpoint_lock);
+}
+
+/* compactions run on a thread of their own, the log writer and SIGUSR2 only ask for them */
+void *compaction_loop(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&compaction_lock);
+	while (!atomic_load(&stopping)) {
+		if (!compaction_asked) {
+			pthread_cond_wait(&compaction_wake, &compaction_lock);
+			continue;
+		}
+		compaction_asked = false;
+		pthread_mutex_unlock(&compaction_lock);
+		compact_registry();
+		pthread_mutex_lock(&compaction_lock);
+	}
+	pthread_mutex_unlock(&compaction_lock);
+	return NULL;
+}
+
+void request_compaction(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&compaction_lock);
+	compaction_asked = true;
+	pthread_cond_signal(&compaction_wake);
+	pthread_mutex_unlock(&compaction_lock);
+}
+
+/* the log writer made more records durable, let the workers release the answers waiting for them */
+void wake_workers(void *arg) {
+	uint64_t one = 1;
+	int i;
+
+	(void) arg;
+	for (i = 0; i < workers_count; i++) {
+		if (write(workers[i].wake_fd, &one, sizeof(one)) == -1) {
+			log_with_errno("[server] waking worker failed");
+		}
+	}
+}
+
+/* send the held answers whose records are durable, or drop the connections if the log failed */
+void release_held(Worker *worker) {
+	Connection *conn = worker->held;
+	Connection *next;
+	int error = atomic_load(&wal->error);
+
+	while (conn != NULL) {
+		next = conn->held_next;
+		if (error != 0) {
+			log_error("[server] write-ahead log failed (%s), closing connection", strerror(error));
+			metric_inc(worker->metrics, METRIC_ERR_RESOURCE);
+			connection_close(conn);
+		} else if (wal_is_durable(wal, conn->wal_sequence)) {
+			connection_unhold(conn);
+			connection_flush(conn);
+		}
+		conn = next;
+	}
+}
+
+/* replay the log written since the snapshot and open it for appending */
+int recover_registry(void) {
+	uint64_t start = metrics_now_ns();
+	uint64_t after = snapshot != NULL ? snapshot->header->wal_sequence : 0;
+	size_t bytes;
+
+	if (wal_replay(snapshot_path, after, registry, snapshot, &recovered_sequence, &bytes) == -1) {
+		log_with_errno("[server] could not read the write-ahead log of '%s'", snapshot_path);
+		return -1;
+	}
+	if (recovered_sequence > after) {
+		log_info("[server] replayed %zu log records (%zu bytes) in %.1f ms",
+		         (size_t) (recovered_sequence - after), bytes, (metrics_now_ns() - start) / 1e6);
+	}
+	if (wal_policy == -1) {
+		return 0;
+	}
+	wal = wal_open(snapshot_path, recovered_sequence + 1, wal_policy, bytes, WAL_COMPACT_BYTES,
+	               wal_policy == WAL_SYNC_ALWAYS ? wake_workers : NULL, request_compaction, NULL);
+	if (wal == NULL) {
+		log_with_errno("[server] could not open the write-ahead log of '%s'", snapshot_path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Map the checkpoint at snapshot_path, lookups are answered from it as soon as this returns.
+ * Returns the users it holds, 0 when there is no usable snapshot.
+ */
+size_t open_snapshot(void) {
+	uint64_t start = metrics_now_ns();
+
+	if ((snapshot = registry_snapshot_open(snapshot_path)) == NULL) {
+		if (errno == ENOENT) {
+			log_info("[server] no registry snapshot at '%s', starting empty", snapshot_path);
+		} else if (errno == EINVAL) {
+			log_error("[server] '%s' is not a registry snapshot of this version, starting empty", snapshot_path);
+		} else {
+			log_with_errno("[server] could not map the registry snapshot '%s'", snapshot_path);
+		}
+		return 0;
+	}
+	log_info("[server] mapped %zu users from '%s' in %.3f ms", atomic_load(&snapshot->remaining), snapshot_path, (metrics_now_ns() - start) / 1e6);
+	return atomic_load(&snapshot->remaining);
+}
+
+/* move the remaining snapshot users into the registry a batch at a time, then unmap the file */
+void *restore_snapshot(void *arg) {
+	uint64_t start = metrics_now_ns();
+	size_t left = SIZE_MAX;
+	size_t before;
+
+	(void) arg;
+	while (left > 0 && !atomic_load_explicit(&stopping, memory_order_relaxed)) {
+		shared_registry_lock_all(registry);
+		if (snapshot == NULL) {
+			shared_registry_unlock_all(registry);
+			return NULL;
+		}
+		before = atomic_load(&snapshot->remaining);
+		left = registry_snapshot_restore(snapshot, registry, SNAPSHOT_RESTORE_BATCH);
+		if (left == 0) {
+			registry_snapshot_close(snapshot);
+			snapshot = NULL;
+		}
+		shared_registry_unlock_all(registry);
+
+		if (left > 0 && left == before) {
+			log_error("[server] out of memory restoring the registry, %zu users are served from the snapshot", left);
+			return NULL;
+		}
+		sched_yield();
+	}
+	if (left == 0) {
+		log_info("[server] registry restored from the snapshot in %.1f ms", (metrics_now_ns() - start) / 1e6);
+	}
+	return NULL;
+}
+
+/*
+ * Parse an ASCII message: "R<username>", "U<username>", "H<username>", "P<username>", "X<username>",
+ * "C <username>", "L <ip> <port>" or "S".
+ * Returns -1 when the message is malformed.
+ */
+int parse_ascii_request(char *plaintext, size_t len, Request *req) {
+	int i = 0;
+	char *token = NULL;
+	char *saveptr = NULL;
+
+	memset(req, 0, sizeof(Request));
+	req->operation = plaintext[0];
+	req->port = -1;
+
+	switch (plaintext[0]) {
+		case REGISTER_BYTE:
+		case UNREGISTER_BYTE:
+		case HEARTBEAT_BYTE:
+		case PARK_BYTE:
+		case RELAY_BYTE:
+			if (len - 2 > USERNAME_MAX_LEN) {
+				return -1;
+			}
+			strcpy(req->username, plaintext + 1);
+			return 0;
+		case CONNECT_BYTE:
+			if (len < 3) {
+				return -1;
+			}
+			token = strtok_r(&plaintext[2], " ", &saveptr);
+			if (token == NULL || strlen(token) > USERNAME_MAX_LEN) {
+				return -1;
+			}
+			strcpy(req->username, token);
+			return 0;
+		case LISTEN_BYTE:
+			if (len < 3) {
+				return -1;
+			}
+			token = strtok_r(&plaintext[2], " ", &saveptr);
+			while (token) {
+				if (i == 0) {
+					if (inet_pton(AF_INET, token, &req->ip_addr) != 1) {
+						return -1;
+					}
+				} else if (i == 1) {
+					req->port = (int) strtol(token, NULL, 10);
+				}
+				token = strtok_r(NULL, " ", &saveptr);
+				i++;
+			}
+			return i >= 2 ? 0 : -1;
+		case STATS_BYTE:
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+int parse_binary_request(const Frame *frame, Request *req) {
+	uint16_t port;
+	RoomPost post;
+
+	memset(req, 0, sizeof(Request));
+	req->port = -1;
+
+	switch (frame->opcode) {
+		case OP_REGISTER:
+		case OP_UNREGISTER:
+		case OP_CONNECT:
+			if (frame->length > USERNAME_MAX_LEN || memchr(frame->payload, '\0', frame->length) != NULL) {
+				return -1;
+			}
+			req->operation = frame->opcode == OP_REGISTER ? REGISTER_BYTE : frame->opcode == OP_UNREGISTER ? UNREGISTER_BYTE : CONNECT_BYTE;
+			memcpy(req->username, frame->payload, frame->length);
+			return 0;
+		case OP_LISTEN:
+			req->operation = LISTEN_BYTE;
+			if (frame_decode_listen(frame, &req->ip_addr, &port) == -1) {
+				return -1;
+			}
+			req->port = port;
+			return 0;
+		case OP_STATS:
+			req->operation = STATS_BYTE;
+			return 0;
+		case OP_HEARTBEAT:
+		case OP_PARK:
+		case OP_RELAY:
+			if (frame->length == 0 || frame->length > USERNAME_MAX_LEN || memchr(frame->payload, '\0', frame->length) != NULL) {
+				return -1;
+			}
+			req->operation = frame->opcode == OP_HEARTBEAT ? HEARTBEAT_BYTE : frame->opcode == OP_PARK ? PARK_BYTE : RELAY_BYTE;
+			memcpy(req->username, frame->payload, frame->length);
+			return 0;
+		case OP_JOIN:
+		case OP_LEAVE:
+			if (frame->length == 0 || frame->length > ROOM_NAME_MAX_LEN || memchr(frame->payload, '\0', frame->length) != NULL) {
+				return -1;
+			}
+			req->operation = frame->opcode == OP_JOIN ? JOIN_BYTE : LEAVE_BYTE;
+			memcpy(req->room, frame->payload, frame->length);
+			return 0;
+		case OP_PUBLISH:
+			if (frame_decode_publish(frame, &post) == -1 || post.room_len == 0 || post.room_len > ROOM_NAME_MAX_LEN ||
+			    memchr(post.room, '\0', post.room_len) != NULL) {
+				return -1;
+			}
+			req->operation = PUBLISH_BYTE;
+			memcpy(req->room, post.room, post.room_len);
+			req->text = post.text;
+			req->text_len = post.text_len;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+void count_request(Worker *worker, char operation) {
+	switch (operation) {
+		case REGISTER_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_REGISTER);
+			break;
+		case UNREGISTER_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_UNREGISTER);
+			break;
+		case LISTEN_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_LISTEN);
+			break;
+		case CONNECT_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_CONNECT);
+			break;
+		case STATS_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_STATS);
+			break;
+		case HEARTBEAT_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_HEARTBEAT);
+			break;
+		case PARK_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_PARK);
+			break;
+		case RELAY_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_RELAY);
+			break;
+		case JOIN_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_JOIN);
+			break;
+		case LEAVE_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_LEAVE);
+			break;
+		case PUBLISH_BYTE:
+			metric_inc(worker->metrics, METRIC_REQ_PUBLISH);
+			break;
+		default:
+			break;
+	}
+}
+
+/* route a request to the handler of the connection's current stage */
+int connection_dispatch(Connection *conn, const Request *req) {
+	Worker *worker = conn->worker;      /* conn is gone if a handler closes it */
+	uint64_t start = metrics_now_ns();
+	int ret;
+
+	count_request(worker, req->operation);
+
+	// STATS is a control request, taken instead of the first request or on a session
+	if (req->operation == STATS_BYTE && (conn->state == STAGE_REGISTER || conn->state == STAGE_SESSION || conn->state == STAGE_ROOM)) {
+		return handle_stats_request(conn);
+	}
+
+	// so is HEARTBEAT, the lease belongs to a registration made on an earlier connection
+	if (req->operation == HEARTBEAT_BYTE && (conn->state == STAGE_REGISTER || conn->state == STAGE_SESSION || conn->state == STAGE_ROOM)) {
+		return handle_heartbeat_request(conn, req);
+	}
+
+	// rooms are for registered users of the binary protocol, JOIN takes the place of LISTEN/CONNECT or follows them on a session
+	if (req->operation == JOIN_BYTE && conn->stream.framing == FRAMING_BINARY && (conn->state == STAGE_OPERATION || conn->state == STAGE_SESSION || conn->state == STAGE_ROOM)) {
+		return handle_join_request(conn, req);
+	}
+	if (req->operation == LEAVE_BYTE && conn->stream.framing == FRAMING_BINARY && conn->state == STAGE_ROOM) {
+		return handle_leave_request(conn, req);
+	}
+	if (req->operation == PUBLISH_BYTE && conn->stream.framing == FRAMING_BINARY && conn->state == STAGE_ROOM) {
+		return handle_publish_request(conn, req);
+	}
+
+	// PARK and RELAY take the place of the first request, the connection carries a chat afterwards
+	if (req->operation == PARK_BYTE && conn->state == STAGE_REGISTER) {
+		return handle_park_request(conn, req);
+	}
+	if (req->operation == RELAY_BYTE && conn->state == STAGE_REGISTER) {
+		return handle_relay_request(conn, req);
+	}
+
+	if (conn->state == STAGE_REGISTER) {
+		if (req->operation != REGISTER_BYTE && req->operation != UNREGISTER_BYTE) {
+			log_error("[server] wrong initial byte %c --> should be one of [%c, %c]", req->operation, REGISTER_BYTE, UNREGISTER_BYTE);
+			log_error("[server] closing connection");
+			metric_inc(conn->worker->metrics, METRIC_ERR_PROTOCOL);
+			connection_close(conn);
+			return -1;
+		}
+		ret = handle_register_request(conn, req);
+		latency_record_since(worker->metrics, LATENCY_REGISTER, start);
+		return ret;
+	}
+
+	if (conn->state == STAGE_SESSION || conn->state == STAGE_ROOM) {
+		if (req->operation != UNREGISTER_BYTE) {
+			log_error("[server] wrong session byte '%c' --> should be %c", req->operation, UNREGISTER_BYTE);
+			log_error("[server] closing connection");
+			metric_inc(conn->worker->metrics, METRIC_ERR_PROTOCOL);
+			connection_close(conn);
+			return -1;
+		}
+		return handle_register_request(conn, req);
+	}
+
+	if (req->operation != CONNECT_BYTE && req->operation != LISTEN_BYTE) {
+		log_error("[server] wrong initial byte '%c' --> should be one of [%c, %c]", req->operation, CONNECT_BYTE, LISTEN_BYTE);
+		log_error("[server] closing connection");
+		metric_inc(conn->worker->metrics, METRIC_ERR_PROTOCOL);
+		connection_close(conn);
+		return -1;
+	}
+	ret = handle_operation_request(conn, req);
+	latency_record_since(worker->metrics, LATENCY_OPERATION, start);
+	return ret;
+}
+
+/* handle one ASCII message. Returns 0, or -1 if the connection was closed or handed over */
+int connection_handle_ascii(Connection *conn, const FramedMessage *message) {
+	char plaintext[BUFLEN];
+	size_t len = message->len;
+	Request req;
+
+	// the parser tokenizes in place, so work on a copy of the message
+	memcpy(plaintext, message->data, len);
+
+	if (conn->state == STAGE_REGISTER) {
+		log_info("[server] Initial message from client: '%s'", plaintext);
+	} else {
+		log_info("[server] operation message from client: '%s'", plaintext);
+	}
+
+	if (parse_ascii_request(plaintext, len, &req) == -1) {
+		if (plaintext[0] != REGISTER_BYTE && plaintext[0] != UNREGISTER_BYTE && plaintext[0] != HEARTBEAT_BYTE &&
+		    plaintext[0] != PARK_BYTE && plaintext[0] != RELAY_BYTE && plaintext[0] != CONNECT_BYTE && plaintext[0] != LISTEN_BYTE) {
+			// unknown operations are rejected by the dispatcher like before
+			return connection_dispatch(conn, &req);
+		}
+		log_error("[server] malformed message from client");
+		metric_inc(conn->worker->metrics, METRIC_ERR_PROTOCOL);
+		conn->state = STAGE_CLOSING;
+		return connection_respond_status(conn, STATUS_BAD_REQUEST);
+	}
+	return connection_dispatch(conn, &req);
+}
+
+/* handle one binary frame. Returns 0, or -1 if the connection was closed or handed over */
+int connection_handle_frame(Connection *conn, const FramedMessage *message) {
+	const Frame frame = message->frame;
+	Request req;
+	uint8_t version;
+	uint8_t flags;
+	char reply[FRAME_HEADER_LEN + 1];
+
+	if (frame.length > FRAME_MAX_PAYLOAD) {
+		log_error("[server] frame of %u bytes exceeds %d bytes, closing connection", frame.length, FRAME_MAX_PAYLOAD);
+		metric_inc(conn->worker->metrics, METRIC_ERR_PROTOCOL);
+		connection_close(conn);
+		return -1;
+	}
+
+	if (!conn->negotiated) {
+		if (frame.opcode != OP_HELLO || frame.length < 1 || frame.payload[0] == 0) {
+			log_error("[server] binary client did not start with a valid HELLO, closing connection");
+			metric_inc(conn->worker->metrics, METRIC_ERR_PROTOCOL);
+			connection_close(conn);
+			return -1;
+		}
+		version = frame.payload[0] < PROTOCOL_VERSION ? frame.payload[0] : PROTOCOL_VERSION;
+		flags = frame.flags & HELLO_FLAG_SESSION;
+		conn->negotiated = true;
+		metric_inc(conn->worker->metrics, METRIC_REQ_HELLO);
+		conn->session = flags & HELLO_FLAG_SESSION;
+		log_debug("[server] client speaks binary protocol version %u, using version %u%s", frame.payload[0], version, conn->session ? " in session mode" : "");
+		if (conn->session) {
+			session_enable_keepalive(conn->fd);
+		}
+		return connection_queue(conn, reply, frame_encode_hello(reply, version, flags));
+	}
+	if (frame.opcode == OP_PING && conn->session) {
+		metric_inc(conn->worker->metrics, METRIC_REQ_PING);
+		return connection_queue(conn, reply, frame_encode(reply, OP_PONG, 0, NULL, 0));
+	}
+	if (parse_binary_request(&frame, &req) == -1) {
+		log_error("[server] malformed frame (opcode 0x%02x) from client", frame.opcode);
+		metric_inc(conn->worker->metrics, METRIC_ERR_PROTOCOL);
+		conn->state = STAGE_CLOSING;
+		return connection_respond_status(conn, STATUS_BAD_REQUEST);
+	}
+	log_info("[server] %s message from client: '%c'", conn->state == STAGE_REGISTER ? "Initial" : "operation", req.operation);
+	return connection_dispatch(conn, &req);
+}
+
+/* account for n bytes that arrived on conn */
+void connection_received(Connection *conn, size_t n) {
+	metric_add(conn->worker->metrics, METRIC_RX_BYTES, (uint64_t) n);
+	conn->active_at = conn->worker->timers.now;
+	if (!conn->received) {
+		conn->received = true;
+		latency_record_since(conn->worker->metrics, LATENCY_FIRST_BYTE, conn->accepted_ns);
+	}
+}
+
+/* the peer closed the connection */
+void connection_on_eof(Connection *conn) {
+	if (conn->state == STAGE_REGISTER) {
+		log_error("[server] connection terminated before receiving init message");
+	} else if (conn->state == STAGE_OPERATION) {
+		log_error("[server] connection terminated before receiving operation message");
+	} else if (conn->state == STAGE_SESSION) {
+		log_info("[server] session closed by client");
+	}
+	connection_close(conn);
+}
+
+/*
+ * Run every complete message received so far through the connection's state machine. Pipelined
+ * requests are all handled at once and their responses leave in a single write. Partial messages
+ * stay in the stream until the rest arrives. Returns -1 if the connection was closed or handed
+ * over.
+ */
+int connection_process(Connection *conn) {
+	FramedMessage message;
+	int ret;
+
+	while (conn->state != STAGE_CLOSING) {
+		if ((ret = framed_next(&conn->stream, &message)) == 0) {
+			break;
+		}
+		if (ret == -1) {
+			log_error("[server] message exceeds %d bytes, closing connection", BUFLEN);
+			metric_inc(conn->worker->metrics, METRIC_ERR_PROTOCOL);
+			connection_close(conn);
+			return -1;
+		}
+		ret = conn->stream.framing == FRAMING_BINARY ? connection_handle_frame(conn, &message) : connection_handle_ascii(conn, &message);
+		if (ret == -1) {
+			return -1;
+		}
+	}
+
+	if (framed_pending_output(&conn->stream) > 0) {
+		if (wal != NULL && !wal_is_durable(wal, conn->wal_sequence)) {
+			connection_hold(conn);
+		} else if (!conn->held) {
+			return connection_flush(conn);
+		}
+	}
+	return 0;
+}
+
+/* read what the socket has and process it */
+void connection_on_readable(Connection *conn) {
+	ssize_t n;
+
+	n = framed_read(&conn->stream);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return;
+		}
+		if (errno == EMSGSIZE) {
+			log_error("[server] message exceeds %d bytes, closing connection", BUFLEN);
+			metric_inc(conn->worker->metrics, METRIC_ERR_PROTOCOL);
+		} else {
+			log_with_errno("[server] socket error receiving message");
+			metric_inc(conn->worker->metrics, METRIC_ERR_SOCKET);
+		}
+		connection_close(conn);
+		return;
+	}
+	if (n == 0) {
+		connection_on_eof(conn);
+		return;
+	}
+	connection_received(conn, (size_t) n);
+	connection_process(conn);
+}
+
+void accept_connections(Worker *worker) {
+	int connection_fd;
+	struct sockaddr_in client_addr;     /* client socket address    */
+	socklen_t client_addr_len;          /* client address length    */
+	Connection *conn;
+
+	while (1) {
+		memset(&client_addr, 0, sizeof(struct sockaddr_in));
+		client_addr_len = sizeof(client_addr);
+		if ((connection_fd = accept4(worker->listen_fd, (struct sockaddr *) &client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			log_with_errno("[server] Socket accept failed");
+			return;
+		}
+		metric_inc(worker->metrics, METRIC_ACCEPTED);
+
+		log_info("[server] client connected from '%s:%d'", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+
+		if ((conn = connection_open(worker, connection_fd, &client_addr)) == NULL) {
+			log_error("[server] out of memory, dropping connection");
+			metric_inc(worker->metrics, METRIC_ERR_RESOURCE);
+			metric_inc(worker->metrics, METRIC_CLOSED);
+			close(connection_fd);
+			continue;
+		}
+
+		// the listening socket defers accept until data arrives, so the requests are usually
+		// already here: handle them right away and only involve epoll if the connection stays
+		connection_on_readable(conn);
+		if (worker->connections[connection_fd] != conn || conn->watched) {
+			continue;
+		}
+		if (connection_watch(conn, EPOLLIN | EPOLLRDHUP) == -1) {
+			log_with_errno("[server] epoll_ctl failed");
+			connection_close(conn);
+			continue;
+		}
+		if (conn->state == STAGE_REGISTER) {
+			log_debug("[server] Waiting for client to send init message");
+		}
+	}
+}
+
+/* a relayed chat holds six descriptors, so relaying takes as many as the hard limit allows */
+void raise_descriptor_limit(void) {
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+		log_with_errno("[server] getrlimit failed");
+		return;
+	}
+	if (limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+			log_with_errno("[server] raising the descriptor limit failed");
+			return;
+		}
+	}
+	log_info("[server] relaying chats, up to %llu descriptors open", (unsigned long long) limit.rlim_cur);
+}
+
+/* ask every worker to leave its event loop */
+void stop_workers(void) {
+	uint64_t one = 1;
+	int i;
+
+	atomic_store(&stopping, true);
+	for (i = 0; i < workers_count; i++) {
+		if (write(workers[i].wake_fd, &one, sizeof(one)) == -1) {
+			log_with_errno("[server] waking worker failed");
+		}
+	}
+}
+
+int open_listen_socket(const struct sockaddr_in *server_addr) {
+	int server_fd;
+	int optval = 1;                     /* socket options	        */
+	int defer_secs = 1;                 /* TCP_DEFER_ACCEPT timeout */
+
+	// socket init
+	if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_IP)) == -1) {
+		log_with_errno("[server] socket call failed");
+		return -1;
+	}
+
+	// set socket options like "ERROR on binding: Address already in use"
+	if ((setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (char *) &optval, sizeof(optval))) < 0) {
+		close(server_fd);
+		log_with_errno("[server] Socket setsockopt failed");
+		return -1;
+	}
+
+	// every worker binds its own socket to the same port and the kernel balances between them
+	if ((setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, (char *) &optval, sizeof(optval))) < 0) {
+		close(server_fd);
+		log_with_errno("[server] Socket setsockopt failed");
+		return -1;
+	}
+
+	// clients always speak first, so only wake up once the first request has arrived
+	if ((setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (char *) &defer_secs, sizeof(defer_secs))) < 0) {
+		log_with_errno("[server] Socket setsockopt TCP_DEFER_ACCEPT failed");
+	}
+
+	//bind the socket
+	if (bind(server_fd, (struct sockaddr *) server_addr, sizeof(*server_addr)) == -1) {
+		close(server_fd);
+		log_with_errno("[server] Socket bind failed");
+		return -1;
+	}
+
+	//listen for connections on socket
+	if (listen(server_fd, SOMAXCONN)) {
+		close(server_fd);
+		log_with_errno("[server] Socket listen failed");
+		return -1;
+	}
+
+	return server_fd;
+}
+
+/* the loop condition picks up a stop request, anything else is the log's progress or room messages */
+void worker_on_wake(Worker *worker) {
+	uint64_t wakeups;
+
+	if (read(worker->wake_fd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN) {
+		log_with_errno("[server] reading the wake descriptor failed");
+	}
+	if (wal != NULL) {
+		release_held(worker);
+	}
+	worker_deliver(worker);
+}
+
+void worker_on_signal(Worker *worker) {
+	struct signalfd_siginfo info;
+
+	if (read(worker->signal_fd, &info, sizeof(info)) != sizeof(info)) {
+		return;
+	}
+	if (info.ssi_signo == SIGUSR1) {
+		dump_metrics();
+	} else if (info.ssi_signo == SIGUSR2) {
+		if (snapshot_path != NULL) {
+			request_compaction(NULL);
+		}
+	} else {
+		log_info("[server] SIGINT handler called");
+		stop_workers();
+	}
+}
+
+/*
+ * io_uring backend. Instead of waiting for readiness and making the calls itself, the worker
+ * keeps requests in the ring and gets their results: one multishot accept for the listening
+ * socket, one receive per connection that takes a buffer of the worker's group only once data
+ * arrived, and sends that go out from the connection's tx ring. Submitting and waiting are a
+ * single io_uring_enter per loop iteration. The connection is in the user_data of its requests;
+ * once closed it stays allocated until the last of them completed.
+ */
+static inline uint64_t uring_tag(Connection *conn, enum uring_request request) {
+	return (uint64_t) (uintptr_t) conn | request;
+}
+
+/* a submission entry, submitting what is prepared when the queue is full */
+struct io_uring_sqe *uring_sqe(Worker *worker) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(&worker->ring)) == NULL) {
+		if (uring_submit_and_wait(&worker->ring, 0, 0) == -1) {
+			log_with_errno("[server] io_uring submission failed");
+			return NULL;
+		}
+		if ((sqe = uring_get_sqe(&worker->ring)) == NULL) {
+			log_error("[server] io_uring submission queue full");
+		}
+	}
+	return sqe;
+}
+
+int uring_arm_accept(Worker *worker) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(worker)) == NULL) {
+		return -1;
+	}
+	uring_prep_accept_multishot(sqe, worker->listen_fd, SOCK_NONBLOCK | SOCK_CLOEXEC, URING_ACCEPT);
+	return 0;
+}
+
+int uring_arm_poll(Worker *worker, int fd, enum uring_request request) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(worker)) == NULL) {
+		return -1;
+	}
+	uring_prep_poll_multishot(sqe, fd, POLLIN, request);
+	return 0;
+}
+
+int uring_recv(Connection *conn) {
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(conn->worker)) == NULL) {
+		return -1;
+	}
+	uring_prep_recv_select(sqe, conn->fd, conn->worker->buffers.group, uring_tag(conn, URING_RECV));
+	conn->receiving = true;
+	conn->inflight++;
+	return 0;
+}
+
+/*
+ * Close the descriptor through the ring and cancel the receive still waiting on it. conn is
+ * released right away but only freed with the last completion that refers to it.
+ */
+void uring_close(Connection *conn) {
+	Worker *worker = conn->worker;
+	struct io_uring_sqe *sqe;
+
+	if (conn->closed) {
+		return;
+	}
+	connection_release(conn);
+	conn->closed = true;
+	if (conn->receiving && (sqe = uring_sqe(worker)) != NULL) {
+		uring_prep_cancel(sqe, uring_tag(conn, URING_RECV), uring_tag(conn, URING_CANCEL));
+		conn->inflight++;
+	}
+	if ((sqe = uring_sqe(worker)) == NULL) {
+		close(conn->fd);
+		return;
+	}
+	uring_prep_close(sqe, conn->fd, uring_tag(conn, URING_CLOSE));
+	conn->inflight++;
+}
+
+/*
+ * Hand the pending response to the ring, one send at a time. A connection that is done is closed
+ * by a close linked to its last send, so the response and the close leave in the same submission.
+ * Returns -1 when the connection has been closed, 0 otherwise.
+ */
+int uring_flush(Connection *conn) {
+	Worker *worker = conn->worker;
+	struct io_uring_sqe *sqe;
+	struct io_uring_sqe *close_sqe;
+	size_t total;
+	int count;
+
+	if (conn->closed) {
+		return -1;
+	}
+	if (conn->sending) {
+		return 0;
+	}
+	memset(&conn->msg, 0, sizeof(struct msghdr));
+	if (conn->outbox != NULL) {
+		count = outbox_gather(conn, conn->outbox->iov, &total);
+		conn->msg.msg_iov = conn->outbox->iov;
+	} else {
+		count = framed_output(&conn->stream, conn->iov);
+		conn->msg.msg_iov = conn->iov;
+	}
+	conn->msg.msg_iovlen = (size_t) count;
+	if (count == 0) {
+		if (conn->state == STAGE_CLOSING) {
+			log_info("[server] closing connection");
+			connection_close(conn);
+			return -1;
+		}
+		return 0;
+	}
+
+	// the send and the close linked to it have to leave in the same submission
+	if (conn->state == STAGE_CLOSING && uring_sq_space(&worker->ring) < 2) {
+		uring_submit_and_wait(&worker->ring, 0, 0);
+	}
+	if ((sqe = uring_sqe(worker)) == NULL) {
+		metric_inc(worker->metrics, METRIC_ERR_RESOURCE);
+		connection_close(conn);
+		return -1;
+	}
+	uring_prep_sendmsg(sqe, conn->fd, &conn->msg, MSG_NOSIGNAL | MSG_WAITALL, uring_tag(conn, URING_SEND));
+	conn->sending = true;
+	conn->inflight++;
+	if (conn->state != STAGE_CLOSING) {
+		return 0;
+	}
+
+	// a failed or short send cancels the close, the completion closes the descriptor then
+	sqe->flags |= IOSQE_IO_LINK;
+	if ((close_sqe = uring_sqe(worker)) == NULL) {
+		sqe->flags &= (uint8_t) ~IOSQE_IO_LINK;
+		return 0;
+	}
+	log_info("[server] closing connection");
+	uring_prep_close(close_sqe, conn->fd, uring_tag(conn, URING_CLOSE));
+	conn->inflight++;
+	connection_release(conn);
+	conn->closed = true;
+	return -1;
+}
+
+/* copy the bytes of a receive into the stream and process them, as much as the stream holds at a time */
+void uring_on_recv(Connection *conn, const struct io_uring_cqe *cqe) {
+	Worker *worker = conn->worker;
+	int buffer = uring_cqe_buffer(cqe);
+	const char *data;
+	size_t remaining;
+	size_t room;
+	size_t len;
+
+	conn->receiving = false;
+	if (conn->closed) {
+		if (buffer != -1) {
+			uring_buffer_recycle(&worker->buffers, (uint16_t) buffer);
+		}
+		return;
+	}
+	if (cqe->res == -ENOBUFS) {
+		// every buffer of the group is taken, try again with the next round
+		uring_recv(conn);
+		return;
+	}
+	if (cqe->res < 0) {
+		errno = -cqe->res;
+		log_with_errno("[server] receiving message from client failed");
+		metric_inc(worker->metrics, METRIC_ERR_SOCKET);
+		connection_close(conn);
+		return;
+	}
+	if (cqe->res == 0) {
+		connection_on_eof(conn);
+		return;
+	}
+
+	connection_received(conn, (size_t) cqe->res);
+	data = uring_buffer(&worker->buffers, (uint16_t) buffer);
+	remaining = (size_t) cqe->res;
+	while (remaining > 0 && !conn->closed && conn->state != STAGE_CLOSING) {
+		room = conn->stream.rx.capacity - framed_pending_input(&conn->stream);
+		if (room == 0) {
+			log_error("[server] message exceeds %d bytes, closing connection", BUFLEN);
+			metric_inc(worker->metrics, METRIC_ERR_PROTOCOL);
+			connection_close(conn);
+			break;
+		}
+		len = remaining < room ? remaining : room;
+		framed_feed(&conn->stream, data, len);
+		data += len;
+		remaining -= len;
+		if (connection_process(conn) == -1) {
+			break;
+		}
+	}
+	uring_buffer_recycle(&worker->buffers, (uint16_t) buffer);
+
+	if (!conn->closed && conn->state != STAGE_CLOSING && uring_recv(conn) == -1) {
+		metric_inc(worker->metrics, METRIC_ERR_RESOURCE);
+		connection_close(conn);
+	}
+}
+
+void uring_on_send(Connection *conn, const struct io_uring_cqe *cqe) {
+	conn->sending = false;
+	if (cqe->res < 0) {
+		if (!conn->closed) {
+			errno = -cqe->res;
+			log_with_errno("[server] sending message to client failed.");
+			metric_inc(conn->worker->metrics, METRIC_ERR_SOCKET);
+			connection_close(conn);
+		}
+		return;
+	}
+	if (conn->outbox != NULL) {
+		outbox_consume(conn, (size_t) cqe->res);
+	} else {
+		framed_sent(&conn->stream, (size_t) cqe->res);
+	}
+	metric_add(conn->worker->metrics, METRIC_TX_BYTES, (uint64_t) cqe->res);
+	if (!conn->closed && !conn->held) {
+		uring_flush(conn);
+	}
+}
+
+void uring_on_accept(Worker *worker, const struct io_uring_cqe *cqe) {
+	struct sockaddr_in client_addr;
+	socklen_t client_addr_len = sizeof(client_addr);
+	Connection *conn;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE) && uring_arm_accept(worker) == -1) {
+		log_error("[server] could not accept connections anymore");
+		stop_workers();
+	}
+	if (cqe->res < 0) {
+		if (cqe->res != -ECANCELED) {
+			errno = -cqe->res;
+			log_with_errno("[server] Socket accept failed");
+		}
+		return;
+	}
+	metric_inc(worker->metrics, METRIC_ACCEPTED);
+
+	// a multishot accept has nowhere to put the address of every connection, ask only to log it
+	memset(&client_addr, 0, sizeof(struct sockaddr_in));
+	if (log_enabled(INFO_LEVEL) && getpeername(cqe->res, (struct sockaddr *) &client_addr, &client_addr_len) == 0) {
+		log_info("[server] client connected from '%s:%d'", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+	}
+
+	if ((conn = connection_open(worker, cqe->res, &client_addr)) == NULL) {
+		log_error("[server] out of memory, dropping connection");
+		metric_inc(worker->metrics, METRIC_ERR_RESOURCE);
+		metric_inc(worker->metrics, METRIC_CLOSED);
+		close(cqe->res);
+		return;
+	}
+	if (uring_recv(conn) == -1) {
+		metric_inc(worker->metrics, METRIC_ERR_RESOURCE);
+		connection_close(conn);
+	}
+}
+
+void uring_on_completion(Worker *worker, const struct io_uring_cqe *cqe) {
+	enum uring_request request = (enum uring_request) (cqe->user_data & URING_REQUEST_MASK);
+	Connection *conn = (Connection *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_REQUEST_MASK);
+
+	switch (request) {
+		case URING_ACCEPT:
+			uring_on_accept(worker, cqe);
+			return;
+		case URING_WAKE:
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				uring_arm_poll(worker, worker->wake_fd, URING_WAKE);
+			}
+			worker_on_wake(worker);
+			return;
+		case URING_SIGNAL:
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				uring_arm_poll(worker, worker->signal_fd, URING_SIGNAL);
+			}
+			worker_on_signal(worker);
+			return;
+		case URING_RECV:
+			uring_on_recv(conn, cqe);
+			break;
+		case URING_SEND:
+			uring_on_send(conn, cqe);
+			break;
+		case URING_CLOSE:
+			// the close linked to a send that failed never ran
+			if (cqe->res == -ECANCELED) {
+				close(conn->fd);
+			}
+			break;
+		default:
+			break;
+	}
+
+	if (--conn->inflight == 0 && conn->closed) {
+		if (worker->connections[conn->fd] == conn) {
+			worker->connections[conn->fd] = NULL;
+		}
+		connection_free(conn);
+	}
+}
+
+int worker_init(Worker *worker, int id, const struct sockaddr_in *server_addr, int signal_fd) {
+	struct epoll_event ev;
+
+	memset(worker, 0, sizeof(Worker));
+	worker->id = id;
+	worker->metrics = &worker_metrics[id];
+	if (worker->metrics->latency == NULL && (worker->metrics->latency = calloc(LATENCY_COUNT, sizeof(LatencyHistogram))) == NULL) {
+		log_error("[server] could not allocate the latency histograms");
+		return -1;
+	}
+	worker->cpu = -1;
+	worker->signal_fd = signal_fd;
+	worker->epoll_fd = -1;
+	worker->wake_fd = -1;
+	worker->parked_fd = -1;
+	worker->ring.fd = -1;
+	worker->held = NULL;
+	pthread_mutex_init(&worker->outbox_lock, NULL);
+	timer_wheel_init(&worker->timers, server_seconds());
+
+	if ((worker->listen_fd = open_listen_socket(server_addr)) == -1) {
+		return -1;
+	}
+
+	if ((worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		log_with_errno("[server] eventfd failed");
+		return -1;
+	}
+
+	if (io_backend == IO_BACKEND_URING) {
+		if (uring_init(&worker->ring, URING_ENTRIES, URING_SETUP) == 0 &&
+		    uring_buffers_init(&worker->ring, &worker->buffers, URING_BUFFER_GROUP, URING_BUFFERS, BUFLEN) == 0) {
+			if (uring_arm_accept(worker) == 0 && uring_arm_poll(worker, worker->wake_fd, URING_WAKE) == 0 &&
+			    (signal_fd == -1 || uring_arm_poll(worker, signal_fd, URING_SIGNAL) == 0)) {
+				return 0;
+			}
+		}
+		// only the first worker may still change its mind, the rest have to do what it does
+		log_with_errno("[server] io_uring is not available");
+		uring_buffers_free(&worker->ring, &worker->buffers);
+		uring_free(&worker->ring);
+		if (id > 0) {
+			return -1;
+		}
+		log_info("[server] falling back to epoll");
+		io_backend = IO_BACKEND_EPOLL;
+	}
+
+	if ((worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		log_with_errno("[server] epoll_create1 failed");
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = worker->listen_fd;
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd, &ev);
+	ev.events = EPOLLIN;
+	ev.data.fd = worker->wake_fd;
+	epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &ev);
+	if (signal_fd != -1) {
+		ev.events = EPOLLIN;
+		ev.data.fd = signal_fd;
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+	}
+	if (relay_enabled) {
+		// parked connections wait in a set of their own, readable once one of them hung up
+		if ((worker->parked_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			log_with_errno("[server] epoll_create1 failed");
+			return -1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.fd = worker->parked_fd;
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->parked_fd, &ev);
+	}
+	return 0;
+}
+
+void worker_destroy(Worker *worker) {
+	Timer *timer;
+
+	// closing the ring cancels what is in flight, the connections are closed like epoll's then
+	if (worker->ring.fd != -1) {
+		uring_buffers_free(&worker->ring, &worker->buffers);
+		uring_free(&worker->ring);
+	}
+	close_all_connections(worker);
+	// what is left are leases, the sweep timer is part of the worker
+	while ((timer = timer_wheel_pop(&worker->timers)) != NULL) {
+		if (timer->callback == lease_expire) {
+			free(timer->arg);
+		}
+	}
+	if (worker->epoll_fd != -1) {
+		close(worker->epoll_fd);
+	}
+	if (worker->parked_fd != -1) {
+		close(worker->parked_fd);
+	}
+	if (worker->listen_fd != -1) {
+		close(worker->listen_fd);
+	}
+}
+
+/* the log writer wakes the workers until it is closed, so their eventfds go last */
+void worker_close_wake(Worker *worker) {
+	if (worker->wake_fd != -1) {
+		close(worker->wake_fd);
+		worker->wake_fd = -1;
+	}
+}
+
+void worker_pin(Worker *worker) {
+	if (worker->cpu != -1) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+			log_error("[server] worker %d could not be pinned to core %d", worker->id, worker->cpu);
+		}
+	}
+}
+
+/* the wheel ticks in seconds, sleep until the second it has to be advanced to, for good without timers */
+int worker_timeout(Worker *worker) {
+	uint64_t next = timer_wheel_next(&worker->timers);
+	uint64_t now_ns;
+	uint64_t wait_ms;
+
+	if (next == UINT64_MAX) {
+		return -1;
+	}
+	now_ns = metrics_now_ns();
+	if (next * 1000000000ull <= now_ns) {
+		return 0;
+	}
+	wait_ms = (next * 1000000000ull - now_ns + 999999ull) / 1000000ull;
+	return wait_ms > INT_MAX ? INT_MAX : (int) wait_ms;
+}
+
+void *worker_loop(void *arg) {
+	Worker *worker = arg;
+	struct epoll_event events[MAX_EVENTS];
+	int i;                                  /* temp int counter             */
+	int n;                                  /* ready events                 */
+
+	worker_pin(worker);
+	while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+		if ((n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, worker_timeout(worker))) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_with_errno("[server] epoll_wait failed");
+			stop_workers();
+			break;
+		}
+		timer_wheel_advance(&worker->timers, server_seconds());
+
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == worker->listen_fd) {
+				accept_connections(worker);
+				continue;
+			}
+
+			if (fd == worker->wake_fd) {
+				worker_on_wake(worker);
+				continue;
+			}
+
+			if (fd == worker->signal_fd) {
+				worker_on_signal(worker);
+				continue;
+			}
+
+			if (fd == worker->parked_fd) {
+				worker_on_parked(worker);
+				continue;
+			}
+
+			// the connection may have been closed by an earlier event of this batch
+			Connection *conn = (size_t) fd < worker->connections_capacity ? worker->connections[fd] : NULL;
+			if (conn == NULL) {
+				continue;
+			}
+			if (conn->relay != NULL) {
+				relay_on_event(conn->relay);
+				continue;
+			}
+
+			if ((events[i].events & EPOLLOUT) && !conn->held) {
+				if (connection_flush(conn) == -1) {
+					continue;
+				}
+			}
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				connection_on_readable(conn);
+			}
+		}
+		if (worker->deliver) {
+			worker->deliver = false;
+			worker_deliver(worker);
+		}
+	}
+	return NULL;
+}
+
+/* submit what the last round prepared and wait for completions, in one system call */
+void *worker_loop_uring(void *arg) {
+	Worker *worker = arg;
+	struct io_uring_cqe *cqe;
+	struct io_uring_cqe completion;
+
+	worker_pin(worker);
+	if (uring_enable(&worker->ring) == -1) {
+		log_with_errno("[server] enabling the io_uring of worker %d failed", worker->id);
+		stop_workers();
+		return NULL;
+	}
+	while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+		// EBUSY: the completion queue overflowed, reaping it below makes room
+		if (uring_submit_and_wait(&worker->ring, 1, worker_timeout(worker)) == -1 && errno != EBUSY && errno != EAGAIN) {
+			log_with_errno("[server] io_uring_enter failed");
+			stop_workers();
+			break;
+		}
+		timer_wheel_advance(&worker->timers, server_seconds());
+
+		while ((cqe = uring_peek_cqe(&worker->ring)) != NULL) {
+			completion = *cqe;
+			uring_cqe_seen(&worker->ring);
+			uring_on_completion(worker, &completion);
+		}
+		if (worker->deliver) {
+			worker->deliver = false;
+			worker_deliver(worker);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char const *argv[]) {
+	/* socket variables */
+	int signal_fd = -1;                 /* SIGINT file descriptor   */
+	int server_port = SERVER_PORT;      /* server port		        */
+	const char *server_ip = SERVER_IP;  /* server IP		        */
+	in_addr_t server_in_addr = INADDR_LOOPBACK;
+	struct sockaddr_in server_addr;     /* server socket address    */
+	sigset_t mask;
+
+	/* command line variables */
+	int opt = 0;                       /* cmd options		        */
+	int any_addr = 0;                  /* listen to any address    */
+	int pin_workers = 0;               /* pin workers to cores     */
+	int log_policy = LOG_OVERFLOW_DROP; /* full log buffer policy  */
+
+
+	/* general purpose variables */
+	char *tmp;                              /* temp pointer for conventions */
+	int i;                                  /* temp int counter             */
+	long cpus_count;                        /* online cores                 */
+
+
+	/* initialize */
+
+	/* get cmd options */
+	while ((opt = getopt(argc, (char *const *) argv, "p:at:l:m:s:w:e:rb:h")) != -1) {
+		switch (opt) {
+			case 'p':
+				server_port = (int) strtol(optarg, &tmp, 10);
+				break;
+			case 'a':
+				any_addr = 1;
+				server_ip = "0.0.0.0";
+				server_in_addr = INADDR_ANY;
+				break;
+			case 't':
+				workers_count = (int) strtol(optarg, &tmp, 10);
+				if (workers_count < 1 || workers_count > MAX_WORKERS) {
+					log_error("[server] workers count must be in range 1 - %d", MAX_WORKERS);
+					exit(EXIT_FAILURE);
+				}
+				pin_workers = 1;
+				break;
+			case 'l':
+				if (strcmp(optarg, "drop") == 0) {
+					log_policy = LOG_OVERFLOW_DROP;
+				} else if (strcmp(optarg, "block") == 0) {
+					log_policy = LOG_OVERFLOW_BLOCK;
+				} else {
+					log_error("[server] unknown log overflow policy '%s'", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'm':
+				metrics_path = optarg;
+				break;
+			case 's':
+				snapshot_path = optarg;
+				break;
+			case 'w':
+				if (strcmp(optarg, "always") == 0) {
+					wal_policy = WAL_SYNC_ALWAYS;
+				} else if (strcmp(optarg, "interval") == 0) {
+					wal_policy = WAL_SYNC_INTERVAL;
+				} else if (strcmp(optarg, "never") == 0) {
+					wal_policy = WAL_SYNC_NEVER;
+				} else {
+					log_error("[server] unknown write-ahead log sync policy '%s'", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'e':
+				lease_secs = (int) strtol(optarg, &tmp, 10);
+				if (*tmp != '\0' || lease_secs < 0 || lease_secs > 365 * 24 * 3600) {
+					log_error("[server] lease must be in range 0 - %d seconds", 365 * 24 * 3600);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'r':
+				relay_enabled = true;
+				break;
+			case 'b':
+				if (strcmp(optarg, "epoll") == 0) {
+					io_backend = IO_BACKEND_EPOLL;
+				} else if (strcmp(optarg, "io_uring") == 0) {
+					io_backend = IO_BACKEND_URING;
+				} else {
+					log_error("[server] unknown backend '%s'", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'h':
+				usage();
+				exit(EXIT_SUCCESS);
+			default:
+				break;
+		}
+	}
+
+	if (wal_policy != -1 && snapshot_path == NULL) {
+		log_error("[server] the write-ahead log lives next to the snapshot, -w needs -s");
+		exit(EXIT_FAILURE);
+	}
+
+	// relays splice between descriptors epoll reports ready
+	if (relay_enabled && io_backend == IO_BACKEND_URING) {
+		log_info("[server] relaying chats needs epoll, not using io_uring");
+		io_backend = IO_BACKEND_EPOLL;
+	}
+
+	memset(&server_addr, 0, sizeof(struct sockaddr_in));
+	server_addr.sin_port = htons(server_port);
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(server_in_addr);
+
+	// SIGINT is delivered through a descriptor so the event loop can wait on it like any socket.
+	// The mask is set before any worker starts, so every thread inherits it.
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0 || (signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+		log_with_errno("[server] signalfd failed");
+		exit(EXIT_FAILURE);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if (relay_enabled) {
+		raise_descriptor_limit();
+	}
+	for (i = 0; i < ROOM_BUCKETS; i++) {
+		pthread_mutex_init(&room_buckets[i].lock, NULL);
+	}
+
+	// log lines are written by a background thread, which inherits the signal mask above
+	if (log_async_start(LOG_ASYNC_CAPACITY, log_policy) == -1) {
+		log_error("[server] could not start the log writer, logging synchronously");
+	}
+
+	// sized for the snapshot up front, so restoring it never waits for a resize
+	size_t snapshot_users = snapshot_path != NULL ? open_snapshot() : 0;
+	if ((registry = create_shared_registry(snapshot_users * 2)) == NULL) {
+		log_error("[server] could not allocate the user registry");
+		exit(EXIT_FAILURE);
+	}
+	if (snapshot_path != NULL && recover_registry() == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	cpus_count = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 0; i < workers_count; i++) {
+		if (worker_init(&workers[i], i, &server_addr, i == 0 ? signal_fd : -1) == -1) {
+			while (i >= 0) {
+				worker_destroy(&workers[i]);
+				worker_close_wake(&workers[i--]);
+			}
+			close(signal_fd);
+			exit(EXIT_FAILURE);
+		}
+		if (pin_workers && cpus_count > 0) {
+			workers[i].cpu = (int) (i % cpus_count);
+		}
+	}
+
+	// registrations that came back from disk expire unless their owners heartbeat within a lease
+	if (lease_secs > 0 && registry_count() > 0) {
+		timer_init(&workers[0].sweep, lease_sweep, &workers[0]);
+		timer_wheel_add(&workers[0].timers, &workers[0].sweep, workers[0].timers.now + (uint64_t) lease_secs);
+	}
+
+	log_info("[server] Awaiting for client connections on '%s:%d'", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port));
+	for (i = 0; i < workers_count; i++) {
+		log_info("[server] worker %d: listen fd %d, core %d", i, workers[i].listen_fd, workers[i].cpu);
+	}
+	log_info("[server] waiting for sockets with %s", io_backend == IO_BACKEND_URING ? "io_uring" : "epoll");
+
+	// the snapshot is already serving lookups, the rebuild happens behind the workers
+	pthread_t restore_thread;
+	bool restoring = snapshot != NULL && pthread_create(&restore_thread, NULL, restore_snapshot, NULL) == 0;
+	pthread_t compaction_thread;
+	bool compacting = snapshot_path != NULL && pthread_create(&compaction_thread, NULL, compaction_loop, NULL) == 0;
+
+	// worker 0 runs on the main thread and owns the signal descriptor
+	for (i = 1; i < workers_count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, io_backend == IO_BACKEND_URING ? worker_loop_uring : worker_loop, &workers[i]) != 0) {
+			log_error("[server] could not start worker %d", i);
+			workers_count = i;
+			stop_workers();
+			break;
+		}
+	}
+	if (io_backend == IO_BACKEND_URING) {
+		worker_loop_uring(&workers[0]);
+	} else {
+		worker_loop(&workers[0]);
+	}
+	for (i = 1; i < workers_count; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	if (restoring) {
+		pthread_join(restore_thread, NULL);
+	}
+	if (compacting) {
+		pthread_mutex_lock(&compaction_lock);
+		pthread_cond_signal(&compaction_wake);
+		pthread_mutex_unlock(&compaction_lock);
+		pthread_join(compaction_thread, NULL);
+	}
+	close_parked();
+
+	// cleanup
+	log_info("[server] cleanup..");
+	uint64_t totals[METRIC_COUNT];
+	LatencySummary latency;
+	for (i = 0; i < workers_count; i++) {
+		worker_destroy(&workers[i]);
+		log_info("[server] worker %d: accepted %" PRIu64 ", handshakes %" PRIu64 ", received bytes %" PRIu64 ", transmitted bytes %" PRIu64,
+		         i, metric_read(&worker_metrics[i], METRIC_ACCEPTED), metric_read(&worker_metrics[i], METRIC_HANDSHAKES),
+		         metric_read(&worker_metrics[i], METRIC_RX_BYTES), metric_read(&worker_metrics[i], METRIC_TX_BYTES));
+	}
+	// closing the sessions above unregistered their users, in the log and in the registry both
+	if (snapshot_path != NULL) {
+		checkpoint_registry();
+	}
+	wal_close(wal);
+	wal = NULL;
+	registry_snapshot_close(snapshot);
+	snapshot = NULL;
+	for (i = 0; i < workers_count; i++) {
+		worker_close_wake(&workers[i]);
+	}
+	metrics_snapshot(worker_metrics, workers_count, totals);
+	log_info("[server] all workers: accepted %" PRIu64 ", handshakes %" PRIu64 ", errors %" PRIu64,
+	         totals[METRIC_ACCEPTED], totals[METRIC_HANDSHAKES],
+	         totals[METRIC_ERR_PROTOCOL] + totals[METRIC_ERR_SOCKET] + totals[METRIC_ERR_RESOURCE]);
+	for (i = 0; i < LATENCY_COUNT; i++) {
+		latency_summarize(worker_metrics, workers_count, i, &latency);
+		if (latency.count > 0) {
+			log_info("[server] latency %s: count %" PRIu64 ", p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us",
+			         latency_name(i), latency.count, latency.p50 / 1e3, latency.p99 / 1e3, latency.p999 / 1e3, latency.max / 1e3);
+		}
+	}
+	for (i = 0; i < workers_count; i++) {
+		free(worker_metrics[i].latency);
+	}
+	free_shared_registry(registry);
+	log_info("[server] freed registered users list");
+	close(signal_fd);
 	log_info("[server] closed server socket");
+	if (log_dropped_records() > 0) {
+		log_info("[server] %zu log records dropped while the log buffer was full", log_dropped_records());
+	}
 	log_info("[server] exiting");
+	log_async_stop();
 	exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
@@ -0,0 +1,548 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+#include <math.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// our libraries
+#include "structures.h"
+#include "shared_registry.h"
+
+
+#define NAME_STRIDE         18          /* "u" + 16 hex digits + NUL, any index fits  */
+#define MIN_OPS             1000000     /* timed operations per workload at least     */
+#define ZIPF_THETA          0.99        /* skew of the Zipfian workload, as in YCSB   */
+#define CHURN_POOL_SHARE    8           /* 1/8 of the users are offline during churn  */
+#define MAX_READERS         64          /* reader threads of the concurrent workloads */
+
+
+/*
+ * Allocation accounting. The registry is linked statically into this program, so these
+ * definitions take the place of the C library's for everything it allocates. The counters
+ * are updated atomically, the concurrent workloads allocate from several threads.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+typedef struct AllocStats {
+	uint64_t allocations;       /* calls that returned new memory   */
+	int64_t live_bytes;         /* usable bytes currently allocated */
+} AllocStats;
+
+static AllocStats alloc_stats;
+
+static void *counted(void *ptr) {
+	if (ptr != NULL) {
+		__atomic_fetch_add(&alloc_stats.allocations, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&alloc_stats.live_bytes, (int64_t) malloc_usable_size(ptr), __ATOMIC_RELAXED);
+	}
+	return ptr;
+}
+
+void *malloc(size_t size) {
+	return counted(__libc_malloc(size));
+}
+
+void *calloc(size_t count, size_t size) {
+	return counted(__libc_calloc(count, size));
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	return counted(__libc_memalign(alignment, size));
+}
+
+void *realloc(void *ptr, size_t size) {
+	if (ptr != NULL) {
+		__atomic_fetch_sub(&alloc_stats.live_bytes, (int64_t) malloc_usable_size(ptr), __ATOMIC_RELAXED);
+	}
+	return counted(__libc_realloc(ptr, size));
+}
+
+void free(void *ptr) {
+	if (ptr != NULL) {
+		__atomic_fetch_sub(&alloc_stats.live_bytes, (int64_t) malloc_usable_size(ptr), __ATOMIC_RELAXED);
+	}
+	__libc_free(ptr);
+}
+
+
+/* one measured workload at one registry size */
+typedef struct BenchResult {
+	const char *workload;
+	size_t users;
+	uint64_t ops;
+	double ns_per_op;
+	double allocs_per_op;
+	double bytes_per_user;      /* registry heap per live user after the workload */
+} BenchResult;
+
+static char *names = NULL;      /* NAME_STRIDE bytes per user index */
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+static FILE *output = NULL;
+static const char *label = "";
+static char stdout_buffer[BUFSIZ];  /* stdio buffers of our own, so reports allocate nothing */
+static char output_buffer[BUFSIZ];
+static int failures = 0;
+static int max_readers = 4;
+
+
+static uint64_t next_random(void) {
+	// xorshift64*
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ULL;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+static inline const char *name_of(size_t index) {
+	return names + index * NAME_STRIDE;
+}
+
+static int names_init(size_t count) {
+	size_t i;
+
+	if ((names = __libc_malloc(count * NAME_STRIDE)) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		snprintf(names + i * NAME_STRIDE, NAME_STRIDE, "u%zx", i);
+	}
+	return 0;
+}
+
+/*
+ * Zipfian ranks in [0, n) following Gray et al., "Quickly generating billion-record synthetic
+ * databases", the generator YCSB uses. Rank 0 is the most popular.
+ */
+typedef struct Zipf {
+	size_t n;
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+} Zipf;
+
+static void zipf_init(Zipf *zipf, size_t n, double theta) {
+	double zeta2 = 1.0 + pow(0.5, theta);
+	size_t i;
+
+	zipf->n = n;
+	zipf->theta = theta;
+	zipf->zetan = 0;
+	for (i = 1; i <= n; i++) {
+		zipf->zetan += 1.0 / pow((double) i, theta);
+	}
+	zipf->alpha = 1.0 / (1.0 - theta);
+	zipf->eta = (1.0 - pow(2.0 / (double) n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+}
+
+static size_t zipf_next(Zipf *zipf) {
+	double u = (double) (next_random() >> 11) / (double) (1ULL << 53);
+	double uz = u * zipf->zetan;
+	size_t rank;
+
+	if (uz < 1.0) {
+		return 0;
+	}
+	if (uz < 1.0 + pow(0.5, zipf->theta)) {
+		return 1;
+	}
+	rank = (size_t) ((double) zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+	return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+static void report(const BenchResult *result) {
+	printf("%-10s %10zu %10" PRIu64 " %10.1f %12.3f %12.1f\n", result->workload, result->users, result->ops,
+	       result->ns_per_op, result->allocs_per_op, result->bytes_per_user);
+	fflush(stdout);
+	if (output != NULL) {
+		fprintf(output, "{\"label\": \"%s\", \"workload\": \"%s\", \"users\": %zu, \"ops\": %" PRIu64
+		                ", \"ns_per_op\": %.2f, \"allocs_per_op\": %.4f, \"bytes_per_user\": %.1f}\n",
+		        label, result->workload, result->users, result->ops, result->ns_per_op, result->allocs_per_op, result->bytes_per_user);
+		fflush(output);
+	}
+}
+
+static void check(int ok, const char *workload, size_t users, const char *what) {
+	if (!ok) {
+		fprintf(stderr, "registry_bench: %s at %zu users: %s\n", workload, users, what);
+		failures++;
+	}
+}
+
+static void finish(BenchResult *result, const char *workload, size_t users, uint64_t ops, uint64_t start_ns,
+                   const AllocStats *before, int64_t base_bytes) {
+	result->workload = workload;
+	result->users = users;
+	result->ops = ops;
+	result->ns_per_op = (double) (now_ns() - start_ns) / (double) ops;
+	result->allocs_per_op = (double) (alloc_stats.allocations - before->allocations) / (double) ops;
+	result->bytes_per_user = (double) (alloc_stats.live_bytes - base_bytes) / (double) users;
+	report(result);
+}
+
+/* one thread of the concurrent workloads */
+typedef struct ReaderTask {
+	pthread_t thread;
+	SharedRegistry *registry;
+	const uint32_t *sequence;
+	uint64_t ops;
+	int id;                     /* reader slot for shared_registry_read() */
+	bool locked;                /* take the shard lock instead            */
+	size_t found;
+} ReaderTask;
+
+static atomic_bool churning;
+
+static void *reader_loop(void *arg) {
+	ReaderTask *task = arg;
+	RegisteredUserView view;
+	RegistryShard *shard;
+	const char *name;
+	uint64_t i;
+
+	for (i = 0; i < task->ops; i++) {
+		name = name_of(task->sequence[i]);
+		if (task->locked) {
+			shard = registry_shard(task->registry, name);
+			registry_shard_lock(shard);
+			task->found += search_registered_user(shard->registry, name) != NULL;
+			registry_shard_unlock(shard);
+		} else {
+			task->found += shared_registry_read(task->registry, task->id, name, &view) == 1;
+		}
+	}
+	return NULL;
+}
+
+/* users from first on register and unregister in turn until the readers are done */
+static void *churn_loop(void *arg) {
+	ReaderTask *task = arg;
+	RegistryShard *shard;
+	const char *name;
+	uint64_t i;
+
+	for (i = 0; atomic_load_explicit(&churning, memory_order_relaxed); i++) {
+		name = name_of(task->sequence[0] + i % task->ops);
+		shard = registry_shard(task->registry, name);
+		registry_shard_lock(shard);
+		if (search_registered_user(shard->registry, name) != NULL) {
+			shard_delete_user(shard, name);
+		} else {
+			shard_add_user(shard, name);
+		}
+		registry_shard_unlock(shard);
+	}
+	task->found = i;
+	return NULL;
+}
+
+/*
+ * Concurrent lookups of registered users from 1 up to max_readers threads while one writer keeps
+ * registering and unregistering other users. ns/op is wall time per lookup across all readers,
+ * so it falls as lookups scale with the cores.
+ */
+static int run_concurrent(size_t users, const uint32_t *sequence, uint64_t ops, bool locked) {
+	static char workload[MAX_READERS][sizeof("lockfree/-2147483648")];
+	ReaderTask tasks[MAX_READERS];
+	ReaderTask writer;
+	uint32_t first = (uint32_t) users;
+	SharedRegistry *registry;
+	BenchResult result;
+	AllocStats before;
+	int64_t base_bytes;
+	uint64_t start;
+	size_t found;
+	size_t i;
+	int readers;
+	int t;
+
+	base_bytes = alloc_stats.live_bytes;
+	if ((registry = create_shared_registry(users)) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < users; i++) {
+		if (shard_add_user(registry_shard(registry, name_of(i)), name_of(i)) == NULL) {
+			free_shared_registry(registry);
+			return -1;
+		}
+	}
+
+	for (readers = 1; readers <= max_readers; readers *= 2) {
+		memset(&writer, 0, sizeof(writer));
+		writer.registry = registry;
+		writer.sequence = &first;
+		writer.ops = users / CHURN_POOL_SHARE + 1;
+		atomic_store(&churning, true);
+		before = alloc_stats;
+		start = now_ns();
+		if (pthread_create(&writer.thread, NULL, churn_loop, &writer) != 0) {
+			free_shared_registry(registry);
+			return -1;
+		}
+		for (t = 0; t < readers; t++) {
+			memset(&tasks[t], 0, sizeof(ReaderTask));
+			tasks[t].registry = registry;
+			tasks[t].sequence = sequence + (uint64_t) t * (ops / readers);
+			tasks[t].ops = ops / readers;
+			tasks[t].id = t;
+			tasks[t].locked = locked;
+			if (pthread_create(&tasks[t].thread, NULL, reader_loop, &tasks[t]) != 0) {
+				readers = t;
+				break;
+			}
+		}
+		found = 0;
+		for (t = 0; t < readers; t++) {
+			pthread_join(tasks[t].thread, NULL);
+			found += tasks[t].found;
+		}
+		snprintf(workload[readers - 1], sizeof(workload[0]), "%s/%d", locked ? "locked" : "lockfree", readers);
+		finish(&result, workload[readers - 1], users, ops / readers * readers, start, &before, base_bytes);
+		atomic_store(&churning, false);
+		pthread_join(writer.thread, NULL);
+		check(found == ops / readers * readers, workload[readers - 1], users, "registered users not found");
+	}
+
+	free_shared_registry(registry);
+	check(alloc_stats.live_bytes == base_bytes, "free", users, "shared registry memory not returned");
+	return 0;
+}
+
+/* every workload at one size, returns -1 when the registry could not be built */
+static int run_size(size_t users) {
+	size_t pool = users / CHURN_POOL_SHARE;
+	uint64_t ops = users > MIN_OPS ? users : MIN_OPS;
+	uint32_t *sequence;
+	uint32_t *online;
+	UserRegistry *registry;
+	BenchResult result;
+	AllocStats before;
+	int64_t base_bytes;
+	uint64_t start;
+	uint64_t i;
+	size_t found = 0;
+	size_t slot;
+	size_t spare;
+	uint32_t tmp;
+	Zipf zipf;
+
+	sequence = __libc_malloc(ops * sizeof(uint32_t));
+	online = __libc_malloc((users + pool) * sizeof(uint32_t));
+	if (sequence == NULL || online == NULL) {
+		__libc_free(sequence);
+		__libc_free(online);
+		return -1;
+	}
+
+	// build: one insert per user into a registry grown on the way
+	base_bytes = alloc_stats.live_bytes;
+	before = alloc_stats;
+	start = now_ns();
+	registry = create_user_registry(0);
+	for (i = 0; i < users && registry != NULL; i++) {
+		found += add_registered_user(registry, name_of(i)) != NULL;
+	}
+	if (registry == NULL) {
+		__libc_free(sequence);
+		__libc_free(online);
+		return -1;
+	}
+	finish(&result, "insert", users, users, start, &before, base_bytes);
+	check(found == users && registered_users_count(registry) == users, "insert", users, "not every user was added");
+
+	// uniform: lookups of random registered users
+	for (i = 0; i < ops; i++) {
+		sequence[i] = (uint32_t) (next_random() % users);
+	}
+	found = 0;
+	before = alloc_stats;
+	start = now_ns();
+	for (i = 0; i < ops; i++) {
+		found += search_registered_user(registry, name_of(sequence[i])) != NULL;
+	}
+	finish(&result, "uniform", users, ops, start, &before, base_bytes);
+	check(found == ops, "uniform", users, "registered users not found");
+
+	// zipfian: a few users are looked up far more often, popular ranks spread over the table
+	zipf_init(&zipf, users, ZIPF_THETA);
+	for (i = 0; i < ops; i++) {
+		sequence[i] = (uint32_t) ((zipf_next(&zipf) * 2654435761ULL) % users);
+	}
+	found = 0;
+	before = alloc_stats;
+	start = now_ns();
+	for (i = 0; i < ops; i++) {
+		found += search_registered_user(registry, name_of(sequence[i])) != NULL;
+	}
+	finish(&result, "zipfian", users, ops, start, &before, base_bytes);
+	check(found == ops, "zipfian", users, "registered users not found");
+
+	// miss: lookups of users that never registered
+	found = 0;
+	before = alloc_stats;
+	start = now_ns();
+	for (i = 0; i < ops; i++) {
+		found += search_registered_user(registry, name_of(users + sequence[i] % (pool + 1))) != NULL;
+	}
+	finish(&result, "miss", users, ops, start, &before, base_bytes);
+	check(found == 0, "miss", users, "unregistered users found");
+
+	// churn: users go offline and others come back, with a lookup in between, at constant size.
+	// Each step is an UNREGISTER, a REGISTER and a lookup, counted as three operations.
+	for (i = 0; i < users + pool; i++) {
+		online[i] = (uint32_t) i;
+	}
+	for (i = 0; i < ops; i++) {
+		sequence[i] = (uint32_t) (next_random() % users);
+	}
+	found = 0;
+	before = alloc_stats;
+	start = now_ns();
+	for (i = 0; i < ops / 3 && pool > 0; i++) {
+		slot = sequence[i];
+		spare = users + sequence[ops - 1 - i] % pool;
+		delete_registered_user(registry, name_of(online[slot]));
+		found += add_registered_user(registry, name_of(online[spare])) != NULL;
+		tmp = online[slot];
+		online[slot] = online[spare];
+		online[spare] = tmp;
+		found += search_registered_user(registry, name_of(online[sequence[(i * 7) % ops]])) != NULL;
+	}
+	if (pool > 0) {
+		finish(&result, "churn", users, i * 3, start, &before, base_bytes);
+		check(found == 2 * i && registered_users_count(registry) == users, "churn", users, "registry lost track of users");
+	}
+
+	// teardown: every user unregisters
+	before = alloc_stats;
+	start = now_ns();
+	for (i = 0; i < users; i++) {
+		delete_registered_user(registry, name_of(online[i]));
+	}
+	finish(&result, "delete", users, users, start, &before, base_bytes);
+	check(registered_users_count(registry) == 0, "delete", users, "users left after deleting all");
+
+	free_user_registry(registry);
+	check(alloc_stats.live_bytes == base_bytes, "free", users, "registry memory not returned");
+
+	// concurrent: the same uniform lookups against the sharded registry, lock-free and locked
+	for (i = 0; i < ops; i++) {
+		sequence[i] = (uint32_t) (next_random() % users);
+	}
+	if (run_concurrent(users, sequence, ops, false) == -1 || run_concurrent(users, sequence, ops, true) == -1) {
+		__libc_free(sequence);
+		__libc_free(online);
+		return -1;
+	}
+	__libc_free(sequence);
+	__libc_free(online);
+	return 0;
+}
+
+static void *idle_loop(void *arg) {
+	return arg;
+}
+
+static void usage(void) {
+	printf("\n"
+	       "Usage: \n"
+	       "\tregistry_bench [-n max_users] [-m min_users] [-t readers] [-o file] [-l label]\n"
+	       "\n"
+	       "Options:\n"
+	       "\t-n users\tLargest registry, sizes go up by powers of ten (default 10000000)\n"
+	       "\t-m users\tSmallest registry (default 1000)\n"
+	       "\t-t count\tMost reader threads of the concurrent workloads, doubled from 1 (default 4)\n"
+	       "\t-o file \tAppend one JSON object per result to file\n"
+	       "\t-l label\tTag the JSON results, e.g. with the commit they were measured on\n"
+	       "\t-h      \tThis help message\n");
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[]) {
+	size_t min_users = 1000;
+	size_t max_users = 10000000;
+	pthread_t idle[MAX_READERS + 1];
+	size_t users;
+	int opt;
+	int t;
+
+	setvbuf(stdout, stdout_buffer, _IOLBF, sizeof(stdout_buffer));
+	while ((opt = getopt(argc, argv, "n:m:t:o:l:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				max_users = strtoull(optarg, NULL, 10);
+				break;
+			case 'm':
+				min_users = strtoull(optarg, NULL, 10);
+				break;
+			case 't':
+				max_readers = atoi(optarg);
+				break;
+			case 'o':
+				if ((output = fopen(optarg, "a")) == NULL) {
+					perror("registry_bench: opening the output file");
+					return EXIT_FAILURE;
+				}
+				setvbuf(output, output_buffer, _IOFBF, sizeof(output_buffer));
+				break;
+			case 'l':
+				label = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (max_readers < 1 || max_readers > MAX_READERS) {
+		fprintf(stderr, "registry_bench: reader threads must be in range 1 - %d\n", MAX_READERS);
+		return EXIT_FAILURE;
+	}
+	if (min_users < 8 || max_users < min_users || max_users > UINT32_MAX / 2) {
+		fprintf(stderr, "registry_bench: sizes must be in range 8 - %u\n", UINT32_MAX / 2);
+		return EXIT_FAILURE;
+	}
+
+	if (names_init(max_users + max_users / CHURN_POOL_SHARE + 1) == -1) {
+		fprintf(stderr, "registry_bench: out of memory for %zu names\n", max_users);
+		return EXIT_FAILURE;
+	}
+
+	// thread stacks are cached with the TLS the C library allocated for them, so start as many
+	// threads as the concurrent workloads run at once before the accounting starts
+	for (t = 0; t <= max_readers && pthread_create(&idle[t], NULL, idle_loop, NULL) == 0; t++) {}
+	while (--t >= 0) {
+		pthread_join(idle[t], NULL);
+	}
+
+	printf("%-10s %10s %10s %10s %12s %12s\n", "workload", "users", "ops", "ns/op", "allocs/op", "bytes/user");
+	for (users = min_users; users <= max_users; users *= 10) {
+		if (run_size(users) == -1) {
+			fprintf(stderr, "registry_bench: out of memory at %zu users\n", users);
+			failures++;
+			break;
+		}
+	}
+
+	__libc_free(names);
+	if (output != NULL) {
+		fclose(output);
+	}
+	return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
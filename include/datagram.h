@@ -0,0 +1,121 @@
+#ifndef C_CHAT_DATAGRAM_H
+#define C_CHAT_DATAGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+ * Chat messages over UDP, for peers that reach each other directly. Every datagram starts with a
+ * DatagramHeader. DGRAM_DATA carries one message, numbered from 1 per direction; the receiver only
+ * takes them in order and answers with cumulative DGRAM_ACKs: at once for every half window, for
+ * a duplicate or a gap, and otherwise after DGRAM_ACK_DELAY_MS. The sender keeps up to
+ * DGRAM_WINDOW messages unacknowledged and sends all of them again when the oldest was not
+ * acknowledged in time (go-back-N), with a timeout that doubles on every try, or at once when an
+ * acknowledgement repeats itself, once per window.
+ *
+ * Datagrams leave and arrive DGRAM_BATCH at a time with sendmmsg/recvmmsg. Where the kernel offers
+ * it, a run of equally sized DATA for one peer leaves as a single UDP_SEGMENT (GSO) send, and
+ * coalesced receives (UDP_GRO) are taken apart again.
+ */
+#define DGRAM_DATA              1
+#define DGRAM_ACK               2
+
+#define DGRAM_HEADER_LEN        8
+#define DGRAM_MAX_PAYLOAD       1200    /* below common path MTUs, nothing gets fragmented */
+#define DGRAM_MAX_LEN           (DGRAM_HEADER_LEN + DGRAM_MAX_PAYLOAD)
+#define DGRAM_WINDOW            64      /* unacknowledged messages per peer, power of two  */
+#define DGRAM_BATCH             64      /* datagrams per sendmmsg/recvmmsg                 */
+#define DGRAM_GRO_BATCH         8       /* receive buffers of DGRAM_GRO_LEN with UDP_GRO   */
+#define DGRAM_GRO_LEN           65536
+#define DGRAM_GSO_SEGMENTS      64      /* datagrams per UDP_SEGMENT send at most          */
+#define DGRAM_ACK_DELAY_MS      10
+#define DGRAM_RTO_MS            200     /* first retransmission timeout                    */
+#define DGRAM_RTO_MAX_MS        3200
+#define DGRAM_RETRIES           8       /* timeouts without progress before a peer is lost */
+
+typedef struct DatagramHeader {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t length;            /* payload length, network byte order              */
+	uint32_t seq;               /* DATA: its number, ACK: last one taken in order  */
+} DatagramHeader;
+
+/* one peer of a DatagramSocket, both directions of the chat with it */
+typedef struct DatagramPeer {
+	struct sockaddr_in addr;
+	void *owner;                /* the caller's, handed back with its messages     */
+	uint32_t sent;              /* number of the last message queued               */
+	uint32_t flushed;           /* last message handed to the kernel               */
+	uint32_t acked;             /* last message the peer acknowledged              */
+	uint32_t received;          /* last message taken in order                     */
+	uint32_t acked_received;    /* last message we acknowledged                    */
+	uint32_t recover;           /* flushed at the last fast retransmission         */
+	bool ack_now;               /* acknowledge with the next flush                 */
+	uint64_t ack_at_ns;         /* delayed acknowledgement due, 0 when none        */
+	uint64_t rto_at_ns;         /* retransmission due, 0 while all is acknowledged */
+	unsigned rto_ms;
+	unsigned retries;           /* timeouts since the peer last acknowledged       */
+	bool lost;                  /* gave up on the peer                             */
+	char *window;               /* DGRAM_WINDOW datagrams of DGRAM_MAX_LEN, by number */
+	uint16_t lengths[DGRAM_WINDOW];
+	struct DatagramPeer *next;
+} DatagramPeer;
+
+typedef void (*datagram_handler)(void *ctx, DatagramPeer *peer, const char *data, size_t len);
+
+/* an unconnected, non-blocking UDP socket serving any number of peers */
+typedef struct DatagramSocket {
+	int fd;
+	uint16_t port;              /* bound to, host byte order                       */
+	bool gso;                   /* UDP_SEGMENT sends                               */
+	bool gro;                   /* UDP_GRO receives                                */
+	DatagramPeer *peers;
+	struct mmsghdr out[DGRAM_BATCH];
+	struct iovec out_iov[DGRAM_BATCH * 2];
+	DatagramHeader out_acks[DGRAM_BATCH];
+	char out_control[DGRAM_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+	struct mmsghdr *in;
+	struct iovec *in_iov;
+	struct sockaddr_in *in_addr;
+	char *in_control;
+	char *rx;
+	unsigned rx_count;          /* receive buffers                                 */
+	size_t rx_size;             /* bytes per receive buffer                        */
+	uint64_t syscalls;          /* sendmmsg and recvmmsg made                      */
+	uint64_t datagrams_out;
+	uint64_t datagrams_in;
+	uint64_t retransmits;
+} DatagramSocket;
+
+int datagram_socket_open(DatagramSocket *sock, const struct sockaddr_in *addr);
+
+void datagram_socket_close(DatagramSocket *sock);
+
+int datagram_peer_init(DatagramSocket *sock, DatagramPeer *peer, const struct sockaddr_in *addr, void *owner);
+
+void datagram_peer_free(DatagramSocket *sock, DatagramPeer *peer);
+
+int datagram_queue(DatagramPeer *peer, const void *data, size_t len);
+
+int datagram_flush(DatagramSocket *sock, uint64_t now_ns);
+
+int datagram_receive(DatagramSocket *sock, uint64_t now_ns, datagram_handler handler, void *ctx);
+
+int datagram_timeout_ms(const DatagramSocket *sock, uint64_t now_ns);
+
+bool datagram_pending_output(const DatagramSocket *sock);
+
+/* the peer takes another message */
+static inline bool datagram_peer_room(const DatagramPeer *peer) {
+	return !peer->lost && peer->sent - peer->acked < DGRAM_WINDOW;
+}
+
+static inline uint32_t datagram_peer_unacked(const DatagramPeer *peer) {
+	return peer->sent - peer->acked;
+}
+
+#endif //C_CHAT_DATAGRAM_H
@@ -1,22 +1,52 @@
 #ifndef C_CHAT_LOGGING_H
 #define C_CHAT_LOGGING_H
 
+#include <stdarg.h>
+#include <stddef.h>
+
 #define DEBUG_LEVEL   2
 #define INFO_LEVEL    4
 #define ERROR_LEVEL   8
 
+/* what log_async_start() callers do when the record ring is full */
+#define LOG_OVERFLOW_DROP     0   /* discard the record and count it  */
+#define LOG_OVERFLOW_BLOCK    1   /* wait for the writer to make room */
+
+#define LOG_ASYNC_CAPACITY    4096
+
+/*
+ * Lowest level compiled in. Statements below it are removed by the compiler, release builds of
+ * the apps define it as INFO_LEVEL so log_debug() costs nothing there.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL DEBUG_LEVEL
+#endif
+
 extern int LOG_LEVEL;
 
+/*
+ * One predictable branch on LOG_LEVEL, taken before any argument of the statement is evaluated.
+ * Debug statements are predicted off, so the filtered out path is the one laid out inline.
+ */
+#define log_enabled(level)  ((level) >= LOG_MIN_LEVEL && __builtin_expect((level) >= LOG_LEVEL, (level) > DEBUG_LEVEL))
+
+#define log_debug(...)      do { if (log_enabled(DEBUG_LEVEL)) log_write(DEBUG_LEVEL, __VA_ARGS__); } while (0)
+#define log_info(...)       do { if (log_enabled(INFO_LEVEL)) log_write(INFO_LEVEL, __VA_ARGS__); } while (0)
+#define log_error(...)      do { if (log_enabled(ERROR_LEVEL)) log_write(ERROR_LEVEL, __VA_ARGS__); } while (0)
+#define log_with_errno(...) do { if (log_enabled(ERROR_LEVEL)) log_write_errno(__VA_ARGS__); } while (0)
+
+
+int log_async_start(size_t capacity, int policy);
 
-void log_format(const char *level, const char *message, va_list args);
+void log_async_stop(void);
 
-void log_debug(const char *message, ...);
+size_t log_dropped_records(void);
 
-void log_info(const char *message, ...);
+void log_format(int level, const char *message, va_list args);
 
-void log_error(const char *message, ...);
+void log_write(int level, const char *message, ...) __attribute__((format(printf, 2, 3)));
 
-void log_with_errno(char *message, ...);
+void log_write_errno(const char *message, ...) __attribute__((format(printf, 1, 2)));
 
 void log_usage(const char *, const char *);
 
@@ -0,0 +1,189 @@
+#ifndef C_CHAT_METRICS_H
+#define C_CHAT_METRICS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* latency histograms every worker keeps, all in nanoseconds */
+enum latency_id {
+	LATENCY_FIRST_BYTE,         /* accept to the first bytes read            */
+	LATENCY_REGISTER,           /* STAGE1 REGISTER/UNREGISTER processing     */
+	LATENCY_OPERATION,          /* STAGE2 LISTEN/CONNECT processing          */
+	LATENCY_LOOKUP,             /* one registry search                       */
+	LATENCY_LIFETIME,           /* accept to close                           */
+	LATENCY_COUNT
+};
+
+/* values a snapshot carries for every histogram */
+enum latency_field {
+	LATENCY_FIELD_COUNT,
+	LATENCY_FIELD_P50,
+	LATENCY_FIELD_P99,
+	LATENCY_FIELD_P999,
+	LATENCY_FIELD_MAX,
+	LATENCY_FIELDS
+};
+
+/* metric ids, the order doubles as the wire order of the OP_STATS answer */
+enum metric_id {
+	/* counters kept by every worker */
+	METRIC_RX_BYTES,
+	METRIC_TX_BYTES,
+	METRIC_ACCEPTED,
+	METRIC_CLOSED,
+	METRIC_HANDSHAKES,
+	METRIC_REQ_HELLO,
+	METRIC_REQ_REGISTER,
+	METRIC_REQ_UNREGISTER,
+	METRIC_REQ_LISTEN,
+	METRIC_REQ_CONNECT,
+	METRIC_REQ_PING,
+	METRIC_REQ_STATS,
+	METRIC_REQ_HEARTBEAT,
+	METRIC_REQ_PARK,
+	METRIC_REQ_RELAY,
+	METRIC_REQ_JOIN,
+	METRIC_REQ_LEAVE,
+	METRIC_REQ_PUBLISH,
+	METRIC_STATUS_OK,
+	METRIC_STATUS_BAD_REQUEST,
+	METRIC_STATUS_NOT_FOUND,
+	METRIC_STATUS_CONFLICT,
+	METRIC_ERR_PROTOCOL,        /* malformed or unexpected messages          */
+	METRIC_ERR_SOCKET,          /* failed reads and writes                   */
+	METRIC_ERR_RESOURCE,        /* out of memory or buffer space             */
+	METRIC_LEASES_EXPIRED,      /* registrations dropped without a heartbeat */
+	METRIC_IDLE_CLOSED,         /* connections closed for sitting idle       */
+	METRIC_RELAYS_OPENED,
+	METRIC_RELAYS_CLOSED,
+	METRIC_RELAY_BYTES,         /* spliced from one end of a relay to the other */
+	METRIC_ROOM_DELIVERIES,     /* room messages queued for a member           */
+	METRIC_ROOM_SLOW_CLOSED,    /* members closed for falling behind a room    */
+	METRIC_WORKER_COUNT,
+
+	/* gauges worked out when a snapshot is taken */
+	METRIC_CONNECTIONS = METRIC_WORKER_COUNT,
+	METRIC_RELAYS,
+	METRIC_PARKED,              /* process wide, filled in by the server       */
+	METRIC_REGISTERED_USERS,
+
+	/* LATENCY_FIELDS values per histogram, see metric_latency_id() */
+	METRIC_LATENCY,
+	METRIC_COUNT = METRIC_LATENCY + LATENCY_COUNT * LATENCY_FIELDS
+};
+
+static inline int metric_latency_id(int latency, int field) {
+	return METRIC_LATENCY + latency * LATENCY_FIELDS + field;
+}
+
+/*
+ * Log-linear histogram in the style of HdrHistogram: values below 2 * LATENCY_SUB_COUNT get a
+ * bucket each, every power of two above is split in LATENCY_SUB_COUNT buckets, so a recorded
+ * value is off by at most 1 / LATENCY_SUB_COUNT (about 3%).
+ */
+#define LATENCY_SUB_BITS        5
+#define LATENCY_SUB_COUNT       (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS        44      /* 2^44 ns (about 4.9 hours) and up share the last bucket */
+#define LATENCY_BUCKETS         ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+
+typedef struct LatencyHistogram {
+	_Atomic uint64_t buckets[LATENCY_BUCKETS];
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+} LatencyHistogram;
+
+typedef struct LatencySummary {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+} LatencySummary;
+
+/*
+ * Counters of one worker, on cache lines of their own. Only the owning worker writes them, so an
+ * update is a plain load and store; anyone may read them at any time for a snapshot.
+ */
+typedef struct WorkerMetrics {
+	_Atomic uint64_t values[METRIC_WORKER_COUNT];
+	LatencyHistogram *latency;  /* LATENCY_COUNT histograms, NULL when not allocated */
+} __attribute__((aligned(64))) WorkerMetrics;
+
+/* single writer update, no read-modify-write instruction needed */
+static inline void metric_bump(_Atomic uint64_t *counter, uint64_t n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metric_add(WorkerMetrics *metrics, int id, uint64_t n) {
+	metric_bump(&metrics->values[id], n);
+}
+
+static inline void metric_inc(WorkerMetrics *metrics, int id) {
+	metric_add(metrics, id, 1);
+}
+
+static inline uint64_t metric_read(const WorkerMetrics *metrics, int id) {
+	return atomic_load_explicit(&((WorkerMetrics *) metrics)->values[id], memory_order_relaxed);
+}
+
+static inline uint64_t metrics_now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+static inline int latency_bucket(uint64_t ns) {
+	int shift;
+
+	if (ns < 2 * LATENCY_SUB_COUNT) {
+		return (int) ns;
+	}
+	shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+	if (shift + LATENCY_SUB_BITS >= LATENCY_MAX_BITS) {
+		return LATENCY_BUCKETS - 1;
+	}
+	return (shift << LATENCY_SUB_BITS) + (int) (ns >> shift);
+}
+
+/* add one value, histograms have a single writer */
+static inline void histogram_record(LatencyHistogram *histogram, uint64_t ns) {
+	metric_bump(&histogram->buckets[latency_bucket(ns)], 1);
+	metric_bump(&histogram->count, 1);
+	metric_bump(&histogram->sum, ns);
+	if (ns > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+		atomic_store_explicit(&histogram->max, ns, memory_order_relaxed);
+	}
+}
+
+/* record ns in one of the worker's histograms, only the owning worker may call this */
+static inline void latency_record(WorkerMetrics *metrics, int id, uint64_t ns) {
+	if (metrics->latency != NULL) {
+		histogram_record(&metrics->latency[id], ns);
+	}
+}
+
+/* record the time passed since start_ns */
+static inline void latency_record_since(WorkerMetrics *metrics, int id, uint64_t start_ns) {
+	latency_record(metrics, id, metrics_now_ns() - start_ns);
+}
+
+int metric_status_id(int status);
+
+const char *latency_name(int id);
+
+void histogram_summarize(const LatencyHistogram *const *histograms, int count, LatencySummary *summary);
+
+void latency_summarize(const WorkerMetrics *workers, int count, int id, LatencySummary *summary);
+
+void metrics_snapshot(const WorkerMetrics *workers, int count, uint64_t *values);
+
+size_t metrics_format_text(const uint64_t *values, size_t count, char separator, char *buffer, size_t size);
+
+int metrics_write_prometheus(FILE *out, const WorkerMetrics *workers, int count, uint64_t parked, uint64_t registered_users);
+
+#endif //C_CHAT_METRICS_H
@@ -1,10 +1,245 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #define REGISTER_BYTE   'R'
 #define UNREGISTER_BYTE 'U'
 #define CONNECT_BYTE    'C'
 #define LISTEN_BYTE     'L'
+#define STATS_BYTE      'S'
+#define HEARTBEAT_BYTE  'H'
+#define PARK_BYTE       'P'
+#define RELAY_BYTE      'X'
+#define JOIN_BYTE       'J'     /* rooms are binary protocol only, see OP_JOIN   */
+#define LEAVE_BYTE      'Q'
+#define PUBLISH_BYTE    'M'
+
+/*
+ * Binary protocol. Every frame starts with a fixed 4 byte header followed by 'length' payload
+ * bytes. Opcodes have the high bit set, so the first byte a client sends tells the server whether
+ * it speaks the binary protocol (OP_HELLO) or the ASCII one (one of the *_BYTE characters).
+ *
+ *   OP_HELLO       client: uint8 highest version it speaks, server: uint8 version chosen.
+ *                  The header flags carry the HELLO_FLAG_* options, the server echoes the ones
+ *                  it accepted
+ *   OP_REGISTER    username (not NUL terminated)
+ *   OP_UNREGISTER  username
+ *   OP_LISTEN      uint32 IPv4 address, uint16 port (both network byte order)
+ *   OP_CONNECT     username of the peer
+ *   OP_STATUS      uint16 status code [, uint32 IPv4 address, uint16 port]
+ *   OP_PING        keepalive on a session connection, no payload
+ *   OP_PONG        answer to OP_PING, no payload
+ *   OP_STATS       client: no payload, server: uint64 counters in metrics.h METRIC_* order of the
+ *                  server's version, readers take length / 8 of them
+ *   OP_HEARTBEAT   username; renews the lease of the registration, answered with OP_STATUS 200,
+ *                  or 404 once the lease has run out and the user has to register again
+ *   OP_PARK        username; a listener leaves the connection with a relaying server for a caller,
+ *                  answered with OP_STATUS 200 once one took it, 404 if the user does not listen
+ *   OP_RELAY       username of the peer; answered with OP_STATUS 200 when a connection the peer
+ *                  parked was joined with this one, 404 when it has none
+ *   OP_JOIN        room name; answered with OP_STATUS 200, 409 when already a member
+ *   OP_LEAVE       room name; answered with OP_STATUS 200, 404 when not a member
+ *   OP_PUBLISH     uint16 room length, room, uint16 username length, username, text. Clients send
+ *                  it without a username, members get it with the sender's. Only answered with
+ *                  OP_STATUS 404 when the sender is not a member, 400 when it does not fit
+ *
+ * Multi-byte fields are in network byte order.
+ */
+#define PROTOCOL_VERSION        1
+
+#define OP_HELLO                0x80
+#define OP_REGISTER             0x81
+#define OP_UNREGISTER           0x82
+#define OP_LISTEN               0x83
+#define OP_CONNECT              0x84
+#define OP_STATUS               0x85
+#define OP_PING                 0x86
+#define OP_PONG                 0x87
+#define OP_STATS                0x88
+#define OP_HEARTBEAT            0x89
+#define OP_PARK                 0x8A
+#define OP_RELAY                0x8B
+#define OP_JOIN                 0x8C
+#define OP_LEAVE                0x8D
+#define OP_PUBLISH              0x8E
+
+/*
+ * Session mode: the connection stays open after LISTEN/CONNECT for keepalives and UNREGISTER,
+ * and the server unregisters the user as soon as the connection goes away.
+ */
+#define HELLO_FLAG_SESSION      0x01
+
+#define SESSION_KEEPALIVE_SECS  15      /* client sends OP_PING after this much silence */
+
+/*
+ * Registrations without a session are leases: the server drops them when no heartbeat renewed
+ * them for REGISTRATION_LEASE_SECS (configurable on the server), so clients that crashed or never
+ * unregister do not stay around forever.
+ */
+#define REGISTRATION_LEASE_SECS 90
+#define HEARTBEAT_INTERVAL_SECS 30      /* client renews its lease this often            */
+
+/*
+ * Relay mode: for peers that cannot reach each other, a listener parks connections with the
+ * server and a caller asks for one with RELAY. After the 200 on both, the two connections are
+ * joined and carry the chat as they would directly; the server takes nothing out of them anymore.
+ * Nothing may be sent behind a PARK before its answer.
+ */
+#define RELAY_PARKED            2       /* connections a listener keeps parked            */
+
+/*
+ * Rooms: a registered user joins rooms on its connection, which stays open for them. Whatever a
+ * member publishes reaches every other member of the room; the sender gets nothing back.
+ */
+#define ROOM_NAME_MAX_LEN       64
+
+/*
+ * Chats between peers are NUL terminated messages both ways. Messages are numbered from 1 in the
+ * order they are sent, which TCP keeps, so the number never travels; the receiver acknowledges
+ * them cumulatively with CHAT_ACK_BYTE and the decimal number of the last one it took, once every
+ * half window. A sender keeps at most CHAT_WINDOW messages unacknowledged and streams freely
+ * within that.
+ * A caller that reaches the listener directly may offer to chat over UDP (datagram.h) right
+ * behind its username: CHAT_UDP_BYTE and the decimal port of its UDP socket, at the address of
+ * the connection. The listener answers in kind with the port of its own, or 0 to stay on TCP. The
+ * caller sends nothing more until the answer, after a yes every message goes over UDP while the
+ * connection stays for closing the chat. Messages longer than DGRAM_MAX_PAYLOAD go in pieces of
+ * consecutive datagrams, only the last piece ends with the NUL terminator.
+ */
+#define CHAT_ACK_BYTE           0x06
+#define CHAT_UDP_BYTE           0x07
+#define CHAT_WINDOW             64
+
+#define FRAME_HEADER_LEN        4
+#define FRAME_MAX_PAYLOAD       1024
+
+#define STATUS_OK               200
+#define STATUS_BAD_REQUEST      400
+#define STATUS_NOT_FOUND        404
+#define STATUS_CONFLICT         409
+
+typedef struct FrameHeader {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t length;            /* payload length, network byte order */
+} FrameHeader;
+
+/* decoded frame, payload points into the buffer it was decoded from */
+typedef struct Frame {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t length;
+	const uint8_t *payload;
+} Frame;
+
+/* decoded OP_PUBLISH, the fields point into the frame's payload and are not NUL terminated */
+typedef struct RoomPost {
+	const char *room;
+	uint16_t room_len;
+	const char *username;
+	uint16_t username_len;
+	const char *text;
+	uint16_t text_len;
+} RoomPost;
+
+static inline int is_binary_opcode(uint8_t byte) {
+	return byte & 0x80;
+}
+
+/*
+ * Buffered message stream over a socket. Received bytes collect in a ring buffer and come out as
+ * whole messages however TCP split or merged them; queued output is written with writev and
+ * survives partial writes. Works with blocking and non-blocking descriptors alike.
+ */
+#define FRAMING_DETECT          0       /* decided by the first byte received             */
+#define FRAMING_ASCII           1       /* NUL terminated messages                        */
+#define FRAMING_BINARY          2       /* FrameHeader + payload                          */
+
+#define STREAM_BUFFER_LEN       4096    /* default ring size, must be a power of two      */
+
+typedef struct RingBuffer {
+	char *data;
+	size_t capacity;            /* power of two                                   */
+	size_t head;                /* read position, free running                    */
+	size_t tail;                /* write position, free running                   */
+} RingBuffer;
+
+typedef struct FramedStream {
+	int fd;
+	int framing;
+	RingBuffer rx;
+	RingBuffer tx;
+	char *scratch;              /* holds a message that wraps around the end of rx */
+} FramedStream;
+
+/* a complete message, data (and frame.payload) stay valid until the next read from the stream */
+typedef struct FramedMessage {
+	const char *data;
+	size_t len;                 /* ASCII messages include their NUL terminator    */
+	Frame frame;                /* decoded header when framing is FRAMING_BINARY  */
+} FramedMessage;
+
+int framed_stream_init(FramedStream *stream, int fd, int framing, size_t rx_capacity, size_t tx_capacity);
+
+void framed_stream_reset(FramedStream *stream, int fd, int framing);
+
+void framed_stream_free(FramedStream *stream);
+
+ssize_t framed_read(FramedStream *stream);
+
+int framed_feed(FramedStream *stream, const void *data, size_t len);
+
+int framed_next(FramedStream *stream, FramedMessage *message);
+
+size_t framed_take(FramedStream *stream, void *out, size_t len);
+
+int framed_write(FramedStream *stream, const void *data, size_t len);
+
+ssize_t framed_flush(FramedStream *stream);
+
+int framed_output(FramedStream *stream, struct iovec iov[2]);
+
+void framed_sent(FramedStream *stream, size_t len);
+
+int framed_recv(FramedStream *stream, FramedMessage *message);
+
+int framed_send(FramedStream *stream, const void *data, size_t len);
+
+static inline size_t framed_pending_output(const FramedStream *stream) {
+	return stream->tx.tail - stream->tx.head;
+}
+
+static inline size_t framed_pending_input(const FramedStream *stream) {
+	return stream->rx.tail - stream->rx.head;
+}
+
+size_t frame_encode(void *buffer, uint8_t opcode, uint8_t flags, const void *payload, uint16_t length);
+
+size_t frame_encode_hello(void *buffer, uint8_t version, uint8_t flags);
+
+size_t frame_encode_listen(void *buffer, uint32_t ip_addr, uint16_t port);
+
+size_t frame_encode_status(void *buffer, uint16_t status);
+
+size_t frame_encode_status_address(void *buffer, uint16_t status, uint32_t ip_addr, uint16_t port);
+
+size_t frame_encode_stats(void *buffer, const uint64_t *values, size_t count);
+
+size_t frame_encode_publish(void *buffer, const char *room, const char *username, const void *text, size_t text_len);
+
+size_t frame_decode(const void *buffer, size_t available, Frame *frame);
+
+int frame_decode_listen(const Frame *frame, uint32_t *ip_addr, uint16_t *port);
+
+int frame_decode_status(const Frame *frame, uint16_t *status, uint32_t *ip_addr, uint16_t *port);
+
+size_t frame_decode_stats(const Frame *frame, uint64_t *values, size_t max);
+
+int frame_decode_publish(const Frame *frame, RoomPost *post);
 
 int extract_status_code(char *plaintext);
 
@@ -0,0 +1,94 @@
+#ifndef C_CHAT_SHARED_REGISTRY_H
+#define C_CHAT_SHARED_REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "structures.h"
+
+#define REGISTRY_SHARDS         64      /* power of two, picked by the top bits of the name's hash */
+#define REGISTRY_READERS        256     /* threads that may call shared_registry_read()            */
+#define REGISTRY_RETIRE_BATCH   64      /* retired blocks a shard gathers before reclaiming        */
+
+/* memory unlinked from a shard, freed once no reader can be looking at it any more */
+typedef struct RetiredBlock {
+	void *ptr;
+	uint64_t epoch;             /* global epoch when it was unlinked */
+} RetiredBlock;
+
+/*
+ * One registry of the sharded whole. Writers take the lock and wrap every change in
+ * registry_write_begin() / registry_write_end(), which keep 'sequence' odd meanwhile; readers
+ * take no lock and repeat a lookup that overlapped a change.
+ */
+typedef struct RegistryShard {
+	pthread_mutex_t lock;
+	_Atomic uint32_t sequence;
+	UserRegistry *registry;
+	RetiredBlock *retired;      /* under lock */
+	size_t retired_count;
+	size_t retired_capacity;
+	struct SharedRegistry *owner;
+} __attribute__((aligned(64))) RegistryShard;
+
+/* a reader's announcement for epoch based reclamation, 0 while it is not reading */
+typedef struct RegistryReader {
+	_Atomic uint64_t epoch;
+} __attribute__((aligned(64))) RegistryReader;
+
+/*
+ * User registry for many threads: lookups are lock-free and writers only serialize with writers
+ * of the same shard. Tables and names a writer unlinks are retired, not freed, and reclaimed
+ * when every reader has moved past the epoch they were unlinked in. Records themselves are
+ * never returned to the system, so a reader holding a stale one still reads valid memory.
+ */
+typedef struct SharedRegistry {
+	RegistryShard shards[REGISTRY_SHARDS];
+	RegistryReader readers[REGISTRY_READERS];
+	_Atomic uint64_t epoch;
+} SharedRegistry;
+
+SharedRegistry *create_shared_registry(size_t capacity);
+
+void free_shared_registry(SharedRegistry *shared);
+
+static inline RegistryShard *registry_shard_of(SharedRegistry *shared, uint64_t hash) {
+	return &shared->shards[hash >> (64 - __builtin_ctz(REGISTRY_SHARDS))];
+}
+
+RegistryShard *registry_shard(SharedRegistry *shared, const char *username);
+
+static inline void registry_shard_lock(RegistryShard *shard) {
+	pthread_mutex_lock(&shard->lock);
+}
+
+static inline void registry_shard_unlock(RegistryShard *shard) {
+	pthread_mutex_unlock(&shard->lock);
+}
+
+static inline void registry_write_begin(RegistryShard *shard) {
+	atomic_store_explicit(&shard->sequence, atomic_load_explicit(&shard->sequence, memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void registry_write_end(RegistryShard *shard) {
+	atomic_store_explicit(&shard->sequence, atomic_load_explicit(&shard->sequence, memory_order_relaxed) + 1, memory_order_release);
+}
+
+RegisteredUser *shard_add_user(RegistryShard *shard, const char *username);
+
+void shard_delete_user(RegistryShard *shard, const char *username);
+
+void shared_registry_lock_all(SharedRegistry *shared);
+
+void shared_registry_unlock_all(SharedRegistry *shared);
+
+int shared_registry_read(SharedRegistry *shared, int reader, const char *username, RegisteredUserView *view);
+
+size_t shared_registry_count(SharedRegistry *shared);
+
+int shared_registry_for_each(SharedRegistry *shared, int (*visit)(RegisteredUser *user, void *arg), void *arg);
+
+#endif //C_CHAT_SHARED_REGISTRY_H
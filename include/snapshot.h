@@ -0,0 +1,80 @@
+#ifndef C_CHAT_SNAPSHOT_H
+#define C_CHAT_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "structures.h"
+#include "shared_registry.h"
+
+#define SNAPSHOT_MAGIC          "CCHATREG"
+#define SNAPSHOT_VERSION        2       /* bump on any layout or hash_username() change */
+
+/*
+ * On-disk registry checkpoint, laid out to be used in place after mmap(): a header, a fixed-size
+ * record per user, an open addressing index over the records and the NUL terminated names.
+ * Offsets are from the start of the file and every section is 8 byte aligned. Values are in
+ * host byte order, a snapshot is only read back on the machine that wrote it.
+ */
+typedef struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t file_size;
+	uint64_t users;
+	uint64_t index_capacity;    /* power of two, at least twice the users                   */
+	uint64_t records_offset;
+	uint64_t index_offset;
+	uint64_t names_offset;
+	uint64_t names_size;
+	uint64_t wal_sequence;      /* last write-ahead log record the snapshot includes, 0 if none */
+	uint64_t checksum;          /* of the header with this field zeroed                     */
+} SnapshotHeader;
+
+typedef struct SnapshotRecord {
+	uint64_t hash;              /* hash_username() of the name                              */
+	uint32_t name_offset;       /* into the names section                                   */
+	uint16_t name_len;
+	uint16_t port;
+	uint32_t ip_addr;
+	char operation;
+	char padding[3];
+} SnapshotRecord;
+
+/* index slot, record is the record number + 1 so that 0 marks a free slot */
+typedef struct SnapshotSlot {
+	uint32_t record;
+	uint32_t tag;               /* upper half of the hash, spares most record reads on a miss */
+} SnapshotSlot;
+
+/*
+ * A mapped snapshot. Users move from the mapping into a heap registry one at a time, either when
+ * they are first looked up or by registry_snapshot_restore(); 'restored' remembers which ones
+ * already did, so a user deleted after the move never comes back from the file.
+ */
+typedef struct RegistrySnapshot {
+	void *base;
+	size_t size;
+	const SnapshotHeader *header;
+	const SnapshotRecord *records;
+	const SnapshotSlot *index;
+	const char *names;
+	_Atomic uint8_t *restored;  /* one bit per record, set by takes under different shard locks */
+	size_t next;                /* first record registry_snapshot_restore() looks at        */
+	atomic_size_t remaining;    /* records not restored yet                                 */
+} RegistrySnapshot;
+
+int registry_snapshot_write(SharedRegistry *registry, RegistrySnapshot *pending, uint64_t wal_sequence, const char *path);
+
+RegistrySnapshot *registry_snapshot_open(const char *path);
+
+void registry_snapshot_close(RegistrySnapshot *snapshot);
+
+const SnapshotRecord *registry_snapshot_find(const RegistrySnapshot *snapshot, const char *username, size_t *number);
+
+RegisteredUser *registry_snapshot_take(RegistrySnapshot *snapshot, SharedRegistry *registry, const char *username);
+
+size_t registry_snapshot_restore(RegistrySnapshot *snapshot, SharedRegistry *registry, size_t max);
+
+#endif //C_CHAT_SNAPSHOT_H
@@ -3,33 +3,126 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <netinet/in.h>
 
 
 
+#define USERNAME_MAX_LEN        256     /* longest username accepted by the client       */
+#define USERNAME_INLINE_LEN     32      /* names shorter than this are stored in the record */
+#define USER_SLAB_RECORDS       1024    /* records carved from each slab chunk            */
+
+/*
+ * One cache line per user. Short names live inline and longer ones in a separate allocation, the
+ * address the user listens on is kept in binary form and the peer is referenced directly. A peer
+ * reference is only valid while connected_with_generation matches the peer's generation, which
+ * is bumped every time a record is released back to the slab.
+ */
 typedef struct RegisteredUser {
-	//u_int32_t id;
-	char *username;
-	char *connected_with;
-	char *ip_addr;
-	int port;
+	union {
+		char inline_name[USERNAME_INLINE_LEN];
+		char *heap_name;
+	} username;
+	struct RegisteredUser *connected_with;  /* doubles as the free list link inside the slab */
+	uint32_t connected_with_generation;
+	uint32_t generation;
+	uint32_t ip_addr;                       /* IPv4 address in network byte order            */
+	uint16_t port;                          /* host byte order, 0 until the user listens     */
+	uint16_t username_len;
+	char operation;
+	uint32_t lease_expires;                 /* server second the lease ends, or a LEASE_*    */
+} __attribute__((aligned(64))) RegisteredUser;
+
+#define LEASE_UNSET             0           /* restored from disk, no lease armed yet        */
+#define LEASE_FOREVER           UINT32_MAX  /* owned by a session, or leases are disabled    */
+
+_Static_assert(sizeof(RegisteredUser) == 64, "RegisteredUser must fit a single cache line");
+
+/* fixed-size record allocator, chunks are never returned so stale peer references stay readable */
+typedef struct UserSlab {
+	RegisteredUser *free_list;
+	RegisteredUser **chunks;
+	size_t chunks_count;
+	size_t chunks_capacity;
+	size_t in_use;
+} UserSlab;
+
+/*
+ * Open addressing slot. user is NULL for a never used slot and REGISTRY_TOMBSTONE for a
+ * deleted one, the full hash is kept so probing only compares names on a hash match.
+ */
+typedef struct RegistrySlot {
+	uint64_t hash;
+	RegisteredUser *user;
+} RegistrySlot;
+
+typedef struct RegistryTable {
+	RegistrySlot *slots;
+	size_t capacity;            /* power of two, 0 when the table is not allocated  */
+	size_t used;                /* live entries plus tombstones                      */
+	size_t live;                /* live entries                                      */
+} RegistryTable;
+
+/*
+ * Hash indexed user registry. Growing does not rehash everything at once: the previous table is
+ * kept as 'old' and every mutation moves a few of its slots into 'table' until it is drained.
+ * Lookups consult both tables while a resize is in progress.
+ */
+typedef struct UserRegistry {
+	RegistryTable table;
+	RegistryTable old;
+	size_t migrate_index;       /* next slot of 'old' to move into 'table'           */
+	UserSlab slab;
+	void (*retire)(void *ptr, void *arg);   /* frees tables and names lock-free readers may still see, free() when NULL */
+	void *retire_arg;
+} UserRegistry;
+
+/* what an optimistic reader copies out of a record */
+typedef struct RegisteredUserView {
+	RegisteredUser *user;
+	uint32_t generation;
+	uint32_t ip_addr;
+	uint16_t port;
 	char operation;
-	struct RegisteredUser *next;
-} RegisteredUser;
+} RegisteredUserView;
+
+UserRegistry *create_user_registry(size_t capacity);
+
+void free_user_registry(UserRegistry *registry);
+
+uint64_t hash_username(const char *username, size_t len);
+
+RegisteredUser *create_registered_user(UserSlab *slab, const char *username, size_t len);
+
+void free_registered_user(UserSlab *slab, RegisteredUser *user);
+
+static inline const char *registered_user_name(const RegisteredUser *user) {
+	return user->username_len < USERNAME_INLINE_LEN ? user->username.inline_name : user->username.heap_name;
+}
+
+void registered_user_connect(RegisteredUser *user, RegisteredUser *peer);
+
+void registered_user_connect_view(RegisteredUser *user, const RegisteredUserView *peer);
+
+RegisteredUser *registered_user_peer(const RegisteredUser *user);
+
+RegisteredUser *add_registered_user(UserRegistry *registry, const char *username);
 
-RegisteredUser *create_registered_user();
+RegisteredUser *search_registered_user(UserRegistry *registry, const char *username);
 
-RegisteredUser *add_registered_user(RegisteredUser **head, char *username);
+int peek_registered_user(UserRegistry *registry, const _Atomic uint32_t *sequence, uint32_t seen,
+                         const char *username, size_t len, uint64_t hash, RegisteredUserView *view);
 
-RegisteredUser *search_registered_user(RegisteredUser *head, const char *username);
+void delete_registered_user(UserRegistry *registry, const char *username);
 
-void delete_registered_user(RegisteredUser **head, char *username);
+size_t registered_users_count(UserRegistry *registry);
 
-void free_registered_users_list(RegisteredUser *head);
+int registry_for_each(UserRegistry *registry, int (*visit)(RegisteredUser *user, void *arg), void *arg);
 
 void print_registered_user(RegisteredUser *user);
 
-void print_all_registered_users(RegisteredUser *head);
+void print_all_registered_users(UserRegistry *registry);
 
 uint32_t uint32_random(void);
 
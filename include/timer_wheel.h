@@ -0,0 +1,56 @@
+#ifndef C_CHAT_TIMER_WHEEL_H
+#define C_CHAT_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_WHEEL_BITS        6       /* slots per level as a power of two                  */
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS      4       /* 64^4 ticks ahead, further timers wait in the last one */
+
+struct Timer;
+
+typedef void (*timer_callback)(struct Timer *timer, void *arg);
+
+/* a timer embedded in whatever it times out, owned by one wheel and thread */
+typedef struct Timer {
+	struct Timer *next;
+	struct Timer **pprev;       /* link pointing at this timer, NULL while not armed */
+	uint64_t expires;           /* tick it fires at                                  */
+	timer_callback callback;
+	void *arg;
+} Timer;
+
+/*
+ * Hierarchical timer wheel in the style of Varghese and Lauck. Level 0 has a slot per tick, every
+ * level above a slot per TIMER_WHEEL_SLOTS slots of the one below. Arming and cancelling are
+ * O(1); a timer moves down a level when the wheel reaches its slot, so it is touched at most
+ * TIMER_WHEEL_LEVELS times however far ahead it was armed. Ticks are whatever unit the owner
+ * advances the wheel in.
+ */
+typedef struct TimerWheel {
+	Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	uint64_t now;               /* last tick advanced to */
+	size_t armed;
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now);
+
+void timer_init(Timer *timer, timer_callback callback, void *arg);
+
+static inline bool timer_armed(const Timer *timer) {
+	return timer->pprev != NULL;
+}
+
+void timer_wheel_add(TimerWheel *wheel, Timer *timer, uint64_t expires);
+
+void timer_wheel_cancel(TimerWheel *wheel, Timer *timer);
+
+size_t timer_wheel_advance(TimerWheel *wheel, uint64_t now);
+
+uint64_t timer_wheel_next(const TimerWheel *wheel);
+
+Timer *timer_wheel_pop(TimerWheel *wheel);
+
+#endif //C_CHAT_TIMER_WHEEL_H
@@ -0,0 +1,131 @@
+#ifndef C_CHAT_URING_H
+#define C_CHAT_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring over the raw system calls: one submission and one completion queue, mapped
+ * once at setup. Submissions are only made visible to the kernel by uring_submit_and_wait(), so
+ * everything prepared in between leaves with a single io_uring_enter. One thread per ring.
+ */
+typedef struct Uring {
+	int fd;
+	unsigned flags;             /* IORING_SETUP_* the ring was set up with   */
+	unsigned features;          /* IORING_FEAT_* the kernel offered         */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	unsigned sq_local_tail;     /* prepared entries, ahead of *sq_tail       */
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;              /* same as sq_ring with IORING_FEAT_SINGLE_MMAP */
+	size_t cq_ring_size;
+	size_t sqes_size;
+} Uring;
+
+/*
+ * Ring of equally sized receive buffers registered with the kernel (IORING_REGISTER_PBUF_RING):
+ * a receive with IOSQE_BUFFER_SELECT takes one only once data is there, so idle connections hold
+ * no buffer. The id of the one used comes back in the completion flags.
+ */
+typedef struct UringBuffers {
+	struct io_uring_buf_ring *ring;
+	char *data;
+	size_t ring_size;
+	unsigned count;             /* power of two                               */
+	size_t size;                /* bytes per buffer                           */
+	uint16_t group;
+} UringBuffers;
+
+int uring_init(Uring *ring, unsigned entries, unsigned flags);
+
+int uring_enable(Uring *ring);
+
+void uring_free(Uring *ring);
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr, int timeout_ms);
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+
+void uring_cqe_seen(Uring *ring);
+
+int uring_buffers_init(Uring *ring, UringBuffers *buffers, uint16_t group, unsigned count, size_t size);
+
+void uring_buffers_free(Uring *ring, UringBuffers *buffers);
+
+void uring_buffer_recycle(UringBuffers *buffers, uint16_t id);
+
+/* submission entries that can still be prepared before the queue has to be submitted */
+static inline unsigned uring_sq_space(const Uring *ring) {
+	return ring->sq_entries - (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static inline char *uring_buffer(const UringBuffers *buffers, uint16_t id) {
+	return buffers->data + (size_t) id * buffers->size;
+}
+
+/* buffer a receive completion used, -1 when it carries none */
+static inline int uring_cqe_buffer(const struct io_uring_cqe *cqe) {
+	return cqe->flags & IORING_CQE_F_BUFFER ? (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+}
+
+static inline void uring_prep(struct io_uring_sqe *sqe, uint8_t opcode, int fd, const void *addr, uint32_t len, uint64_t user_data) {
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) addr;
+	sqe->len = len;
+	sqe->user_data = user_data;
+}
+
+/* one completion per accepted connection until the kernel ends it (no IORING_CQE_F_MORE) */
+static inline void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, int flags, uint64_t user_data) {
+	uring_prep(sqe, IORING_OP_ACCEPT, fd, NULL, 0, user_data);
+	sqe->accept_flags = (uint32_t) flags;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* receive into a buffer of the group, picked once data arrived */
+static inline void uring_prep_recv_select(struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data) {
+	uring_prep(sqe, IORING_OP_RECV, fd, NULL, 0, user_data);
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = group;
+}
+
+static inline void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, int flags, uint64_t user_data) {
+	uring_prep(sqe, IORING_OP_SENDMSG, fd, msg, 1, user_data);
+	sqe->msg_flags = (uint32_t) flags;
+}
+
+static inline void uring_prep_close(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+	uring_prep(sqe, IORING_OP_CLOSE, fd, NULL, 0, user_data);
+}
+
+/* one completion per time fd became ready for events */
+static inline void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd, uint32_t events, uint64_t user_data) {
+	uring_prep(sqe, IORING_OP_POLL_ADD, fd, NULL, IORING_POLL_ADD_MULTI, user_data);
+	sqe->poll32_events = events;
+}
+
+/* cancel the request submitted with target as its user_data */
+static inline void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data) {
+	uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, user_data);
+	sqe->addr = target;
+}
+
+#endif //C_CHAT_URING_H
@@ -0,0 +1,111 @@
+#ifndef C_CHAT_WAL_H
+#define C_CHAT_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "structures.h"
+#include "shared_registry.h"
+#include "snapshot.h"
+
+#define WAL_MAGIC               "CCHATWAL"
+#define WAL_VERSION             1
+#define WAL_SEGMENT_SUFFIX      ".wal."     /* segments are <path>.wal.<first sequence>      */
+
+/* when appended records reach the disk */
+enum wal_sync_policy {
+	WAL_SYNC_ALWAYS,            /* fdatasync every batch, callers wait for it       */
+	WAL_SYNC_INTERVAL,          /* fdatasync at most every WAL_SYNC_INTERVAL_MS     */
+	WAL_SYNC_NEVER              /* leave it to the kernel                           */
+};
+
+#define WAL_SYNC_INTERVAL_MS    100
+
+enum wal_record_type {
+	WAL_REGISTER = 1,
+	WAL_UNREGISTER,
+	WAL_LISTEN,                 /* ip_addr and port of the user                     */
+	WAL_CONNECT                 /* peer the user connected with                     */
+};
+
+/* record header on disk, followed by the name and the peer name, neither NUL terminated, padded to 8 bytes */
+typedef struct WalRecord {
+	uint32_t length;            /* bytes after the header                           */
+	uint32_t checksum;          /* of the record with this field zeroed             */
+	uint64_t sequence;
+	uint32_t ip_addr;           /* network byte order                               */
+	uint16_t port;
+	uint16_t name_len;
+	uint16_t peer_len;
+	uint8_t type;
+	uint8_t padding[5];
+} WalRecord;
+
+_Static_assert(sizeof(WalRecord) == 32, "WalRecord keeps the records after it 8 byte aligned");
+
+typedef struct WalSegmentHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t padding;
+} WalSegmentHeader;
+
+typedef struct WalBuffer {
+	char *data;
+	size_t len;
+	size_t capacity;
+} WalBuffer;
+
+/*
+ * Append-only log of registry mutations with group commit. Appends only copy the record into
+ * 'pending'; a writer thread swaps the buffers and puts everything gathered meanwhile on disk
+ * with one write() and, depending on the policy, one fdatasync(). The log is split in segments,
+ * a new one is started by wal_rotate() and the older ones are deleted by wal_compacted() once a
+ * snapshot covers them.
+ */
+typedef struct WriteAheadLog {
+	char *path;
+	int policy;
+	size_t compact_bytes;       /* segment bytes that ask for a compaction, 0 never   */
+	void (*on_durable)(void *arg);  /* from the writer thread after every sync        */
+	void (*on_compact)(void *arg);  /* from the writer thread, once per segment       */
+	void *arg;
+
+	pthread_mutex_t lock;       /* pending, next_sequence and the flags below         */
+	pthread_cond_t wake;
+	WalBuffer pending;
+	uint64_t next_sequence;
+	bool stopping;
+	bool compact_asked;
+
+	pthread_mutex_t io_lock;    /* fd, the segment fields and writing                 */
+	WalBuffer writing;
+	int fd;
+	uint64_t segment;           /* first sequence of the current segment              */
+	size_t segment_bytes;       /* bytes in the current segment                       */
+	bool unsynced;              /* written since the last fdatasync                   */
+	uint64_t synced_ms;
+
+	_Atomic uint64_t durable;   /* every record up to this one is on disk             */
+	_Atomic int error;          /* errno of the first failed write or sync, 0 if none */
+	pthread_t thread;
+} WriteAheadLog;
+
+int wal_replay(const char *path, uint64_t after, SharedRegistry *registry, RegistrySnapshot *snapshot, uint64_t *last, size_t *bytes);
+
+WriteAheadLog *wal_open(const char *path, uint64_t next_sequence, int policy, size_t replayed_bytes, size_t compact_bytes,
+                        void (*on_durable)(void *arg), void (*on_compact)(void *arg), void *arg);
+
+uint64_t wal_append(WriteAheadLog *wal, int type, const char *username, const char *peer, uint32_t ip_addr, uint16_t port);
+
+bool wal_is_durable(WriteAheadLog *wal, uint64_t sequence);
+
+uint64_t wal_rotate(WriteAheadLog *wal);
+
+void wal_compacted(const char *path, uint64_t segment);
+
+void wal_close(WriteAheadLog *wal);
+
+#endif //C_CHAT_WAL_H
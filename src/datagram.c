@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+
+#include "datagram.h"
+
+// older headers lack the offloads, the kernel tells whether it has them
+#ifndef SOL_UDP
+#define SOL_UDP                 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT             103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO                 104
+#endif
+
+#define DGRAM_GSO_MAX_BYTES     65000   /* a UDP_SEGMENT send stays below the 64k datagram */
+
+
+/* a message prepared in DatagramSocket.out, first is 0 for an acknowledgement */
+typedef struct DatagramOut {
+	DatagramPeer *peer;
+	uint32_t first;
+} DatagramOut;
+
+static inline uint64_t ms_to_ns(unsigned ms) {
+	return (uint64_t) ms * 1000000ULL;
+}
+
+static inline char *window_slot(const DatagramPeer *peer, uint32_t seq) {
+	return peer->window + (size_t) (seq & (DGRAM_WINDOW - 1)) * DGRAM_MAX_LEN;
+}
+
+static inline uint16_t window_length(const DatagramPeer *peer, uint32_t seq) {
+	return peer->lengths[seq & (DGRAM_WINDOW - 1)];
+}
+
+/*
+ * Bind a UDP socket to addr (port 0 picks one) and switch on the offloads the kernel has. Returns
+ * -1 with errno set on error.
+ */
+int datagram_socket_open(DatagramSocket *sock, const struct sockaddr_in *addr) {
+	struct sockaddr_in bound;
+	socklen_t len = sizeof(bound);
+	int gso_size = 0;
+	int on = 1;
+	int saved_errno;
+
+	memset(sock, 0, sizeof(DatagramSocket));
+	if ((sock->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP)) == -1) {
+		return -1;
+	}
+	if (bind(sock->fd, (const struct sockaddr *) addr, sizeof(struct sockaddr_in)) == -1 ||
+	    getsockname(sock->fd, (struct sockaddr *) &bound, &len) == -1) {
+		goto fail;
+	}
+	sock->port = ntohs(bound.sin_port);
+	// a segment size of 0 leaves every send as it is, the option only tells that GSO is there (4.18)
+	sock->gso = setsockopt(sock->fd, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == 0;
+	sock->gro = setsockopt(sock->fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+
+	// coalesced receives need buffers that can take a whole train of segments
+	sock->rx_count = sock->gro ? DGRAM_GRO_BATCH : DGRAM_BATCH;
+	sock->rx_size = sock->gro ? DGRAM_GRO_LEN : DGRAM_MAX_LEN;
+	sock->in = calloc(sock->rx_count, sizeof(struct mmsghdr));
+	sock->in_iov = calloc(sock->rx_count, sizeof(struct iovec));
+	sock->in_addr = calloc(sock->rx_count, sizeof(struct sockaddr_in));
+	sock->in_control = calloc(sock->rx_count, CMSG_SPACE(sizeof(int)));
+	sock->rx = malloc(sock->rx_count * sock->rx_size);
+	if (sock->in == NULL || sock->in_iov == NULL || sock->in_addr == NULL || sock->in_control == NULL || sock->rx == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	saved_errno = errno;
+	datagram_socket_close(sock);
+	errno = saved_errno;
+	return -1;
+}
+
+/* close the socket, the peers are the caller's to free */
+void datagram_socket_close(DatagramSocket *sock) {
+	if (sock->fd != -1) {
+		close(sock->fd);
+	}
+	free(sock->in);
+	free(sock->in_iov);
+	free(sock->in_addr);
+	free(sock->in_control);
+	free(sock->rx);
+	memset(sock, 0, sizeof(DatagramSocket));
+	sock->fd = -1;
+}
+
+/* start a chat with addr, messages from there reach the handler with owner. Returns -1 when out of memory */
+int datagram_peer_init(DatagramSocket *sock, DatagramPeer *peer, const struct sockaddr_in *addr, void *owner) {
+	memset(peer, 0, sizeof(DatagramPeer));
+	if ((peer->window = malloc((size_t) DGRAM_WINDOW * DGRAM_MAX_LEN)) == NULL) {
+		return -1;
+	}
+	peer->addr = *addr;
+	peer->owner = owner;
+	peer->rto_ms = DGRAM_RTO_MS;
+	peer->next = sock->peers;
+	sock->peers = peer;
+	return 0;
+}
+
+void datagram_peer_free(DatagramSocket *sock, DatagramPeer *peer) {
+	DatagramPeer **link;
+
+	for (link = &sock->peers; *link != NULL; link = &(*link)->next) {
+		if (*link == peer) {
+			*link = peer->next;
+			break;
+		}
+	}
+	free(peer->window);
+	peer->window = NULL;
+}
+
+/* number the message and keep it in the window until acknowledged. Returns -1 when the window is full or it is too long */
+int datagram_queue(DatagramPeer *peer, const void *data, size_t len) {
+	DatagramHeader header;
+	char *slot;
+
+	if (!datagram_peer_room(peer)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (len > DGRAM_MAX_PAYLOAD) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	peer->sent++;
+	header.type = DGRAM_DATA;
+	header.flags = 0;
+	header.length = htons((uint16_t) len);
+	header.seq = htonl(peer->sent);
+	slot = window_slot(peer, peer->sent);
+	memcpy(slot, &header, DGRAM_HEADER_LEN);
+	memcpy(slot + DGRAM_HEADER_LEN, data, len);
+	peer->lengths[peer->sent & (DGRAM_WINDOW - 1)] = (uint16_t) (DGRAM_HEADER_LEN + len);
+	return 0;
+}
+
+/* the oldest message went unacknowledged for too long: everything after it goes out again */
+static void datagram_check_timeout(DatagramSocket *sock, DatagramPeer *peer, uint64_t now_ns) {
+	if (peer->rto_at_ns == 0 || now_ns < peer->rto_at_ns) {
+		return;
+	}
+	peer->rto_at_ns = 0;
+	if (++peer->retries > DGRAM_RETRIES) {
+		peer->lost = true;
+		return;
+	}
+	sock->retransmits += peer->flushed - peer->acked;
+	peer->flushed = peer->acked;
+	peer->rto_ms = peer->rto_ms * 2 > DGRAM_RTO_MAX_MS ? DGRAM_RTO_MAX_MS : peer->rto_ms * 2;
+}
+
+/*
+ * Hand the prepared messages to the kernel. What it did not take is prepared again by the next
+ * flush. Returns 1 when all of them left, 0 when the socket is full and -1 on error.
+ */
+static int datagram_send_batch(DatagramSocket *sock, const DatagramOut *out, unsigned count) {
+	unsigned sent = 0;
+	int n;
+	int i;
+
+	while (sent < count) {
+		n = sendmmsg(sock->fd, sock->out + sent, count - sent, 0);
+		sock->syscalls++;
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				break;
+			}
+			// a device without checksum offload refuses segmentation, send one by one then
+			if ((errno == EIO || errno == EINVAL) && sock->gso) {
+				sock->gso = false;
+				break;
+			}
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			sock->datagrams_out += sock->out[sent + (unsigned) i].msg_hdr.msg_iovlen;
+		}
+		sent += (unsigned) n;
+	}
+	// backwards, so every peer ends up at its earliest message that did not leave
+	for (i = (int) count - 1; i >= (int) sent; i--) {
+		if (out[i].first == 0) {
+			out[i].peer->ack_now = true;
+		} else {
+			out[i].peer->flushed = out[i].first - 1;
+		}
+	}
+	return sent == count ? 1 : 0;
+}
+
+/* prepare the next run of messages of the peer as one message, one UDP_SEGMENT send with GSO */
+static void datagram_prepare_data(DatagramSocket *sock, DatagramPeer *peer, unsigned count, unsigned *iovs, uint64_t now_ns) {
+	struct msghdr *msg = &sock->out[count].msg_hdr;
+	struct cmsghdr *cmsg;
+	uint32_t seq = peer->flushed + 1;
+	uint16_t segment = window_length(peer, seq);
+	uint16_t len = segment;
+	size_t bytes = 0;
+	unsigned segments = 0;
+
+	memset(msg, 0, sizeof(struct msghdr));
+	msg->msg_name = &peer->addr;
+	msg->msg_namelen = sizeof(struct sockaddr_in);
+	msg->msg_iov = &sock->out_iov[*iovs];
+	// equally sized ones, the last of a run may be shorter
+	do {
+		sock->out_iov[*iovs].iov_base = window_slot(peer, seq);
+		sock->out_iov[*iovs].iov_len = len;
+		(*iovs)++;
+		segments++;
+		bytes += len;
+		seq++;
+	} while (sock->gso && len == segment && seq != peer->sent + 1 && segments < DGRAM_GSO_SEGMENTS && *iovs < DGRAM_BATCH * 2 &&
+	         (len = window_length(peer, seq)) <= segment && bytes + len <= DGRAM_GSO_MAX_BYTES);
+	msg->msg_iovlen = segments;
+	if (segments > 1) {
+		msg->msg_control = sock->out_control[count];
+		msg->msg_controllen = sizeof(sock->out_control[count]);
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		memcpy(CMSG_DATA(cmsg), &segment, sizeof(uint16_t));
+	}
+	sock->out[count].msg_len = 0;
+	peer->flushed = seq - 1;
+	if (peer->rto_at_ns == 0) {
+		peer->rto_at_ns = now_ns + ms_to_ns(peer->rto_ms);
+	}
+}
+
+static void datagram_prepare_ack(DatagramSocket *sock, DatagramPeer *peer, unsigned count, unsigned *iovs) {
+	struct msghdr *msg = &sock->out[count].msg_hdr;
+	DatagramHeader *header = &sock->out_acks[count];
+
+	header->type = DGRAM_ACK;
+	header->flags = 0;
+	header->length = 0;
+	header->seq = htonl(peer->received);
+	memset(msg, 0, sizeof(struct msghdr));
+	msg->msg_name = &peer->addr;
+	msg->msg_namelen = sizeof(struct sockaddr_in);
+	msg->msg_iov = &sock->out_iov[*iovs];
+	msg->msg_iovlen = 1;
+	sock->out_iov[*iovs].iov_base = header;
+	sock->out_iov[*iovs].iov_len = DGRAM_HEADER_LEN;
+	(*iovs)++;
+	sock->out[count].msg_len = 0;
+	peer->acked_received = peer->received;
+	peer->ack_now = false;
+	peer->ack_at_ns = 0;
+}
+
+/*
+ * Send what is due for every peer: new messages, the window again after a timeout, and
+ * acknowledgements, DGRAM_BATCH messages per system call. Peers that stopped acknowledging are
+ * marked lost. Returns 0, also when the socket is full (see datagram_pending_output()), -1 on
+ * error.
+ */
+int datagram_flush(DatagramSocket *sock, uint64_t now_ns) {
+	DatagramOut out[DGRAM_BATCH];
+	DatagramPeer *peer;
+	unsigned count = 0;
+	unsigned iovs = 0;
+	int ret;
+
+	for (peer = sock->peers; peer != NULL; peer = peer->next) {
+		if (peer->lost) {
+			continue;
+		}
+		datagram_check_timeout(sock, peer, now_ns);
+		while (!peer->lost && (peer->flushed != peer->sent || peer->ack_now || (peer->ack_at_ns != 0 && now_ns >= peer->ack_at_ns))) {
+			if (count == DGRAM_BATCH || iovs == DGRAM_BATCH * 2) {
+				if ((ret = datagram_send_batch(sock, out, count)) != 1) {
+					return ret;
+				}
+				count = 0;
+				iovs = 0;
+			}
+			out[count].peer = peer;
+			if (peer->flushed != peer->sent) {
+				out[count].first = peer->flushed + 1;
+				datagram_prepare_data(sock, peer, count, &iovs, now_ns);
+			} else {
+				out[count].first = 0;
+				datagram_prepare_ack(sock, peer, count, &iovs);
+			}
+			count++;
+		}
+	}
+	if (count > 0 && (ret = datagram_send_batch(sock, out, count)) != 1) {
+		return ret;
+	}
+	return 0;
+}
+
+static DatagramPeer *datagram_peer_of(const DatagramSocket *sock, const struct sockaddr_in *addr) {
+	DatagramPeer *peer;
+
+	for (peer = sock->peers; peer != NULL; peer = peer->next) {
+		if (peer->addr.sin_addr.s_addr == addr->sin_addr.s_addr && peer->addr.sin_port == addr->sin_port) {
+			return peer;
+		}
+	}
+	return NULL;
+}
+
+/* one datagram from addr. Anything not from a peer, or not making sense, is dropped */
+static void datagram_take(DatagramSocket *sock, const struct sockaddr_in *addr, const char *data, size_t len, uint64_t now_ns, datagram_handler handler, void *ctx) {
+	DatagramHeader header;
+	DatagramPeer *peer;
+	uint32_t seq;
+
+	if (len < DGRAM_HEADER_LEN) {
+		return;
+	}
+	memcpy(&header, data, DGRAM_HEADER_LEN);
+	if (ntohs(header.length) != len - DGRAM_HEADER_LEN || (peer = datagram_peer_of(sock, addr)) == NULL || peer->lost) {
+		return;
+	}
+	sock->datagrams_in++;
+	seq = ntohl(header.seq);
+	if (header.type == DGRAM_ACK) {
+		// the peer saw a gap: the window goes again, unless it did since what it lacks was sent
+		if (seq == peer->acked && peer->flushed != peer->acked && (int32_t) (peer->acked - peer->recover) >= 0) {
+			sock->retransmits += peer->flushed - peer->acked;
+			peer->recover = peer->flushed;
+			peer->flushed = peer->acked;
+			return;
+		}
+		// acknowledgements overtaken by later ones carry nothing new
+		if (seq == peer->acked || seq - peer->acked > peer->sent - peer->acked) {
+			return;
+		}
+		peer->acked = seq;
+		if ((int32_t) (peer->flushed - seq) < 0) {
+			peer->flushed = seq;
+		}
+		peer->retries = 0;
+		peer->rto_ms = DGRAM_RTO_MS;
+		peer->rto_at_ns = peer->flushed != peer->acked ? now_ns + ms_to_ns(peer->rto_ms) : 0;
+	} else if (header.type == DGRAM_DATA) {
+		if (seq != peer->received + 1) {
+			// a duplicate means our acknowledgement got lost, a gap that messages did
+			peer->ack_now = true;
+			return;
+		}
+		peer->received = seq;
+		if (peer->received - peer->acked_received >= DGRAM_WINDOW / 2) {
+			peer->ack_now = true;
+		} else if (peer->ack_at_ns == 0) {
+			peer->ack_at_ns = now_ns + ms_to_ns(DGRAM_ACK_DELAY_MS);
+		}
+		handler(ctx, peer, data + DGRAM_HEADER_LEN, len - DGRAM_HEADER_LEN);
+	}
+}
+
+/* the segment size of a coalesced receive, 0 when it is a single datagram */
+static size_t datagram_gro_segment(struct msghdr *msg) {
+	struct cmsghdr *cmsg;
+	int segment;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+			memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+			return segment > 0 ? (size_t) segment : 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Take everything waiting on the socket, a batch per system call. Messages that are next in order
+ * reach handler, which must not free the peer. Returns the datagrams taken, -1 on error.
+ */
+int datagram_receive(DatagramSocket *sock, uint64_t now_ns, datagram_handler handler, void *ctx) {
+	struct msghdr *msg;
+	const char *buffer;
+	size_t segment;
+	size_t offset;
+	size_t len;
+	int taken = 0;
+	int n;
+	int i;
+
+	while (1) {
+		for (i = 0; i < (int) sock->rx_count; i++) {
+			msg = &sock->in[i].msg_hdr;
+			sock->in_iov[i].iov_base = sock->rx + (size_t) i * sock->rx_size;
+			sock->in_iov[i].iov_len = sock->rx_size;
+			memset(msg, 0, sizeof(struct msghdr));
+			msg->msg_name = &sock->in_addr[i];
+			msg->msg_namelen = sizeof(struct sockaddr_in);
+			msg->msg_iov = &sock->in_iov[i];
+			msg->msg_iovlen = 1;
+			msg->msg_control = sock->in_control + (size_t) i * CMSG_SPACE(sizeof(int));
+			msg->msg_controllen = CMSG_SPACE(sizeof(int));
+		}
+		n = recvmmsg(sock->fd, sock->in, sock->rx_count, MSG_DONTWAIT, NULL);
+		sock->syscalls++;
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// ICMP errors of earlier sends surface here, they are nothing to act on
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED) {
+				return taken;
+			}
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			buffer = sock->in_iov[i].iov_base;
+			len = sock->in[i].msg_len;
+			if ((segment = datagram_gro_segment(&sock->in[i].msg_hdr)) == 0) {
+				segment = len;
+			}
+			for (offset = 0; offset < len; offset += segment) {
+				datagram_take(sock, &sock->in_addr[i], buffer + offset, len - offset < segment ? len - offset : segment, now_ns, handler, ctx);
+				taken++;
+			}
+		}
+		if (n < (int) sock->rx_count) {
+			return taken;
+		}
+	}
+}
+
+/* milliseconds until an acknowledgement or a retransmission is due, -1 when nothing is */
+int datagram_timeout_ms(const DatagramSocket *sock, uint64_t now_ns) {
+	const DatagramPeer *peer;
+	uint64_t due = UINT64_MAX;
+
+	for (peer = sock->peers; peer != NULL; peer = peer->next) {
+		if (peer->lost) {
+			continue;
+		}
+		if (peer->ack_at_ns != 0 && peer->ack_at_ns < due) {
+			due = peer->ack_at_ns;
+		}
+		if (peer->rto_at_ns != 0 && peer->rto_at_ns < due) {
+			due = peer->rto_at_ns;
+		}
+	}
+	if (due == UINT64_MAX) {
+		return -1;
+	}
+	return due <= now_ns ? 0 : (int) ((due - now_ns + 999999) / 1000000);
+}
+
+/* something is waiting for the socket to take more, poll it for POLLOUT */
+bool datagram_pending_output(const DatagramSocket *sock) {
+	const DatagramPeer *peer;
+
+	for (peer = sock->peers; peer != NULL; peer = peer->next) {
+		if (!peer->lost && (peer->flushed != peer->sent || peer->ack_now)) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -4,79 +4,339 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 
 #include "logging.h"
 
 
-void log_format(const char *level, const char *message, va_list args) {
-	char *buffer = malloc(512 * sizeof(char));
-	char time_str[256];
-	time_t rawtime;
-	struct tm *timeinfo;
+#define LOG_RECORD_LEN      512     /* longest message kept, longer ones are truncated  */
+#define LOG_BATCH_LEN       65536   /* bytes the writer collects before each write      */
+#define LOG_TIME_LEN        32
+#define LOG_IDLE_WAIT_MS    100     /* writer re-checks the ring at least this often     */
 
-	time(&rawtime);
-	timeinfo = localtime(&rawtime);
+/*
+ * Slot of the bounded MPSC ring (Vyukov's queue). sequence tells who owns the slot: it equals
+ * the enqueue position when free for a producer and position + 1 once the record is published.
+ */
+typedef struct LogRecord {
+	atomic_size_t sequence;
+	int level;
+	time_t time;
+	char text[LOG_RECORD_LEN];
+} LogRecord;
 
-	sprintf(
+typedef struct AsyncLogger {
+	LogRecord *records;
+	size_t mask;                        /* capacity - 1, capacity is a power of two    */
+	int policy;                         /* LOG_OVERFLOW_DROP or LOG_OVERFLOW_BLOCK     */
+	_Alignas(64) atomic_size_t enqueue_pos;
+	_Alignas(64) size_t dequeue_pos;    /* only touched by the writer thread           */
+	atomic_bool writer_idle;
+	atomic_bool stopping;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+} AsyncLogger;
+
+static AsyncLogger *logger = NULL;
+static atomic_size_t dropped_records = 0;
+static bool atexit_registered = false;
+
+
+static const char *level_name(int level) {
+	switch (level) {
+		case DEBUG_LEVEL:
+			return "DEBUG";
+		case INFO_LEVEL:
+			return "INFO";
+		case ERROR_LEVEL:
+			return "ERROR";
+		default:
+			return "";
+	}
+}
+
+static void format_time(time_t rawtime, char *time_str) {
+	struct tm timeinfo;
+
+	localtime_r(&rawtime, &timeinfo);
+	snprintf(
 			time_str,
+			LOG_TIME_LEN,
 			"%d-%d-%d %d:%d:%d",
-			timeinfo->tm_mday,
-			timeinfo->tm_mon + 1,
-			timeinfo->tm_year + 1900,
-			timeinfo->tm_hour,
-			timeinfo->tm_min,
-			timeinfo->tm_sec
+			timeinfo.tm_mday,
+			timeinfo.tm_mon + 1,
+			timeinfo.tm_year + 1900,
+			timeinfo.tm_hour,
+			timeinfo.tm_min,
+			timeinfo.tm_sec
 	);
+}
+
+/* append "[time] [LEVEL] text\n" to out, returns the bytes written */
+static size_t format_line(char *out, size_t size, const char *time_str, int level, const char *text) {
+	int n = snprintf(out, size, "[%s] [%s] %s\n", time_str, level_name(level), text);
+	if (n < 0) {
+		return 0;
+	}
+	if ((size_t) n >= size) {
+		// keep the newline of a truncated line
+		out[size - 2] = '\n';
+		return size - 1;
+	}
+	return (size_t) n;
+}
+
+static void write_all(const char *data, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(STDOUT_FILENO, data, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		data += n;
+		len -= (size_t) n;
+	}
+}
 
-	sprintf(buffer, "[%s] [%s] %s", time_str, level, message);
+/* claim the next slot, NULL when the ring is full */
+static LogRecord *ring_reserve(AsyncLogger *log) {
+	size_t pos = atomic_load_explicit(&log->enqueue_pos, memory_order_relaxed);
+	LogRecord *record;
+	size_t sequence;
 
+	while (1) {
+		record = &log->records[pos & log->mask];
+		sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+		if (sequence == pos) {
+			if (atomic_compare_exchange_weak_explicit(&log->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				return record;
+			}
+		} else if (sequence < pos) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&log->enqueue_pos, memory_order_relaxed);
+		}
+	}
+}
+
+static void ring_publish(AsyncLogger *log, LogRecord *record) {
+	size_t pos = atomic_load_explicit(&record->sequence, memory_order_relaxed);
+
+	atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+	if (atomic_load(&log->writer_idle)) {
+		pthread_mutex_lock(&log->lock);
+		pthread_cond_signal(&log->wake);
+		pthread_mutex_unlock(&log->lock);
+	}
+}
+
+/* format every published record into large batches, returns how many were written */
+static size_t ring_drain(AsyncLogger *log, char *batch) {
+	static time_t last_time = -1;
+	static char time_str[LOG_TIME_LEN];
+	LogRecord *record;
+	size_t len = 0;
+	size_t count = 0;
+
+	while (1) {
+		record = &log->records[log->dequeue_pos & log->mask];
+		if (atomic_load_explicit(&record->sequence, memory_order_acquire) != log->dequeue_pos + 1) {
+			break;
+		}
 
-	int level_no;
-	if (strcmp(level, "DEBUG") == 0) {
-		level_no = DEBUG_LEVEL;
-	} else if (strcmp(level, "INFO") == 0) {
-		level_no = INFO_LEVEL;
-	} else if (strcmp(level, "ERROR") == 0) {
-		level_no = ERROR_LEVEL;
-	} else {
-		level_no = -1;
+		// records of the same second share one localtime_r call
+		if (record->time != last_time) {
+			last_time = record->time;
+			format_time(last_time, time_str);
+		}
+		if (LOG_BATCH_LEN - len < LOG_RECORD_LEN + 2 * LOG_TIME_LEN) {
+			write_all(batch, len);
+			len = 0;
+		}
+		len += format_line(batch + len, LOG_BATCH_LEN - len, time_str, record->level, record->text);
+
+		// hand the slot back to producers one lap later
+		atomic_store_explicit(&record->sequence, log->dequeue_pos + log->mask + 1, memory_order_release);
+		log->dequeue_pos++;
+		count++;
+	}
+
+	if (len > 0) {
+		write_all(batch, len);
+	}
+	return count;
+}
+
+static void *writer_loop(void *arg) {
+	AsyncLogger *log = arg;
+	char *batch = malloc(LOG_BATCH_LEN);
+	struct timespec deadline;
+
+	if (batch == NULL) {
+		return NULL;
 	}
 
-	if (level_no >= LOG_LEVEL) {
-		vprintf(buffer, args);
-		fprintf(stdout, "\n");
+	while (1) {
 		fflush(stdout);
+		if (ring_drain(log, batch) > 0) {
+			continue;
+		}
+		if (atomic_load(&log->stopping)) {
+			break;
+		}
+
+		// announce the nap before the last look, so a producer either sees it or we see its record
+		atomic_store(&log->writer_idle, true);
+		if (ring_drain(log, batch) == 0 && !atomic_load(&log->stopping)) {
+			pthread_mutex_lock(&log->lock);
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += LOG_IDLE_WAIT_MS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+			pthread_mutex_unlock(&log->lock);
+		}
+		atomic_store(&log->writer_idle, false);
 	}
 
-	free(buffer);
+	ring_drain(log, batch);
+	free(batch);
+	return NULL;
 }
 
-void log_debug(const char *message, ...) {
-	va_list args;
-	va_start(args, message);
-	log_format("DEBUG", message, args);
-	va_end(args);
+/*
+ * Move log output to a background writer. Callers only copy their message into a ring of
+ * 'capacity' records (rounded up to a power of two); policy decides what happens when it is full.
+ * Returns -1 if the logger could not be started, logging stays synchronous then.
+ */
+int log_async_start(size_t capacity, int policy) {
+	AsyncLogger *log;
+	size_t rounded = 2;
+	size_t i;
+
+	if (logger != NULL) {
+		return 0;
+	}
+	while (rounded < capacity) {
+		rounded *= 2;
+	}
+
+	if ((log = calloc(1, sizeof(AsyncLogger))) == NULL) {
+		return -1;
+	}
+	if ((log->records = calloc(rounded, sizeof(LogRecord))) == NULL) {
+		free(log);
+		return -1;
+	}
+	for (i = 0; i < rounded; i++) {
+		atomic_init(&log->records[i].sequence, i);
+	}
+	log->mask = rounded - 1;
+	log->policy = policy;
+	atomic_init(&log->enqueue_pos, 0);
+	log->dequeue_pos = 0;
+	atomic_init(&log->writer_idle, false);
+	atomic_init(&log->stopping, false);
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->wake, NULL);
+
+	if (pthread_create(&log->thread, NULL, writer_loop, log) != 0) {
+		free(log->records);
+		free(log);
+		return -1;
+	}
+	logger = log;
+
+	// exit() from anywhere still gets the queued lines out
+	if (!atexit_registered) {
+		atexit(log_async_stop);
+		atexit_registered = true;
+	}
+	return 0;
 }
 
-void log_info(const char *message, ...) {
-	va_list args;
-	va_start(args, message);
-	log_format("INFO", message, args);
-	va_end(args);
+/* write out whatever is still queued and go back to synchronous logging */
+void log_async_stop(void) {
+	AsyncLogger *log = logger;
+
+	if (log == NULL) {
+		return;
+	}
+	atomic_store(&log->stopping, true);
+	pthread_mutex_lock(&log->lock);
+	pthread_cond_signal(&log->wake);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->thread, NULL);
+
+	logger = NULL;
+	pthread_mutex_destroy(&log->lock);
+	pthread_cond_destroy(&log->wake);
+	free(log->records);
+	free(log);
+}
+
+size_t log_dropped_records(void) {
+	return atomic_load(&dropped_records);
+}
+
+void log_format(int level, const char *message, va_list args) {
+	char text[LOG_RECORD_LEN];
+	char time_str[LOG_TIME_LEN];
+	char line[LOG_RECORD_LEN + 2 * LOG_TIME_LEN];
+	LogRecord *record;
+
+	if (level < LOG_LEVEL) {
+		return;
+	}
+
+	if (logger != NULL) {
+		while ((record = ring_reserve(logger)) == NULL) {
+			if (logger->policy == LOG_OVERFLOW_DROP) {
+				atomic_fetch_add_explicit(&dropped_records, 1, memory_order_relaxed);
+				return;
+			}
+			sched_yield();
+		}
+		record->level = level;
+		record->time = time(NULL);
+		vsnprintf(record->text, sizeof(record->text), message, args);
+		ring_publish(logger, record);
+		return;
+	}
+
+	vsnprintf(text, sizeof(text), message, args);
+	format_time(time(NULL), time_str);
+	fflush(stdout);
+	write_all(line, format_line(line, sizeof(line), time_str, level, text));
 }
 
-void log_error(const char *message, ...) {
+void log_write(int level, const char *message, ...) {
 	va_list args;
 	va_start(args, message);
-	log_format("ERROR", message, args);
+	log_format(level, message, args);
 	va_end(args);
 }
 
-void log_with_errno(char *message, ...) {
+void log_write_errno(const char *message, ...) {
+	char text[LOG_RECORD_LEN];
+	int saved_errno = errno;
 	va_list args;
+
 	va_start(args, message);
-	log_error("%s - %s",message, strerror(errno));
+	vsnprintf(text, sizeof(text), message, args);
 	va_end(args);
+	log_write(ERROR_LEVEL, "%s - %s", text, strerror(saved_errno));
 }
 
 void log_usage(const char *message, const char *options) {
@@ -88,4 +348,3 @@ void log_usage(const char *message, const char *options) {
 	fprintf(stdout, "%s\n", options);
 	fflush(stdout);
 }
-
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "metrics.h"
+#include "network.h"
+
+
+typedef struct MetricInfo {
+	const char *family;         /* Prometheus metric name                   */
+	const char *label;          /* extra label of the sample, NULL for none */
+	const char *key;            /* name in the STATS text answer            */
+	const char *help;
+} MetricInfo;
+
+/* entries of the same family must be next to each other, latency metrics are named from latency_names */
+static const MetricInfo metric_info[METRIC_LATENCY] = {
+		[METRIC_RX_BYTES]           = {"c_chat_received_bytes_total", NULL, "rx_bytes", "Bytes received from clients."},
+		[METRIC_TX_BYTES]           = {"c_chat_transmitted_bytes_total", NULL, "tx_bytes", "Bytes sent to clients."},
+		[METRIC_ACCEPTED]           = {"c_chat_connections_accepted_total", NULL, "accepted", "Accepted client connections."},
+		[METRIC_CLOSED]             = {"c_chat_connections_closed_total", NULL, "closed", "Closed client connections."},
+		[METRIC_HANDSHAKES]         = {"c_chat_handshakes_total", NULL, "handshakes", "Completed UNREGISTER, LISTEN and CONNECT handshakes."},
+		[METRIC_REQ_HELLO]          = {"c_chat_requests_total", "op=\"hello\"", "req_hello", "Requests received by operation."},
+		[METRIC_REQ_REGISTER]       = {"c_chat_requests_total", "op=\"register\"", "req_register", NULL},
+		[METRIC_REQ_UNREGISTER]     = {"c_chat_requests_total", "op=\"unregister\"", "req_unregister", NULL},
+		[METRIC_REQ_LISTEN]         = {"c_chat_requests_total", "op=\"listen\"", "req_listen", NULL},
+		[METRIC_REQ_CONNECT]        = {"c_chat_requests_total", "op=\"connect\"", "req_connect", NULL},
+		[METRIC_REQ_PING]           = {"c_chat_requests_total", "op=\"ping\"", "req_ping", NULL},
+		[METRIC_REQ_STATS]          = {"c_chat_requests_total", "op=\"stats\"", "req_stats", NULL},
+		[METRIC_REQ_HEARTBEAT]      = {"c_chat_requests_total", "op=\"heartbeat\"", "req_heartbeat", NULL},
+		[METRIC_REQ_PARK]           = {"c_chat_requests_total", "op=\"park\"", "req_park", NULL},
+		[METRIC_REQ_RELAY]          = {"c_chat_requests_total", "op=\"relay\"", "req_relay", NULL},
+		[METRIC_REQ_JOIN]           = {"c_chat_requests_total", "op=\"join\"", "req_join", NULL},
+		[METRIC_REQ_LEAVE]          = {"c_chat_requests_total", "op=\"leave\"", "req_leave", NULL},
+		[METRIC_REQ_PUBLISH]        = {"c_chat_requests_total", "op=\"publish\"", "req_publish", NULL},
+		[METRIC_STATUS_OK]          = {"c_chat_responses_total", "code=\"200\"", "status_200", "Responses sent by status code."},
+		[METRIC_STATUS_BAD_REQUEST] = {"c_chat_responses_total", "code=\"400\"", "status_400", NULL},
+		[METRIC_STATUS_NOT_FOUND]   = {"c_chat_responses_total", "code=\"404\"", "status_404", NULL},
+		[METRIC_STATUS_CONFLICT]    = {"c_chat_responses_total", "code=\"409\"", "status_409", NULL},
+		[METRIC_ERR_PROTOCOL]       = {"c_chat_errors_total", "kind=\"protocol\"", "err_protocol", "Connection errors by kind."},
+		[METRIC_ERR_SOCKET]         = {"c_chat_errors_total", "kind=\"socket\"", "err_socket", NULL},
+		[METRIC_ERR_RESOURCE]       = {"c_chat_errors_total", "kind=\"resource\"", "err_resource", NULL},
+		[METRIC_LEASES_EXPIRED]     = {"c_chat_leases_expired_total", NULL, "leases_expired", "Registrations dropped after their lease ran out."},
+		[METRIC_IDLE_CLOSED]        = {"c_chat_idle_closed_total", NULL, "idle_closed", "Connections closed after sitting idle."},
+		[METRIC_RELAYS_OPENED]      = {"c_chat_relays_opened_total", NULL, "relays_opened", "Relayed chats started."},
+		[METRIC_RELAYS_CLOSED]      = {"c_chat_relays_closed_total", NULL, "relays_closed", "Relayed chats finished."},
+		[METRIC_RELAY_BYTES]        = {"c_chat_relay_bytes_total", NULL, "relay_bytes", "Bytes spliced between the ends of relayed chats."},
+		[METRIC_ROOM_DELIVERIES]    = {"c_chat_room_deliveries_total", NULL, "room_deliveries", "Room messages queued for a member."},
+		[METRIC_ROOM_SLOW_CLOSED]   = {"c_chat_room_slow_closed_total", NULL, "room_slow_closed", "Room members closed for falling too far behind."},
+		[METRIC_CONNECTIONS]        = {"c_chat_connections", NULL, "connections", "Open client connections."},
+		[METRIC_RELAYS]             = {"c_chat_relays", NULL, "relays", "Relayed chats in progress."},
+		[METRIC_PARKED]             = {"c_chat_parked_connections", NULL, "parked", "Connections parked for a relayed chat."},
+		[METRIC_REGISTERED_USERS]   = {"c_chat_registered_users", NULL, "registered_users", "Users in the registry."},
+};
+
+static const char *latency_names[LATENCY_COUNT] = {
+		[LATENCY_FIRST_BYTE] = "first_byte",
+		[LATENCY_REGISTER]   = "register",
+		[LATENCY_OPERATION]  = "operation",
+		[LATENCY_LOOKUP]     = "lookup",
+		[LATENCY_LIFETIME]   = "lifetime",
+};
+
+static const char *latency_field_names[LATENCY_FIELDS] = {
+		[LATENCY_FIELD_COUNT] = "count",
+		[LATENCY_FIELD_P50]   = "p50_ns",
+		[LATENCY_FIELD_P99]   = "p99_ns",
+		[LATENCY_FIELD_P999]  = "p999_ns",
+		[LATENCY_FIELD_MAX]   = "max_ns",
+};
+
+/* metric counting responses with the given status code, -1 for codes without one */
+int metric_status_id(int status) {
+	switch (status) {
+		case STATUS_OK:
+			return METRIC_STATUS_OK;
+		case STATUS_BAD_REQUEST:
+			return METRIC_STATUS_BAD_REQUEST;
+		case STATUS_NOT_FOUND:
+			return METRIC_STATUS_NOT_FOUND;
+		case STATUS_CONFLICT:
+			return METRIC_STATUS_CONFLICT;
+		default:
+			return -1;
+	}
+}
+
+const char *latency_name(int id) {
+	return latency_names[id];
+}
+
+/* highest value that lands in the bucket */
+static uint64_t latency_bucket_limit(int bucket) {
+	int shift;
+	uint64_t sub;
+
+	if (bucket < 2 * LATENCY_SUB_COUNT) {
+		return (uint64_t) bucket;
+	}
+	shift = (bucket >> LATENCY_SUB_BITS) - 1;
+	sub = (uint64_t) (bucket - (shift << LATENCY_SUB_BITS));
+	return ((sub + 1) << shift) - 1;
+}
+
+/* value below which a 'quantile' share of the recorded values falls, never above the maximum seen */
+static uint64_t latency_quantile(const uint64_t *buckets, uint64_t count, uint64_t max, double quantile) {
+	uint64_t rank = (uint64_t) (quantile * (double) count + 0.5);
+	uint64_t seen = 0;
+	uint64_t limit;
+	int bucket;
+
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		seen += buckets[bucket];
+		if (seen >= rank) {
+			limit = latency_bucket_limit(bucket);
+			return limit < max ? limit : max;
+		}
+	}
+	return max;
+}
+
+/* merge histograms and work out the percentiles of the whole, NULL entries are skipped */
+void histogram_summarize(const LatencyHistogram *const *histograms, int count, LatencySummary *summary) {
+	uint64_t *buckets = calloc(LATENCY_BUCKETS, sizeof(uint64_t));
+	const LatencyHistogram *histogram;
+	uint64_t value;
+	uint64_t total = 0;
+	int bucket;
+	int i;
+
+	memset(summary, 0, sizeof(LatencySummary));
+	if (buckets == NULL) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		if ((histogram = histograms[i]) == NULL) {
+			continue;
+		}
+		for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+			value = atomic_load_explicit((_Atomic uint64_t *) &histogram->buckets[bucket], memory_order_relaxed);
+			buckets[bucket] += value;
+			total += value;
+		}
+		summary->sum += atomic_load_explicit((_Atomic uint64_t *) &histogram->sum, memory_order_relaxed);
+		value = atomic_load_explicit((_Atomic uint64_t *) &histogram->max, memory_order_relaxed);
+		if (value > summary->max) {
+			summary->max = value;
+		}
+	}
+
+	// the buckets are the reference, count and sum of a histogram may be one record ahead of them
+	summary->count = total;
+	if (total > 0) {
+		summary->p50 = latency_quantile(buckets, total, summary->max, 0.5);
+		summary->p99 = latency_quantile(buckets, total, summary->max, 0.99);
+		summary->p999 = latency_quantile(buckets, total, summary->max, 0.999);
+	}
+	free(buckets);
+}
+
+/* merge one histogram of every worker */
+void latency_summarize(const WorkerMetrics *workers, int count, int id, LatencySummary *summary) {
+	const LatencyHistogram **histograms = calloc((size_t) count + 1, sizeof(LatencyHistogram *));
+	int w;
+
+	if (histograms == NULL) {
+		memset(summary, 0, sizeof(LatencySummary));
+		return;
+	}
+	for (w = 0; w < count; w++) {
+		histograms[w] = workers[w].latency != NULL ? &workers[w].latency[id] : NULL;
+	}
+	histogram_summarize(histograms, count, summary);
+	free(histograms);
+}
+
+/*
+ * Gauge of a worker: open connections or relays. The closing counter is read first so a
+ * concurrent open cannot make it negative.
+ */
+static uint64_t worker_gauge(const WorkerMetrics *metrics, int id) {
+	uint64_t closed = metric_read(metrics, id == METRIC_RELAYS ? METRIC_RELAYS_CLOSED : METRIC_CLOSED);
+	uint64_t opened = metric_read(metrics, id == METRIC_RELAYS ? METRIC_RELAYS_OPENED : METRIC_ACCEPTED);
+
+	return opened > closed ? opened - closed : 0;
+}
+
+/* sum the counters of all workers into values[METRIC_COUNT], METRIC_PARKED and METRIC_REGISTERED_USERS are left 0 */
+void metrics_snapshot(const WorkerMetrics *workers, int count, uint64_t *values) {
+	LatencySummary summary;
+	int w;
+	int id;
+
+	memset(values, 0, METRIC_COUNT * sizeof(uint64_t));
+	for (w = 0; w < count; w++) {
+		for (id = 0; id < METRIC_WORKER_COUNT; id++) {
+			values[id] += metric_read(&workers[w], id);
+		}
+		values[METRIC_CONNECTIONS] += worker_gauge(&workers[w], METRIC_CONNECTIONS);
+		values[METRIC_RELAYS] += worker_gauge(&workers[w], METRIC_RELAYS);
+	}
+
+	for (id = 0; id < LATENCY_COUNT; id++) {
+		latency_summarize(workers, count, id, &summary);
+		values[metric_latency_id(id, LATENCY_FIELD_COUNT)] = summary.count;
+		values[metric_latency_id(id, LATENCY_FIELD_P50)] = summary.p50;
+		values[metric_latency_id(id, LATENCY_FIELD_P99)] = summary.p99;
+		values[metric_latency_id(id, LATENCY_FIELD_P999)] = summary.p999;
+		values[metric_latency_id(id, LATENCY_FIELD_MAX)] = summary.max;
+	}
+}
+
+/*
+ * Write the first count values as "key=value" pairs split by separator. Returns the length of the
+ * text, which is always NUL terminated and cut short if it does not fit.
+ */
+size_t metrics_format_text(const uint64_t *values, size_t count, char separator, char *buffer, size_t size) {
+	size_t len = 0;
+	size_t id;
+	int n;
+
+	if (size == 0) {
+		return 0;
+	}
+	buffer[0] = '\0';
+	for (id = 0; id < count && id < METRIC_COUNT; id++) {
+		if (id < METRIC_LATENCY) {
+			n = snprintf(buffer + len, size - len, "%.*s%s=%" PRIu64, id > 0, &separator, metric_info[id].key, values[id]);
+		} else {
+			n = snprintf(buffer + len, size - len, "%clatency_%s_%s=%" PRIu64, separator,
+			             latency_names[(id - METRIC_LATENCY) / LATENCY_FIELDS], latency_field_names[(id - METRIC_LATENCY) % LATENCY_FIELDS], values[id]);
+		}
+		if (n < 0 || (size_t) n >= size - len) {
+			buffer[len] = '\0';
+			break;
+		}
+		len += (size_t) n;
+	}
+	return len;
+}
+
+/*
+ * Dump every metric in the Prometheus text exposition format, per worker where the worker keeps
+ * it. Returns -1 if writing to out failed.
+ */
+int metrics_write_prometheus(FILE *out, const WorkerMetrics *workers, int count, uint64_t parked, uint64_t registered_users) {
+	const MetricInfo *info;
+	LatencySummary summary;
+	uint64_t value;
+	int id;
+	int w;
+
+	for (id = 0; id < METRIC_LATENCY; id++) {
+		info = &metric_info[id];
+		if (id == 0 || strcmp(info->family, metric_info[id - 1].family) != 0) {
+			fprintf(out, "# HELP %s %s\n", info->family, info->help);
+			fprintf(out, "# TYPE %s %s\n", info->family, id < METRIC_WORKER_COUNT ? "counter" : "gauge");
+		}
+
+		if (id == METRIC_PARKED || id == METRIC_REGISTERED_USERS) {
+			fprintf(out, "%s %" PRIu64 "\n", info->family, id == METRIC_PARKED ? parked : registered_users);
+			continue;
+		}
+		for (w = 0; w < count; w++) {
+			value = id < METRIC_WORKER_COUNT ? metric_read(&workers[w], id) : worker_gauge(&workers[w], id);
+			fprintf(out, "%s{worker=\"%d\"%s%s} %" PRIu64 "\n", info->family, w, info->label ? "," : "", info->label ? info->label : "", value);
+		}
+	}
+
+	// histograms are merged across workers, percentiles of separate workers cannot be added up
+	fprintf(out, "# HELP c_chat_latency_seconds Latency of the connection stages.\n");
+	fprintf(out, "# TYPE c_chat_latency_seconds summary\n");
+	for (id = 0; id < LATENCY_COUNT; id++) {
+		latency_summarize(workers, count, id, &summary);
+		fprintf(out, "c_chat_latency_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n", latency_names[id], summary.p50 / 1e9);
+		fprintf(out, "c_chat_latency_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n", latency_names[id], summary.p99 / 1e9);
+		fprintf(out, "c_chat_latency_seconds{stage=\"%s\",quantile=\"0.999\"} %.9f\n", latency_names[id], summary.p999 / 1e9);
+		fprintf(out, "c_chat_latency_seconds{stage=\"%s\",quantile=\"1\"} %.9f\n", latency_names[id], summary.max / 1e9);
+		fprintf(out, "c_chat_latency_seconds_sum{stage=\"%s\"} %.9f\n", latency_names[id], summary.sum / 1e9);
+		fprintf(out, "c_chat_latency_seconds_count{stage=\"%s\"} %" PRIu64 "\n", latency_names[id], summary.count);
+	}
+	return ferror(out) ? -1 : 0;
+}
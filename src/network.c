@@ -1,11 +1,480 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
 
 #include "network.h"
 #include "logging.h"
 
 
+size_t frame_encode(void *buffer, uint8_t opcode, uint8_t flags, const void *payload, uint16_t length) {
+	uint8_t *p = buffer;
+	FrameHeader header = {opcode, flags, htons(length)};
+
+	memcpy(p, &header, FRAME_HEADER_LEN);
+	if (length > 0) {
+		memcpy(p + FRAME_HEADER_LEN, payload, length);
+	}
+	return FRAME_HEADER_LEN + length;
+}
+
+size_t frame_encode_hello(void *buffer, uint8_t version, uint8_t flags) {
+	return frame_encode(buffer, OP_HELLO, flags, &version, sizeof(version));
+}
+
+size_t frame_encode_listen(void *buffer, uint32_t ip_addr, uint16_t port) {
+	uint8_t payload[6];
+	port = htons(port);
+	memcpy(payload, &ip_addr, 4);
+	memcpy(payload + 4, &port, 2);
+	return frame_encode(buffer, OP_LISTEN, 0, payload, sizeof(payload));
+}
+
+size_t frame_encode_status(void *buffer, uint16_t status) {
+	status = htons(status);
+	return frame_encode(buffer, OP_STATUS, 0, &status, sizeof(status));
+}
+
+size_t frame_encode_status_address(void *buffer, uint16_t status, uint32_t ip_addr, uint16_t port) {
+	uint8_t payload[8];
+	status = htons(status);
+	port = htons(port);
+	memcpy(payload, &status, 2);
+	memcpy(payload + 2, &ip_addr, 4);
+	memcpy(payload + 6, &port, 2);
+	return frame_encode(buffer, OP_STATUS, 0, payload, sizeof(payload));
+}
+
+/* counters as big endian uint64, as many as fit a frame */
+size_t frame_encode_stats(void *buffer, const uint64_t *values, size_t count) {
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	uint64_t value;
+	size_t i;
+
+	if (count > FRAME_MAX_PAYLOAD / sizeof(uint64_t)) {
+		count = FRAME_MAX_PAYLOAD / sizeof(uint64_t);
+	}
+	for (i = 0; i < count; i++) {
+		value = htobe64(values[i]);
+		memcpy(payload + i * sizeof(value), &value, sizeof(value));
+	}
+	return frame_encode(buffer, OP_STATS, 0, payload, (uint16_t) (count * sizeof(value)));
+}
+
+/* OP_PUBLISH into buffer, which must hold FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD bytes. 0 if it does not fit a frame */
+size_t frame_encode_publish(void *buffer, const char *room, const char *username, const void *text, size_t text_len) {
+	uint8_t *p = (uint8_t *) buffer + FRAME_HEADER_LEN;
+	size_t room_len = strlen(room);
+	size_t username_len = strlen(username);
+	size_t length = 2 + room_len + 2 + username_len + text_len;
+	FrameHeader header;
+	uint16_t field;
+
+	if (length > FRAME_MAX_PAYLOAD) {
+		return 0;
+	}
+	field = htons((uint16_t) room_len);
+	memcpy(p, &field, 2);
+	memcpy(p + 2, room, room_len);
+	p += 2 + room_len;
+	field = htons((uint16_t) username_len);
+	memcpy(p, &field, 2);
+	memcpy(p + 2, username, username_len);
+	memcpy(p + 2 + username_len, text, text_len);
+
+	header.opcode = OP_PUBLISH;
+	header.flags = 0;
+	header.length = htons((uint16_t) length);
+	memcpy(buffer, &header, FRAME_HEADER_LEN);
+	return FRAME_HEADER_LEN + length;
+}
+
+/*
+ * Decode the frame at the start of buffer without copying its payload. Returns the number of
+ * bytes the frame occupies, or 0 while fewer than a whole frame is available.
+ */
+size_t frame_decode(const void *buffer, size_t available, Frame *frame) {
+	FrameHeader header;
+	size_t total;
+
+	if (available < FRAME_HEADER_LEN) {
+		return 0;
+	}
+	memcpy(&header, buffer, FRAME_HEADER_LEN);
+	frame->opcode = header.opcode;
+	frame->flags = header.flags;
+	frame->length = ntohs(header.length);
+	frame->payload = (const uint8_t *) buffer + FRAME_HEADER_LEN;
+
+	total = FRAME_HEADER_LEN + (size_t) frame->length;
+	return available >= total ? total : 0;
+}
+
+int frame_decode_listen(const Frame *frame, uint32_t *ip_addr, uint16_t *port) {
+	if (frame->length != 6) {
+		return -1;
+	}
+	memcpy(ip_addr, frame->payload, 4);
+	memcpy(port, frame->payload + 4, 2);
+	*port = ntohs(*port);
+	return 0;
+}
+
+// the address is optional, ip_addr and port are left untouched when the frame does not carry one
+int frame_decode_status(const Frame *frame, uint16_t *status, uint32_t *ip_addr, uint16_t *port) {
+	if (frame->opcode != OP_STATUS || (frame->length != 2 && frame->length != 8)) {
+		return -1;
+	}
+	memcpy(status, frame->payload, 2);
+	*status = ntohs(*status);
+	if (frame->length == 8) {
+		memcpy(ip_addr, frame->payload + 2, 4);
+		memcpy(port, frame->payload + 6, 2);
+		*port = ntohs(*port);
+	}
+	return 0;
+}
+
+/* returns how many counters were stored in values, 0 if the frame is not a STATS answer */
+size_t frame_decode_stats(const Frame *frame, uint64_t *values, size_t max) {
+	uint64_t value;
+	size_t count;
+	size_t i;
+
+	if (frame->opcode != OP_STATS) {
+		return 0;
+	}
+	count = frame->length / sizeof(value);
+	if (count > max) {
+		count = max;
+	}
+	for (i = 0; i < count; i++) {
+		memcpy(&value, frame->payload + i * sizeof(value), sizeof(value));
+		values[i] = be64toh(value);
+	}
+	return count;
+}
+
+int frame_decode_publish(const Frame *frame, RoomPost *post) {
+	const char *p = (const char *) frame->payload;
+	size_t left = frame->length;
+	uint16_t field;
+
+	if (frame->opcode != OP_PUBLISH || left < 2) {
+		return -1;
+	}
+	memcpy(&field, p, 2);
+	post->room_len = ntohs(field);
+	post->room = p + 2;
+	if (left - 2 < (size_t) post->room_len + 2) {
+		return -1;
+	}
+	p += 2 + post->room_len;
+	left -= 2 + post->room_len;
+	memcpy(&field, p, 2);
+	post->username_len = ntohs(field);
+	post->username = p + 2;
+	if (left - 2 < post->username_len) {
+		return -1;
+	}
+	post->text = p + 2 + post->username_len;
+	post->text_len = (uint16_t) (left - 2 - post->username_len);
+	return 0;
+}
+
+
+static int ring_init(RingBuffer *ring, size_t capacity) {
+	ring->data = malloc(capacity);
+	if (ring->data == NULL) {
+		return -1;
+	}
+	ring->capacity = capacity;
+	ring->head = 0;
+	ring->tail = 0;
+	return 0;
+}
+
+// split the free space (for_write) or the buffered bytes into at most two contiguous regions
+static int ring_regions(RingBuffer *ring, struct iovec iov[2], int for_write) {
+	size_t mask = ring->capacity - 1;
+	size_t start = for_write ? ring->tail : ring->head;
+	size_t len = for_write ? ring->capacity - (ring->tail - ring->head) : ring->tail - ring->head;
+	size_t offset = start & mask;
+	size_t first = ring->capacity - offset < len ? ring->capacity - offset : len;
+
+	if (len == 0) {
+		return 0;
+	}
+	iov[0].iov_base = ring->data + offset;
+	iov[0].iov_len = first;
+	if (first == len) {
+		return 1;
+	}
+	iov[1].iov_base = ring->data;
+	iov[1].iov_len = len - first;
+	return 2;
+}
+
+// copy len buffered bytes starting 'skip' bytes after head, without consuming them
+static void ring_peek(const RingBuffer *ring, size_t skip, void *out, size_t len) {
+	size_t offset = (ring->head + skip) & (ring->capacity - 1);
+	size_t first = ring->capacity - offset < len ? ring->capacity - offset : len;
+
+	memcpy(out, ring->data + offset, first);
+	memcpy((char *) out + first, ring->data, len - first);
+}
+
+static void ring_put(RingBuffer *ring, const void *data, size_t len) {
+	size_t offset = ring->tail & (ring->capacity - 1);
+	size_t first = ring->capacity - offset < len ? ring->capacity - offset : len;
+
+	memcpy(ring->data + offset, data, first);
+	memcpy(ring->data, (const char *) data + first, len - first);
+	ring->tail += len;
+}
+
+int framed_stream_init(FramedStream *stream, int fd, int framing, size_t rx_capacity, size_t tx_capacity) {
+	memset(stream, 0, sizeof(FramedStream));
+	stream->fd = fd;
+	stream->framing = framing;
+	if (ring_init(&stream->rx, rx_capacity) == -1) {
+		return -1;
+	}
+	if (ring_init(&stream->tx, tx_capacity) == -1) {
+		free(stream->rx.data);
+		return -1;
+	}
+	return 0;
+}
+
+/* reuse the buffers of a stream for another connection, whatever was buffered is dropped */
+void framed_stream_reset(FramedStream *stream, int fd, int framing) {
+	stream->fd = fd;
+	stream->framing = framing;
+	stream->rx.head = 0;
+	stream->rx.tail = 0;
+	stream->tx.head = 0;
+	stream->tx.tail = 0;
+}
+
+void framed_stream_free(FramedStream *stream) {
+	free(stream->rx.data);
+	free(stream->tx.data);
+	free(stream->scratch);
+	stream->rx.data = NULL;
+	stream->tx.data = NULL;
+	stream->scratch = NULL;
+}
+
+/*
+ * One read syscall into the free space of the receive ring. Returns the bytes read, 0 when the
+ * peer closed the connection and -1 on error (EAGAIN on an idle non-blocking socket, EMSGSIZE
+ * when the ring is full of an incomplete message).
+ */
+ssize_t framed_read(FramedStream *stream) {
+	RingBuffer *rx = &stream->rx;
+	struct iovec iov[2];
+	int iovcnt;
+	ssize_t n;
+
+	// an empty ring restarts at offset 0 so messages rarely wrap around
+	if (rx->head == rx->tail) {
+		rx->head = 0;
+		rx->tail = 0;
+	}
+	if ((iovcnt = ring_regions(rx, iov, 1)) == 0) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	do {
+		n = readv(stream->fd, iov, iovcnt);
+	} while (n == -1 && errno == EINTR);
+
+	if (n > 0) {
+		rx->tail += (size_t) n;
+	}
+	return n;
+}
+
+/* append bytes that were received by other means (e.g. a completion based backend) */
+int framed_feed(FramedStream *stream, const void *data, size_t len) {
+	RingBuffer *rx = &stream->rx;
+
+	if (rx->head == rx->tail) {
+		rx->head = 0;
+		rx->tail = 0;
+	}
+	if (len > rx->capacity - (rx->tail - rx->head)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	ring_put(rx, data, len);
+	return 0;
+}
+
+/*
+ * Take the next complete message out of the receive ring. Returns 1 and fills message when one
+ * is available, 0 when more bytes are needed and -1 (EMSGSIZE) when a message can never fit.
+ */
+int framed_next(FramedStream *stream, FramedMessage *message) {
+	RingBuffer *rx = &stream->rx;
+	size_t available = rx->tail - rx->head;
+	size_t offset = rx->head & (rx->capacity - 1);
+	size_t contiguous = rx->capacity - offset < available ? rx->capacity - offset : available;
+	size_t len;
+	char *end;
+	FrameHeader header;
+
+	if (available == 0) {
+		return 0;
+	}
+	if (stream->framing == FRAMING_DETECT) {
+		stream->framing = is_binary_opcode((uint8_t) rx->data[offset]) ? FRAMING_BINARY : FRAMING_ASCII;
+	}
+
+	if (stream->framing == FRAMING_ASCII) {
+		if ((end = memchr(rx->data + offset, '\0', contiguous)) != NULL) {
+			len = (size_t) (end - (rx->data + offset)) + 1;
+		} else if (available > contiguous && (end = memchr(rx->data, '\0', available - contiguous)) != NULL) {
+			len = contiguous + (size_t) (end - rx->data) + 1;
+		} else if (available == rx->capacity) {
+			errno = EMSGSIZE;
+			return -1;
+		} else {
+			return 0;
+		}
+	} else {
+		if (available < FRAME_HEADER_LEN) {
+			return 0;
+		}
+		ring_peek(rx, 0, &header, FRAME_HEADER_LEN);
+		len = FRAME_HEADER_LEN + (size_t) ntohs(header.length);
+		if (len > rx->capacity) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		if (available < len) {
+			return 0;
+		}
+	}
+
+	if (len <= contiguous) {
+		message->data = rx->data + offset;
+	} else {
+		if (stream->scratch == NULL && (stream->scratch = malloc(rx->capacity)) == NULL) {
+			return -1;
+		}
+		ring_peek(rx, 0, stream->scratch, len);
+		message->data = stream->scratch;
+	}
+	message->len = len;
+	rx->head += len;
+
+	if (stream->framing == FRAMING_BINARY) {
+		frame_decode(message->data, len, &message->frame);
+	}
+	return 1;
+}
+
+/* move up to len received bytes out as they are, for a connection that stops carrying messages */
+size_t framed_take(FramedStream *stream, void *out, size_t len) {
+	RingBuffer *rx = &stream->rx;
+
+	if (len > rx->tail - rx->head) {
+		len = rx->tail - rx->head;
+	}
+	ring_peek(rx, 0, out, len);
+	rx->head += len;
+	return len;
+}
+
+/* queue bytes for sending. Returns -1 (ENOBUFS) when the send ring has no room for all of them */
+int framed_write(FramedStream *stream, const void *data, size_t len) {
+	RingBuffer *tx = &stream->tx;
+
+	if (tx->head == tx->tail) {
+		tx->head = 0;
+		tx->tail = 0;
+	}
+	if (len > tx->capacity - (tx->tail - tx->head)) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	ring_put(tx, data, len);
+	return 0;
+}
+
+/*
+ * Write queued output with as few syscalls as possible. Returns the number of bytes still queued
+ * (non-zero when a non-blocking socket is full) or -1 on error.
+ */
+ssize_t framed_flush(FramedStream *stream) {
+	RingBuffer *tx = &stream->tx;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	while ((msg.msg_iovlen = (size_t) ring_regions(tx, iov, 0)) > 0) {
+		n = sendmsg(stream->fd, &msg, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return -1;
+		}
+		tx->head += (size_t) n;
+	}
+	return (ssize_t) (tx->tail - tx->head);
+}
+
+/*
+ * The queued output as at most two regions, for writing it by other means (e.g. a completion
+ * based backend). They stay valid while more is queued, until framed_sent() says they left.
+ */
+int framed_output(FramedStream *stream, struct iovec iov[2]) {
+	return ring_regions(&stream->tx, iov, 0);
+}
+
+void framed_sent(FramedStream *stream, size_t len) {
+	stream->tx.head += len;
+}
+
+/* blocking receive of the next message. Returns 1, 0 when the peer closed the connection or -1 */
+int framed_recv(FramedStream *stream, FramedMessage *message) {
+	int ret;
+	ssize_t n;
+
+	while ((ret = framed_next(stream, message)) == 0) {
+		if ((n = framed_read(stream)) <= 0) {
+			return (int) n;
+		}
+	}
+	return ret;
+}
+
+/* blocking send, returns once everything queued so far has been written */
+int framed_send(FramedStream *stream, const void *data, size_t len) {
+	ssize_t pending;
+
+	if (framed_write(stream, data, len) == -1) {
+		if (framed_flush(stream) == -1 || framed_write(stream, data, len) == -1) {
+			return -1;
+		}
+	}
+	while ((pending = framed_flush(stream)) > 0) {}
+	return pending == -1 ? -1 : 0;
+}
 
 int extract_status_code(char *plaintext) {
 	int status_code = -1;
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "shared_registry.h"
+
+
+static void reclaim(RegistryShard *shard);
+
+// UserRegistry.retire of every shard, runs with the shard's lock held
+static void retire_block(void *ptr, void *arg) {
+	RegistryShard *shard = arg;
+	RetiredBlock *tmp;
+	size_t capacity;
+
+	if (ptr == NULL) {
+		return;
+	}
+	if (shard->retired_count == shard->retired_capacity) {
+		capacity = shard->retired_capacity ? shard->retired_capacity * 2 : REGISTRY_RETIRE_BATCH;
+		if ((tmp = realloc(shard->retired, capacity * sizeof(RetiredBlock))) == NULL) {
+			// no room to defer it, wait until every reader has left instead
+			reclaim(shard);
+			while (shard->retired_count == shard->retired_capacity) {
+				sched_yield();
+				reclaim(shard);
+			}
+			tmp = shard->retired;
+			capacity = shard->retired_capacity;
+		}
+		shard->retired = tmp;
+		shard->retired_capacity = capacity;
+	}
+	shard->retired[shard->retired_count].ptr = ptr;
+	shard->retired[shard->retired_count].epoch = atomic_load(&shard->owner->epoch);
+	shard->retired_count++;
+
+	if (shard->retired_count >= REGISTRY_RETIRE_BATCH) {
+		reclaim(shard);
+	}
+}
+
+/* free the retired blocks no reader can still see: every reader inside started after they were unlinked */
+static void reclaim(RegistryShard *shard) {
+	SharedRegistry *shared = shard->owner;
+	uint64_t oldest;
+	uint64_t epoch;
+	size_t kept = 0;
+	size_t i;
+
+	oldest = atomic_fetch_add(&shared->epoch, 1) + 1;
+	atomic_thread_fence(memory_order_seq_cst);
+	for (i = 0; i < REGISTRY_READERS; i++) {
+		epoch = atomic_load_explicit(&shared->readers[i].epoch, memory_order_acquire);
+		if (epoch != 0 && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+
+	for (i = 0; i < shard->retired_count; i++) {
+		if (shard->retired[i].epoch < oldest) {
+			free(shard->retired[i].ptr);
+		} else {
+			shard->retired[kept++] = shard->retired[i];
+		}
+	}
+	shard->retired_count = kept;
+}
+
+/* capacity is the users expected in total, spread over the shards */
+SharedRegistry *create_shared_registry(size_t capacity) {
+	SharedRegistry *shared = aligned_alloc(64, sizeof(SharedRegistry));
+	RegistryShard *shard;
+	int i;
+
+	if (shared == NULL) {
+		return NULL;
+	}
+	memset(shared, 0, sizeof(SharedRegistry));
+	atomic_init(&shared->epoch, 1);
+	for (i = 0; i < REGISTRY_SHARDS; i++) {
+		shard = &shared->shards[i];
+		if ((shard->registry = create_user_registry(capacity / REGISTRY_SHARDS)) == NULL) {
+			while (--i >= 0) {
+				free_user_registry(shared->shards[i].registry);
+				pthread_mutex_destroy(&shared->shards[i].lock);
+			}
+			free(shared);
+			return NULL;
+		}
+		pthread_mutex_init(&shard->lock, NULL);
+		atomic_init(&shard->sequence, 0);
+		shard->owner = shared;
+		shard->registry->retire = retire_block;
+		shard->registry->retire_arg = shard;
+	}
+	for (i = 0; i < REGISTRY_READERS; i++) {
+		atomic_init(&shared->readers[i].epoch, 0);
+	}
+	return shared;
+}
+
+/* no reader may be left */
+void free_shared_registry(SharedRegistry *shared) {
+	size_t j;
+	int i;
+
+	if (shared == NULL) {
+		return;
+	}
+	for (i = 0; i < REGISTRY_SHARDS; i++) {
+		for (j = 0; j < shared->shards[i].retired_count; j++) {
+			free(shared->shards[i].retired[j].ptr);
+		}
+		free(shared->shards[i].retired);
+		free_user_registry(shared->shards[i].registry);
+		pthread_mutex_destroy(&shared->shards[i].lock);
+	}
+	free(shared);
+}
+
+RegistryShard *registry_shard(SharedRegistry *shared, const char *username) {
+	return registry_shard_of(shared, hash_username(username, strlen(username)));
+}
+
+/* add_registered_user() on a locked shard */
+RegisteredUser *shard_add_user(RegistryShard *shard, const char *username) {
+	RegisteredUser *user;
+
+	registry_write_begin(shard);
+	user = add_registered_user(shard->registry, username);
+	registry_write_end(shard);
+	return user;
+}
+
+/* delete_registered_user() on a locked shard */
+void shard_delete_user(RegistryShard *shard, const char *username) {
+	registry_write_begin(shard);
+	delete_registered_user(shard->registry, username);
+	registry_write_end(shard);
+}
+
+/* stop every writer, shards are always taken in index order */
+void shared_registry_lock_all(SharedRegistry *shared) {
+	int i;
+	for (i = 0; i < REGISTRY_SHARDS; i++) {
+		registry_shard_lock(&shared->shards[i]);
+	}
+}
+
+void shared_registry_unlock_all(SharedRegistry *shared) {
+	int i;
+	for (i = REGISTRY_SHARDS - 1; i >= 0; i--) {
+		registry_shard_unlock(&shared->shards[i]);
+	}
+}
+
+/*
+ * Lock-free lookup of username on behalf of reader (0 - REGISTRY_READERS - 1, one per thread).
+ * The view is a consistent copy of the record as it was at some point during the call. Returns
+ * 1 when the user was found, 0 otherwise.
+ */
+int shared_registry_read(SharedRegistry *shared, int reader, const char *username, RegisteredUserView *view) {
+	size_t len = strlen(username);
+	uint64_t hash = hash_username(username, len);
+	RegistryShard *shard = registry_shard_of(shared, hash);
+	RegistryReader *self = &shared->readers[reader];
+	uint32_t seen;
+	int found;
+
+	// announce the epoch before touching anything a writer might retire
+	atomic_store_explicit(&self->epoch, atomic_load_explicit(&shared->epoch, memory_order_relaxed), memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	do {
+		while ((seen = atomic_load_explicit(&shard->sequence, memory_order_acquire)) & 1) {
+			sched_yield();
+		}
+		found = peek_registered_user(shard->registry, &shard->sequence, seen, username, len, hash, view);
+	} while (found == -1);
+	atomic_store_explicit(&self->epoch, 0, memory_order_release);
+	return found;
+}
+
+/* users in every shard, each shard counted under its lock */
+size_t shared_registry_count(SharedRegistry *shared) {
+	size_t count = 0;
+	int i;
+
+	for (i = 0; i < REGISTRY_SHARDS; i++) {
+		registry_shard_lock(&shared->shards[i]);
+		count += registered_users_count(shared->shards[i].registry);
+		registry_shard_unlock(&shared->shards[i]);
+	}
+	return count;
+}
+
+/* registry_for_each() over every shard, the caller holds all the locks */
+int shared_registry_for_each(SharedRegistry *shared, int (*visit)(RegisteredUser *user, void *arg), void *arg) {
+	int i;
+
+	for (i = 0; i < REGISTRY_SHARDS; i++) {
+		if (registry_for_each(shared->shards[i].registry, visit, arg) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
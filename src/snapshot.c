@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+
+#define SNAPSHOT_ALIGN(n)       (((n) + 7) & ~(uint64_t) 7)
+#define SNAPSHOT_MIN_INDEX      16
+
+
+/* state of registry_snapshot_write() while it walks the registry */
+typedef struct SnapshotWriter {
+	SnapshotRecord *records;
+	SnapshotSlot *index;
+	char *names;
+	uint64_t index_mask;
+	uint64_t users;
+	uint64_t names_len;
+	uint64_t users_limit;       /* sizes the file was laid out for */
+	uint64_t names_limit;
+} SnapshotWriter;
+
+
+static uint64_t header_checksum(const SnapshotHeader *header) {
+	SnapshotHeader copy = *header;
+	const unsigned char *bytes = (const unsigned char *) &copy;
+	uint64_t h = 0xcbf29ce484222325ull;
+	size_t i;
+
+	copy.checksum = 0;
+	for (i = 0; i < sizeof(copy); i++) {
+		h = (h ^ bytes[i]) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+static const char *record_name(const RegistrySnapshot *snapshot, const SnapshotRecord *record);
+
+static inline int record_restored(const RegistrySnapshot *snapshot, size_t number) {
+	return (atomic_load_explicit(&snapshot->restored[number / 8], memory_order_relaxed) >> (number % 8)) & 1;
+}
+
+static int count_names(RegisteredUser *user, void *arg) {
+	*(uint64_t *) arg += (uint64_t) user->username_len + 1;
+	return 0;
+}
+
+static int append_record(SnapshotWriter *writer, const char *name, uint16_t len, uint32_t ip_addr, uint16_t port, char operation) {
+	SnapshotRecord *record;
+	uint64_t i;
+
+	if (writer->users == writer->users_limit || writer->names_len + len + 1 > writer->names_limit) {
+		return -1;
+	}
+	record = &writer->records[writer->users];
+	record->hash = hash_username(name, len);
+	record->name_offset = (uint32_t) writer->names_len;
+	record->name_len = len;
+	record->port = port;
+	record->ip_addr = ip_addr;
+	record->operation = operation;
+	memcpy(writer->names + writer->names_len, name, (size_t) len + 1);
+	writer->names_len += (uint64_t) len + 1;
+
+	for (i = record->hash & writer->index_mask; writer->index[i].record != 0; i = (i + 1) & writer->index_mask) {}
+	writer->index[i].record = (uint32_t) (writer->users + 1);
+	writer->index[i].tag = (uint32_t) (record->hash >> 32);
+	writer->users++;
+	return 0;
+}
+
+static int write_record(RegisteredUser *user, void *arg) {
+	return append_record(arg, registered_user_name(user), user->username_len, user->ip_addr, user->port, user->operation);
+}
+
+// the users of a mapped snapshot that never made it into the registry, with the names they need
+static uint64_t pending_users(const RegistrySnapshot *pending, uint64_t *names_size) {
+	const char *name;
+	uint64_t users = 0;
+	size_t i;
+
+	for (i = 0; pending != NULL && atomic_load(&pending->remaining) > 0 && i < pending->header->users; i++) {
+		if (!record_restored(pending, i) && (name = record_name(pending, &pending->records[i])) != NULL) {
+			*names_size += (uint64_t) pending->records[i].name_len + 1;
+			users++;
+		}
+	}
+	return users;
+}
+
+static int write_pending(SnapshotWriter *writer, const RegistrySnapshot *pending) {
+	const SnapshotRecord *record;
+	const char *name;
+	size_t i;
+
+	for (i = 0; pending != NULL && atomic_load(&pending->remaining) > 0 && i < pending->header->users; i++) {
+		record = &pending->records[i];
+		if (!record_restored(pending, i) && (name = record_name(pending, record)) != NULL &&
+		    append_record(writer, name, record->name_len, record->ip_addr, record->port, record->operation) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Checkpoint every registered user to path, together with the users of pending (a snapshot still
+ * being restored, may be NULL) that are not in the registry yet. wal_sequence is the last log
+ * record the registry reflects. The snapshot is built in a temporary file next to path and
+ * renamed over the old one once it is on disk, so readers find either snapshot complete. Peer
+ * references are not kept. The caller holds every shard lock. Returns -1 and sets errno on failure.
+ */
+int registry_snapshot_write(SharedRegistry *registry, RegistrySnapshot *pending, uint64_t wal_sequence, const char *path) {
+	char tmp_path[PATH_MAX];
+	SnapshotHeader header;
+	SnapshotWriter writer;
+	uint64_t names_size = 0;
+	uint64_t users = pending_users(pending, &names_size);
+	uint64_t capacity = SNAPSHOT_MIN_INDEX;
+	unsigned char *base;
+	int saved_errno;
+	int fd;
+	int i;
+
+	for (i = 0; i < REGISTRY_SHARDS; i++) {
+		users += registered_users_count(registry->shards[i].registry);
+	}
+	if (users >= UINT32_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	while (capacity < users * 2) {
+		capacity *= 2;
+	}
+	shared_registry_for_each(registry, count_names, &names_size);
+	if (names_size > UINT32_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.header_size = sizeof(SnapshotHeader);
+	header.users = users;
+	header.index_capacity = capacity;
+	header.records_offset = SNAPSHOT_ALIGN(sizeof(SnapshotHeader));
+	header.index_offset = SNAPSHOT_ALIGN(header.records_offset + users * sizeof(SnapshotRecord));
+	header.names_offset = SNAPSHOT_ALIGN(header.index_offset + capacity * sizeof(SnapshotSlot));
+	header.names_size = names_size;
+	header.wal_sequence = wal_sequence;
+	header.file_size = SNAPSHOT_ALIGN(header.names_offset + names_size);
+	header.checksum = header_checksum(&header);
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+		return -1;
+	}
+	if (ftruncate(fd, (off_t) header.file_size) == -1) {
+		goto fail;
+	}
+	base = mmap(NULL, header.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		goto fail;
+	}
+
+	// the file is all zeroes after ftruncate(), so the index starts out empty
+	memset(&writer, 0, sizeof(writer));
+	writer.records = (SnapshotRecord *) (base + header.records_offset);
+	writer.index = (SnapshotSlot *) (base + header.index_offset);
+	writer.names = (char *) (base + header.names_offset);
+	writer.index_mask = capacity - 1;
+	writer.users_limit = users;
+	writer.names_limit = names_size;
+	if (shared_registry_for_each(registry, write_record, &writer) == -1 || write_pending(&writer, pending) == -1 || writer.users != users) {
+		munmap(base, header.file_size);
+		errno = EAGAIN;
+		goto fail;
+	}
+	memcpy(base, &header, sizeof(header));
+
+	if (msync(base, header.file_size, MS_SYNC) == -1) {
+		munmap(base, header.file_size);
+		goto fail;
+	}
+	munmap(base, header.file_size);
+	if (fsync(fd) == -1 || close(fd) == -1) {
+		fd = -1;
+		goto fail;
+	}
+	if (rename(tmp_path, path) == -1) {
+		saved_errno = errno;
+		unlink(tmp_path);
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (fd != -1) {
+		close(fd);
+	}
+	unlink(tmp_path);
+	errno = saved_errno;
+	return -1;
+}
+
+static int snapshot_layout_valid(const SnapshotHeader *header, size_t size) {
+	uint64_t records_end;
+	uint64_t index_end;
+
+	if (size < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+		return 0;
+	}
+	if (header->version != SNAPSHOT_VERSION || header->header_size != sizeof(SnapshotHeader) ||
+	    header->checksum != header_checksum(header) || header->file_size != size) {
+		return 0;
+	}
+	if (header->users >= UINT32_MAX || header->names_size > UINT32_MAX ||
+	    header->index_capacity < SNAPSHOT_MIN_INDEX || header->index_capacity > size / sizeof(SnapshotSlot) ||
+	    (header->index_capacity & (header->index_capacity - 1)) != 0 || header->index_capacity < header->users * 2) {
+		return 0;
+	}
+	if ((header->records_offset | header->index_offset | header->names_offset) & 7) {
+		return 0;
+	}
+
+	// the sections follow each other and stay inside the file
+	records_end = header->records_offset + header->users * sizeof(SnapshotRecord);
+	index_end = header->index_offset + header->index_capacity * sizeof(SnapshotSlot);
+	return header->records_offset >= sizeof(SnapshotHeader) && records_end <= header->index_offset &&
+	       index_end <= header->names_offset && header->names_offset <= size &&
+	       header->names_size <= size - header->names_offset;
+}
+
+/*
+ * Map the snapshot at path. Only the header is checked here, so opening takes the same time at
+ * any size; records are checked when they are used. Returns NULL and sets errno on failure,
+ * EINVAL for a file that is not a snapshot of this version.
+ */
+RegistrySnapshot *registry_snapshot_open(const char *path) {
+	RegistrySnapshot *snapshot;
+	struct stat st;
+	void *base;
+	int saved_errno;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return NULL;
+	}
+	if ((size_t) st.st_size < sizeof(SnapshotHeader)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	saved_errno = errno;
+	close(fd);
+	if (base == MAP_FAILED) {
+		errno = saved_errno;
+		return NULL;
+	}
+	if (!snapshot_layout_valid(base, (size_t) st.st_size)) {
+		munmap(base, (size_t) st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((snapshot = calloc(1, sizeof(RegistrySnapshot))) == NULL) {
+		munmap(base, (size_t) st.st_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	snapshot->base = base;
+	snapshot->size = (size_t) st.st_size;
+	snapshot->header = base;
+	snapshot->records = (const SnapshotRecord *) ((const char *) base + snapshot->header->records_offset);
+	snapshot->index = (const SnapshotSlot *) ((const char *) base + snapshot->header->index_offset);
+	snapshot->names = (const char *) base + snapshot->header->names_offset;
+	atomic_init(&snapshot->remaining, snapshot->header->users);
+	if ((snapshot->restored = calloc(snapshot->header->users / 8 + 1, sizeof(_Atomic uint8_t))) == NULL) {
+		munmap(base, snapshot->size);
+		free(snapshot);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// lookups will hit the index first, fault it in while the server starts
+	madvise((char *) snapshot->index - ((uintptr_t) snapshot->index & (uintptr_t) (sysconf(_SC_PAGESIZE) - 1)),
+	        snapshot->header->index_capacity * sizeof(SnapshotSlot), MADV_WILLNEED);
+	return snapshot;
+}
+
+void registry_snapshot_close(RegistrySnapshot *snapshot) {
+	if (snapshot == NULL) {
+		return;
+	}
+	munmap(snapshot->base, snapshot->size);
+	free((void *) snapshot->restored);
+	free(snapshot);
+}
+
+/* the NUL terminated name of a record, NULL when the record points outside the names section */
+static const char *record_name(const RegistrySnapshot *snapshot, const SnapshotRecord *record) {
+	uint64_t end = (uint64_t) record->name_offset + record->name_len;
+
+	if (record->name_len > USERNAME_MAX_LEN || end >= snapshot->header->names_size || snapshot->names[end] != '\0') {
+		return NULL;
+	}
+	return snapshot->names + record->name_offset;
+}
+
+/*
+ * Look username up in the mapped file. Returns the record and its number, or NULL when the
+ * snapshot does not have the user or it was restored already.
+ */
+const SnapshotRecord *registry_snapshot_find(const RegistrySnapshot *snapshot, const char *username, size_t *number) {
+	size_t len = strlen(username);
+	uint64_t hash = hash_username(username, len);
+	uint64_t mask = snapshot->header->index_capacity - 1;
+	const SnapshotRecord *record;
+	const char *name;
+	uint64_t probes;
+	uint64_t i = hash & mask;
+
+	for (probes = 0; probes <= mask && snapshot->index[i].record != 0; probes++, i = (i + 1) & mask) {
+		if (snapshot->index[i].tag != (uint32_t) (hash >> 32) || snapshot->index[i].record > snapshot->header->users) {
+			continue;
+		}
+		record = &snapshot->records[snapshot->index[i].record - 1];
+		if (record->hash != hash || record->name_len != len || (name = record_name(snapshot, record)) == NULL ||
+		    memcmp(name, username, len) != 0) {
+			continue;
+		}
+		*number = snapshot->index[i].record - 1;
+		return record_restored(snapshot, *number) ? NULL : record;
+	}
+	return NULL;
+}
+
+// copy a record into its shard and mark it as restored, NULL if there was no room for it
+static RegisteredUser *restore_record(RegistrySnapshot *snapshot, SharedRegistry *registry, size_t number) {
+	const SnapshotRecord *record = &snapshot->records[number];
+	const char *name = record_name(snapshot, record);
+	RegistryShard *shard;
+	RegisteredUser *user = NULL;
+
+	if (name != NULL) {
+		shard = registry_shard(registry, name);
+		registry_write_begin(shard);
+		if ((user = add_registered_user(shard->registry, name)) != NULL) {
+			user->ip_addr = record->ip_addr;
+			user->port = record->port;
+			user->operation = record->operation;
+		}
+		registry_write_end(shard);
+		if (user == NULL && search_registered_user(shard->registry, name) == NULL) {
+			// out of memory, leave the record for a later try
+			return NULL;
+		}
+	}
+	// a damaged record, or a name registered anew since the snapshot, is dropped
+	atomic_fetch_or_explicit(&snapshot->restored[number / 8], (uint8_t) (1 << (number % 8)), memory_order_relaxed);
+	atomic_fetch_sub(&snapshot->remaining, 1);
+	return user;
+}
+
+/*
+ * Move username from the snapshot into its shard of the registry, for lookups that missed it.
+ * The caller holds the lock of that shard. Returns the registry entry, NULL when the snapshot has
+ * no such user left.
+ */
+RegisteredUser *registry_snapshot_take(RegistrySnapshot *snapshot, SharedRegistry *registry, const char *username) {
+	size_t number;
+
+	if (atomic_load(&snapshot->remaining) == 0 || registry_snapshot_find(snapshot, username, &number) == NULL) {
+		return NULL;
+	}
+	return restore_record(snapshot, registry, number);
+}
+
+/*
+ * Rebuild step: restore up to max of the records nobody asked for yet, with every shard lock
+ * held. Returns how many records are left, the snapshot can be closed once it returns 0.
+ */
+size_t registry_snapshot_restore(RegistrySnapshot *snapshot, SharedRegistry *registry, size_t max) {
+	size_t before;
+
+	while (max > 0 && snapshot->next < snapshot->header->users) {
+		if (!record_restored(snapshot, snapshot->next)) {
+			before = atomic_load(&snapshot->remaining);
+			restore_record(snapshot, registry, snapshot->next);
+			if (atomic_load(&snapshot->remaining) == before) {
+				break;
+			}
+			max--;
+		}
+		snapshot->next++;
+	}
+	return atomic_load(&snapshot->remaining);
+}
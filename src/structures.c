@@ -3,121 +3,462 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdbool.h>
+
+#include <arpa/inet.h>
 
 #include "structures.h"
 
 
+#define REGISTRY_MIN_CAPACITY   64
+#define REGISTRY_MIGRATE_STEP   128     /* old slots moved per mutation while resizing */
 
-RegisteredUser *create_registered_user() {
-	RegisteredUser *temp = malloc(sizeof(RegisteredUser));
-	//temp->id = -1;
+static RegisteredUser registry_tombstone;
+#define REGISTRY_TOMBSTONE      (&registry_tombstone)
 
-	temp->username = malloc(256 * sizeof(char));
-	temp->connected_with = malloc(256 * sizeof(char));
-	temp->ip_addr = malloc(INET_ADDRSTRLEN * sizeof(char));
 
-	memset(temp->username, '\0', strlen(temp->username));
-	memset(temp->connected_with, '\0', strlen(temp->connected_with));
-	memset(temp->ip_addr, '\0', strlen(temp->ip_addr));
-	temp->port = -1;
-	temp->operation = '\0';
-	temp->next = NULL;
-	return temp;
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+	__uint128_t r = (__uint128_t) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
 }
 
-RegisteredUser *add_registered_user(RegisteredUser **head, char *username) {
+// consumes the name 8 bytes at a time, short names cost one or two multiplications
+uint64_t hash_username(const char *username, size_t len) {
+	uint64_t h = 0x2d358dccaa6c78a5ull ^ len;
+	uint64_t word;
+
+	while (len >= 8) {
+		memcpy(&word, username, 8);
+		h = hash_mix(h ^ word, 0x8bb84b93962eacc9ull);
+		username += 8;
+		len -= 8;
+	}
+	word = 0;
+	memcpy(&word, username, len);
+	h = hash_mix(h ^ word, 0x4b33a62ed433d4a3ull);
+	return hash_mix(h, 0x9e3779b97f4a7c15ull);
+}
+
+static void registry_release(UserRegistry *registry, void *ptr) {
+	if (registry->retire != NULL) {
+		registry->retire(ptr, registry->retire_arg);
+	} else {
+		free(ptr);
+	}
+}
+
+static int registry_table_init(RegistryTable *table, size_t capacity) {
+	table->slots = calloc(capacity, sizeof(RegistrySlot));
+	if (table->slots == NULL) {
+		return -1;
+	}
+	table->capacity = capacity;
+	table->used = 0;
+	table->live = 0;
+	return 0;
+}
+
+static RegistrySlot *registry_table_find(RegistryTable *table, uint64_t hash, const char *username) {
+	size_t mask;
+	size_t i;
+	RegistrySlot *slot;
+
+	if (table->live == 0) {
+		return NULL;
+	}
+
+	mask = table->capacity - 1;
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		slot = &table->slots[i];
+		if (slot->user == NULL) {
+			return NULL;
+		}
+		if (slot->hash == hash && slot->user != REGISTRY_TOMBSTONE && strcmp(registered_user_name(slot->user), username) == 0) {
+			return slot;
+		}
+	}
+}
+
+// the caller guarantees the key is absent and the table has a free slot
+static void registry_table_insert(RegistryTable *table, uint64_t hash, RegisteredUser *user) {
+	size_t mask = table->capacity - 1;
+	size_t i;
+
+	for (i = hash & mask; table->slots[i].user != NULL && table->slots[i].user != REGISTRY_TOMBSTONE; i = (i + 1) & mask) {}
+
+	if (table->slots[i].user == NULL) {
+		table->used++;
+	}
+	table->slots[i].hash = hash;
+	table->slots[i].user = user;
+	table->live++;
+}
+
+// move up to 'steps' slots of the old table into the current one
+static void registry_migrate(UserRegistry *registry, size_t steps) {
+	RegistrySlot *slot;
+
+	while (registry->old.capacity > 0 && steps-- > 0) {
+		slot = &registry->old.slots[registry->migrate_index++];
+		if (slot->user != NULL && slot->user != REGISTRY_TOMBSTONE) {
+			registry_table_insert(&registry->table, slot->hash, slot->user);
+			// keep the probe chains of the remaining old entries intact
+			slot->user = REGISTRY_TOMBSTONE;
+			registry->old.live--;
+		}
+
+		if (registry->migrate_index == registry->old.capacity) {
+			registry_release(registry, registry->old.slots);
+			memset(&registry->old, 0, sizeof(RegistryTable));
+			registry->migrate_index = 0;
+		}
+	}
+}
+
+// start a resize once the table is 3/4 full (tombstones included)
+static int registry_reserve(UserRegistry *registry) {
+	RegistryTable *table = &registry->table;
+	RegistryTable next;
+	size_t capacity;
+
+	if ((table->used + 1) * 4 <= table->capacity * 3) {
+		return 0;
+	}
+
+	// a previous resize is still draining, finish it before starting another one
+	registry_migrate(registry, registry->old.capacity);
+
+	// grow when half full with live entries, otherwise only flush the tombstones
+	capacity = table->capacity;
+	if ((table->live + 1) * 2 > capacity) {
+		capacity *= 2;
+	}
+	if (registry_table_init(&next, capacity) == -1) {
+		return -1;
+	}
+
+	registry->old = *table;
+	registry->table = next;
+	registry->migrate_index = 0;
+	registry_migrate(registry, REGISTRY_MIGRATE_STEP);
+	return 0;
+}
+
+UserRegistry *create_user_registry(size_t capacity) {
+	UserRegistry *registry = calloc(1, sizeof(UserRegistry));
+	size_t rounded = REGISTRY_MIN_CAPACITY;
+
+	if (registry == NULL) {
+		return NULL;
+	}
+
+	while (rounded < capacity) {
+		rounded *= 2;
+	}
+	if (registry_table_init(&registry->table, rounded) == -1) {
+		free(registry);
+		return NULL;
+	}
+	return registry;
+}
+
+static void registry_table_free(UserSlab *slab, RegistryTable *table) {
+	size_t i;
+	for (i = 0; i < table->capacity; i++) {
+		if (table->slots[i].user != NULL && table->slots[i].user != REGISTRY_TOMBSTONE) {
+			free_registered_user(slab, table->slots[i].user);
+		}
+	}
+	free(table->slots);
+}
+
+void free_user_registry(UserRegistry *registry) {
+	size_t i;
+
+	if (registry == NULL) {
+		return;
+	}
+	registry_table_free(&registry->slab, &registry->old);
+	registry_table_free(&registry->slab, &registry->table);
+	for (i = 0; i < registry->slab.chunks_count; i++) {
+		free(registry->slab.chunks[i]);
+	}
+	free(registry->slab.chunks);
+	free(registry);
+}
+
+// carve a new chunk of records and thread them onto the free list
+static int user_slab_grow(UserSlab *slab) {
+	RegisteredUser *chunk;
+	size_t i;
+
+	if (slab->chunks_count == slab->chunks_capacity) {
+		size_t capacity = slab->chunks_capacity ? slab->chunks_capacity * 2 : 16;
+		RegisteredUser **chunks = realloc(slab->chunks, capacity * sizeof(RegisteredUser *));
+		if (chunks == NULL) {
+			return -1;
+		}
+		slab->chunks = chunks;
+		slab->chunks_capacity = capacity;
+	}
+
+	chunk = aligned_alloc(sizeof(RegisteredUser), USER_SLAB_RECORDS * sizeof(RegisteredUser));
+	if (chunk == NULL) {
+		return -1;
+	}
+	memset(chunk, 0, USER_SLAB_RECORDS * sizeof(RegisteredUser));
+	for (i = 0; i < USER_SLAB_RECORDS; i++) {
+		chunk[i].connected_with = i + 1 < USER_SLAB_RECORDS ? &chunk[i + 1] : slab->free_list;
+	}
+	slab->free_list = chunk;
+	slab->chunks[slab->chunks_count++] = chunk;
+	return 0;
+}
+
+RegisteredUser *create_registered_user(UserSlab *slab, const char *username, size_t len) {
 	RegisteredUser *temp;
-	RegisteredUser *p;
 
-	temp = create_registered_user();
-	//temp->id = uint32_random();
-	strcpy(temp->username, username);
-	if (*head == NULL) {
-		*head = temp;
+	if (slab->free_list == NULL && user_slab_grow(slab) == -1) {
+		return NULL;
+	}
+	temp = slab->free_list;
+
+	if (len < USERNAME_INLINE_LEN) {
+		memcpy(temp->username.inline_name, username, len);
+		memset(temp->username.inline_name + len, 0, USERNAME_INLINE_LEN - len);
 	} else {
-		p = *head;
-		while (p->next != NULL) {
-			p = p->next;
+		temp->username.heap_name = malloc(len + 1);
+		if (temp->username.heap_name == NULL) {
+			return NULL;
 		}
-		p->next = temp;
+		memcpy(temp->username.heap_name, username, len);
+		temp->username.heap_name[len] = '\0';
 	}
+	slab->free_list = temp->connected_with;
+	slab->in_use++;
+
+	temp->username_len = (uint16_t) len;
+	temp->connected_with = NULL;
+	temp->connected_with_generation = 0;
+	temp->ip_addr = 0;
+	temp->port = 0;
+	temp->operation = '\0';
+	temp->lease_expires = LEASE_UNSET;
 	return temp;
 }
 
-RegisteredUser *search_registered_user(RegisteredUser *head, const char *username) {
-	RegisteredUser *p = head;
-	if (p == NULL) {
+void free_registered_user(UserSlab *slab, RegisteredUser *user) {
+	if (user->username_len >= USERNAME_INLINE_LEN) {
+		free(user->username.heap_name);
+	}
+	// invalidates every peer reference that still points at this record
+	user->generation++;
+	user->connected_with = slab->free_list;
+	slab->free_list = user;
+	slab->in_use--;
+}
+
+void registered_user_connect(RegisteredUser *user, RegisteredUser *peer) {
+	user->connected_with = peer;
+	user->connected_with_generation = peer != NULL ? peer->generation : 0;
+}
+
+/* connect with a peer found by peek_registered_user(), its generation as it was when seen */
+void registered_user_connect_view(RegisteredUser *user, const RegisteredUserView *peer) {
+	user->connected_with = peer->user;
+	user->connected_with_generation = peer->generation;
+}
+
+RegisteredUser *registered_user_peer(const RegisteredUser *user) {
+	if (user->connected_with == NULL || user->connected_with->generation != user->connected_with_generation) {
+		return NULL;
+	}
+	return user->connected_with;
+}
+
+/*
+ * Register a new user. Returns NULL when the username is already registered, longer than
+ * USERNAME_MAX_LEN or on allocation failure, the new entry otherwise.
+ */
+RegisteredUser *add_registered_user(UserRegistry *registry, const char *username) {
+	RegisteredUser *temp;
+	size_t len = strlen(username);
+	uint64_t hash = hash_username(username, len);
+
+	if (len > USERNAME_MAX_LEN) {
+		return NULL;
+	}
+
+	registry_migrate(registry, REGISTRY_MIGRATE_STEP);
+	if (registry_table_find(&registry->table, hash, username) != NULL || registry_table_find(&registry->old, hash, username) != NULL) {
+		return NULL;
+	}
+	if (registry_reserve(registry) == -1) {
+		return NULL;
+	}
+
+	temp = create_registered_user(&registry->slab, username, len);
+	if (temp == NULL) {
 		return NULL;
 	}
+	//temp->id = uint32_random();
+	registry_table_insert(&registry->table, hash, temp);
+	return temp;
+}
+
+RegisteredUser *search_registered_user(UserRegistry *registry, const char *username) {
+	uint64_t hash = hash_username(username, strlen(username));
+	RegistrySlot *slot = registry_table_find(&registry->table, hash, username);
+
+	if (slot == NULL) {
+		slot = registry_table_find(&registry->old, hash, username);
+	}
+	return slot != NULL ? slot->user : NULL;
+}
+
+static inline bool sequence_changed(const _Atomic uint32_t *sequence, uint32_t seen) {
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(sequence, memory_order_relaxed) != seen;
+}
+
+static int peek_table(const RegistryTable *table, const _Atomic uint32_t *sequence, uint32_t seen,
+                      const char *username, size_t len, uint64_t hash, RegisteredUserView *view) {
+	RegistrySlot *slots = table->slots;
+	size_t capacity = table->capacity;
+	const RegisteredUser *user;
+	const char *name;
+	size_t probes;
+	size_t i;
+
+	// slots and capacity belong together only if no writer ran while they were read
+	if (sequence_changed(sequence, seen)) {
+		return -1;
+	}
+	if (capacity == 0) {
+		return 0;
+	}
 
-	while (p != NULL) {
-		if (strcmp(p->username, username) == 0) {
-			return p;
+	for (probes = 0, i = hash & (capacity - 1); probes < capacity; probes++, i = (i + 1) & (capacity - 1)) {
+		user = __atomic_load_n(&slots[i].user, __ATOMIC_RELAXED);
+		if (user == NULL) {
+			return 0;
+		}
+		if (user == REGISTRY_TOMBSTONE || __atomic_load_n(&slots[i].hash, __ATOMIC_RELAXED) != hash || user->username_len != len) {
+			continue;
+		}
+		name = len < USERNAME_INLINE_LEN ? user->username.inline_name : user->username.heap_name;
+		// a heap name is only dereferenced once it is known to match len
+		if (sequence_changed(sequence, seen)) {
+			return -1;
 		}
-		p = p->next;
+		if (memcmp(name, username, len) != 0) {
+			continue;
+		}
+		view->user = (RegisteredUser *) user;
+		view->generation = user->generation;
+		view->ip_addr = user->ip_addr;
+		view->port = user->port;
+		view->operation = user->operation;
+		return sequence_changed(sequence, seen) ? -1 : 1;
 	}
-	return NULL;
+	return 0;
 }
 
-void delete_registered_user(RegisteredUser **head, char *username) {
-	RegisteredUser *p = *head;
-	RegisteredUser *prev = NULL;
+/*
+ * Lookup for readers that hold no lock. Writers make *sequence odd while they change the
+ * registry and even again afterwards, seen is the even value read before calling; memory they
+ * release must outlive the reader (see UserRegistry.retire). Returns 1 and fills view when the
+ * user was found, 0 when not, -1 when a writer interfered and the lookup has to be repeated.
+ */
+int peek_registered_user(UserRegistry *registry, const _Atomic uint32_t *sequence, uint32_t seen,
+                         const char *username, size_t len, uint64_t hash, RegisteredUserView *view) {
+	RegistryTable table = registry->table;
+	RegistryTable old = registry->old;
+	int found = peek_table(&table, sequence, seen, username, len, hash, view);
 
-	// If head node itself holds the key to be deleted
-	if (*head != NULL && strcmp((*head)->username, username) == 0) {
-		*head = (*head)->next; // Changed head
-		free(p); // free old head
-		return;
+	if (found == 0) {
+		found = peek_table(&old, sequence, seen, username, len, hash, view);
 	}
+	return found;
+}
+
+void delete_registered_user(UserRegistry *registry, const char *username) {
+	uint64_t hash = hash_username(username, strlen(username));
+	RegistryTable *table = &registry->table;
+	RegistrySlot *slot = registry_table_find(table, hash, username);
 
-	// Search for the key to be deleted, keep track of the
-	// previous node as we need to change 'prev->next'
-	while (p != NULL && strcmp(p->username, username) != 0) {
-		prev = p;
-		p = p->next;
+	if (slot == NULL) {
+		table = &registry->old;
+		slot = registry_table_find(table, hash, username);
 	}
 
-	// If key was not present in linked list
-	if (p == NULL) {
+	// If key was not present in the registry
+	if (slot == NULL) {
 		return;
 	}
 
-	// Unlink the node from linked list
-	prev->next = p->next;
+	// username may point into the entry itself, so it is not used past this point
+	if (slot->user->username_len >= USERNAME_INLINE_LEN && registry->retire != NULL) {
+		registry->retire(slot->user->username.heap_name, registry->retire_arg);
+		slot->user->username.heap_name = NULL;
+	}
+	free_registered_user(&registry->slab, slot->user);
+	slot->user = REGISTRY_TOMBSTONE;
+	table->live--;
+
+	registry_migrate(registry, REGISTRY_MIGRATE_STEP);
+}
 
-	free(p); // free node from linked list
-	p = NULL;
+size_t registered_users_count(UserRegistry *registry) {
+	return registry->table.live + registry->old.live;
 }
 
-void free_registered_users_list(RegisteredUser *head) {
-	RegisteredUser *p = head;
-	struct RegisteredUser *tmp;
-	while (p) {
-		tmp = p;
-		p = p->next;
-		free(tmp);
+/* call visit for every registered user, stops and returns -1 as soon as visit does */
+int registry_for_each(UserRegistry *registry, int (*visit)(RegisteredUser *user, void *arg), void *arg) {
+	RegistryTable *tables[] = {&registry->old, &registry->table};
+	RegistrySlot *slot;
+	size_t t;
+	size_t i;
+
+	for (t = 0; t < 2; t++) {
+		for (i = 0; i < tables[t]->capacity; i++) {
+			slot = &tables[t]->slots[i];
+			if (slot->user != NULL && slot->user != REGISTRY_TOMBSTONE && visit(slot->user, arg) == -1) {
+				return -1;
+			}
+		}
 	}
+	return 0;
 }
 
 void print_registered_user(RegisteredUser *user) {
-	printf("username: '%s', operation: '%c', IP: '%s', port: '%d'", user->username, user->operation, user->ip_addr, user->port);
+	char ip_addr[INET_ADDRSTRLEN];
+	RegisteredUser *peer = registered_user_peer(user);
+
+	inet_ntop(AF_INET, &user->ip_addr, ip_addr, sizeof(ip_addr));
+	printf("username: '%s', operation: '%c', IP: '%s', port: '%d', connected with: '%s'\n",
+	       registered_user_name(user), user->operation, ip_addr, user->port, peer != NULL ? registered_user_name(peer) : "");
 	fflush(stdout);
 }
 
-void print_all_registered_users(RegisteredUser *head) {
-	if (head == NULL) {
-		return;
+static void print_registry_table(RegistryTable *table) {
+	size_t i;
+	for (i = 0; i < table->capacity; i++) {
+		if (table->slots[i].user != NULL && table->slots[i].user != REGISTRY_TOMBSTONE) {
+			print_registered_user(table->slots[i].user);
+		}
 	}
+}
 
-	int users_count = 0;
-	RegisteredUser *p = head;
-	while (p) {
-		users_count++;
-		print_registered_user(p);
-		p = p->next;
+void print_all_registered_users(UserRegistry *registry) {
+	if (registry == NULL) {
+		return;
 	}
 
-	printf("[server] Total registered users: %d", users_count);
+	print_registry_table(&registry->old);
+	print_registry_table(&registry->table);
+
+	printf("[server] Total registered users: %zu\n", registered_users_count(registry));
 	fflush(stdout);
 }
 
@@ -129,4 +470,4 @@ uint32_t uint32_random(void) {
 		Z = (Z >> 1) ^ 0x7FFFF159;
 	}
 	return Z;
-}
\ No newline at end of file
+}
@@ -0,0 +1,174 @@
+#include <string.h>
+
+#include "timer_wheel.h"
+
+
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_SPAN        (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now) {
+	memset(wheel, 0, sizeof(TimerWheel));
+	wheel->now = now;
+}
+
+void timer_init(Timer *timer, timer_callback callback, void *arg) {
+	memset(timer, 0, sizeof(Timer));
+	timer->callback = callback;
+	timer->arg = arg;
+}
+
+static void timer_link(Timer **head, Timer *timer) {
+	timer->next = *head;
+	timer->pprev = head;
+	if (*head != NULL) {
+		(*head)->pprev = &timer->next;
+	}
+	*head = timer;
+}
+
+static void timer_unlink(Timer *timer) {
+	*timer->pprev = timer->next;
+	if (timer->next != NULL) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+// the level is picked by how far ahead the timer is, the slot by the bits of its tick at that level
+static void timer_place(TimerWheel *wheel, Timer *timer, uint64_t earliest) {
+	uint64_t expires = timer->expires > earliest ? timer->expires : earliest;
+	uint64_t delta = expires - wheel->now;
+	int level = 0;
+
+	if (delta >= TIMER_WHEEL_SPAN) {
+		// parked as far out as the wheel reaches, placed again when it gets there
+		expires = wheel->now + TIMER_WHEEL_SPAN - 1;
+		delta = TIMER_WHEEL_SPAN - 1;
+	}
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1ull << (TIMER_WHEEL_BITS * (level + 1))) {
+		level++;
+	}
+	timer_link(&wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], timer);
+}
+
+/* arm timer to fire once the wheel reaches expires, a tick already passed fires on the next one */
+void timer_wheel_add(TimerWheel *wheel, Timer *timer, uint64_t expires) {
+	if (timer_armed(timer)) {
+		timer_unlink(timer);
+	} else {
+		wheel->armed++;
+	}
+	timer->expires = expires;
+	timer_place(wheel, timer, wheel->now + 1);
+}
+
+void timer_wheel_cancel(TimerWheel *wheel, Timer *timer) {
+	if (timer_armed(timer)) {
+		timer_unlink(timer);
+		wheel->armed--;
+	}
+}
+
+// move the timers of a slot one level (or more) down, the ones due right now into the slot run next
+static void timer_cascade(TimerWheel *wheel, int level, size_t slot) {
+	Timer *timer;
+
+	while ((timer = wheel->slots[level][slot]) != NULL) {
+		timer_unlink(timer);
+		timer_place(wheel, timer, wheel->now);
+	}
+}
+
+/*
+ * Move the wheel forward to tick now, running the callback of every timer that came due on the
+ * way, in tick order. Callbacks may arm and cancel timers, their own included. Returns how many
+ * fired.
+ */
+size_t timer_wheel_advance(TimerWheel *wheel, uint64_t now) {
+	size_t fired = 0;
+	Timer **head;
+	Timer *timer;
+	int level;
+
+	while (wheel->now < now) {
+		if (wheel->armed == 0) {
+			wheel->now = now;
+			break;
+		}
+		wheel->now++;
+		for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			if ((wheel->now & ((1ull << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+				break;
+			}
+			timer_cascade(wheel, level, (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+		}
+
+		head = &wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+		while ((timer = *head) != NULL) {
+			timer_unlink(timer);
+			wheel->armed--;
+			fired++;
+			timer->callback(timer, timer->arg);
+		}
+	}
+	return fired;
+}
+
+/*
+ * The tick the wheel has to be advanced to next: the first occupied slot of level 0, or the first
+ * cascade of an occupied slot above, whichever comes first. A cascade may fire nothing, the owner
+ * asks again after it. UINT64_MAX when nothing is armed.
+ */
+uint64_t timer_wheel_next(const TimerWheel *wheel) {
+	uint64_t next = UINT64_MAX;
+	uint64_t unit;
+	uint64_t base;
+	uint64_t tick;
+	size_t index;
+	size_t slot;
+	int level;
+
+	if (wheel->armed == 0) {
+		return next;
+	}
+	// timers are placed from the tick after now, at most a lap ahead
+	for (tick = wheel->now + 1; tick <= wheel->now + TIMER_WHEEL_SLOTS; tick++) {
+		if (wheel->slots[0][tick & TIMER_WHEEL_MASK] != NULL) {
+			next = tick;
+			break;
+		}
+	}
+	// a slot above is emptied when the ticks below it wrap around to 0 at its index
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		unit = 1ull << (TIMER_WHEEL_BITS * level);
+		base = (wheel->now / unit + 1) * unit;
+		index = (base >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+		for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			if (wheel->slots[level][slot] != NULL) {
+				tick = base + ((slot - index) & TIMER_WHEEL_MASK) * unit;
+				next = tick < next ? tick : next;
+			}
+		}
+	}
+	return next;
+}
+
+/* disarm and return any armed timer, NULL when none is left; for tearing a wheel down */
+Timer *timer_wheel_pop(TimerWheel *wheel) {
+	Timer *timer;
+	int level;
+	int slot;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS && wheel->armed > 0; level++) {
+		for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			if ((timer = wheel->slots[level][slot]) != NULL) {
+				timer_unlink(timer);
+				wheel->armed--;
+				return timer;
+			}
+		}
+	}
+	return NULL;
+}
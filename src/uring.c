@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t arg_size) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Set up a ring of entries submissions and twice as many completions. flags are IORING_SETUP_*
+ * the ring works without; a kernel too old for them gets a ring without any. Returns -1 with
+ * errno set when the kernel has no io_uring or refuses it (ENOSYS, EPERM), the caller falls back
+ * then.
+ */
+int uring_init(Uring *ring, unsigned entries, unsigned flags) {
+	struct io_uring_params params;
+	int saved_errno;
+
+	memset(ring, 0, sizeof(Uring));
+	memset(&params, 0, sizeof(params));
+	params.flags = flags;
+	if ((ring->fd = uring_setup(entries, &params)) == -1 && errno == EINVAL && flags != 0) {
+		memset(&params, 0, sizeof(params));
+		ring->fd = uring_setup(entries, &params);
+	}
+	if (ring->fd == -1) {
+		return -1;
+	}
+	ring->flags = params.flags;
+	// the timeout of uring_submit_and_wait() needs IORING_FEAT_EXT_ARG (5.11)
+	if (!(params.features & IORING_FEAT_EXT_ARG)) {
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	ring->features = params.features;
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		goto fail;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else if ((ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		ring->cq_ring = NULL;
+		goto fail;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	ring->sq_head = (unsigned *) ((char *) ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *) ((char *) ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_array = (unsigned *) ((char *) ring->sq_ring + params.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *) ((char *) ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *) ((char *) ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + params.cq_off.cqes);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	uring_free(ring);
+	errno = saved_errno;
+	return -1;
+}
+
+/* start a ring set up with IORING_SETUP_R_DISABLED, a single issuer ring belongs to the caller then */
+int uring_enable(Uring *ring) {
+	if (!(ring->flags & IORING_SETUP_R_DISABLED)) {
+		return 0;
+	}
+	if (uring_register(ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) == -1) {
+		return -1;
+	}
+	ring->flags &= ~IORING_SETUP_R_DISABLED;
+	return 0;
+}
+
+void uring_free(Uring *ring) {
+	if (ring->sqes != NULL) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if (ring->fd != -1) {
+		close(ring->fd);
+	}
+	memset(ring, 0, sizeof(Uring));
+	ring->fd = -1;
+}
+
+/* the next free submission entry, NULL when the queue is full and has to be submitted first */
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (ring->sq_local_tail - head >= ring->sq_entries) {
+		return NULL;
+	}
+	sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+	ring->sq_array[ring->sq_local_tail & ring->sq_mask] = ring->sq_local_tail & ring->sq_mask;
+	ring->sq_local_tail++;
+	return sqe;
+}
+
+/*
+ * Hand the prepared entries to the kernel and wait until wait_nr completions are there, or
+ * timeout_ms passed (-1 waits for ever). Both happen in one system call. Returns the number of
+ * entries submitted, -1 with errno set on error (ETIME and EINTR are not errors of the ring).
+ */
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr, int timeout_ms) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned submit = ring->sq_local_tail - *ring->sq_tail;
+	unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	if (submit == 0 && wait_nr == 0) {
+		return 0;
+	}
+	if (wait_nr > 0 && timeout_ms >= 0) {
+		memset(&arg, 0, sizeof(arg));
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+		ret = uring_enter(ring->fd, submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	} else {
+		ret = uring_enter(ring->fd, submit, wait_nr, flags, NULL, 0);
+	}
+	if (ret == -1 && (errno == ETIME || errno == EINTR)) {
+		// whatever was submitted has been consumed, only the wait was cut short
+		return (int) submit;
+	}
+	return ret;
+}
+
+/* the oldest completion not seen yet, NULL when there is none */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* allocate count buffers of size bytes, register them as group and hand all of them to the kernel */
+int uring_buffers_init(Uring *ring, UringBuffers *buffers, uint16_t group, unsigned count, size_t size) {
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	memset(buffers, 0, sizeof(UringBuffers));
+	buffers->ring_size = count * sizeof(struct io_uring_buf);
+	// the kernel wants the ring page aligned
+	buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffers->ring == MAP_FAILED) {
+		buffers->ring = NULL;
+		return -1;
+	}
+	if ((buffers->data = malloc(count * size)) == NULL) {
+		munmap(buffers->ring, buffers->ring_size);
+		buffers->ring = NULL;
+		return -1;
+	}
+	buffers->count = count;
+	buffers->size = size;
+	buffers->group = group;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) buffers->ring;
+	reg.ring_entries = count;
+	reg.bgid = group;
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		free(buffers->data);
+		munmap(buffers->ring, buffers->ring_size);
+		memset(buffers, 0, sizeof(UringBuffers));
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		uring_buffer_recycle(buffers, (uint16_t) i);
+	}
+	return 0;
+}
+
+void uring_buffers_free(Uring *ring, UringBuffers *buffers) {
+	struct io_uring_buf_reg reg;
+
+	if (buffers->ring == NULL) {
+		return;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = buffers->group;
+	if (ring->fd != -1) {
+		uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	}
+	free(buffers->data);
+	munmap(buffers->ring, buffers->ring_size);
+	memset(buffers, 0, sizeof(UringBuffers));
+}
+
+/* give buffer id back to the kernel once its bytes have been copied out */
+void uring_buffer_recycle(UringBuffers *buffers, uint16_t id) {
+	uint16_t tail = buffers->ring->tail;
+	struct io_uring_buf *buf = &buffers->ring->bufs[tail & (buffers->count - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) uring_buffer(buffers, id);
+	buf->len = (uint32_t) buffers->size;
+	buf->bid = id;
+	__atomic_store_n(&buffers->ring->tail, (uint16_t) (tail + 1), __ATOMIC_RELEASE);
+}
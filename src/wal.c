@@ -0,0 +1,559 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+#include "network.h"
+
+
+#define WAL_BUFFER_MIN      65536
+#define WAL_PAD(n)          (((n) + 7) & ~(size_t) 7)     /* records start 8 byte aligned */
+
+
+static uint64_t now_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+static uint32_t record_checksum(const WalRecord *record) {
+	WalRecord header = *record;
+	const unsigned char *bytes = (const unsigned char *) &header;
+	uint32_t h = 0x811c9dc5u;
+	size_t i;
+
+	header.checksum = 0;
+	for (i = 0; i < sizeof(header); i++) {
+		h = (h ^ bytes[i]) * 0x01000193u;
+	}
+	bytes = (const unsigned char *) (record + 1);
+	for (i = 0; i < record->length; i++) {
+		h = (h ^ bytes[i]) * 0x01000193u;
+	}
+	return h;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, data, len)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += n;
+		len -= (size_t) n;
+	}
+	return 0;
+}
+
+// make a created or deleted segment name durable
+static void sync_directory(const char *path) {
+	char copy[PATH_MAX];
+	int fd;
+
+	snprintf(copy, sizeof(copy), "%s", path);
+	if ((fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/* first sequences of the segments of path, sorted, returns how many or -1 */
+static int list_segments(const char *path, uint64_t **segments) {
+	char dir_copy[PATH_MAX];
+	char base_copy[PATH_MAX];
+	char prefix[PATH_MAX];
+	struct dirent *entry;
+	uint64_t *list = NULL;
+	uint64_t *tmp;
+	size_t prefix_len;
+	size_t capacity = 0;
+	int count = 0;
+	char *end;
+	DIR *dir;
+	int i, j;
+
+	snprintf(dir_copy, sizeof(dir_copy), "%s", path);
+	snprintf(base_copy, sizeof(base_copy), "%s", path);
+	snprintf(prefix, sizeof(prefix), "%s" WAL_SEGMENT_SUFFIX, basename(base_copy));
+	prefix_len = strlen(prefix);
+	if ((dir = opendir(dirname(dir_copy))) == NULL) {
+		return -1;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, prefix, prefix_len) != 0 || entry->d_name[prefix_len] < '0' || entry->d_name[prefix_len] > '9') {
+			continue;
+		}
+		if ((size_t) count == capacity) {
+			capacity = capacity ? capacity * 2 : 8;
+			if ((tmp = realloc(list, capacity * sizeof(uint64_t))) == NULL) {
+				free(list);
+				closedir(dir);
+				return -1;
+			}
+			list = tmp;
+		}
+		list[count] = strtoull(entry->d_name + prefix_len, &end, 10);
+		if (*end == '\0') {
+			count++;
+		}
+	}
+	closedir(dir);
+
+	// a handful of segments at most, insertion sort does
+	for (i = 1; i < count; i++) {
+		uint64_t key = list[i];
+		for (j = i - 1; j >= 0 && list[j] > key; j--) {
+			list[j + 1] = list[j];
+		}
+		list[j + 1] = key;
+	}
+	*segments = list;
+	return count;
+}
+
+static void segment_path(char *out, size_t size, const char *path, uint64_t segment) {
+	snprintf(out, size, "%s" WAL_SEGMENT_SUFFIX "%" PRIu64, path, segment);
+}
+
+static RegisteredUser *replay_lookup(SharedRegistry *registry, RegistrySnapshot *snapshot, const char *username) {
+	RegisteredUser *user = search_registered_user(registry_shard(registry, username)->registry, username);
+
+	if (user == NULL && snapshot != NULL) {
+		user = registry_snapshot_take(snapshot, registry, username);
+	}
+	return user;
+}
+
+static void replay_record(const WalRecord *record, SharedRegistry *registry, RegistrySnapshot *snapshot) {
+	char name[USERNAME_MAX_LEN + 1];
+	char peer[USERNAME_MAX_LEN + 1];
+	const char *payload = (const char *) (record + 1);
+	RegisteredUser *user;
+
+	memcpy(name, payload, record->name_len);
+	name[record->name_len] = '\0';
+	memcpy(peer, payload + record->name_len, record->peer_len);
+	peer[record->peer_len] = '\0';
+
+	user = replay_lookup(registry, snapshot, name);
+	switch (record->type) {
+		case WAL_REGISTER:
+			if (user == NULL) {
+				shard_add_user(registry_shard(registry, name), name);
+			}
+			break;
+		case WAL_UNREGISTER:
+			if (user != NULL) {
+				shard_delete_user(registry_shard(registry, name), name);
+			}
+			break;
+		case WAL_LISTEN:
+			if (user != NULL) {
+				user->operation = LISTEN_BYTE;
+				user->ip_addr = record->ip_addr;
+				user->port = record->port;
+			}
+			break;
+		case WAL_CONNECT:
+			if (user != NULL) {
+				user->operation = CONNECT_BYTE;
+				registered_user_connect(user, replay_lookup(registry, snapshot, peer));
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+/* apply the records of one segment after 'after', stops quietly at a torn or damaged tail */
+static void replay_segment(const char *file, uint64_t after, SharedRegistry *registry, RegistrySnapshot *snapshot, uint64_t *last, size_t *bytes) {
+	const WalSegmentHeader *header;
+	const WalRecord *record;
+	const char *base;
+	struct stat st;
+	size_t offset;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1) {
+		return;
+	}
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(WalSegmentHeader)) {
+		close(fd);
+		return;
+	}
+	base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return;
+	}
+	madvise((void *) base, (size_t) st.st_size, MADV_SEQUENTIAL);
+
+	header = (const WalSegmentHeader *) base;
+	if (memcmp(header->magic, WAL_MAGIC, sizeof(header->magic)) == 0 && header->version == WAL_VERSION) {
+		for (offset = sizeof(WalSegmentHeader); offset + sizeof(WalRecord) <= (size_t) st.st_size; offset += sizeof(WalRecord) + WAL_PAD(record->length)) {
+			record = (const WalRecord *) (base + offset);
+			if (WAL_PAD(record->length) > (size_t) st.st_size - offset - sizeof(WalRecord) || record->name_len > USERNAME_MAX_LEN ||
+			    record->peer_len > USERNAME_MAX_LEN || (size_t) record->name_len + record->peer_len != record->length ||
+			    record->checksum != record_checksum(record)) {
+				break;
+			}
+			if (record->sequence > after) {
+				replay_record(record, registry, snapshot);
+			}
+			if (record->sequence > *last) {
+				*last = record->sequence;
+			}
+		}
+		*bytes += offset;
+	}
+	munmap((void *) base, (size_t) st.st_size);
+}
+
+/*
+ * Recovery: apply every logged mutation after sequence 'after' (the one the snapshot includes)
+ * to registry, in order, before any other thread uses it. Users the records refer to are taken
+ * from snapshot when it has them.
+ * last is set to the highest sequence found and bytes to the size of the log. Returns -1 when
+ * the segments could not be listed.
+ */
+int wal_replay(const char *path, uint64_t after, SharedRegistry *registry, RegistrySnapshot *snapshot, uint64_t *last, size_t *bytes) {
+	char file[PATH_MAX];
+	uint64_t *segments = NULL;
+	int count;
+	int i;
+
+	*last = after;
+	*bytes = 0;
+	if ((count = list_segments(path, &segments)) == -1) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		segment_path(file, sizeof(file), path, segments[i]);
+		replay_segment(file, after, registry, snapshot, last, bytes);
+	}
+	free(segments);
+	return 0;
+}
+
+static int buffer_reserve(WalBuffer *buffer, size_t len) {
+	size_t capacity = buffer->capacity ? buffer->capacity : WAL_BUFFER_MIN;
+	char *data;
+
+	if (buffer->len + len <= buffer->capacity) {
+		return 0;
+	}
+	while (capacity < buffer->len + len) {
+		capacity *= 2;
+	}
+	if ((data = realloc(buffer->data, capacity)) == NULL) {
+		return -1;
+	}
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return 0;
+}
+
+static int open_segment(const char *path, uint64_t segment) {
+	char file[PATH_MAX];
+	WalSegmentHeader header;
+	int fd;
+
+	segment_path(file, sizeof(file), path, segment);
+	if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+		return -1;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, WAL_MAGIC, sizeof(header.magic));
+	header.version = WAL_VERSION;
+	if (write_all(fd, (const char *) &header, sizeof(header)) == -1 || fdatasync(fd) == -1) {
+		close(fd);
+		unlink(file);
+		return -1;
+	}
+	sync_directory(path);
+	return fd;
+}
+
+static void record_error(WriteAheadLog *wal, int error) {
+	int expected = 0;
+	atomic_compare_exchange_strong(&wal->error, &expected, error);
+}
+
+// write what was swapped into 'writing' and sync as the policy says, io_lock must be held
+static void write_batch(WriteAheadLog *wal, uint64_t last, bool force_sync) {
+	uint64_t now;
+
+	if (wal->writing.len > 0) {
+		if (write_all(wal->fd, wal->writing.data, wal->writing.len) == -1) {
+			record_error(wal, errno);
+		}
+		wal->segment_bytes += wal->writing.len;
+		wal->writing.len = 0;
+		wal->unsynced = true;
+	}
+
+	now = now_ms();
+	if (wal->unsynced && (force_sync || wal->policy == WAL_SYNC_ALWAYS ||
+	                      (wal->policy == WAL_SYNC_INTERVAL && now - wal->synced_ms >= WAL_SYNC_INTERVAL_MS))) {
+		if (fdatasync(wal->fd) == -1) {
+			record_error(wal, errno);
+		}
+		wal->synced_ms = now;
+		wal->unsynced = false;
+	}
+	if (atomic_load(&wal->error) == 0 && (!wal->unsynced || wal->policy == WAL_SYNC_NEVER)) {
+		atomic_store_explicit(&wal->durable, last, memory_order_release);
+	}
+}
+
+// move 'pending' into 'writing', returns the last sequence it holds; lock must be held
+static uint64_t swap_buffers(WriteAheadLog *wal) {
+	WalBuffer tmp = wal->writing;
+
+	wal->writing = wal->pending;
+	wal->pending = tmp;
+	wal->pending.len = 0;
+	return wal->next_sequence - 1;
+}
+
+static void *writer_loop(void *arg) {
+	WriteAheadLog *wal = arg;
+	struct timespec deadline;
+	bool stop;
+	bool compact;
+	uint64_t last;
+
+	while (1) {
+		pthread_mutex_lock(&wal->lock);
+		while (!wal->stopping && wal->pending.len == 0) {
+			if (!wal->unsynced || wal->policy != WAL_SYNC_INTERVAL) {
+				pthread_cond_wait(&wal->wake, &wal->lock);
+				continue;
+			}
+			// an interval sync is owed even if nothing new arrives
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += WAL_SYNC_INTERVAL_MS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			if (pthread_cond_timedwait(&wal->wake, &wal->lock, &deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+		stop = wal->stopping;
+		pthread_mutex_unlock(&wal->lock);
+
+		pthread_mutex_lock(&wal->io_lock);
+		pthread_mutex_lock(&wal->lock);
+		last = swap_buffers(wal);
+		pthread_mutex_unlock(&wal->lock);
+		write_batch(wal, last, stop);
+
+		compact = false;
+		if (wal->compact_bytes > 0 && wal->segment_bytes >= wal->compact_bytes) {
+			pthread_mutex_lock(&wal->lock);
+			compact = !wal->compact_asked;
+			wal->compact_asked = true;
+			pthread_mutex_unlock(&wal->lock);
+		}
+		pthread_mutex_unlock(&wal->io_lock);
+
+		if (wal->on_durable != NULL) {
+			wal->on_durable(wal->arg);
+		}
+		if (compact && wal->on_compact != NULL) {
+			wal->on_compact(wal->arg);
+		}
+		if (stop) {
+			return NULL;
+		}
+	}
+}
+
+/*
+ * Start logging to a new segment of path, numbered next_sequence. replayed_bytes is the size of
+ * the log recovery went through, it counts towards the next compaction like fresh appends.
+ * on_compact is called when the segment outgrew compact_bytes. Returns NULL and sets errno on
+ * failure.
+ */
+WriteAheadLog *wal_open(const char *path, uint64_t next_sequence, int policy, size_t replayed_bytes, size_t compact_bytes,
+                        void (*on_durable)(void *arg), void (*on_compact)(void *arg), void *arg) {
+	WriteAheadLog *wal;
+	int saved_errno;
+
+	if ((wal = calloc(1, sizeof(WriteAheadLog))) == NULL || (wal->path = strdup(path)) == NULL) {
+		free(wal);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((wal->fd = open_segment(path, next_sequence)) == -1) {
+		saved_errno = errno;
+		free(wal->path);
+		free(wal);
+		errno = saved_errno;
+		return NULL;
+	}
+	wal->policy = policy;
+	wal->compact_bytes = compact_bytes;
+	wal->on_durable = on_durable;
+	wal->on_compact = on_compact;
+	wal->arg = arg;
+	wal->next_sequence = next_sequence;
+	wal->segment = next_sequence;
+	wal->segment_bytes = replayed_bytes;
+	wal->synced_ms = now_ms();
+	atomic_init(&wal->durable, next_sequence - 1);
+	atomic_init(&wal->error, 0);
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_mutex_init(&wal->io_lock, NULL);
+	pthread_cond_init(&wal->wake, NULL);
+
+	if (pthread_create(&wal->thread, NULL, writer_loop, wal) != 0) {
+		close(wal->fd);
+		free(wal->path);
+		free(wal);
+		errno = EAGAIN;
+		return NULL;
+	}
+	return wal;
+}
+
+/*
+ * Queue one mutation, the caller orders appends the same way it orders the mutations. Returns
+ * the record's sequence, 0 if there was no memory for it.
+ */
+uint64_t wal_append(WriteAheadLog *wal, int type, const char *username, const char *peer, uint32_t ip_addr, uint16_t port) {
+	size_t name_len = strlen(username);
+	size_t peer_len = peer != NULL ? strlen(peer) : 0;
+	size_t len = sizeof(WalRecord) + WAL_PAD(name_len + peer_len);
+	WalRecord *record;
+	uint64_t sequence;
+	bool was_empty;
+
+	if (name_len > USERNAME_MAX_LEN || peer_len > USERNAME_MAX_LEN) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&wal->lock);
+	if (buffer_reserve(&wal->pending, len) == -1) {
+		pthread_mutex_unlock(&wal->lock);
+		return 0;
+	}
+	record = (WalRecord *) (wal->pending.data + wal->pending.len);
+	memset(record, 0, len);
+	record->length = (uint32_t) (name_len + peer_len);
+	record->sequence = sequence = wal->next_sequence++;
+	record->ip_addr = ip_addr;
+	record->port = port;
+	record->name_len = (uint16_t) name_len;
+	record->peer_len = (uint16_t) peer_len;
+	record->type = (uint8_t) type;
+	memcpy((char *) (record + 1), username, name_len);
+	memcpy((char *) (record + 1) + name_len, peer, peer_len);
+	record->checksum = record_checksum(record);
+
+	was_empty = wal->pending.len == 0;
+	wal->pending.len += len;
+	if (was_empty) {
+		pthread_cond_signal(&wal->wake);
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return sequence;
+}
+
+/* whether an answer that depends on record 'sequence' may leave, always true unless WAL_SYNC_ALWAYS */
+bool wal_is_durable(WriteAheadLog *wal, uint64_t sequence) {
+	return wal->policy != WAL_SYNC_ALWAYS || atomic_load_explicit(&wal->durable, memory_order_acquire) >= sequence;
+}
+
+/*
+ * Put everything appended so far on disk and continue in a new segment. The caller must keep
+ * appends out meanwhile, so that a snapshot taken right after includes exactly the records
+ * before the new segment. Returns the new segment's first sequence, 0 on failure.
+ */
+uint64_t wal_rotate(WriteAheadLog *wal) {
+	uint64_t last;
+	int fd;
+
+	pthread_mutex_lock(&wal->io_lock);
+	pthread_mutex_lock(&wal->lock);
+	last = swap_buffers(wal);
+	pthread_mutex_unlock(&wal->lock);
+	write_batch(wal, last, true);
+
+	if (atomic_load(&wal->error) != 0 || (fd = open_segment(wal->path, last + 1)) == -1) {
+		pthread_mutex_unlock(&wal->io_lock);
+		return 0;
+	}
+	close(wal->fd);
+	wal->fd = fd;
+	wal->segment = last + 1;
+	wal->segment_bytes = 0;
+	pthread_mutex_unlock(&wal->io_lock);
+
+	pthread_mutex_lock(&wal->lock);
+	wal->compact_asked = false;
+	pthread_mutex_unlock(&wal->lock);
+	if (wal->on_durable != NULL) {
+		wal->on_durable(wal->arg);
+	}
+	return last + 1;
+}
+
+/* a durable snapshot covers every record before 'segment', delete the segments of path holding them */
+void wal_compacted(const char *path, uint64_t segment) {
+	char file[PATH_MAX];
+	uint64_t *segments = NULL;
+	int count;
+	int i;
+
+	if ((count = list_segments(path, &segments)) == -1) {
+		return;
+	}
+	for (i = 0; i < count && segments[i] < segment; i++) {
+		segment_path(file, sizeof(file), path, segments[i]);
+		unlink(file);
+	}
+	free(segments);
+	sync_directory(path);
+}
+
+/* write and sync whatever is queued, then stop the writer */
+void wal_close(WriteAheadLog *wal) {
+	if (wal == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&wal->lock);
+	wal->stopping = true;
+	pthread_cond_signal(&wal->wake);
+	pthread_mutex_unlock(&wal->lock);
+	pthread_join(wal->thread, NULL);
+
+	close(wal->fd);
+	pthread_mutex_destroy(&wal->lock);
+	pthread_mutex_destroy(&wal->io_lock);
+	pthread_cond_destroy(&wal->wake);
+	free(wal->pending.data);
+	free(wal->writing.data);
+	free(wal->path);
+	free(wal);
+}